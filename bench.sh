@@ -0,0 +1,518 @@
+#!/bin/sh
+# rough benchmarks for rsh, run from the repo root after `make`
+# usage: ./bench.sh [launch|path|parse|lex|startup|builtin|jobs|pipeline|
+#                    pipestatus|timing|trace|analyze|pipesize|replicate|
+#                    parallel|plan|loops|arith|subst|glob|history|
+#                    complete|prompt|zygote|server]
+RSH=${RSH:-./rsh}
+N=${N:-2000}
+
+# feeds N copies of a line to rsh on stdin and prints the wall time
+run_lines() {
+  line=$1
+  shift
+  i=0
+  while [ $i -lt "$N" ]; do
+    echo "$line"
+    i=$((i + 1))
+  done >/tmp/rsh_bench_in.$$
+  echo exit >>/tmp/rsh_bench_in.$$
+  start=$(date +%s%N)
+  env "$@" "$RSH" </tmp/rsh_bench_in.$$ >/dev/null 2>&1
+  end=$(date +%s%N)
+  rm -f /tmp/rsh_bench_in.$$
+  echo "$(((end - start) / 1000000)) ms total, $(((end - start) / N / 1000)) us/line"
+}
+
+# launch latency of posix_spawn vs fork+exec
+bench_launch() {
+  for mode in spawn fork; do
+    printf "%-6s /bin/true:          " $mode
+    run_lines "/bin/true" RSH_SPAWN=$mode
+    printf "%-6s true | true | true: " $mode
+    run_lines "true | true | true" RSH_SPAWN=$mode
+  done
+}
+
+# PATH search cost with a long PATH, bare name vs absolute path
+bench_path() {
+  long=/nonexistent/a:/nonexistent/b:/nonexistent/c:/nonexistent/d
+  long=$long:/nonexistent/e:/nonexistent/f:/nonexistent/g:/nonexistent/h
+  long=$long:/nonexistent/i:/nonexistent/j:$PATH
+  printf "true (PATH +10 dirs): "
+  run_lines "true" PATH=$long
+  printf "/bin/true:            "
+  run_lines "/bin/true" PATH=$long
+}
+
+# parser cost on long generated lines (cd only looks at its first argument,
+# so the time is reading + parsing 5000 tokens per line)
+bench_parse() {
+  line="cd ."
+  i=0
+  while [ $i -lt 5000 ]; do
+    line="$line arg$i"
+    i=$((i + 1))
+  done
+  printf "cd . arg0..arg4999: "
+  N=${N_PARSE:-500} run_lines "$line"
+}
+
+# lexer/parser throughput on a multi-megabyte input of long quoted lines
+bench_lex() {
+  awk 'BEGIN {
+    for (l = 0; l < 800; l++) {
+      line = "cd ."
+      for (i = 0; i < 400; i++)
+        line = line " arg" i " \"dq " i "|x\" \x27sq;" i "\x27 esc\\ " i
+      print line
+    }
+    print "exit"
+  }' >/tmp/rsh_bench_lex.$$
+  bytes=$(wc -c </tmp/rsh_bench_lex.$$)
+  start=$(date +%s%N)
+  "$RSH" </tmp/rsh_bench_lex.$$ >/dev/null 2>&1
+  end=$(date +%s%N)
+  rm -f /tmp/rsh_bench_lex.$$
+  ms=$(((end - start) / 1000000))
+  echo "$bytes bytes in $ms ms, $((bytes / 1000 / (ms + 1))) MB/s"
+}
+
+# process startup: N runs of `-c true` for rsh and dash
+bench_startup() {
+  for sh in "$RSH" dash; do
+    start=$(date +%s%N)
+    i=0
+    while [ $i -lt "$N" ]; do
+      "$sh" -c true
+      i=$((i + 1))
+    done
+    end=$(date +%s%N)
+    printf "%-6s -c true: %d us/run\n" "$(basename "$sh")" \
+      $(((end - start) / N / 1000))
+  done
+}
+
+# in-shell builtins vs the same programs from /bin
+bench_builtin() {
+  for cmd in "true" "echo hi" "printf %s\\n hi" "test -d /"; do
+    printf "%-18s " "$cmd:"
+    run_lines "$cmd"
+    printf "%-18s " "/bin/$cmd:"
+    run_lines "/bin/$cmd"
+  done
+}
+
+# 20 pipelines of sleep 0.1 run one after another vs all in the background
+bench_jobs() {
+  printf "sequential:   "
+  N=20 run_lines "sleep 0.1 | cat"
+  printf "background &: "
+  N=20 run_lines "sleep 0.1 | cat &"
+  printf "wait at exit: "
+  N=1 run_lines "sleep 0.1 | cat & sleep 0.1 | cat & sleep 0.1 | cat & wait"
+}
+
+# one very long pipeline, echo | cat | ... | cat, at growing stage counts
+bench_pipeline() {
+  for n in 10 100 1000 2000 4000; do
+    printf "%5d stages: " $n
+    N=1 run_lines "echo hi$(awk -v n=$n 'BEGIN { for (i = 0; i < n; i++) printf " | /bin/cat" }')"
+  done
+}
+
+# finding the failing stage: $PIPESTATUS in rsh vs re-running under bash
+bench_pipestatus() {
+  printf "rsh PIPESTATUS:   "
+  N=500 run_lines 'false | true; echo ${PIPESTATUS[0]}'
+  printf "bash -c per line: "
+  N=500 run_lines "bash -c 'false | true; echo \${PIPESTATUS[0]}'"
+}
+
+# cost of set -o timing on a launch-bound and a builtin-bound line
+bench_timing() {
+  for opt in "" "set -o timing; "; do
+    printf "%-16s /bin/true: " "${opt:-default}"
+    run_lines "$opt/bin/true"
+    printf "%-16s echo hi:   " "${opt:-default}"
+    run_lines "${opt}echo hi"
+  done
+}
+
+# a 40-stage pipeline with tracing off and on (RSH_TRACE writes to /tmp)
+bench_trace() {
+  line="seq 1000$(awk 'BEGIN { for (i = 0; i < 38; i++) printf " | /bin/cat" }') | wc -l"
+  printf "off: "
+  N=50 run_lines "$line"
+  printf "on:  "
+  N=50 run_lines "$line" RSH_TRACE=/tmp/rsh_bench_trace.json
+  rm -f /tmp/rsh_bench_trace.json
+}
+
+# meter overhead: the same data-heavy pipeline plain and with ANALYZE
+bench_analyze() {
+  printf "plain:   "
+  N=5 run_lines "seq 2000000 | grep 1 | sort | uniq -c | wc -l"
+  printf "ANALYZE: "
+  N=5 run_lines "seq 2000000 | grep 1 | sort | uniq -c | wc -l ANALYZE"
+}
+
+# throughput at several pipe sizes, then the cat builtin moving a file into a
+# pipe (splice) and into /dev/null (sendfile) instead of through a buffer
+bench_pipesize() {
+  for size in 0 256k 1M; do
+    printf "%-5s yes | head -c 1G | wc -c:   " $size
+    N=3 run_lines "set pipesize=$size; yes | head -c 1G | wc -c"
+    printf "%-5s zero | cat | cat | wc -c: " $size
+    N=3 run_lines "set pipesize=$size; head -c 1G /dev/zero | /bin/cat | /bin/cat | wc -c"
+  done
+  head -c 512M /dev/zero >/tmp/rsh_bench_big.$$
+  printf "cat file | /bin/cat >/dev/null: "
+  N=3 run_lines "cat /tmp/rsh_bench_big.$$ | /bin/cat >/dev/null"
+  printf "cat file >/dev/null:            "
+  N=3 run_lines "cat /tmp/rsh_bench_big.$$ >/dev/null"
+  rm -f /tmp/rsh_bench_big.$$
+}
+
+bench_replicate() {
+  seq 1 4000000 >/tmp/rsh_bench_seq.$$
+  filter="grep -E '(1|2)+3*(4|5)+[6-9]{2}'"
+  printf "serial      | %s | wc -l: " "$filter"
+  N=3 run_lines "cat /tmp/rsh_bench_seq.$$ | $filter | wc -l"
+  for n in 2 4 $(nproc); do
+    printf "%-3s replicas |@%s ordered:       " $n $n
+    N=3 run_lines "cat /tmp/rsh_bench_seq.$$ |@$n $filter | wc -l"
+    printf "%-3s replicas |@%su unordered:    " $n $n
+    N=3 run_lines "cat /tmp/rsh_bench_seq.$$ |@${n}u $filter | wc -l"
+  done
+  rm -f /tmp/rsh_bench_seq.$$
+}
+
+bench_parallel() {
+  args=$(seq 1 500 | tr '\n' ' ')
+  printf "500 x /bin/true, one per line:      "
+  N=500 run_lines "/bin/true"
+  for j in 1 4 16; do
+    printf "parallel -j %-2s /bin/true ::: 1..500: " $j
+    N=1 run_lines "parallel -j $j /bin/true ::: $args"
+  done
+  printf "16 x sleep 0.1, one per line:        "
+  N=16 run_lines "sleep 0.1"
+  printf "parallel -j 8 sleep ::: 16 x 0.1:    "
+  N=1 run_lines "parallel -j 8 sleep ::: $(yes 0.1 | head -16 | tr '\n' ' ')"
+}
+
+# the same line over and over against lines that differ by one word, so
+# every one of them is parsed
+bench_plan() {
+  line="true a b c d e f g h && true i j k l m n o p && true q r s t u v w"
+  printf "repeated line:  "
+  N=20000 run_lines "$line"
+  awk -v line="$line" 'BEGIN { for (i = 0; i < 20000; i++) print line, i
+    print "exit" }' >/tmp/rsh_bench_plan.$$
+  start=$(date +%s%N)
+  "$RSH" </tmp/rsh_bench_plan.$$ >/dev/null 2>&1
+  end=$(date +%s%N)
+  rm -f /tmp/rsh_bench_plan.$$
+  echo "distinct lines: $(((end - start) / 1000000)) ms total"
+}
+
+# 100000 loop iterations that only assign, in one script, against dash and
+# bash running the same text
+bench_loops() {
+  d="0 1 2 3 4 5 6 7 8 9"
+  cat >/tmp/rsh_bench_loops.$$ <<EOF
+for a in $d; do for b in $d; do for c in $d; do for e in $d; do
+  for f in $d; do v=\$a\$b\$c\$e\$f; done
+done; done; done; done
+EOF
+  for sh in "$RSH" dash bash; do
+    command -v "$sh" >/dev/null || continue
+    start=$(date +%s%N)
+    "$sh" /tmp/rsh_bench_loops.$$ >/dev/null 2>&1
+    end=$(date +%s%N)
+    printf "%-6s %6d ms, %4d ns/iteration\n" "${sh##*/}" \
+      $(((end - start) / 1000000)) $(((end - start) / 100000))
+  done
+  rm -f /tmp/rsh_bench_loops.$$
+}
+
+# i=$((i+1)) a million times under a while loop, against dash and bash
+bench_arith() {
+  echo 'i=0; while [ $i -lt 1000000 ]; do i=$((i+1)); done' \
+    >/tmp/rsh_bench_arith.$$
+  for sh in "$RSH" dash bash; do
+    command -v "$sh" >/dev/null || continue
+    start=$(date +%s%N)
+    "$sh" /tmp/rsh_bench_arith.$$ >/dev/null 2>&1
+    end=$(date +%s%N)
+    printf "%-6s %6d ms, %4d ns/iteration\n" "${sh##*/}" \
+      $(((end - start) / 1000000)) $(((end - start) / 1000000))
+  done
+  rm -f /tmp/rsh_bench_arith.$$
+}
+
+# $(...) of a builtin (no fork in rsh) and of a program, per substitution
+bench_subst() {
+  for cmd in "echo hi:20000" "/bin/echo hi:2000"; do
+    n=${cmd##*:}
+    echo "i=0; while [ \$i -lt $n ]; do x=\$(${cmd%:*}); i=\$((i+1)); done" \
+      >/tmp/rsh_bench_subst.$$
+    echo "x=\$(${cmd%:*}), $n times"
+    for sh in "$RSH" dash bash; do
+      command -v "$sh" >/dev/null || continue
+      start=$(date +%s%N)
+      "$sh" /tmp/rsh_bench_subst.$$ >/dev/null 2>&1
+      end=$(date +%s%N)
+      printf "%-6s %6d ms, %6d ns/substitution\n" "${sh##*/}" \
+        $(((end - start) / 1000000)) $(((end - start) / n))
+    done
+  done
+  rm -f /tmp/rsh_bench_subst.$$
+}
+
+# *.log in a directory of GLOB_FILES files (500000), one in ten a .log, and
+# the same pattern twice in one command, which rsh reads the directory for once
+bench_glob() {
+  n=${GLOB_FILES:-500000}
+  dir=/tmp/rsh_bench_glob.$$
+  mkdir -p "$dir"
+  (cd "$dir" && seq 1 "$n" | awk '{ print "f" $1 (NR % 10 ? ".txt" : ".log") }' |
+    xargs touch)
+  for pat in '*.log' '*.log *.log' 'f1*0.log'; do
+    echo "cd $dir; for i in 1 2 3 4 5; do echo $pat; done" >"$dir.sh"
+    echo "echo $pat, 5 times, $n files"
+    for sh in "$RSH" dash bash; do
+      command -v "$sh" >/dev/null || continue
+      start=$(date +%s%N)
+      "$sh" "$dir.sh" >/dev/null 2>&1
+      end=$(date +%s%N)
+      printf "%-6s %6d ms\n" "${sh##*/}" $(((end - start) / 1000000))
+    done
+  done
+  rm -rf "$dir" "$dir.sh"
+}
+
+# a history file of HIST_ENTRIES (1000000) records written by python3, then
+# the first search (which indexes the file) and 5000 searches after it
+bench_history() {
+  command -v python3 >/dev/null || { echo "needs python3" >&2; return 1; }
+  n=${HIST_ENTRIES:-1000000}
+  file=/tmp/rsh_bench_hist.$$
+  python3 - "$file" "$n" <<'EOF'
+import random, struct, sys
+words = ["git", "make", "ls", "cd", "grep", "ssh", "vim", "cat", "docker",
+         "kubectl", "build", "src", "-la", "--all", "logs", "deploy", "test"]
+random.seed(1)
+with open(sys.argv[1], "wb") as f:
+    for i in range(int(sys.argv[2])):
+        text = " ".join(random.choice(words) for _ in range(4)) + " %d" % i
+        data = text.encode()
+        h = 2166136261
+        for b in data:
+            h = ((h ^ b) * 16777619) & 0xffffffff
+        rec = struct.pack("<IIII", 0x31485352, len(data), h, 0) + data
+        f.write(rec + b"\0" * (-len(rec) % 8))
+EOF
+  cat "$file" >/dev/null # warm, the first search is then indexing alone
+  ls -l "$file" | awk '{ print $5 " bytes" }'
+  for q in "ssh deploy" "kubectl logs 12345" "never typed"; do
+    start=$(date +%s%N)
+    RSH_HISTFILE=$file "$RSH" -c "history -n 1 $q" >/dev/null
+    mid=$(date +%s%N)
+    RSH_HISTFILE=$file "$RSH" -c "history -n 1 $q
+      i=0; while [ \$i -lt 5000 ]; do history -n 1 $q; i=\$((i+1)); done" \
+      >/dev/null
+    end=$(date +%s%N)
+    printf "%-20s first %5d ms, then %6d us/search\n" "$q" \
+      $(((mid - start) / 1000000)) $(((end - mid - (mid - start)) / 5000000))
+  done
+  rm -f "$file"
+}
+
+# Tab completion at the prompt with COMP_EXECS (default 20000) executables on
+# PATH, typed through a pty. the shell's own trace gives the time each Tab
+# took inside it: the first builds the PATH trie, the rest walk it, and one
+# after a new file appears shows the inotify update
+bench_complete() {
+  command -v python3 >/dev/null || { echo "needs python3" >&2; return 1; }
+  dir=/tmp/rsh_bench_comp.$$
+  mkdir -p "$dir"
+  python3 - "$RSH" "$dir" "${COMP_EXECS:-20000}" <<'EOF'
+import json, os, pty, select, sys, time
+rsh, d, n = os.path.abspath(sys.argv[1]), sys.argv[2], int(sys.argv[3])
+for i in range(n):
+    path = "%s/cmd%05d" % (d, i)
+    open(path, "w").close()
+    os.chmod(path, 0o755)
+trace = d + "/trace.json"
+env = dict(os.environ, TERM="xterm", PATH=d + ":/usr/bin:/bin",
+           RSH_TRACE=trace, RSH_HISTFILE=d + "/hist")
+pid, fd = pty.fork()
+if pid == 0:
+    os.execve(rsh, [rsh], env)
+def drain(t):
+    end = time.time() + t
+    while time.time() < end:
+        if select.select([fd], [], [], 0.02)[0]:
+            try:
+                os.read(fd, 1 << 16)
+            except OSError:
+                return
+drain(0.5)
+words = ["cmd", "cmd1", "cmd123", "cmd1234", "cmd12345", "cmd", "c", "ca"]
+for w in words:
+    os.write(fd, (w + "\t").encode())
+    drain(0.2)
+    os.write(fd, b"\x15")
+    drain(0.05)
+open(d + "/cmdnew", "w").close()
+os.chmod(d + "/cmdnew", 0o755)
+drain(0.1)
+os.write(fd, b"cmdn\t")
+drain(0.2)
+os.write(fd, b"\x15exit\r")
+drain(0.3)
+os.waitpid(pid, 0)
+spans = [e for e in json.loads(open(trace).read().rstrip(",\n") + "]")
+         if e.get("cat") == "edit"]
+for e in spans:
+    print("%-10s %-10s %8.1f us" % (e["name"], e["args"]["detail"], e["dur"]))
+EOF
+  rm -rf "$dir"
+}
+
+# interactive round trips through a pty: a line typed at the prompt until
+# the next prompt is back, PROMPT_LINES (default 5000) times, with the
+# default prompt and with one using every escape
+bench_prompt() {
+  command -v python3 >/dev/null || { echo "needs python3" >&2; return 1; }
+  for ps1 in "" '\u@\h \w [\?] \j \D \$ '; do
+    python3 - "$RSH" "${PROMPT_LINES:-5000}" "$ps1" <<'EOF'
+import os, pty, sys, time
+rsh, n, ps1 = os.path.abspath(sys.argv[1]), int(sys.argv[2]), sys.argv[3]
+env = dict(os.environ, TERM="xterm", RSH_HISTFILE="/dev/null")
+if ps1:
+    env["PS1"] = ps1 + "> "
+pid, fd = pty.fork()
+if pid == 0:
+    os.execve(rsh, [rsh], env)
+def prompt():
+    buf = b""
+    while not buf.endswith(b"> "):
+        buf += os.read(fd, 4096)
+def io():
+    f = dict(l.split(": ") for l in open("/proc/%d/io" % pid).read().split("\n") if l)
+    return int(f["syscr"]) + int(f["syscw"])
+prompt()
+calls = io()
+start = time.perf_counter()
+for i in range(n):
+    os.write(fd, b":\r")
+    prompt()
+took = time.perf_counter() - start
+calls = io() - calls
+os.write(fd, b"exit\r")
+os.waitpid(pid, 0)
+print("%-30s %6.1f us/line, %.1f reads+writes/line" %
+      (repr(ps1 or "default"), took / n * 1e6, calls / n))
+EOF
+  done
+}
+
+# launch latency of /bin/true by spawn mode as the shell grows: a variable
+# of ZYGOTE_SIZES bytes (default 0 256M 1G) is filled first, then
+# ZYGOTE_RUNS (default 2000) launches are timed from the shell's trace
+bench_zygote() {
+  command -v python3 >/dev/null || { echo "needs python3" >&2; return 1; }
+  trace=/tmp/rsh_bench_zygote.$$.json
+  printf "%-6s %-7s %9s %8s %8s %8s %8s\n" rss mode p50 p90 p99 max launches
+  for size in ${ZYGOTE_SIZES:-0 256000000 1000000000}; do
+    for mode in fork posix zygote; do
+      rm -f "$trace"
+      rss=$(RSH_SPAWN=$mode RSH_TRACE=$trace "$RSH" -c "
+        big=\$(head -c $size /dev/zero | tr '\\0' x)
+        i=0; while [ \$i -lt ${ZYGOTE_RUNS:-2000} ]; do /bin/true; i=\$((i+1)); done
+        grep VmRSS /proc/\$\$/status")
+      python3 - "$trace" "$mode" "$rss" <<'EOF'
+import json, sys
+trace, mode, rss = sys.argv[1:]
+names = {"fork": "fork+exec", "posix": "posix_spawn", "zygote": "zygote"}
+events = json.loads(open(trace).read().rstrip(",\n") + "]")
+shell = next(e["pid"] for e in events if e["name"] == "process_name" and
+             e["args"]["name"] == "rsh")
+d = sorted(e["dur"] for e in events
+           if e.get("cat") == "spawn" and e.get("name") == names[mode] and
+           e["args"]["detail"] == "/bin/true" and e["pid"] == shell)
+pct = lambda p: d[min(len(d) - 1, int(len(d) * p))]
+print("%-6s %-7s %7.0fus %6.0fus %6.0fus %6.0fus %8d" %
+      ("%dM" % (int(rss.split()[1]) // 1024), mode, pct(.5), pct(.9), pct(.99), d[-1],
+       len(d)))
+EOF
+    done
+  done
+  rm -f "$trace"
+}
+
+# rsh -c per command, as a build runs it, against rshc and an rsh --server
+bench_server() {
+  sock=/tmp/rsh_bench_server.$$
+  "$RSH" --server $sock &
+  server=$!
+  sleep 0.2
+  for line in "${SERVER_LINE:-test -d /tmp && echo cc -c x.c >/dev/null}" \
+    "${SERVER_EXEC:-/bin/true}"; do
+    echo "$line"
+    for client in "$RSH" "${RSHC:-./rshc}"; do
+      start=$(date +%s%N)
+      i=0
+      while [ $i -lt "$N" ]; do
+        RSH_SERVER=$sock $client -c "$line"
+        i=$((i + 1))
+      done
+      end=$(date +%s%N)
+      printf "  %-8s sequential %6d us/command" "${client##*/}" \
+        $(((end - start) / N / 1000))
+      start=$(date +%s%N)
+      seq "$N" | RSH_SERVER=$sock xargs -P "${SERVER_JOBS:-4}" -I{} \
+        $client -c "$line"
+      end=$(date +%s%N)
+      printf "   -P%d %6d us/command\n" "${SERVER_JOBS:-4}" \
+        $(((end - start) / N / 1000))
+    done
+  done
+  kill $server
+  wait $server
+}
+
+case ${1:-launch} in
+launch) bench_launch ;;
+path) bench_path ;;
+parse) bench_parse ;;
+lex) bench_lex ;;
+startup) bench_startup ;;
+builtin) bench_builtin ;;
+jobs) bench_jobs ;;
+pipeline) bench_pipeline ;;
+pipestatus) bench_pipestatus ;;
+timing) bench_timing ;;
+trace) bench_trace ;;
+analyze) bench_analyze ;;
+pipesize) bench_pipesize ;;
+replicate) bench_replicate ;;
+parallel) bench_parallel ;;
+plan) bench_plan ;;
+loops) bench_loops ;;
+arith) bench_arith ;;
+subst) bench_subst ;;
+glob) bench_glob ;;
+history) bench_history ;;
+complete) bench_complete ;;
+prompt) bench_prompt ;;
+zygote) bench_zygote ;;
+server) bench_server ;;
+*)
+  echo "usage: $0 [launch|path|parse|lex|startup|builtin|jobs|pipeline|pipestatus|timing|trace|analyze|pipesize|replicate|parallel|plan|loops|arith|subst|glob|history|complete|prompt|zygote|server]" >&2
+  exit 1
+  ;;
+esac
@@ -1,23 +1,86 @@
+#define _GNU_SOURCE // pipe2, strchrnul
+
+#include <ctype.h>
+#include <dirent.h> // getdents64
 #include <errno.h>
+#include <fcntl.h>
+#include <fnmatch.h>
 #include <limits.h> // PATH_MAX
+#include <poll.h>
+#include <pwd.h> // getpwuid
+#include <sched.h> // sched_getaffinity
+#include <signal.h>
+#include <spawn.h>
+#include <stdarg.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/inotify.h>
+#include <sys/ioctl.h> // TIOCGWINSZ
+#include <sys/mman.h>
+#include <sys/prctl.h> // PR_SET_PDEATHSIG
+#include <sys/resource.h>
+#include <sys/sendfile.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/un.h> // sockaddr_un
+#include <sys/stat.h>
+#include <sys/time.h> // timeradd, timersub
 #include <sys/wait.h>
+#include <termios.h>
+#include <time.h>
 #include <unistd.h>
 
 #define HELP_CMD "help"
 #define HELP_MSG                                                               \
   "Type any system command, exit to exit, cd [path] to change directory, or "  \
-  "mkdir [dirname] to create a new directory\n"
+  "mkdir [dirname] to create a new directory\n"                               \
+  "hash [-r] [-d name] [name ...] inspects, resets or fills the PATH cache\n"  \
+  "cmd & runs in the background, jobs/fg/bg/wait [%job] manage it\n"         \
+  "$? and ${PIPESTATUS[n]} hold exit statuses, set -o pipefail fails a "       \
+  "pipeline on any stage\n"                                                   \
+  "time cmd reports what a pipeline cost, set -o timing feeds every command "  \
+  "to stats\n"                                                                \
+  "a |@N cmd runs cmd on N batches of its input at once (|@Nu unordered, z "   \
+  "for NUL)\n"                                                                 \
+  "parallel [-j N] [-k] [-t] cmd [{}] [::: arg ...] runs cmd per arg or line, "\
+  "N at a time, each job's stdout in one piece (stderr as it comes)\n"         \
+  "if/elif/else, while, until, for, case, { list; } and name() { list; } run "  \
+  "in the shell, name=value sets $name\n"                                      \
+  "export/unset manage variables, ${name} ${#name} ${name:-word} and "          \
+  "$((arithmetic)) expand, name=value cmd sets cmd's environment\n"           \
+  "$(cmd) and `cmd` expand to cmd's output, builtins run without a fork\n"     \
+  "* ? [...] and ** match file names, {a,b} and {1..9} expand to each\n"       \
+  "history [-n count] [text] lists the lines typed before ($RSH_HISTFILE)\n"   \
+  "at the prompt Up/Down walk history, Ctrl-R searches it and Tab completes "  \
+  "commands and file names\n"                                                 \
+  "cd [dir | -] keeps $PWD and $OLDPWD, pushd [dir]/popd/dirs keep a stack\n" \
+  "PS1 sets the prompt: \\w \\W \\u \\h \\$ \\? (status) \\j (jobs) \\D "       \
+  "(time taken) \\e \\n\n"                                                    \
+  "rsh --server socket serves rshc -c command, rsh -c without a new shell "     \
+  "($RSH_SERVER)\n"                                                           \
+  "builtins: cd pushd popd dirs exit hash jobs fg bg wait set export unset "  \
+  "times history "                                                             \
+  "stats "                                                                     \
+  "parallel help : true false echo pwd printf test [ cat\n"
 #define QUIT_CMD "exit"
+#define RSH_USAGE "usage: rsh [-c command | script | --server socket]\n"
+#define RSH_STDIN_BUFSIZE (64 * 1024) // stdio buffer when stdin is not a tty
+#define RSH_PS1 "\\e[36m\\W \\e[0m> " // the prompt when PS1 is unset
+#define RSH_PS2 "> "
 
 #define RSH_RL_BUFSIZE 1024
 #define RSH_TOK_BUFSIZE 64
+#define RSH_ARENA_CHUNK (64 * 1024) // default arena chunk size
+
 
-#define RSH_TOK_DELIM " \t\r\n\a"
-#define PIPE_DELIM "|"
+#define RSH_SPAWN_ENV "RSH_SPAWN" // "fork" or "zygote" instead of posix_spawn
+#define RSH_PATH_HASH_SIZE 256    // buckets in the PATH lookup cache
+#define RSH_COPY_CHUNK (1 << 20)  // bytes per splice/sendfile call
+#define RSH_MAX_REPLICAS 256      // largest N in |@N
+#define RSH_HIST_BATCH 16384      // history records indexed per idle step
 
 // ANSI colors
 #define ANSI_COLOR_RED "\x1b[31m"
@@ -29,511 +92,9757 @@
 #define ANSI_COLOR_RESET "\x1b[0m"
 
 /* ---------------------------------------------------------------- PARSING
-  Instruction
-    - Command (if more than one, pipe)
-      - Arguments
-      - Redirect Stream (input)
-      - Redirect Stream (output)
-      - Execute (should this be executed)
-    - has_pipe (contains a pipe?)
-    - Execute
+  a line is lexed in one pass into (offset, length) spans over the input and
+  parsed straight into an AST. words are NUL terminated in place, so argv
+  points into the line and nothing is copied per token.
+  Node
+    - NODE_PIPE Pipeline (one or more Commands joined by |)
+      - Command
+        - Arguments (raw, quotes are removed right before exec)
+        - Redirect Stream (input)
+        - Redirect Stream (output)
+        - Execute (should this be executed)
+    - NODE_AND / NODE_OR (left && right, left || right)
+    - NODE_SEQ (left ; right)
+    - NODE_BG (left &)
+    - NODE_IF, NODE_WHILE, NODE_UNTIL, NODE_FOR, NODE_CASE, NODE_GROUP,
+      NODE_FUNC: compound commands, compiled to bytecode once parsed
 */
 
+// token kinds produced by the lexer
+enum {
+  TOK_WORD,
+  TOK_PIPE,   // |
+  TOK_LT,     // <
+  TOK_GT,     // >
+  TOK_DGT,    // >>
+  TOK_SEMI,   // ;
+  TOK_AND_IF, // &&
+  TOK_OR_IF,  // ||
+  TOK_AMP,    // &
+  TOK_NEWLINE,
+  TOK_EOF,
+  TOK_ERROR // unterminated quote or trailing backslash
+} typedef TokenKind;
+
+#define WORD_QUOTED 0x1 // word has quotes or backslashes to remove
+#define WORD_EXPAND 0x2 // word has a $ that may expand
+#define WORD_GLOB 0x4   // word has a * ? [ or { that may expand to names
+
+// a token is a span over the input, nothing is copied
+struct {
+  TokenKind kind;
+  unsigned flags; // WORD_* for TOK_WORD
+  size_t off;
+  size_t len;
+} typedef Token;
+
 // stores a single command (no pipes)
 struct {
   char **argv; // array of arguments example (ls -l => argv[0] = ls, argv[1] =
-               // -l, argv[2] = NULL)
+               // -l, argv[2] = NULL), raw words that point into the line
+  int argc;
   char *output_file; // Stores filename for output redirection
   char *input_file;
-  bool append; // True for >> (append), False for > (overwrite)
+  bool append;  // True for >> (append), False for > (overwrite)
   bool execute;
+  bool quoted; // some word still has quotes to remove or $ to expand
+  int replicas;  // copies from |@N in front of this stage, 0 for one
+  int replica_flags; // REPLICA_*
+  // set by the plan cache for a line it keeps: argv[0] is then known to be
+  // builtin, or a program at path (NULL: not found)
+  bool resolved;
+  const struct Builtin *builtin;
+  const char *path;
+  // name=value words in front of argv[0], split off when the command runs
+  char **assigns;
+  int nassigns;
 } typedef Command;
 
-// stores an instruction (whatever the user typed), can have multiple commands
+// |@N suffixes: u merges replica output as it comes, z splits on NUL
+#define REPLICA_UNORDERED 0x1
+#define REPLICA_NUL 0x2
+
+// commands joined by pipes: example: for ls | grep .c ->
+// commands[0] = {"ls", NULL}, commands[1] = {"grep", ".c", NULL}
 struct {
-  Command **
-      commands; // holds multiple commands: example: for ls | grep .c ->
-                // commands[0] = {"ls", NULL},commands[1] = {"grep", ".c", NULL}
-  bool has_pipe; // true if user command has a pipe
-  bool execute;
-} typedef Instruction;
+  Command **commands; // NULL terminated
+  int count;
+  long *pipe_sizes; // capacity of pipe i from |[size], 0 for the default
+  bool timed; // time prefix
+} typedef Pipeline;
 
-// func to read a line from the user during main loop
-char *rsh_read_line(void) {
-  char *line = NULL;
-  size_t bufsize = 0;
+enum {
+  NODE_PIPE,
+  NODE_AND,
+  NODE_OR,
+  NODE_SEQ,
+  NODE_BG,
+  NODE_IF,    // if left; then right; else alt; fi
+  NODE_WHILE, // while left; do right; done
+  NODE_UNTIL,
+  NODE_FOR,   // for name in words; do right; done
+  NODE_CASE,  // case name in arms esac
+  NODE_GROUP, // { left; }
+  NODE_FUNC   // name() right
+} typedef NodeType;
 
-  if (getline(&line, &bufsize, stdin) == -1) {
-    if (feof(stdin)) {
-      exit(EXIT_SUCCESS);
-    } else {
-      perror("readline");
-      exit(EXIT_FAILURE);
-    }
-  }
+struct CaseArm;
 
-  return line;
-}
+struct Node {
+  NodeType type;
+  Pipeline *pipe;     // NODE_PIPE
+  struct Node *left;  // NODE_AND, NODE_OR, NODE_SEQ, NODE_BG, conditions
+  struct Node *right; // NODE_AND, NODE_OR, NODE_SEQ, bodies
+  struct Node *alt;   // NODE_IF: elif (a nested NODE_IF) or else, or NULL
+  char *name;         // NODE_FOR variable, NODE_CASE word, NODE_FUNC name
+  char **words;       // NODE_FOR, NULL terminated, NULL for "$@"
+  struct CaseArm *arms; // NODE_CASE
+  int narms;
+  struct Code *code; // outermost compound commands, see COMPILER
+} typedef Node;
 
-// func to parse a command with arguments
-Command *rsh_parse_cmd(char *cmd_str) {
-  int bufsize = RSH_TOK_BUFSIZE;
-  int position = 0;
-  char *token;
-  char **tokens = malloc(sizeof(char *) * bufsize);
-  char *output_file = NULL;
-  char *input_file = NULL;
-  bool append = false;
-  if (!tokens) {
-    fprintf(stderr, "rsh_parse_cmd: tokens allocation error");
-    exit(EXIT_FAILURE);
-  }
+// pat | pat) body ;;
+struct CaseArm {
+  char **patterns; // raw words, NULL terminated
+  Node *body;
+} typedef CaseArm;
+
+/* ---------------------------------------------------------------- ARENA
+  bump allocator that owns everything parsed from one line. nothing in it is
+  freed on its own, arena_reset hands the whole thing back in O(1) and keeps
+  the chunks for the next line, so a warm shell does no mallocs while parsing.
+ * -----------------------------------------------------------------------------------------
+ */
 
-  char *saveptr_cmd; // for strtok_r to save where it is
+struct ArenaChunk {
+  struct ArenaChunk *next;
+  size_t size;
+  char data[];
+} typedef ArenaChunk;
 
-  token = strtok_r(cmd_str, RSH_TOK_DELIM,
-                   &saveptr_cmd); // splits string into tokens for parsing
+struct {
+  ArenaChunk *first;   // chunk list, kept across resets
+  ArenaChunk *current; // chunk being bumped
+  size_t used;         // bytes used in current
+  void *last;          // most recent allocation, can grow in place
+  size_t chunk_mallocs;
+  size_t chunk_size; // 0 for RSH_ARENA_CHUNK
+} typedef Arena;
 
-  while (token != NULL) {
+#define ARENA_ALIGN 16
 
-    if (strcmp(token, "<") == 0) {
-      token = strtok_r(NULL, RSH_TOK_DELIM, &saveptr_cmd);
-      if (token == NULL) {
-        fprintf(stderr, "rsh: syntax error near input redirect\n");
-        exit(EXIT_FAILURE);
-      }
+// returns size bytes from the arena, exits on allocation failure
+void *arena_alloc(Arena *a, size_t size) {
+  size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
 
-      input_file = strdup(token);                          // save input file
-      token = strtok_r(NULL, RSH_TOK_DELIM, &saveptr_cmd); // get next token
+  while (a->current == NULL || a->used + size > a->current->size) {
+    // reuse the next kept chunk if it is big enough
+    if (a->current && a->current->next && a->current->next->size >= size) {
+      a->current = a->current->next;
+      a->used = 0;
       continue;
     }
-
-    // finds > or >> and stores the filename to write or append to
-    if (strcmp(token, ">") == 0 ||
-        strcmp(token, ">>") == 0) {        // if ">" or ">>" is found in token
-      append = (strcmp(token, ">>") == 0); // True if >>, else false
-      token = strtok_r(NULL, RSH_TOK_DELIM, &saveptr_cmd);
-      if (token == NULL) {
-        fprintf(stderr, "rsh: syntax error near redirection\n");
-        exit(EXIT_FAILURE);
-      }
-      output_file = strdup(token); // set input after > as output_file
-      token = strtok_r(NULL, RSH_TOK_DELIM, &saveptr_cmd);
+    if (a->current == NULL && a->first && a->first->size >= size) {
+      a->current = a->first;
+      a->used = 0;
       continue;
     }
 
-    // copy token for storage
-    char *token_copy = strdup(token); // makes a copy of the token
-    if (!token_copy) {
-      fprintf(stderr, "strdup error in rsh_parse_cmd");
+    size_t chunk_size = a->chunk_size ? a->chunk_size : RSH_ARENA_CHUNK;
+    if (size > chunk_size)
+      chunk_size = size;
+    ArenaChunk *chunk = malloc(sizeof(ArenaChunk) + chunk_size);
+    if (!chunk) {
+      fprintf(stderr, "rsh: arena allocation error");
       exit(EXIT_FAILURE);
     }
-    tokens[position] = token_copy;
-    position++;
-
-    if (position >= bufsize) {
-      bufsize += RSH_TOK_BUFSIZE;
-      tokens = realloc(tokens, sizeof(char *) * bufsize);
-      if (!tokens) {
-        fprintf(stderr, "rsh: allocation error");
-        exit(EXIT_FAILURE);
-      }
+    a->chunk_mallocs++;
+    chunk->size = chunk_size;
+    // splice in after current so kept chunks stay reachable
+    if (a->current) {
+      chunk->next = a->current->next;
+      a->current->next = chunk;
+    } else {
+      chunk->next = a->first;
+      a->first = chunk;
     }
-    token = strtok_r(NULL, RSH_TOK_DELIM,
-                     &saveptr_cmd); // incroments the next thing in cmd_str
-                                    // based off RSH_TOK_DELIM
+    a->current = chunk;
+    a->used = 0;
   }
-  tokens[position] = NULL;
-  Command *cmd = malloc(sizeof(Command));
 
-  if (!cmd) {
-    fprintf(stderr, "rsh: cmd allocation error");
-    exit(EXIT_FAILURE);
+  void *p = a->current->data + a->used;
+  a->used += size;
+  a->last = p;
+  return p;
+}
+
+// resizes ptr (of old_size bytes), in place when it was the last allocation
+void *arena_grow(Arena *a, void *ptr, size_t old_size, size_t new_size) {
+  if (ptr && ptr == a->last) {
+    size_t start = (char *)ptr - a->current->data;
+    size_t need = (new_size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+    if (start + need <= a->current->size) {
+      a->used = start + need;
+      return ptr;
+    }
   }
+  void *p = arena_alloc(a, new_size);
+  if (ptr)
+    memcpy(p, ptr, old_size);
+  return p;
+}
 
-  cmd->argv = tokens;
-  cmd->output_file = output_file;
-  cmd->input_file = input_file;
-  cmd->append = append;
-  cmd->execute = true;
+// forgets every allocation, chunks are kept for reuse
+void arena_reset(Arena *a) {
+  a->current = NULL;
+  a->used = 0;
+  a->last = NULL;
+}
 
-  // handle echo
-  if (!strcmp(tokens[position - 1], "ECHO") ||
-      !strcmp(tokens[position - 1], "PIPE") ||
-      !strcmp(tokens[position - 1], "IO")) {
-    cmd->execute = false;
-    free(cmd->argv[position - 1]);
-    cmd->argv[position - 1] = NULL;
+// a point to go back to: what was allocated after it is forgotten, so a
+// loop can reuse the same bytes every iteration
+struct {
+  ArenaChunk *current;
+  size_t used;
+} typedef ArenaMark;
+
+ArenaMark arena_mark(Arena *a) { return (ArenaMark){a->current, a->used}; }
+
+void arena_release(Arena *a, ArenaMark mark) {
+  a->current = mark.current;
+  a->used = mark.used;
+  a->last = NULL;
+}
+
+// frees the chunks themselves
+void arena_free(Arena *a) {
+  ArenaChunk *chunk = a->first;
+  while (chunk) {
+    ArenaChunk *next = chunk->next;
+    free(chunk);
+    chunk = next;
   }
-  return cmd;
+  a->first = NULL;
+  arena_reset(a);
 }
 
-// splits a line from the user into an instruction
-Instruction *rsh_parse_instruction(char *line) {
-  int bufsize = RSH_TOK_BUFSIZE;
-  int position = 0;
+/* ---------------------------------------------------------------- TRACE
+  RSH_TRACE=file.json writes Chrome trace events (chrome://tracing, Perfetto)
+  for reading, parsing, spawning, child setup, exec and reaping, with one
+  track per pid. each process fills its own buffer and appends it to the file
+  with a single O_APPEND write when it fills up, before an exec and at exit,
+  so the shell and its children never share state. the file is a JSON array
+  left open at the end, which both viewers accept. with tracing off every
+  hook is one branch on trace_fd
+ * -----------------------------------------------------------------------------------------
+ */
 
-  Instruction *instr = malloc(sizeof(Instruction));
-  if (!instr) {
-    fprintf(stderr, "rsh: instr allocation error");
-    exit(EXIT_FAILURE);
-  }
+#define RSH_TRACE_ENV "RSH_TRACE"
+#define RSH_TRACE_BUFSIZE (64 * 1024)
+#define RSH_TRACE_EVENT 768 // longest event, detail strings are cut to fit
 
-  instr->execute = true;
-  instr->commands = malloc(sizeof(Command *) * bufsize);
+#define TRACING (trace_fd != -1)
 
-  if (!instr->commands) {
-    fprintf(stderr, "rsh: instr commands allocation error");
-    exit(EXIT_FAILURE);
+int trace_fd = -1;
+pid_t trace_pid; // this process, the track shell events go on
+char trace_buf[RSH_TRACE_BUFSIZE];
+size_t trace_len;
+
+// CLOCK_MONOTONIC in ns, the same clock in every process
+long long rsh_trace_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+long long rsh_ts_ns(const struct timespec *ts) {
+  return ts->tv_sec * 1000000000LL + ts->tv_nsec;
+}
+
+void rsh_trace_flush(void) {
+  if (trace_fd == -1 || trace_len == 0)
+    return;
+  ssize_t n = write(trace_fd, trace_buf, trace_len);
+  (void)n; // a trace that cannot be written is not worth failing over
+  trace_len = 0;
+}
+
+void rsh_trace_track(pid_t pid, const char *name);
+
+// in a new child: what is buffered belongs to the parent, which writes it
+void rsh_trace_forked(const char *name) {
+  if (!TRACING)
+    return;
+  trace_len = 0;
+  trace_pid = getpid();
+  rsh_trace_track(trace_pid, name);
+}
+
+void rsh_trace_emit(const char *fmt, ...) {
+  char event[RSH_TRACE_EVENT];
+  va_list args;
+  va_start(args, fmt);
+  int n = vsnprintf(event, sizeof(event), fmt, args);
+  va_end(args);
+  if (n < 0 || n >= (int)sizeof(event))
+    return;
+
+  // events never straddle two writes, so processes cannot split each other's
+  if (trace_len + n > RSH_TRACE_BUFSIZE)
+    rsh_trace_flush();
+  memcpy(trace_buf + trace_len, event, n);
+  trace_len += n;
+}
+
+// s as the inside of a JSON string, cut to fit in size
+const char *rsh_json_str(char *out, size_t size, const char *s) {
+  size_t o = 0;
+  for (; s && *s && o + 7 < size; s++) {
+    unsigned char c = *s;
+    if (c == '"' || c == '\\') {
+      out[o++] = '\\';
+      out[o++] = c;
+    } else if (c < 0x20) {
+      o += snprintf(out + o, size - o, "\\u%04x", c);
+    } else {
+      out[o++] = c;
+    }
   }
+  out[o] = '\0';
+  return out;
+}
 
-  instr->has_pipe = strchr(line, '|') != NULL; // set has_pipe
+// a complete ("X") event on pid's track
+void rsh_trace_span(pid_t pid, const char *cat, const char *name,
+                    long long start, long long end, const char *detail) {
+  char n[128], d[256];
+  rsh_trace_emit("{\"ph\":\"X\",\"cat\":\"%s\",\"name\":\"%s\",\"pid\":%d,"
+                 "\"tid\":%d,\"ts\":%lld.%03lld,\"dur\":%lld.%03lld,"
+                 "\"args\":{\"detail\":\"%s\"}},\n",
+                 cat, rsh_json_str(n, sizeof(n), name), (int)pid, (int)pid,
+                 start / 1000, start % 1000, (end - start) / 1000,
+                 (end - start) % 1000, rsh_json_str(d, sizeof(d), detail));
+}
 
-  char *line_copy = strdup(line); // copy for strtok
-  if (!line_copy) {
-    fprintf(stderr, "rsh: line_copy allocation error");
-    exit(EXIT_FAILURE);
+// an instant ("i") event on pid's track
+void rsh_trace_instant(pid_t pid, const char *cat, const char *name,
+                       const char *detail) {
+  char n[128], d[256];
+  long long now = rsh_trace_now();
+  rsh_trace_emit("{\"ph\":\"i\",\"s\":\"t\",\"cat\":\"%s\",\"name\":\"%s\","
+                 "\"pid\":%d,\"tid\":%d,\"ts\":%lld.%03lld,"
+                 "\"args\":{\"detail\":\"%s\"}},\n",
+                 cat, rsh_json_str(n, sizeof(n), name), (int)pid, (int)pid,
+                 now / 1000, now % 1000, rsh_json_str(d, sizeof(d), detail));
+}
+
+// names pid's track
+void rsh_trace_track(pid_t pid, const char *name) {
+  char n[128];
+  rsh_trace_emit("{\"ph\":\"M\",\"name\":\"process_name\",\"pid\":%d,"
+                 "\"args\":{\"name\":\"%s\"}},\n",
+                 (int)pid, rsh_json_str(n, sizeof(n), name));
+}
+
+// truncates path and starts the array. the fd is close-on-exec: forked
+// children write before they exec and programs never see it
+void rsh_trace_init(const char *path) {
+  trace_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC,
+                  0666);
+  if (trace_fd == -1) {
+    fprintf(stderr, "rsh: %s: %s\n", path, strerror(errno));
+    return;
   }
+  trace_pid = getpid();
+  rsh_trace_emit("[\n");
+  rsh_trace_flush(); // before any child can append
+  rsh_trace_track(trace_pid, "rsh");
+  atexit(rsh_trace_flush);
+}
 
-  char *saveptr_instr; // saveptr for strtok_r
-  char *token = strtok_r(line_copy, PIPE_DELIM, &saveptr_instr);
-  while (token != NULL) {
-    // strip whitespace
-    char *start = token;
-    while (*start == ' ')
-      start++; // Trim leading spaces
-
-    char *end = start + strlen(start) - 1;
-    while (end > start && *end == ' ')
-      end--; // Trim trailing spaces
-    *(end + 1) = '\0';
-
-    // parse this command
-    instr->commands[position] = rsh_parse_cmd(start);
-    // if any of the commands are set to not execute, do not execute the
-    // instruction
-    if (!instr->commands[position]->execute)
-      instr->execute = false;
-    position++;
-
-    // realloc if needed
-    if (position >= bufsize) {
-      bufsize += RSH_TOK_BUFSIZE;
-      instr->commands = realloc(instr->commands, sizeof(Command *) * bufsize);
-      if (!instr->commands) {
-        fprintf(stderr, "rsh: allocation error");
-        exit(EXIT_FAILURE);
-      }
+void rsh_reap(void); // JOBS
+extern int sigchld_fd;
+bool rsh_hist_pending(void); // HISTORY
+void rsh_hist_step(size_t budget);
+bool rsh_edit_usable(void); // LINE EDITOR, near the end
+bool rsh_trie_pending(void);
+void rsh_trie_build(void);
+char *rsh_edit_line(const char *prompt, char **line, size_t *bufsize);
+
+// waits for stdin to be readable. an interactive shell reaps background jobs
+// meanwhile so they do not linger as zombies, and indexes history and builds
+// the completion trie while nothing is typed
+void rsh_wait_input(void) {
+  while (sigchld_fd != -1) {
+    struct pollfd pfds[2] = {{STDIN_FILENO, POLLIN, 0},
+                             {sigchld_fd, POLLIN, 0}};
+    int ready =
+        poll(pfds, 2, rsh_hist_pending() || rsh_trie_pending() ? 0 : -1);
+    if (ready == -1 && errno != EINTR)
+      break;
+    if (ready == 0 && rsh_hist_pending()) {
+      rsh_hist_step(RSH_HIST_BATCH);
+      continue;
+    }
+    if (ready == 0) {
+      rsh_trie_build();
+      continue;
     }
-    // get the next command
-    token = strtok_r(NULL, PIPE_DELIM, &saveptr_instr);
+    if (pfds[1].revents & POLLIN)
+      rsh_reap(); // reported before the next prompt
+    if (pfds[0].revents)
+      break;
   }
-  // set end to null
-  instr->commands[position] = NULL;
-  free(line_copy); // free the duplicated line
-  return instr;
 }
 
-/* ---------------------------------------------------------------- EXECUTION
- * -----------------------------------------------------------------------------------------
- */
+// func to read a line from the user during main loop, after showing prompt
+// (NULL for none). the buffer is reused across calls (getline only reallocs
+// when a line outgrows it). returns NULL at end of input. a terminal gets
+// the line editor
+char *rsh_read_line(char **line, size_t *bufsize, const char *prompt,
+                    bool interactive) {
+  if (interactive && rsh_edit_usable())
+    return rsh_edit_line(prompt ? prompt : "", line, bufsize);
+  if (prompt) {
+    fputs(prompt, stdout);
+    fflush(stdout);
+  }
+  if (interactive)
+    rsh_wait_input();
 
-int rsh_launch(Command *cmd) {
-  // cd handle
-  if (!strncmp(cmd->argv[0], "cd", strlen("cd"))) {
-    if (cmd->argv[1] == NULL) {
-      fprintf(stderr, "rsh: expected argument to \"cd\"\n");
+  long long start = TRACING ? rsh_trace_now() : 0;
+  ssize_t len = getline(line, bufsize, stdin);
+  if (TRACING)
+    rsh_trace_span(trace_pid, "io", "read_line", start, rsh_trace_now(), NULL);
+
+  if (len == -1) {
+    if (feof(stdin)) {
+      return NULL;
     } else {
-      if (chdir(cmd->argv[1]) != 0) {
-        printf("cd: No such file or directory %s\n", cmd->argv[1]);
-      }
+      perror("readline");
+      exit(EXIT_FAILURE);
     }
-    return 1;
   }
 
-  // help handle
-  if (!strncmp(HELP_CMD, cmd->argv[0], strlen(HELP_CMD))) {
-    printf(HELP_MSG);
-    return 1;
-  }
+  return *line;
+}
 
-  // if not help or cd, then a sys cmd
-  pid_t pid;
-  int status;
+/* ---------------------------------------------------------------- LEXER
+ * -----------------------------------------------------------------------------------------
+ */
 
-  pid = fork();
-  if (pid == 0) {
-    // child
-    FILE *fd_out = NULL, *fd_in = NULL;
+struct {
+  char *src;  // NUL terminated input, words get terminated in place
+  size_t pos; // next byte to scan
+  const char *error;
+} typedef Lexer;
 
-    if (cmd->input_file) {
-      fd_in = fopen(cmd->input_file, "r");
-      if (!fd_in) {
-        fprintf(stderr, "rsh: cannot open input file %s\n", cmd->input_file);
-        exit(EXIT_FAILURE);
+#define IS_BLANK(c) ((c) == ' ' || (c) == '\t' || (c) == '\r' || (c) == '\a')
+#define IS_META(c)                                                             \
+  ((c) == '|' || (c) == '&' || (c) == ';' || (c) == '<' || (c) == '>' ||       \
+   (c) == '\n' || (c) == '\0')
+
+// the end of the $(...) or $((...)) at s: the byte after its matching ), or
+// NULL when the input runs out first. a ) inside quotes does not count
+const char *rsh_subst_end(const char *s) {
+  int depth = 0;
+  for (s++; *s; s++) {
+    if (*s == '\\' && s[1]) {
+      s++;
+    } else if (*s == '\'' || *s == '`') {
+      const char *close = strchr(s + 1, *s);
+      if (!close)
+        return NULL;
+      s = close;
+    } else if (*s == '"') {
+      for (s++; *s != '"';) {
+        if (!*s)
+          return NULL;
+        if (*s == '$' && s[1] == '(') {
+          if (!(s = rsh_subst_end(s)))
+            return NULL;
+        } else {
+          s += *s == '\\' && s[1] ? 2 : 1;
+        }
       }
-      dup2(fileno(fd_in), STDIN_FILENO);
-      fclose(fd_in);
+    } else if (*s == '(') {
+      depth++;
+    } else if (*s == ')' && --depth == 0) {
+      return s + 1;
     }
+  }
+  return NULL;
+}
+
+// returns the next token, every byte of the input is looked at once
+Token rsh_lex(Lexer *lx) {
+  const char *s = lx->src;
+  size_t i = lx->pos;
+  Token tok = {TOK_EOF, 0, i, 0};
 
-    if (cmd->output_file) { // checks if there is an output file
-      if (cmd->append) {
-        fd_out = fopen(cmd->output_file, "a"); // appends
+  while (IS_BLANK(s[i]))
+    i++;
+  if (s[i] == '#') { // comment runs to the end of the line
+    while (s[i] != '\0' && s[i] != '\n')
+      i++;
+  }
+  tok.off = i;
+
+  switch (s[i]) {
+  case '\0':
+    tok.kind = TOK_EOF;
+    break;
+  case '\n':
+    tok.kind = TOK_NEWLINE;
+    i++;
+    break;
+  case '|':
+    tok.kind = s[i + 1] == '|' ? TOK_OR_IF : TOK_PIPE;
+    i += tok.kind == TOK_OR_IF ? 2 : 1;
+    if (tok.kind == TOK_PIPE && s[i] == '[' &&
+        isdigit((unsigned char)s[i + 1])) {
+      // |[size] sets the capacity of this pipe, the parser reads the size.
+      // anything but digits and a K, M or G in the brackets is a plain |
+      // with a [ command after it
+      size_t j = i + 1;
+      while (isdigit((unsigned char)s[j]))
+        j++;
+      if (s[j] && strchr("kKmMgG", s[j]))
+        j++;
+      if (s[j] == ']')
+        i = j + 1;
+    } else if (tok.kind == TOK_PIPE && s[i] == '@') {
+      // |@N[u][z] replicates the next stage, the parser reads the count.
+      // the u and z are flags only when the word ends there: |@2uniq is
+      // |@2 and then uniq
+      i++;
+      while (isdigit((unsigned char)s[i]))
+        i++;
+      size_t j = i;
+      while (s[j] == 'u' || s[j] == 'z')
+        j++;
+      if (!s[j] || IS_BLANK(s[j]) || IS_META(s[j]))
+        i = j;
+    }
+    break;
+  case '&':
+    tok.kind = s[i + 1] == '&' ? TOK_AND_IF : TOK_AMP;
+    i += tok.kind == TOK_AND_IF ? 2 : 1;
+    break;
+  case ';':
+    tok.kind = TOK_SEMI;
+    i++;
+    break;
+  case '<':
+    tok.kind = TOK_LT;
+    i++;
+    break;
+  case '>':
+    tok.kind = s[i + 1] == '>' ? TOK_DGT : TOK_GT;
+    i += tok.kind == TOK_DGT ? 2 : 1;
+    break;
+  default:
+    tok.kind = TOK_WORD;
+    while (!IS_BLANK(s[i]) && !IS_META(s[i])) {
+      if (s[i] == '\\') {
+        tok.flags |= WORD_QUOTED;
+        if (s[i + 1] == '\0') {
+          lx->error = "trailing backslash";
+          tok.kind = TOK_ERROR;
+          break;
+        }
+        i += 2;
+      } else if (s[i] == '\'') {
+        tok.flags |= WORD_QUOTED;
+        const char *close = strchr(s + i + 1, '\'');
+        if (!close) {
+          lx->error = "unterminated quote";
+          tok.kind = TOK_ERROR;
+          break;
+        }
+        i = close - s + 1;
+      } else if (s[i] == '"') {
+        tok.flags |= WORD_QUOTED;
+        i++;
+        while (s[i] != '"' && s[i] != '\0') {
+          if (s[i] == '$' && s[i + 1] == '(') {
+            const char *end = rsh_subst_end(s + i);
+            i = end ? (size_t)(end - s) : strlen(s);
+            continue;
+          }
+          if (s[i] == '\\' && s[i + 1] != '\0')
+            i++;
+          i++;
+        }
+        if (s[i] == '\0') {
+          lx->error = "unterminated quote";
+          tok.kind = TOK_ERROR;
+          break;
+        }
+        i++;
+      } else if (s[i] == '$' && s[i + 1] == '(') {
+        // $((...)) and $(...) are one word up to the matching ), blanks
+        // and operators included
+        tok.flags |= WORD_EXPAND;
+        const char *end = rsh_subst_end(s + i);
+        if (!end) {
+          lx->error = "unterminated $(";
+          tok.kind = TOK_ERROR;
+          break;
+        }
+        i = end - s;
+      } else if (s[i] == '`') {
+        tok.flags |= WORD_QUOTED;
+        for (i++; s[i] != '`' && s[i] != '\0'; i++) {
+          if (s[i] == '\\' && s[i + 1] != '\0')
+            i++;
+        }
+        if (s[i] == '\0') {
+          lx->error = "unterminated `";
+          tok.kind = TOK_ERROR;
+          break;
+        }
+        i++;
       } else {
-        fd_out = fopen(cmd->output_file, "w"); // writes
-      }
-      if (!fd_out) {
-        fprintf(stderr, "rsh: cannot open output file %s\n", cmd->output_file);
-        exit(EXIT_FAILURE);
+        if (s[i] == '$')
+          tok.flags |= WORD_EXPAND;
+        // a lone [ or { is the test builtin or a group, ${ a parameter
+        else if (s[i] == '*' || s[i] == '?' ||
+                 ((s[i] == '[' || s[i] == '{') && !IS_BLANK(s[i + 1]) &&
+                  !IS_META(s[i + 1]) && (i == tok.off || s[i - 1] != '$')))
+          tok.flags |= WORD_GLOB;
+        i++;
       }
-      dup2(fileno(fd_out), STDOUT_FILENO); // makes it so it prints to a file
-      fclose(fd_out);
-    }
-
-    if (execvp(cmd->argv[0], cmd->argv) == -1) {
-      perror("rsh");
-      exit(EXIT_FAILURE);
     }
-  } else if (pid < 0) {
-    // error forking
-    perror("rsh");
-  } else {
-    // parent
-    do {
-      waitpid(pid, &status, WUNTRACED);
-    } while (!WIFEXITED(status) && !WIFSIGNALED(status));
+    if (tok.kind == TOK_ERROR)
+      i = strlen(s); // nothing after this can be trusted
   }
 
-  return 1;
+  tok.len = i - tok.off;
+  lx->pos = i;
+  return tok;
 }
 
-// creates a pipeline if needed and executes an instruction
-int rsh_execute(Instruction *instr) {
-  if (instr->commands[0]->argv[0] == NULL) {
-    // empty command
-    return 1;
+// text of an operator token for error messages
+const char *rsh_tok_name(TokenKind kind) {
+  switch (kind) {
+  case TOK_PIPE:
+    return "|";
+  case TOK_LT:
+    return "<";
+  case TOK_GT:
+    return ">";
+  case TOK_DGT:
+    return ">>";
+  case TOK_SEMI:
+    return ";";
+  case TOK_AND_IF:
+    return "&&";
+  case TOK_OR_IF:
+    return "||";
+  case TOK_AMP:
+    return "&";
+  case TOK_NEWLINE:
+    return "newline";
+  case TOK_EOF:
+    return "end of line";
+  default:
+    return "word";
   }
+}
 
-  // no pipe
-  if (!instr->has_pipe) {
-    return rsh_launch(instr->commands[0]);
-  } else {
-    // pipe execution
-    int num_commands = 0;
-    // get number of commands
-    while (instr->commands[num_commands] != NULL) {
-      num_commands++;
-    }
+/* ---------------------------------------------------------------- PARSER
+  recursive descent over the token stream with one token of lookahead:
+    list     : and_or ((';' | '&' | newline) and_or)*
+    and_or   : pipeline (('&&' | '||') pipeline)*
+    pipeline : ['time'] command (('|' | '|[' size ']' | '|@' N ['u'] ['z'])
+               command)*
+    command  : (word | ('<' | '>' | '>>') word)+
+ * -----------------------------------------------------------------------------------------
+ */
 
-    int pipefds[num_commands - 1][2]; // need n-1 pipes for n commands
+// "65536", "256k", "1M", "1G". false for anything else
+bool rsh_parse_size(const char *text, long *size) {
+  char *end;
+  errno = 0;
+  long n = strtol(text, &end, 10);
+  if (end == text || n < 0 || errno)
+    return false;
+  switch (*end) {
+  case 'k':
+  case 'K':
+    n <<= 10;
+    end++;
+    break;
+  case 'm':
+  case 'M':
+    n <<= 20;
+    end++;
+    break;
+  case 'g':
+  case 'G':
+    n <<= 30;
+    end++;
+    break;
+  }
+  if (*end != '\0')
+    return false;
+  *size = n;
+  return true;
+}
 
-    // create pipes
-    for (int i = 0; i < num_commands - 1; i++) {
-      if (pipe(pipefds[i]) == -1) {
-        perror("pipe");
-        fprintf(stderr, "Pipe creation failed for command %d: %s\n", i,
-                strerror(errno));
-        return 1;
-      }
-    }
+struct {
+  Lexer lx;
+  Token tok; // current token
+  Arena *arena;
+  bool dry_run; // an ECHO/PIPE/IO keyword was seen
+  bool analyze; // an ANALYZE keyword was seen
+  bool failed;
+  bool incomplete; // failed only because the input ended too early
+  int depth;       // compound commands being parsed
+} typedef Parser;
 
-    pid_t pids[num_commands];
+void parser_next(Parser *p) { p->tok = rsh_lex(&p->lx); }
 
-    for (int i = 0; i < num_commands; i++) {
-      pids[i] = fork();
+void parser_error(Parser *p) {
+  if (p->failed)
+    return;
+  p->failed = true;
+  // more input could still complete these, the caller decides what to say.
+  // a lexer error always takes the rest of the input
+  if (p->tok.kind == TOK_EOF ||
+      (p->tok.kind == TOK_ERROR && strcmp(p->lx.error, "unterminated |["))) {
+    p->incomplete = true;
+    return;
+  }
+  if (p->tok.kind == TOK_ERROR) {
+    fprintf(stderr, "rsh: syntax error: %s\n", p->lx.error);
+  } else {
+    fprintf(stderr, "rsh: syntax error near unexpected token `%s'\n",
+            rsh_tok_name(p->tok.kind));
+  }
+}
 
-      if (pids[i] == 0) { // child
-        // redirect input
-        if (i > 0) {
-          if (dup2(pipefds[i - 1][0], STDIN_FILENO) == -1) {
-            perror("dup2 (stdin)");
-            fprintf(stderr, "dup2 failed for stdin of command %d: %s\n", i,
-                    strerror(errno));
-            exit(EXIT_FAILURE);
-          }
-        }
+// takes the current word token. the byte after it has already been scanned
+// once the next token is lexed, so it can be overwritten with the NUL
+char *parser_take_word(Parser *p) {
+  Token word = p->tok;
+  parser_next(p);
+  char *text = p->lx.src + word.off;
+  text[word.len] = '\0';
+  return text;
+}
 
-        // redirect output
-        if (i < num_commands - 1) {
-          if (dup2(pipefds[i][1], STDOUT_FILENO) == -1) {
-            perror("dup2 (stdout)");
-            fprintf(stderr, "dup2 failed for stdout of command %d: %s\n", i,
-                    strerror(errno));
-            exit(EXIT_FAILURE);
-          }
-        }
+void parser_skip_newlines(Parser *p) {
+  while (p->tok.kind == TOK_NEWLINE)
+    parser_next(p);
+}
 
-        // close all pipe fd
-        for (int j = 0; j < num_commands - 1; j++) {
-          close(pipefds[j][0]);
-          close(pipefds[j][1]);
-        }
+// func to parse a command with arguments
+Command *rsh_parse_cmd(Parser *p) {
+  int bufsize = RSH_TOK_BUFSIZE;
+  int position = 0;
+  long long start = TRACING ? rsh_trace_now() : 0;
 
-        // Handle input redirection for the first command
-        if (i == 0 && instr->commands[i]->input_file) {
-          FILE *fd_in = fopen(instr->commands[i]->input_file, "r");
-          if (!fd_in) {
-            fprintf(stderr, "rsh: cannot open input file %s\n",
-                    instr->commands[i]->input_file);
-            exit(EXIT_FAILURE);
-          }
-          dup2(fileno(fd_in), STDIN_FILENO);
-          fclose(fd_in);
-        }
+  // the Command goes first so argv stays the last allocation and can grow in
+  // place
+  Command *cmd = arena_alloc(p->arena, sizeof(Command));
+  char **tokens = arena_alloc(p->arena, sizeof(char *) * bufsize);
+  cmd->output_file = NULL;
+  cmd->input_file = NULL;
+  cmd->append = false;
+  cmd->execute = true;
+  cmd->quoted = false;
+  cmd->replicas = 0;
+  cmd->replica_flags = 0;
+  cmd->resolved = false;
+  cmd->builtin = NULL;
+  cmd->path = NULL;
+  cmd->assigns = NULL;
+  cmd->nassigns = 0;
 
-        // Handle output redirection for the last command
-        if (instr->commands[i]->output_file) {
-          FILE *fd;
-          if (instr->commands[i]->append) {
-            fd = fopen(instr->commands[i]->output_file, "a"); // appends
-          } else {
-            fd = fopen(instr->commands[i]->output_file, "w"); // writes
-          }
-          if (!fd) {
-            fprintf(stderr, "rsh: cannot open output file %s\n",
-                    instr->commands[i]->output_file);
-            exit(EXIT_FAILURE);
-          }
-          dup2(fileno(fd), STDOUT_FILENO);
-          fclose(fd);
-        }
+  while (true) {
+    TokenKind kind = p->tok.kind;
 
-        // execute the command
-        if (execvp(instr->commands[i]->argv[0], instr->commands[i]->argv) ==
-            -1) {
-          perror("execvp");
-          fprintf(stderr, "exec failed for command %d: %s\n", i,
-                  strerror(errno));
-          exit(EXIT_FAILURE);
-        }
-      } else if (pids[i] < 0) {
-        // error forking
-        perror("fork");
-        return 1;
+    if (kind == TOK_LT || kind == TOK_GT || kind == TOK_DGT) {
+      parser_next(p);
+      if (p->tok.kind != TOK_WORD) {
+        parser_error(p);
+        return NULL;
+      }
+      cmd->quoted |= p->tok.flags != 0;
+      if (kind == TOK_LT) {
+        cmd->input_file = parser_take_word(p); // save input file
+      } else {
+        cmd->append = kind == TOK_DGT; // True if >>, else false
+        cmd->output_file = parser_take_word(p);
       }
+      continue;
     }
 
-    // parent
-    // close all pipe file descriptors
-    for (int i = 0; i < num_commands - 1; i++) {
-      close(pipefds[i][0]);
-      close(pipefds[i][1]);
+    if (kind != TOK_WORD)
+      break;
+
+    cmd->quoted |= p->tok.flags != 0;
+    tokens[position++] = parser_take_word(p); // points into the line
+
+    if (position >= bufsize) {
+      tokens = arena_grow(p->arena, tokens, sizeof(char *) * bufsize,
+                          sizeof(char *) * (bufsize + RSH_TOK_BUFSIZE));
+      bufsize += RSH_TOK_BUFSIZE;
     }
+  }
+
+  if (p->tok.kind == TOK_ERROR ||
+      (position == 0 && !cmd->input_file && !cmd->output_file)) {
+    parser_error(p);
+    return NULL;
+  }
+  tokens[position] = NULL;
+  cmd->argv = tokens;
+  cmd->argc = position;
 
-    // wait for all children
-    for (int i = 0; i < num_commands; i++) {
-      wait(NULL);
+  // handle echo
+  if (position > 0 && (!strcmp(tokens[position - 1], "ECHO") ||
+                       !strcmp(tokens[position - 1], "PIPE") ||
+                       !strcmp(tokens[position - 1], "IO"))) {
+    cmd->execute = false;
+    cmd->argv[--cmd->argc] = NULL;
+    p->dry_run = true;
+  } else if (position > 0 && !strcmp(tokens[position - 1], "ANALYZE")) {
+    // runs the line and reports what went through each pipe
+    cmd->argv[--cmd->argc] = NULL;
+    p->analyze = true;
+    if (cmd->argc == 0 && !cmd->input_file && !cmd->output_file) {
+      parser_error(p);
+      return NULL;
     }
   }
+  if (TRACING)
+    rsh_trace_span(trace_pid, "parse", "parse_cmd", start, rsh_trace_now(),
+                   cmd->argv[0]);
+  return cmd;
+}
 
-  return 1;
+Node *rsh_new_node(Parser *p, NodeType type, Node *left, Node *right) {
+  Node *node = arena_alloc(p->arena, sizeof(Node));
+  memset(node, 0, sizeof(Node));
+  node->type = type;
+  node->left = left;
+  node->right = right;
+  return node;
 }
 
-/* ------------------------------------------------------ UTILS/TESTING
- * -------------------------------------------------------------- */
+// reserved words only count unquoted and in command position
+bool parser_at(Parser *p, const char *word) {
+  size_t len = strlen(word);
+  return p->tok.kind == TOK_WORD && p->tok.flags == 0 && p->tok.len == len &&
+         !strncmp(p->lx.src + p->tok.off, word, len);
+}
 
-// free a command
-void free_cmd(Command *cmd) {
-  if (!cmd)
-    return;
-  for (int i = 0; cmd->argv[i] != NULL; i++) {
-    free(cmd->argv[i]);
+// consumes the reserved word that has to come next
+bool parser_expect(Parser *p, const char *word) {
+  if (!parser_at(p, word)) {
+    parser_error(p);
+    return false;
   }
-  free(cmd->argv);
-  free(cmd->output_file);
-  free(cmd->input_file);
-  free(cmd);
+  parser_next(p);
+  return true;
 }
 
-// free an instruction
-void free_instr(Instruction *instr) {
-  if (!instr)
-    return;
-  for (int i = 0; instr->commands[i] != NULL; i++) {
-    free_cmd(instr->commands[i]);
+// a name for variables and functions: [A-Za-z_][A-Za-z0-9_]*
+bool rsh_is_name(const char *s, size_t len) {
+  if (len == 0 || isdigit((unsigned char)s[0]))
+    return false;
+  for (size_t i = 0; i < len; i++) {
+    if (!isalnum((unsigned char)s[i]) && s[i] != '_')
+      return false;
   }
-  free(instr->commands);
-  free(instr);
+  return true;
 }
 
-// print current working directory (not absolute)
-void print_prompt() {
-  char cwd[PATH_MAX];
-  if (getcwd(cwd, sizeof(cwd)) != NULL) {
-    char *last_slash = strrchr(cwd, '/');
-    if (last_slash != NULL) {
-      printf(ANSI_COLOR_CYAN "%s " ANSI_COLOR_RESET "> ", last_slash + 1);
-    } else {
-      printf("%s", cwd);
+Node *rsh_parse_and_or(Parser *p);
+Node *rsh_parse_compound(Parser *p);
+struct Code *rsh_compile(Node *node, Arena *a); // COMPILER, after the parser
+
+// the list inside a compound command, up to (not including) one of the
+// reserved words in ends. ";;" ends a case arm. an empty list is NULL with
+// p->failed unset
+Node *rsh_parse_body(Parser *p, const char *const *ends) {
+  Node *list = NULL;
+  while (true) {
+    parser_skip_newlines(p);
+    for (int i = 0; ends[i]; i++) {
+      if (!strcmp(ends[i], ";;") ? p->tok.kind == TOK_SEMI
+                                 : parser_at(p, ends[i]))
+        return list;
+    }
+    if (p->tok.kind == TOK_EOF) {
+      parser_error(p);
+      return NULL;
     }
-  } else {
-    perror("getcwd() error");
-  }
-}
 
-void print_cmd(Command *cmd) {
-  for (int i = 0; cmd->argv[i] != NULL; i++) {
-    if (i == 0) {
-      fprintf(stderr, ANSI_COLOR_GREEN "%s " ANSI_COLOR_RESET, cmd->argv[i]);
-    } else {
-      fprintf(stderr, "%s ", cmd->argv[i]);
+    Node *item = rsh_parse_and_or(p);
+    if (!item)
+      return NULL;
+    if (p->tok.kind == TOK_AMP) {
+      item = rsh_new_node(p, NODE_BG, item, NULL);
+      parser_next(p);
+    } else if (p->tok.kind == TOK_SEMI) {
+      parser_next(p);
+    } else if (p->tok.kind != TOK_NEWLINE) {
+      parser_error(p);
+      return NULL;
     }
+    list = list ? rsh_new_node(p, NODE_SEQ, list, item) : item;
   }
-  if (cmd->input_file)
-    fprintf(stderr, ANSI_COLOR_RED "LT " ANSI_COLOR_RESET "%s ", cmd->input_file);
-  if (cmd->output_file)
-    fprintf(stderr, ANSI_COLOR_RED "GT " ANSI_COLOR_RESET "%s ", cmd->output_file);
 }
 
-void print_instr(Instruction *instr) {
-  for (int i = 0; instr->commands[i] != NULL; i++) {
-    if (i != 0)
-      fprintf(stderr, ANSI_COLOR_CYAN " PIPE " ANSI_COLOR_RESET);
-    print_cmd(instr->commands[i]);
+// if and elif: the else part of an elif chain is a nested NODE_IF
+Node *rsh_parse_if(Parser *p) {
+  static const char *const then[] = {"then", NULL};
+  static const char *const branch[] = {"elif", "else", "fi", NULL};
+  static const char *const fi[] = {"fi", NULL};
+  parser_next(p);
+  Node *cond = rsh_parse_body(p, then);
+  if (p->failed || !parser_expect(p, "then"))
+    return NULL;
+  Node *body = rsh_parse_body(p, branch);
+  if (p->failed)
+    return NULL;
+  Node *node = rsh_new_node(p, NODE_IF, cond, body);
+  if (parser_at(p, "elif")) {
+    node->alt = rsh_parse_if(p); // takes the fi
+    return node->alt ? node : NULL;
+  }
+  if (parser_at(p, "else")) {
+    parser_next(p);
+    node->alt = rsh_parse_body(p, fi);
+    if (p->failed)
+      return NULL;
   }
-  fprintf(stderr, "\n");
+  return parser_expect(p, "fi") ? node : NULL;
 }
 
-/* ----------------------------------------------------------------------------------
- * MAIN
- * ---------------------------------------------------------------------------------
- */
-
-void rsh_loop(void) {
-  char *line;
-  Instruction *instr;
-  int status;
+Node *rsh_parse_loop(Parser *p, NodeType type) {
+  static const char *const do_[] = {"do", NULL};
+  static const char *const done[] = {"done", NULL};
+  parser_next(p);
+  Node *cond = rsh_parse_body(p, do_);
+  if (p->failed || !parser_expect(p, "do"))
+    return NULL;
+  Node *body = rsh_parse_body(p, done);
+  if (p->failed || !parser_expect(p, "done"))
+    return NULL;
+  return rsh_new_node(p, type, cond, body);
+}
 
-  // start prompt
-  system("clear");
-  printf("Welcome to rsh!\nType any system command, \"help\" for help, or "
-         "\"exit\" to exit!\n");
+// raw words up to the next operator, NULL terminated
+char **rsh_parse_words(Parser *p) {
+  int n = 0, cap = RSH_TOK_BUFSIZE;
+  char **words = arena_alloc(p->arena, sizeof(char *) * cap);
+  while (p->tok.kind == TOK_WORD) {
+    words[n++] = parser_take_word(p);
+    if (n == cap) {
+      words = arena_grow(p->arena, words, sizeof(char *) * cap,
+                         sizeof(char *) * (cap + RSH_TOK_BUFSIZE));
+      cap += RSH_TOK_BUFSIZE;
+    }
+  }
+  words[n] = NULL;
+  return words;
+}
 
-  do {
+// for name [in word ...]; do list; done
+Node *rsh_parse_for(Parser *p) {
+  static const char *const done[] = {"done", NULL};
+  parser_next(p);
+  if (p->tok.kind != TOK_WORD || p->tok.flags ||
+      !rsh_is_name(p->lx.src + p->tok.off, p->tok.len)) {
+    parser_error(p);
+    return NULL;
+  }
+  Node *node = rsh_new_node(p, NODE_FOR, NULL, NULL);
+  node->name = parser_take_word(p);
+  if (p->tok.kind == TOK_SEMI) {
+    parser_next(p);
+  } else {
+    parser_skip_newlines(p);
+    if (parser_at(p, "in")) {
+      parser_next(p);
+      node->words = rsh_parse_words(p);
+      if (p->tok.kind != TOK_SEMI && p->tok.kind != TOK_NEWLINE) {
+        parser_error(p);
+        return NULL;
+      }
+      parser_next(p);
+    }
+  }
+  parser_skip_newlines(p);
+  if (!parser_expect(p, "do"))
+    return NULL;
+  node->right = rsh_parse_body(p, done);
+  if (p->failed || !parser_expect(p, "done"))
+    return NULL;
+  return node;
+}
 
-    print_prompt();
-    line = rsh_read_line();
+// case word in [(] pat [| pat] ) list ;; ... esac
+Node *rsh_parse_case(Parser *p) {
+  static const char *const arm_end[] = {";;", "esac", NULL};
+  parser_next(p);
+  if (p->tok.kind != TOK_WORD) {
+    parser_error(p);
+    return NULL;
+  }
+  Node *node = rsh_new_node(p, NODE_CASE, NULL, NULL);
+  node->name = parser_take_word(p);
+  parser_skip_newlines(p);
+  if (!parser_expect(p, "in"))
+    return NULL;
 
-    // quit
-    if (!strncmp(QUIT_CMD, line, strlen(QUIT_CMD))) {
-      free(line);
+  int cap = 0;
+  while (true) {
+    parser_skip_newlines(p);
+    if (parser_at(p, "esac"))
       break;
-    }
-    instr = rsh_parse_instruction(line);
-    if (instr->execute) {
-      status = rsh_execute(instr);
-    } else {
-      print_instr(instr);
-      status = 1;
-    }
+    if (parser_at(p, "("))
+      parser_next(p);
 
-    free_instr(instr);
-    free(line);
+    // words up to one ending in ), joined by |
+    int n = 0, pcap = 4;
+    char **patterns = arena_alloc(p->arena, sizeof(char *) * pcap);
+    while (true) {
+      if (p->tok.kind != TOK_WORD) {
+        parser_error(p);
+        return NULL;
+      }
+      // (x) is one word, so its ( comes off here like the ) does
+      bool opened = n == 0 && p->lx.src[p->tok.off] == '(';
+      bool closed = p->lx.src[p->tok.off + p->tok.len - 1] == ')';
+      char *word = parser_take_word(p);
+      if (closed)
+        word[strlen(word) - 1] = '\0';
+      if (opened && *word == '(')
+        word++;
+      if (*word) {
+        if (n + 1 == pcap) {
+          patterns = arena_grow(p->arena, patterns, sizeof(char *) * pcap,
+                                sizeof(char *) * pcap * 2);
+          pcap *= 2;
+        }
+        patterns[n++] = word;
+      }
+      if (closed)
+        break;
+      if (p->tok.kind == TOK_PIPE) {
+        parser_next(p);
+      } else if (!parser_at(p, ")")) {
+        parser_error(p);
+        return NULL;
+      }
+    }
+    patterns[n] = NULL;
 
-  } while (status);
+    Node *body = rsh_parse_body(p, arm_end);
+    if (p->failed)
+      return NULL;
+    if (node->narms == cap) {
+      cap = cap ? 2 * cap : 4;
+      node->arms = arena_grow(p->arena, node->arms,
+                              sizeof(CaseArm) * node->narms,
+                              sizeof(CaseArm) * cap);
+    }
+    node->arms[node->narms++] = (CaseArm){patterns, body};
+    // ;; after the list, the list may have taken the first ;
+    if (p->tok.kind == TOK_SEMI)
+      parser_next(p);
+    if (p->tok.kind == TOK_SEMI)
+      parser_next(p);
+  }
+  parser_next(p); // esac
+  return node;
 }
 
-int main() {
-  rsh_loop();
-  return 0;
+// { list; }
+Node *rsh_parse_group(Parser *p) {
+  static const char *const close[] = {"}", NULL};
+  parser_next(p);
+  Node *body = rsh_parse_body(p, close);
+  if (p->failed || !parser_expect(p, "}"))
+    return NULL;
+  return rsh_new_node(p, NODE_GROUP, body, NULL);
 }
+
+// name() compound or function name compound
+Node *rsh_parse_function(Parser *p) {
+  size_t len = p->tok.len;
+  if (parser_at(p, "function")) {
+    parser_next(p);
+    len = p->tok.kind == TOK_WORD ? p->tok.len : 0;
+  } else {
+    len -= 2; // the ()
+  }
+  if (p->tok.kind != TOK_WORD || p->tok.flags ||
+      !rsh_is_name(p->lx.src + p->tok.off, len)) {
+    parser_error(p);
+    return NULL;
+  }
+  Node *node = rsh_new_node(p, NODE_FUNC, NULL, NULL);
+  node->name = parser_take_word(p);
+  node->name[len] = '\0';
+  parser_skip_newlines(p);
+  node->right = rsh_parse_compound(p);
+  if (!node->right) {
+    parser_error(p);
+    return NULL;
+  }
+  return node;
+}
+
+// a compound command if one starts here, else NULL with p->failed unset
+Node *rsh_parse_compound(Parser *p) {
+  if (p->tok.kind != TOK_WORD || p->tok.flags)
+    return NULL;
+  const char *word = p->lx.src + p->tok.off;
+  size_t len = p->tok.len;
+
+  p->depth++;
+  Node *node;
+  if (parser_at(p, "if"))
+    node = rsh_parse_if(p);
+  else if (parser_at(p, "while"))
+    node = rsh_parse_loop(p, NODE_WHILE);
+  else if (parser_at(p, "until"))
+    node = rsh_parse_loop(p, NODE_UNTIL);
+  else if (parser_at(p, "for"))
+    node = rsh_parse_for(p);
+  else if (parser_at(p, "case"))
+    node = rsh_parse_case(p);
+  else if (parser_at(p, "{"))
+    node = rsh_parse_group(p);
+  else if (parser_at(p, "function") ||
+           (len > 2 && !strncmp(word + len - 2, "()", 2)))
+    node = rsh_parse_function(p);
+  else
+    node = NULL;
+  p->depth--;
+
+  // the outermost compound is compiled once here, nested ones are part of
+  // its code
+  if (node && p->depth == 0)
+    node->code = rsh_compile(node, p->arena);
+  return node;
+}
+
+
+// commands joined by |
+Node *rsh_parse_pipeline(Parser *p) {
+  Command *stack[RSH_TOK_BUFSIZE];
+  long size_stack[RSH_TOK_BUFSIZE];
+  Command **stages = stack;
+  long *sizes = size_stack;
+  bool sized = false;
+  int bufsize = RSH_TOK_BUFSIZE;
+  int count = 0;
+
+  // a compound command stands alone: rsh does not pipe or redirect one
+  Node *compound = rsh_parse_compound(p);
+  if (compound || p->failed) {
+    if (compound && p->tok.kind != TOK_WORD && p->tok.kind != TOK_PIPE &&
+        p->tok.kind != TOK_LT && p->tok.kind != TOK_GT &&
+        p->tok.kind != TOK_DGT)
+      return compound;
+    parser_error(p);
+    return NULL;
+  }
+
+  // time is a keyword only in front of a pipeline, and only unquoted
+  bool timed = false;
+  if (p->tok.kind == TOK_WORD && p->tok.flags == 0 && p->tok.len == 4 &&
+      !strncmp(p->lx.src + p->tok.off, "time", 4)) {
+    timed = true;
+    parser_next(p);
+  }
+
+  int replicas = 0, replica_flags = 0; // from the |@N just read
+  while (true) {
+    Command *cmd = rsh_parse_cmd(p);
+    if (!cmd)
+      return NULL;
+    cmd->replicas = replicas;
+    cmd->replica_flags = replica_flags;
+    stages[count++] = cmd;
+
+    // grow if needed
+    if (count >= bufsize) {
+      Command **bigger = arena_alloc(p->arena, sizeof(Command *) * 2 * bufsize);
+      memcpy(bigger, stages, sizeof(Command *) * bufsize);
+      stages = bigger;
+      long *more = arena_alloc(p->arena, sizeof(long) * 2 * bufsize);
+      memcpy(more, sizes, sizeof(long) * bufsize);
+      sizes = more;
+      bufsize *= 2;
+    }
+
+    if (p->tok.kind != TOK_PIPE)
+      break;
+    sizes[count - 1] = 0;
+    replicas = replica_flags = 0;
+    if (p->tok.len > 1 && p->lx.src[p->tok.off + 1] == '@') {
+      // |@N[u][z]: between 2 and RSH_MAX_REPLICAS copies
+      const char *text = p->lx.src + p->tok.off + 2;
+      const char *end = p->lx.src + p->tok.off + p->tok.len;
+      char *flags;
+      long n = strtol(text, &flags, 10);
+      for (; flags < end; flags++) {
+        if (*flags == 'u' && !(replica_flags & REPLICA_UNORDERED))
+          replica_flags |= REPLICA_UNORDERED;
+        else if (*flags == 'z' && !(replica_flags & REPLICA_NUL))
+          replica_flags |= REPLICA_NUL;
+        else
+          break;
+      }
+      if (!isdigit((unsigned char)*text) || flags != end || n < 1 ||
+          n > RSH_MAX_REPLICAS) {
+        fprintf(stderr, "rsh: syntax error: bad replica count `%.*s'\n",
+                (int)(end - text), text);
+        p->failed = true;
+        return NULL;
+      }
+      replicas = n;
+    } else if (p->tok.len > 1) {
+      // |[size]: the lexer made sure of the brackets
+      char text[32];
+      int len = p->tok.len - 3;
+      snprintf(text, sizeof(text), "%.*s", len, p->lx.src + p->tok.off + 2);
+      if (len >= (int)sizeof(text) || !rsh_parse_size(text, &sizes[count - 1])) {
+        fprintf(stderr, "rsh: syntax error: bad pipe size `%.*s'\n", len,
+                p->lx.src + p->tok.off + 2);
+        p->failed = true;
+        return NULL;
+      }
+      sized = true;
+    }
+    parser_next(p);
+    parser_skip_newlines(p);
+  }
+
+  Pipeline *pipeline = arena_alloc(p->arena, sizeof(Pipeline));
+  pipeline->commands = arena_alloc(p->arena, sizeof(Command *) * (count + 1));
+  memcpy(pipeline->commands, stages, sizeof(Command *) * count);
+  pipeline->commands[count] = NULL;
+  pipeline->count = count;
+  pipeline->timed = timed;
+  pipeline->pipe_sizes = NULL;
+  if (sized) {
+    pipeline->pipe_sizes = arena_alloc(p->arena, sizeof(long) * count);
+    memcpy(pipeline->pipe_sizes, sizes, sizeof(long) * (count - 1));
+  }
+
+  Node *node = rsh_new_node(p, NODE_PIPE, NULL, NULL);
+  node->pipe = pipeline;
+  return node;
+}
+
+// pipelines joined by && and ||, left associative
+Node *rsh_parse_and_or(Parser *p) {
+  Node *left = rsh_parse_pipeline(p);
+  while (left &&
+         (p->tok.kind == TOK_AND_IF || p->tok.kind == TOK_OR_IF)) {
+    NodeType type = p->tok.kind == TOK_AND_IF ? NODE_AND : NODE_OR;
+    parser_next(p);
+    parser_skip_newlines(p);
+    Node *right = rsh_parse_pipeline(p);
+    if (!right)
+      return NULL;
+    left = rsh_new_node(p, type, left, right);
+  }
+  return left;
+}
+
+// parses one complete command: and_or lists separated by ; and & up to the
+// end of the line. returns NULL for an empty line or a syntax error
+// (p->failed tells them apart)
+Node *rsh_parse_list(Parser *p) {
+  Node *list = NULL;
+
+  while (p->tok.kind != TOK_NEWLINE && p->tok.kind != TOK_EOF) {
+    Node *item = rsh_parse_and_or(p);
+    if (!item)
+      return NULL;
+
+    if (p->tok.kind == TOK_AMP) {
+      item = rsh_new_node(p, NODE_BG, item, NULL);
+      parser_next(p);
+    } else if (p->tok.kind == TOK_SEMI) {
+      parser_next(p);
+    } else if (p->tok.kind != TOK_NEWLINE && p->tok.kind != TOK_EOF) {
+      parser_error(p);
+      return NULL;
+    }
+
+    list = list ? rsh_new_node(p, NODE_SEQ, list, item) : item;
+  }
+  return list;
+}
+
+/* ---------------------------------------------------------------- COMPILER
+  a compound command is compiled once, when it is parsed (or defined, for a
+  function body), into a flat array of ops run by rsh_run_code. conditions
+  become jumps on the last status, loops jump back, break and continue jump
+  to addresses known at compile time, and only pipelines reach the
+  executor, so an iteration of a loop of builtins costs a few ops and no
+  fork. loop and case state lives in numbered slots of the running frame.
+ * -----------------------------------------------------------------------------------------
+ */
+
+enum {
+  OP_PIPE,   // status = pipe run in the foreground
+  OP_BG,     // node (a NODE_BG) started
+  OP_JUMP,   // to arg
+  OP_JZ,     // to arg if status is 0
+  OP_JNZ,    // to arg if status is not 0
+  OP_TRUE,   // status = 0
+  OP_LOOP,   // slot status = 0, a while or until loop starts
+  OP_SAVE,   // slot status = status, a loop body ended
+  OP_LEAVE,  // status = slot status, the loop is over
+  OP_BREAK,  // slot status = 0, to arg
+  OP_FOR,    // slot words = node's words expanded
+  OP_NEXT,   // node's variable = next slot word, or to arg when none is left
+  OP_CASE,   // slot word = node's word expanded
+  OP_MATCH,  // to arg unless the slot word matches one of arm's patterns
+  OP_DEF,    // the function node is defined
+  OP_RETURN, // leaves the code, status from cmd's argument or $?
+} typedef OpCode;
+
+struct {
+  OpCode op;
+  int arg;  // jump target, or the next break to patch while compiling
+  int slot; // OP_LOOP .. OP_MATCH
+  union {
+    Pipeline *pipe;
+    Node *node;
+    CaseArm *arm;
+    Command *cmd;
+  };
+} typedef Op;
+
+struct Code {
+  Op *ops;
+  int count;
+  int nslots;
+} typedef Code;
+
+// the innermost loop being compiled
+struct LoopCtx {
+  int cont;   // where continue goes
+  int slot;
+  int breaks; // chain of OP_BREAKs to patch with the loop's end, -1 ends
+  struct LoopCtx *outer;
+} typedef LoopCtx;
+
+struct {
+  Arena *arena;
+  Op *ops;
+  int count, cap;
+  int nslots;
+  LoopCtx *loop;
+} typedef Compiler;
+
+int emit(Compiler *c, OpCode op, void *ptr) {
+  if (c->count == c->cap) {
+    int cap = c->cap ? 2 * c->cap : 16;
+    c->ops = arena_grow(c->arena, c->ops, sizeof(Op) * c->cap, sizeof(Op) * cap);
+    c->cap = cap;
+  }
+  Op *o = &c->ops[c->count];
+  memset(o, 0, sizeof(*o));
+  o->op = op;
+  o->node = ptr;
+  return c->count++;
+}
+
+// emit can move the ops, so they are indexed only once it has returned
+void emit_slot(Compiler *c, OpCode op, int slot, void *ptr) {
+  int i = emit(c, op, ptr);
+  c->ops[i].slot = slot;
+}
+
+void emit_jump(Compiler *c, int target) {
+  int i = emit(c, OP_JUMP, NULL);
+  c->ops[i].arg = target;
+}
+
+// break/continue [n] and return [n]: jumps and exits, not commands
+bool rsh_compile_jump(Compiler *c, Command *cmd) {
+  const char *name = cmd->argv[0];
+  if (!name || strpbrk(name, "'\"\\$") || cmd->input_file ||
+      cmd->output_file)
+    return false;
+  if (!strcmp(name, "return")) {
+    emit(c, OP_RETURN, cmd);
+    return true;
+  }
+  bool is_break = !strcmp(name, "break");
+  if (!is_break && strcmp(name, "continue"))
+    return false;
+
+  LoopCtx *loop = c->loop;
+  for (int n = cmd->argv[1] ? atoi(cmd->argv[1]) : 1; loop && loop->outer && n > 1;
+       n--)
+    loop = loop->outer;
+  if (!loop) { // not in a loop: does nothing
+    emit(c, OP_TRUE, NULL);
+  } else if (is_break) {
+    int op = emit(c, OP_BREAK, NULL);
+    c->ops[op].slot = loop->slot;
+    c->ops[op].arg = loop->breaks;
+    loop->breaks = op;
+  } else {
+    emit_jump(c, loop->cont);
+  }
+  return true;
+}
+
+void rsh_compile_node(Compiler *c, Node *node);
+
+// the body of a loop that starts at cont, then its end: breaks land there
+void rsh_compile_loop_body(Compiler *c, Node *body, int slot, int cont) {
+  LoopCtx loop = {cont, slot, -1, c->loop};
+  c->loop = &loop;
+  rsh_compile_node(c, body);
+  c->loop = loop.outer;
+  emit_slot(c, OP_SAVE, slot, NULL);
+  emit_jump(c, cont);
+  for (int op = loop.breaks; op != -1;) {
+    int next = c->ops[op].arg;
+    c->ops[op].arg = c->count;
+    op = next;
+  }
+}
+
+void rsh_compile_node(Compiler *c, Node *node) {
+  if (!node) { // an empty list succeeds
+    emit(c, OP_TRUE, NULL);
+    return;
+  }
+
+  int jump, end, slot;
+  switch (node->type) {
+  case NODE_PIPE:
+    if (node->pipe->count != 1 || node->pipe->timed ||
+        !rsh_compile_jump(c, node->pipe->commands[0]))
+      emit(c, OP_PIPE, node->pipe);
+    break;
+  case NODE_AND:
+  case NODE_OR:
+    rsh_compile_node(c, node->left);
+    jump = emit(c, node->type == NODE_AND ? OP_JNZ : OP_JZ, NULL);
+    rsh_compile_node(c, node->right);
+    c->ops[jump].arg = c->count;
+    break;
+  case NODE_SEQ:
+    rsh_compile_node(c, node->left);
+    rsh_compile_node(c, node->right);
+    break;
+  case NODE_BG:
+    emit(c, OP_BG, node);
+    break;
+  case NODE_IF:
+    rsh_compile_node(c, node->left);
+    jump = emit(c, OP_JNZ, NULL);
+    rsh_compile_node(c, node->right);
+    end = emit(c, OP_JUMP, NULL);
+    c->ops[jump].arg = c->count;
+    rsh_compile_node(c, node->alt); // no else: status 0
+    c->ops[end].arg = c->count;
+    break;
+  case NODE_WHILE:
+  case NODE_UNTIL: {
+    slot = c->nslots++;
+    emit_slot(c, OP_LOOP, slot, NULL);
+    int cont = c->count;
+    rsh_compile_node(c, node->left);
+    jump = emit(c, node->type == NODE_WHILE ? OP_JNZ : OP_JZ, NULL);
+    rsh_compile_loop_body(c, node->right, slot, cont);
+    c->ops[jump].arg = c->count;
+    emit_slot(c, OP_LEAVE, slot, NULL);
+    break;
+  }
+  case NODE_FOR: {
+    slot = c->nslots++;
+    emit_slot(c, OP_FOR, slot, node);
+    int next = c->count;
+    emit_slot(c, OP_NEXT, slot, node);
+    rsh_compile_loop_body(c, node->right, slot, next);
+    c->ops[next].arg = c->count;
+    emit_slot(c, OP_LEAVE, slot, NULL);
+    break;
+  }
+  case NODE_CASE: {
+    slot = c->nslots++;
+    emit_slot(c, OP_CASE, slot, node);
+    int ends = -1; // chain of jumps to the end
+    for (int i = 0; i < node->narms; i++) {
+      int match = c->count;
+      emit_slot(c, OP_MATCH, slot, &node->arms[i]);
+      rsh_compile_node(c, node->arms[i].body);
+      jump = emit(c, OP_JUMP, NULL);
+      c->ops[jump].arg = ends;
+      ends = jump;
+      c->ops[match].arg = c->count;
+    }
+    emit(c, OP_TRUE, NULL); // nothing matched
+    while (ends != -1) {
+      int next = c->ops[ends].arg;
+      c->ops[ends].arg = c->count;
+      ends = next;
+    }
+    break;
+  }
+  case NODE_GROUP:
+    rsh_compile_node(c, node->left);
+    break;
+  case NODE_FUNC:
+    emit(c, OP_DEF, node);
+    break;
+  }
+}
+
+Code *rsh_compile(Node *node, Arena *a) {
+  Compiler c = {a, NULL, 0, 0, 0, NULL};
+  rsh_compile_node(&c, node);
+  Code *code = arena_alloc(a, sizeof(Code));
+  code->ops = c.ops;
+  code->count = c.count;
+  code->nslots = c.nslots;
+  return code;
+}
+
+bool rsh_is_compound(const Node *node) { return node->type >= NODE_IF; }
+
+// compiles the outermost compound commands of a list, the ones rsh_execute
+// meets
+void rsh_compile_outer(Node *node, Arena *a) {
+  if (!node)
+    return;
+  if (rsh_is_compound(node)) {
+    node->code = rsh_compile(node, a);
+  } else {
+    rsh_compile_outer(node->left, a);
+    rsh_compile_outer(node->right, a);
+  }
+}
+
+/* ---------------------------------------------------------------- PATH CACHE
+  command name -> absolute path, filled on first use so a launch costs one
+  execve instead of one failing execve per $PATH entry. the whole table is
+  dropped when PATH changes (or on cd when PATH has relative entries) and a
+  single entry is dropped when its file disappears.
+ * -----------------------------------------------------------------------------------------
+ */
+
+struct PathEntry {
+  char *name;
+  char *path;
+  unsigned long hits;
+  struct PathEntry *next;
+} typedef PathEntry;
+
+PathEntry *path_table[RSH_PATH_HASH_SIZE];
+char *path_cached_env;       // the PATH value the table was filled from
+bool path_has_relative;      // PATH contains "" or a relative directory
+unsigned long path_hits, path_misses;
+unsigned long path_generation; // bumped whenever entries are dropped
+
+// FNV-1a
+unsigned rsh_path_hash(const char *name) {
+  unsigned h = 2166136261u;
+  for (; *name; name++) {
+    h ^= (unsigned char)*name;
+    h *= 16777619u;
+  }
+  return h & (RSH_PATH_HASH_SIZE - 1);
+}
+
+// drops every cached entry (hash -r), counters are kept
+void rsh_path_reset(void) {
+  path_generation++;
+  for (int i = 0; i < RSH_PATH_HASH_SIZE; i++) {
+    PathEntry *e = path_table[i];
+    while (e) {
+      PathEntry *next = e->next;
+      free(e->name);
+      free(e->path);
+      free(e);
+      e = next;
+    }
+    path_table[i] = NULL;
+  }
+}
+
+// drops one entry, returns false if it was not cached
+bool rsh_path_forget(const char *name) {
+  PathEntry **link = &path_table[rsh_path_hash(name)];
+  for (; *link; link = &(*link)->next) {
+    if (!strcmp((*link)->name, name)) {
+      PathEntry *e = *link;
+      *link = e->next;
+      path_generation++;
+      free(e->name);
+      free(e->path);
+      free(e);
+      return true;
+    }
+  }
+  return false;
+}
+
+const char *rsh_var_get(const char *name, size_t len); // VARIABLES
+
+// resets the table if PATH changed since it was filled
+void rsh_path_check_env(void) {
+  const char *path = rsh_var_get("PATH", 4);
+  if (!path)
+    path = "";
+  if (path_cached_env && !strcmp(path_cached_env, path))
+    return;
+
+  rsh_path_reset();
+  free(path_cached_env);
+  path_cached_env = strdup(path);
+  if (!path_cached_env) {
+    fprintf(stderr, "rsh: path cache allocation error");
+    exit(EXIT_FAILURE);
+  }
+
+  // "" entries and relative dirs resolve against the cwd
+  path_has_relative = false;
+  const char *dir = path;
+  while (true) {
+    if (*dir != '/')
+      path_has_relative = true;
+    dir = strchr(dir, ':');
+    if (!dir)
+      break;
+    dir++;
+  }
+}
+
+// walks $PATH for name, returns a malloc'd path or NULL
+char *rsh_path_search(const char *name) {
+  size_t name_len = strlen(name);
+  const char *dir = path_cached_env;
+  char buf[PATH_MAX];
+
+  while (true) {
+    const char *end = strchrnul(dir, ':');
+    size_t dir_len = end - dir;
+
+    if (dir_len + name_len + 2 <= sizeof(buf)) {
+      if (dir_len == 0) {
+        buf[0] = '.'; // empty entry means the cwd
+        dir_len = 1;
+      } else {
+        memcpy(buf, dir, dir_len);
+      }
+      buf[dir_len] = '/';
+      memcpy(buf + dir_len + 1, name, name_len + 1);
+
+      struct stat st;
+      if (stat(buf, &st) == 0 && S_ISREG(st.st_mode) &&
+          access(buf, X_OK) == 0)
+        return strdup(buf);
+    }
+
+    if (*end == '\0')
+      return NULL;
+    dir = end + 1;
+  }
+}
+
+// resolves a command name to a path. names with a '/' are used as is.
+// *cached is set when the answer came from the table
+const char *rsh_path_lookup(const char *name, bool *cached) {
+  *cached = false;
+  if (strchr(name, '/'))
+    return name;
+
+  rsh_path_check_env();
+
+  unsigned h = rsh_path_hash(name);
+  for (PathEntry *e = path_table[h]; e; e = e->next) {
+    if (!strcmp(e->name, name)) {
+      e->hits++;
+      path_hits++;
+      *cached = true;
+      return e->path;
+    }
+  }
+
+  path_misses++;
+  char *path = rsh_path_search(name);
+  if (!path)
+    return NULL;
+
+  PathEntry *e = malloc(sizeof(PathEntry));
+  if (!e || !(e->name = strdup(name))) {
+    fprintf(stderr, "rsh: path cache allocation error");
+    exit(EXIT_FAILURE);
+  }
+  e->path = path;
+  e->hits = 1;
+  e->next = path_table[h];
+  path_table[h] = e;
+  return path;
+}
+
+/* ---------------------------------------------------------------- BUILTINS
+  commands that run inside the shell instead of fork+exec. they read and
+  write the fds in their BuiltinIO rather than 0/1, so redirects and pipeline
+  positions work without a child. lookup is a perfect hash: the seed is chosen
+  so no two names share a slot and rsh_builtins_init refuses to start if a new
+  builtin breaks that.
+ * -----------------------------------------------------------------------------------------
+ */
+
+int last_status;   // exit status of the last pipeline, $?
+bool opt_pipefail; // set -o pipefail
+bool opt_timing;   // set -o timing
+long opt_pipesize; // set pipesize=, 0 keeps the kernel default
+
+// the fds a builtin uses as its stdin/stdout
+struct {
+  int in;
+  int out;
+} typedef BuiltinIO;
+
+typedef int (*BuiltinFn)(char **argv, BuiltinIO *io);
+
+struct Builtin {
+  const char *name;
+  BuiltinFn fn;
+  bool special;    // changes shell state, so it is forked inside pipelines
+  bool plain_args; // options are left to the external program of that name
+} typedef Builtin;
+
+const Builtin *rsh_find_builtin(char **argv); // BUILTIN TABLE, near the end
+
+// growable string for job texts and captured output
+struct {
+  char *data;
+  size_t len;
+  size_t cap;
+} typedef StrBuf;
+
+void sb_write(StrBuf *sb, const char *s, size_t len) {
+  if (sb->len + len + 1 > sb->cap) {
+    sb->cap = (sb->len + len + 1) * 2;
+    sb->data = realloc(sb->data, sb->cap);
+    if (!sb->data) {
+      fprintf(stderr, "rsh: allocation error");
+      exit(EXIT_FAILURE);
+    }
+  }
+  memcpy(sb->data + sb->len, s, len);
+  sb->len += len;
+  sb->data[sb->len] = '\0';
+}
+
+void sb_puts(StrBuf *sb, const char *s) { sb_write(sb, s, strlen(s)); }
+
+// a builtin run for $(...) gets this as io->out: what it writes is appended
+// to capture_buf instead of going through a pipe and a child
+#define RSH_CAPTURE_FD -2
+StrBuf capture_buf;
+
+// buffered writer so a builtin's output goes out in as few writes as possible
+struct {
+  int fd;
+  size_t len;
+  bool failed;
+  char buf[4096];
+} typedef OutBuf;
+
+void rsh_plan_report(OutBuf *o); // PLAN CACHE, near the end
+
+// write(2) until everything is out, false on error
+bool rsh_write_all(int fd, const char *data, size_t len) {
+  if (fd == RSH_CAPTURE_FD) {
+    sb_write(&capture_buf, data, len);
+    return true;
+  }
+  while (len > 0) {
+    ssize_t n = write(fd, data, len);
+    if (n == -1) {
+      if (errno == EINTR)
+        continue;
+      return false;
+    }
+    data += n;
+    len -= n;
+  }
+  return true;
+}
+
+void out_flush(OutBuf *o) {
+  if (o->len > 0 && !o->failed && !rsh_write_all(o->fd, o->buf, o->len))
+    o->failed = true;
+  o->len = 0;
+}
+
+void out_write(OutBuf *o, const char *data, size_t len) {
+  if (o->len + len > sizeof(o->buf))
+    out_flush(o);
+  if (len >= sizeof(o->buf)) {
+    if (!o->failed && !rsh_write_all(o->fd, data, len))
+      o->failed = true;
+    return;
+  }
+  memcpy(o->buf + o->len, data, len);
+  o->len += len;
+}
+
+void out_puts(OutBuf *o, const char *s) { out_write(o, s, strlen(s)); }
+
+void out_putc(OutBuf *o, char c) { out_write(o, &c, 1); }
+
+void out_printf(OutBuf *o, const char *fmt, ...) {
+  char small[512];
+  va_list ap;
+  va_start(ap, fmt);
+  int n = vsnprintf(small, sizeof(small), fmt, ap);
+  va_end(ap);
+  if (n < 0)
+    return;
+  if ((size_t)n < sizeof(small)) {
+    out_write(o, small, n);
+    return;
+  }
+
+  char *big = malloc(n + 1);
+  if (!big) {
+    fprintf(stderr, "rsh: printf allocation error");
+    exit(EXIT_FAILURE);
+  }
+  va_start(ap, fmt);
+  vsnprintf(big, n + 1, fmt, ap);
+  va_end(ap);
+  out_write(o, big, n);
+  free(big);
+}
+
+// writes s with backslash escapes interpreted. \0nnn is octal for echo and
+// \nnn for printf. returns false when \c asked for output to stop
+bool out_escaped(OutBuf *o, const char *s, bool zero_octal) {
+  for (; *s; s++) {
+    if (*s != '\\' || s[1] == '\0') {
+      out_putc(o, *s);
+      continue;
+    }
+
+    s++;
+    switch (*s) {
+    case 'a':
+      out_putc(o, '\a');
+      break;
+    case 'b':
+      out_putc(o, '\b');
+      break;
+    case 'c':
+      return false;
+    case 'e':
+      out_putc(o, '\x1b');
+      break;
+    case 'f':
+      out_putc(o, '\f');
+      break;
+    case 'n':
+      out_putc(o, '\n');
+      break;
+    case 'r':
+      out_putc(o, '\r');
+      break;
+    case 't':
+      out_putc(o, '\t');
+      break;
+    case 'v':
+      out_putc(o, '\v');
+      break;
+    case '\\':
+      out_putc(o, '\\');
+      break;
+    default:
+      if (*s >= '0' && *s <= '7') {
+        // up to three octal digits, after the leading 0 for echo
+        if (zero_octal && *s == '0')
+          s++;
+        int value = 0;
+        int digits = 0;
+        while (digits < 3 && *s >= '0' && *s <= '7') {
+          value = value * 8 + (*s++ - '0');
+          digits++;
+        }
+        s--;
+        out_putc(o, (char)value);
+      } else {
+        out_putc(o, '\\');
+        out_putc(o, *s);
+      }
+    }
+  }
+  return true;
+}
+
+// copies in to out until EOF, false on a read or write error
+bool rsh_copy_fd(int in, int out) {
+  // the kernel moves the data when it can: copy_file_range between regular
+  // files, splice when either side is a pipe, sendfile out of a regular file.
+  // each advances the file offsets, so a refusal part way through simply
+  // carries on in the read/write loop below
+  struct stat in_st, out_st;
+  bool in_ok = fstat(in, &in_st) == 0, out_ok = fstat(out, &out_st) == 0;
+  bool in_file = in_ok && S_ISREG(in_st.st_mode);
+  bool in_pipe = in_ok && S_ISFIFO(in_st.st_mode);
+  bool out_file = out_ok && S_ISREG(out_st.st_mode);
+  bool out_pipe = out_ok && S_ISFIFO(out_st.st_mode);
+
+  while (in_file || in_pipe || out_pipe) {
+    ssize_t n;
+    if (in_file && out_file)
+      n = copy_file_range(in, NULL, out, NULL, RSH_COPY_CHUNK, 0);
+    else if (in_pipe || out_pipe)
+      n = splice(in, NULL, out, NULL, RSH_COPY_CHUNK, SPLICE_F_MOVE);
+    else
+      n = sendfile(out, in, NULL, RSH_COPY_CHUNK);
+
+    if (n == 0)
+      return true;
+    if (n > 0)
+      continue;
+    if (errno == EINTR)
+      continue;
+    if (errno != EINVAL && errno != ENOSYS && errno != EXDEV &&
+        errno != EOPNOTSUPP && errno != EBADF)
+      return false;
+    break; // not for this pair of fds (a tty, an O_APPEND file, ...)
+  }
+
+  char buf[64 * 1024];
+  while (true) {
+    ssize_t n = read(in, buf, sizeof(buf));
+    if (n == 0)
+      return true;
+    if (n == -1) {
+      if (errno == EINTR)
+        continue;
+      return false;
+    }
+    if (!rsh_write_all(out, buf, n))
+      return false;
+  }
+}
+
+int bi_true(char **argv, BuiltinIO *io) {
+  (void)argv;
+  (void)io;
+  return 0;
+}
+
+int bi_false(char **argv, BuiltinIO *io) {
+  (void)argv;
+  (void)io;
+  return 1;
+}
+
+int bi_help(char **argv, BuiltinIO *io) {
+  (void)argv;
+  return rsh_write_all(io->out, HELP_MSG, strlen(HELP_MSG)) ? 0 : 1;
+}
+
+int bi_exit(char **argv, BuiltinIO *io) {
+  (void)io;
+  exit(argv[1] ? atoi(argv[1]) & 0xff : last_status);
+}
+
+void rsh_var_export(const char *name, const char *value); // VARIABLES
+
+// the working directory as cd left it, so the prompt and pwd need no
+// getcwd. it is worked out on first use, from $PWD when that names the
+// same directory as ".", and again after a cd it could not follow
+char *shell_cwd;
+unsigned long cwd_generation; // counts changes of directory
+char **dir_stack; // pushd's directories, the most recent last
+int dir_depth, dir_cap;
+
+// whether the path has a . or .. component, or an empty one
+bool rsh_path_dotted(const char *path) {
+  for (const char *s = strchr(path, '/'); s; s = strchr(s + 1, '/')) {
+    size_t n = strchrnul(s + 1, '/') - (s + 1);
+    if ((n == 0 && s[1]) || (n == 1 && s[1] == '.') ||
+        (n == 2 && s[1] == '.' && s[2] == '.'))
+      return true;
+  }
+  return false;
+}
+
+const char *rsh_cwd(void) {
+  if (shell_cwd)
+    return shell_cwd;
+  const char *pwd = rsh_var_get("PWD", 3);
+  struct stat a, b;
+  char buf[PATH_MAX];
+  if (pwd && pwd[0] == '/' && !rsh_path_dotted(pwd) && stat(pwd, &a) == 0 &&
+      stat(".", &b) == 0 && a.st_dev == b.st_dev && a.st_ino == b.st_ino)
+    shell_cwd = strdup(pwd);
+  else
+    shell_cwd = strdup(getcwd(buf, sizeof(buf)) ? buf : ".");
+  if (!shell_cwd) {
+    fprintf(stderr, "rsh: allocation error\n");
+    exit(EXIT_FAILURE);
+  }
+  rsh_var_export("PWD", shell_cwd);
+  return shell_cwd;
+}
+
+// dir taken from base the way cd -L does, by text: . is dropped and ..
+// takes off the component before it. false when it does not fit
+bool rsh_cwd_join(const char *base, const char *dir, char out[PATH_MAX]) {
+  size_t len = 0;
+  if (dir[0] != '/') {
+    len = strlen(base);
+    if (len >= PATH_MAX)
+      return false;
+    memcpy(out, base, len);
+  }
+  for (const char *s = dir; *s;) {
+    while (*s == '/')
+      s++;
+    const char *end = strchrnul(s, '/');
+    size_t n = end - s;
+    if (n == 2 && s[0] == '.' && s[1] == '.') {
+      while (len > 0 && out[len - 1] != '/')
+        len--;
+      if (len > 0)
+        len--; // the slash before it
+    } else if (n > 0 && !(n == 1 && s[0] == '.')) {
+      if (len + n + 2 > PATH_MAX)
+        return false;
+      if (len == 0 || out[len - 1] != '/')
+        out[len++] = '/';
+      memcpy(out + len, s, n);
+      len += n;
+    }
+    s = end;
+  }
+  if (len == 0)
+    out[len++] = '/';
+  out[len] = '\0';
+  return true;
+}
+
+// changes directory and sets PWD and OLDPWD. the new path comes from the
+// old one by text, so cd .. out of a symlinked directory goes back where it
+// came from, with the kernel's own path only when that one does not work
+int rsh_chdir(const char *dir) {
+  char path[PATH_MAX];
+  const char *old = rsh_cwd();
+  if (!rsh_cwd_join(old, dir, path) || chdir(path) != 0) {
+    if (chdir(dir) != 0) {
+      fprintf(stderr, "rsh: cd: %s: %s\n", dir, strerror(errno));
+      return 1;
+    }
+    if (!getcwd(path, sizeof(path)))
+      snprintf(path, sizeof(path), "%s", dir);
+  }
+  rsh_var_export("OLDPWD", old);
+  cwd_generation++;
+  free(shell_cwd);
+  if (!(shell_cwd = strdup(path))) {
+    fprintf(stderr, "rsh: allocation error\n");
+    exit(EXIT_FAILURE);
+  }
+  rsh_var_export("PWD", shell_cwd);
+  if (path_has_relative)
+    rsh_path_reset(); // relative PATH entries now point elsewhere
+  return 0;
+}
+
+// cd [dir | -]: no dir is $HOME, - is $OLDPWD and prints where it went
+int bi_cd(char **argv, BuiltinIO *io) {
+  const char *dir = argv[1];
+  bool back = dir && !strcmp(dir, "-");
+  if (!dir || back) {
+    const char *name = back ? "OLDPWD" : "HOME";
+    if (!(dir = rsh_var_get(name, strlen(name))) || !*dir) {
+      fprintf(stderr, "rsh: cd: %s not set\n", name);
+      return 1;
+    }
+  }
+  char target[PATH_MAX];
+  snprintf(target, sizeof(target), "%s", dir); // OLDPWD is about to change
+  if (rsh_chdir(target) != 0)
+    return 1;
+  if (back) {
+    OutBuf o = {.fd = io->out};
+    out_printf(&o, "%s\n", shell_cwd);
+    out_flush(&o);
+  }
+  return 0;
+}
+
+// pwd [-L | -P]: the directory as cd reached it, or with -P as the kernel
+// has it, symlinks resolved
+int bi_pwd(char **argv, BuiltinIO *io) {
+  char cwd[PATH_MAX + 1];
+  if (argv[1] && !strcmp(argv[1], "-P")) {
+    if (getcwd(cwd, PATH_MAX) == NULL) {
+      fprintf(stderr, "rsh: pwd: %s\n", strerror(errno));
+      return 1;
+    }
+  } else {
+    snprintf(cwd, PATH_MAX, "%s", rsh_cwd());
+  }
+  size_t len = strlen(cwd);
+  cwd[len++] = '\n';
+  return rsh_write_all(io->out, cwd, len) ? 0 : 1;
+}
+
+// dirs: the working directory, then the stack from the most recent
+int bi_dirs(char **argv, BuiltinIO *io) {
+  (void)argv;
+  OutBuf o = {.fd = io->out};
+  out_puts(&o, rsh_cwd());
+  for (int i = dir_depth - 1; i >= 0; i--)
+    out_printf(&o, " %s", dir_stack[i]);
+  out_puts(&o, "\n");
+  out_flush(&o);
+  return 0;
+}
+
+// pushd [dir]: goes to dir and keeps the directory it left on the stack.
+// without dir it swaps the working directory with the top of the stack
+int bi_pushd(char **argv, BuiltinIO *io) {
+  char *left = strdup(rsh_cwd());
+  if (!left) {
+    fprintf(stderr, "rsh: allocation error\n");
+    exit(EXIT_FAILURE);
+  }
+  if (!argv[1] && dir_depth == 0) {
+    fprintf(stderr, "rsh: pushd: no other directory\n");
+    free(left);
+    return 1;
+  }
+  if (rsh_chdir(argv[1] ? argv[1] : dir_stack[dir_depth - 1]) != 0) {
+    free(left);
+    return 1;
+  }
+  if (!argv[1]) {
+    free(dir_stack[dir_depth - 1]);
+    dir_stack[dir_depth - 1] = left;
+  } else {
+    if (dir_depth == dir_cap) {
+      dir_cap = dir_cap ? dir_cap * 2 : 8;
+      if (!(dir_stack = realloc(dir_stack, dir_cap * sizeof(char *)))) {
+        fprintf(stderr, "rsh: allocation error\n");
+        exit(EXIT_FAILURE);
+      }
+    }
+    dir_stack[dir_depth++] = left;
+  }
+  return bi_dirs(argv, io);
+}
+
+// popd: back to the directory on top of the stack, which it leaves
+int bi_popd(char **argv, BuiltinIO *io) {
+  if (dir_depth == 0) {
+    fprintf(stderr, "rsh: popd: directory stack empty\n");
+    return 1;
+  }
+  if (rsh_chdir(dir_stack[dir_depth - 1]) != 0)
+    return 1;
+  free(dir_stack[--dir_depth]);
+  return bi_dirs(argv, io);
+}
+
+// echo [-neE] [arg ...]
+int bi_echo(char **argv, BuiltinIO *io) {
+  OutBuf o = {.fd = io->out};
+  bool newline = true;
+  bool escapes = false;
+  int i = 1;
+
+  for (; argv[i] && argv[i][0] == '-' && argv[i][1]; i++) {
+    const char *flag = argv[i] + 1;
+    if (strspn(flag, "neE") != strlen(flag))
+      break; // not an option, print it
+    for (; *flag; flag++) {
+      if (*flag == 'n')
+        newline = false;
+      else
+        escapes = *flag == 'e';
+    }
+  }
+
+  for (int first = i; argv[i]; i++) {
+    if (i > first)
+      out_putc(&o, ' ');
+    if (!escapes) {
+      out_puts(&o, argv[i]);
+    } else if (!out_escaped(&o, argv[i], true)) {
+      newline = false; // \c
+      break;
+    }
+  }
+  if (newline)
+    out_putc(&o, '\n');
+  out_flush(&o);
+  return o.failed ? 1 : 0;
+}
+
+// numeric printf argument, 'c gives the character code like POSIX wants
+long long rsh_printf_num(const char *arg, bool *bad) {
+  if (!arg)
+    return 0;
+  if (arg[0] == '\'' || arg[0] == '"')
+    return (unsigned char)arg[1];
+  char *end;
+  errno = 0;
+  long long value = strtoll(arg, &end, 0);
+  if (end == arg || *end != '\0' || errno) {
+    // large unsigned values
+    value = (long long)strtoull(arg, &end, 0);
+    if (end == arg || *end != '\0') {
+      fprintf(stderr, "rsh: printf: %s: invalid number\n", arg);
+      *bad = true;
+    }
+  }
+  return value;
+}
+
+// floating printf argument, long double like coreutils printf reads it
+long double rsh_printf_float(const char *arg, bool *bad) {
+  if (!arg)
+    return 0;
+  if (arg[0] == '\'' || arg[0] == '"')
+    return (unsigned char)arg[1];
+  char *end;
+  errno = 0;
+  long double value = strtold(arg, &end);
+  if (end == arg || *end != '\0' || errno == EINVAL) {
+    fprintf(stderr, "rsh: printf: %s: invalid number\n", arg);
+    *bad = true;
+  }
+  return value;
+}
+
+// printf format [arg ...], the format is reused while arguments remain
+int bi_printf(char **argv, BuiltinIO *io) {
+  if (argv[1] == NULL) {
+    fprintf(stderr, "rsh: printf: usage: printf format [arguments]\n");
+    return 2;
+  }
+
+  OutBuf o = {.fd = io->out};
+  const char *format = argv[1];
+  char **args = argv + 2;
+  bool bad = false;
+
+  while (true) {
+    char **pass_start = args;
+
+    for (const char *f = format; *f; f++) {
+      if (*f == '\\' && f[1]) {
+        f++;
+        if (*f >= '0' && *f <= '7') {
+          int value = 0;
+          for (int d = 0; d < 3 && *f >= '0' && *f <= '7'; d++)
+            value = value * 8 + (*f++ - '0');
+          f--;
+          out_putc(&o, (char)value);
+        } else {
+          char esc[3] = {'\\', *f, '\0'};
+          if (!out_escaped(&o, esc, false)) { // \c
+            out_flush(&o);
+            return o.failed || bad ? 1 : 0;
+          }
+        }
+        continue;
+      }
+      if (*f != '%') {
+        out_putc(&o, *f);
+        continue;
+      }
+      if (f[1] == '%') {
+        out_putc(&o, '%');
+        f++;
+        continue;
+      }
+
+      // %[flags][width][.precision]conversion, '*' takes an argument
+      char spec[64] = "%";
+      size_t len = 1;
+      int star[2];
+      int nstar = 0;
+      for (f++; *f && strchr("-+ #0", *f) && len < 8; f++)
+        spec[len++] = *f;
+      for (int part = 0; part < 2; part++) {
+        if (part == 1) {
+          if (*f != '.')
+            break;
+          spec[len++] = *f++;
+        }
+        if (*f == '*') {
+          star[nstar++] = (int)rsh_printf_num(*args ? *args++ : NULL, &bad);
+          spec[len++] = *f++;
+        } else {
+          while (*f >= '0' && *f <= '9' && len < 40)
+            spec[len++] = *f++;
+        }
+      }
+
+      const char *arg = *args ? *args++ : NULL;
+      char conv = *f;
+      if (conv && strchr("diouxX", conv)) {
+        spec[len++] = 'l';
+        spec[len++] = 'l';
+        spec[len++] = conv;
+        spec[len] = '\0';
+        long long value = rsh_printf_num(arg, &bad);
+        if (nstar == 2)
+          out_printf(&o, spec, star[0], star[1], value);
+        else if (nstar == 1)
+          out_printf(&o, spec, star[0], value);
+        else
+          out_printf(&o, spec, value);
+      } else if (conv && strchr("feEgGaA", conv)) {
+        spec[len++] = 'L';
+        spec[len++] = conv;
+        spec[len] = '\0';
+        long double value = rsh_printf_float(arg, &bad);
+        if (nstar == 2)
+          out_printf(&o, spec, star[0], star[1], value);
+        else if (nstar == 1)
+          out_printf(&o, spec, star[0], value);
+        else
+          out_printf(&o, spec, value);
+      } else if (conv == 's' || conv == 'c') {
+        spec[len++] = 's';
+        spec[len] = '\0';
+        char c[2] = {arg ? arg[0] : '\0', '\0'};
+        const char *text = conv == 'c' ? c : (arg ? arg : "");
+        if (nstar == 2)
+          out_printf(&o, spec, star[0], star[1], text);
+        else if (nstar == 1)
+          out_printf(&o, spec, star[0], text);
+        else
+          out_printf(&o, spec, text);
+      } else if (conv == 'b') {
+        if (arg && !out_escaped(&o, arg, true)) {
+          out_flush(&o);
+          return o.failed || bad ? 1 : 0;
+        }
+      } else {
+        fprintf(stderr, "rsh: printf: %%%c: invalid directive\n", conv);
+        out_flush(&o);
+        return 1;
+      }
+      if (!*f)
+        break;
+    }
+
+    // the format is reused only if it consumed arguments
+    if (*args == NULL || args == pass_start)
+      break;
+  }
+
+  out_flush(&o);
+  return o.failed || bad ? 1 : 0;
+}
+
+/* test / [ : recursive descent over
+     expr    : and ('-o' and)*
+     and     : not ('-a' not)*
+     not     : '!' not | primary
+     primary : '(' expr ')' | unary-op arg | arg binary-op arg | arg
+*/
+
+struct {
+  char **argv;
+  int pos;
+  int argc;
+  bool error;
+} typedef TestParser;
+
+bool rsh_test_expr(TestParser *t);
+
+bool rsh_test_int(TestParser *t, const char *s, long long *value) {
+  char *end;
+  errno = 0;
+  *value = strtoll(s, &end, 10);
+  while (*end == ' ' || *end == '\t')
+    end++;
+  if (end == s || *end != '\0' || errno) {
+    fprintf(stderr, "rsh: test: %s: integer expression expected\n", s);
+    t->error = true;
+    return false;
+  }
+  return true;
+}
+
+bool rsh_test_unary(const char *op, const char *arg) {
+  struct stat st;
+  switch (op[1]) {
+  case 'z':
+    return arg[0] == '\0';
+  case 'n':
+    return arg[0] != '\0';
+  case 't':
+    return isatty(atoi(arg));
+  case 'L':
+  case 'h':
+    return lstat(arg, &st) == 0 && S_ISLNK(st.st_mode);
+  case 'r':
+    return access(arg, R_OK) == 0;
+  case 'w':
+    return access(arg, W_OK) == 0;
+  case 'x':
+    return access(arg, X_OK) == 0;
+  }
+
+  if (stat(arg, &st) != 0)
+    return false;
+  switch (op[1]) {
+  case 'e':
+    return true;
+  case 'f':
+    return S_ISREG(st.st_mode);
+  case 'd':
+    return S_ISDIR(st.st_mode);
+  case 's':
+    return st.st_size > 0;
+  case 'p':
+    return S_ISFIFO(st.st_mode);
+  case 'S':
+    return S_ISSOCK(st.st_mode);
+  case 'b':
+    return S_ISBLK(st.st_mode);
+  case 'c':
+    return S_ISCHR(st.st_mode);
+  case 'g':
+    return st.st_mode & S_ISGID;
+  case 'u':
+    return st.st_mode & S_ISUID;
+  }
+  return false;
+}
+
+bool rsh_test_is_unary(const char *op) {
+  return op[0] == '-' && op[1] && !op[2] && strchr("zntLhrwxefdspSbcgu", op[1]);
+}
+
+bool rsh_test_is_binary(const char *op) {
+  static const char *ops[] = {"=",   "==",  "!=",  "<",   ">",   "-eq",
+                              "-ne", "-lt", "-le", "-gt", "-ge", "-nt",
+                              "-ot", "-ef", NULL};
+  for (int i = 0; ops[i]; i++) {
+    if (!strcmp(op, ops[i]))
+      return true;
+  }
+  return false;
+}
+
+bool rsh_test_binary(TestParser *t, const char *l, const char *op,
+                     const char *r) {
+  if (!strcmp(op, "=") || !strcmp(op, "=="))
+    return strcmp(l, r) == 0;
+  if (!strcmp(op, "!="))
+    return strcmp(l, r) != 0;
+  if (!strcmp(op, "<"))
+    return strcmp(l, r) < 0;
+  if (!strcmp(op, ">"))
+    return strcmp(l, r) > 0;
+
+  if (!strcmp(op, "-nt") || !strcmp(op, "-ot") || !strcmp(op, "-ef")) {
+    struct stat ls, rs;
+    bool lok = stat(l, &ls) == 0, rok = stat(r, &rs) == 0;
+    if (op[1] == 'e')
+      return lok && rok && ls.st_dev == rs.st_dev && ls.st_ino == rs.st_ino;
+    if (op[1] == 'n')
+      return lok && (!rok || ls.st_mtime > rs.st_mtime);
+    return rok && (!lok || ls.st_mtime < rs.st_mtime);
+  }
+
+  long long a, b;
+  if (!rsh_test_int(t, l, &a) || !rsh_test_int(t, r, &b))
+    return false;
+  if (!strcmp(op, "-eq"))
+    return a == b;
+  if (!strcmp(op, "-ne"))
+    return a != b;
+  if (!strcmp(op, "-lt"))
+    return a < b;
+  if (!strcmp(op, "-le"))
+    return a <= b;
+  if (!strcmp(op, "-gt"))
+    return a > b;
+  return a >= b;
+}
+
+bool rsh_test_primary(TestParser *t) {
+  int left = t->argc - t->pos;
+  if (left <= 0) {
+    fprintf(stderr, "rsh: test: argument expected\n");
+    t->error = true;
+    return false;
+  }
+
+  char **a = t->argv + t->pos;
+  if (left >= 3 && rsh_test_is_binary(a[1])) {
+    t->pos += 3;
+    return rsh_test_binary(t, a[0], a[1], a[2]);
+  }
+  if (!strcmp(a[0], "(") && left >= 2) {
+    t->pos++;
+    bool value = rsh_test_expr(t);
+    if (t->pos >= t->argc || strcmp(t->argv[t->pos], ")")) {
+      fprintf(stderr, "rsh: test: `)' expected\n");
+      t->error = true;
+      return false;
+    }
+    t->pos++;
+    return value;
+  }
+  if (left >= 2 && rsh_test_is_unary(a[0])) {
+    t->pos += 2;
+    return rsh_test_unary(a[0], a[1]);
+  }
+  t->pos++;
+  return a[0][0] != '\0'; // a lone string is true when not empty
+}
+
+bool rsh_test_not(TestParser *t) {
+  if (t->pos < t->argc - 1 && !strcmp(t->argv[t->pos], "!")) {
+    t->pos++;
+    return !rsh_test_not(t);
+  }
+  return rsh_test_primary(t);
+}
+
+bool rsh_test_and(TestParser *t) {
+  bool value = rsh_test_not(t);
+  while (!t->error && t->pos < t->argc && !strcmp(t->argv[t->pos], "-a")) {
+    t->pos++;
+    bool right = rsh_test_not(t);
+    value = value && right;
+  }
+  return value;
+}
+
+bool rsh_test_expr(TestParser *t) {
+  bool value = rsh_test_and(t);
+  while (!t->error && t->pos < t->argc && !strcmp(t->argv[t->pos], "-o")) {
+    t->pos++;
+    bool right = rsh_test_and(t);
+    value = value || right;
+  }
+  return value;
+}
+
+// test expr, [ expr ]: 0 true, 1 false, 2 error
+int bi_test(char **argv, BuiltinIO *io) {
+  (void)io;
+  int argc = 0;
+  while (argv[argc])
+    argc++;
+
+  if (!strcmp(argv[0], "[")) {
+    if (strcmp(argv[argc - 1], "]")) {
+      fprintf(stderr, "rsh: [: missing `]'\n");
+      return 2;
+    }
+    argc--;
+  }
+  if (argc == 1)
+    return 1; // no expression is false
+
+  TestParser t = {argv, 1, argc, false};
+  bool value = rsh_test_expr(&t);
+  if (!t.error && t.pos != argc) {
+    fprintf(stderr, "rsh: test: %s: unexpected argument\n", argv[t.pos]);
+    t.error = true;
+  }
+  if (t.error)
+    return 2;
+  return value ? 0 : 1;
+}
+
+// cat [file ...], "-" is stdin. options go to /bin/cat (plain_args)
+int bi_cat(char **argv, BuiltinIO *io) {
+  if (argv[1] == NULL)
+    return rsh_copy_fd(io->in, io->out) ? 0 : 1;
+
+  int status = 0;
+  for (int i = 1; argv[i]; i++) {
+    if (!strcmp(argv[i], "-")) {
+      if (!rsh_copy_fd(io->in, io->out))
+        status = 1;
+      continue;
+    }
+    int fd = open(argv[i], O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+      fprintf(stderr, "rsh: cat: %s: %s\n", argv[i], strerror(errno));
+      status = 1;
+      continue;
+    }
+    if (!rsh_copy_fd(fd, io->out)) {
+      fprintf(stderr, "rsh: cat: %s: %s\n", argv[i], strerror(errno));
+      status = 1;
+    }
+    close(fd);
+  }
+  return status;
+}
+
+// hash builtin: no args lists the table, -r resets it, -d drops names and
+// any other names are looked up ahead of time
+int bi_hash(char **argv, BuiltinIO *io) {
+  if (argv[1] == NULL) {
+    OutBuf o = {.fd = io->out};
+    rsh_path_check_env();
+    bool empty = true;
+    for (int i = 0; i < RSH_PATH_HASH_SIZE; i++) {
+      for (PathEntry *e = path_table[i]; e; e = e->next) {
+        if (empty)
+          out_puts(&o, "hits\tcommand\n");
+        empty = false;
+        out_printf(&o, "%4lu\t%s\n", e->hits, e->path);
+      }
+    }
+    if (empty)
+      out_puts(&o, "hash: hash table empty\n");
+    out_printf(&o, "%lu hits, %lu misses\n", path_hits, path_misses);
+    rsh_plan_report(&o);
+    out_flush(&o);
+    return o.failed ? 1 : 0;
+  }
+
+  int status = 0;
+  int i = 1;
+  if (!strcmp(argv[1], "-r")) {
+    rsh_path_reset();
+    i = 2;
+  } else if (!strcmp(argv[1], "-d")) {
+    rsh_path_check_env();
+    for (i = 2; argv[i] != NULL; i++) {
+      if (!rsh_path_forget(argv[i])) {
+        fprintf(stderr, "rsh: hash: %s: not found\n", argv[i]);
+        status = 1;
+      }
+    }
+    return status;
+  }
+
+  for (; argv[i] != NULL; i++) {
+    bool cached;
+    if (!strchr(argv[i], '/') && !rsh_path_lookup(argv[i], &cached)) {
+      fprintf(stderr, "rsh: hash: %s: not found\n", argv[i]);
+      status = 1;
+    }
+  }
+  return status;
+}
+
+// set -o/+o options
+struct {
+  const char *name;
+  bool *value;
+} typedef ShellOption;
+
+ShellOption rsh_options[] = {
+    {"pipefail", &opt_pipefail}, // a pipeline fails if any stage fails
+    {"timing", &opt_timing},     // every command feeds the stats builtin
+};
+
+// set -o [name], set +o name
+int bi_set(char **argv, BuiltinIO *io) {
+  size_t count = sizeof(rsh_options) / sizeof(rsh_options[0]);
+
+  if (argv[1] == NULL || (!strcmp(argv[1], "-o") && argv[2] == NULL)) {
+    OutBuf o = {.fd = io->out};
+    for (size_t i = 0; i < count; i++) {
+      out_printf(&o, "%-16s%s\n", rsh_options[i].name,
+                 *rsh_options[i].value ? "on" : "off");
+    }
+    if (opt_pipesize)
+      out_printf(&o, "%-16s%ld\n", "pipesize", opt_pipesize);
+    else
+      out_printf(&o, "%-16s%s\n", "pipesize", "default");
+    out_flush(&o);
+    return o.failed ? 1 : 0;
+  }
+
+  int status = 0;
+  for (int i = 1; argv[i]; i += 2) {
+    if (!strncmp(argv[i], "pipesize=", 9)) {
+      if (!rsh_parse_size(argv[i] + 9, &opt_pipesize)) {
+        fprintf(stderr, "rsh: set: %s: bad size\n", argv[i] + 9);
+        status = 1;
+      }
+      i--; // a single word
+      continue;
+    }
+    bool on = !strcmp(argv[i], "-o");
+    if ((!on && strcmp(argv[i], "+o")) || argv[i + 1] == NULL) {
+      fprintf(stderr, "rsh: set: usage: set [-o|+o] option | pipesize=size\n");
+      return 2;
+    }
+    size_t j = 0;
+    while (j < count && strcmp(rsh_options[j].name, argv[i + 1]))
+      j++;
+    if (j == count) {
+      fprintf(stderr, "rsh: set: %s: invalid option name\n", argv[i + 1]);
+      status = 1;
+      continue;
+    }
+    *rsh_options[j].value = on;
+  }
+  return status;
+}
+
+/* ---------------------------------------------------------------- JOBS
+  every pipeline the shell starts is a Job, entered in the table before it
+  can be reaped. SIGCHLD stays blocked and is read from a signalfd, and each
+  wakeup collects every status change with wait4(WNOHANG), filed under the
+  stage it belongs to together with its rusage. background jobs are reaped as
+  soon as the shell gets control. an interactive shell also does job control:
+  every job gets its own process group and the foreground one owns the
+  terminal.
+ * -----------------------------------------------------------------------------------------
+ */
+
+struct {
+  pid_t pid;  // 0 for a stage that never ran or ran inside the shell
+  int status; // wait status once done or stopped
+  bool done;
+  bool stopped;
+  struct rusage ru;      // filled in when it exits
+  struct timespec start; // CLOCK_MONOTONIC when started
+  struct timespec end;   // and when it was reaped
+} typedef Process;
+
+struct {
+  int id;     // %id
+  pid_t pgid; // 0 until the first process exists (job control only)
+  Process *procs;
+  int nprocs;
+  int nstages; // procs past this are helpers (ANALYZE meters)
+  char *text;  // command line shown by jobs
+  bool background;
+  bool notified;     // the last stop was reported
+  unsigned long seq; // recency, the highest is %+ and the next is %-
+} typedef Job;
+
+Job **jobs; // slot i holds job id i + 1, NULL when free
+int jobs_cap;
+int jobs_live; // slots in use, \j in the prompt
+unsigned long job_seq;
+pid_t last_bg_pid;
+
+bool job_control; // interactive shell that owns a terminal
+pid_t shell_pgid;
+struct termios shell_tmodes;
+int sigchld_fd = -1;
+
+// one stage of the last foreground pipeline
+struct {
+  int status; // $PIPESTATUS
+  struct rusage ru;
+  long wall_us;
+} typedef StageResult;
+
+StageResult *pipe_stages;
+int pipe_count, pipe_cap;
+
+// microseconds from a to b
+long rsh_elapsed_us(const struct timespec *a, const struct timespec *b) {
+  return (b->tv_sec - a->tv_sec) * 1000000L + (b->tv_nsec - a->tv_nsec) / 1000;
+}
+
+// turns a wait status into a shell exit status
+int rsh_wait_status(int status) {
+  if (WIFEXITED(status))
+    return WEXITSTATUS(status);
+  if (WIFSIGNALED(status))
+    return 128 + WTERMSIG(status);
+  return 1;
+}
+
+void rsh_cmd_text(Command *cmd, StrBuf *sb) {
+  for (int i = 0; cmd->argv[i] != NULL; i++) {
+    if (i > 0)
+      sb_puts(sb, " ");
+    sb_puts(sb, cmd->argv[i]);
+  }
+  if (cmd->input_file) {
+    sb_puts(sb, " < ");
+    sb_puts(sb, cmd->input_file);
+  }
+  if (cmd->output_file) {
+    sb_puts(sb, cmd->append ? " >> " : " > ");
+    sb_puts(sb, cmd->output_file);
+  }
+}
+
+void rsh_body_text(Node *body, const char *close, StrBuf *sb);
+
+// source-like text of an AST, words keep their quotes
+void rsh_node_text(Node *node, StrBuf *sb) {
+  switch (node->type) {
+  case NODE_PIPE:
+    for (int i = 0; i < node->pipe->count; i++) {
+      if (i > 0)
+        sb_puts(sb, " | ");
+      rsh_cmd_text(node->pipe->commands[i], sb);
+    }
+    break;
+  case NODE_AND:
+  case NODE_OR:
+  case NODE_SEQ:
+    rsh_node_text(node->left, sb);
+    sb_puts(sb, node->type == NODE_AND ? " && "
+                                       : (node->type == NODE_OR ? " || " : "; "));
+    rsh_node_text(node->right, sb);
+    break;
+  case NODE_BG:
+    rsh_node_text(node->left, sb);
+    sb_puts(sb, " &");
+    break;
+  case NODE_IF:
+    sb_puts(sb, "if ");
+    rsh_body_text(node->left, "; then ", sb);
+    rsh_body_text(node->right, "; ", sb);
+    if (node->alt) {
+      sb_puts(sb, "else ");
+      rsh_body_text(node->alt, "; ", sb);
+    }
+    sb_puts(sb, "fi");
+    break;
+  case NODE_WHILE:
+  case NODE_UNTIL:
+    sb_puts(sb, node->type == NODE_WHILE ? "while " : "until ");
+    rsh_body_text(node->left, "; do ", sb);
+    rsh_body_text(node->right, "; done", sb);
+    break;
+  case NODE_FOR:
+    sb_puts(sb, "for ");
+    sb_puts(sb, node->name);
+    if (node->words) {
+      sb_puts(sb, " in");
+      for (int i = 0; node->words[i]; i++) {
+        sb_puts(sb, " ");
+        sb_puts(sb, node->words[i]);
+      }
+    }
+    sb_puts(sb, "; do ");
+    rsh_body_text(node->right, "; done", sb);
+    break;
+  case NODE_CASE:
+    sb_puts(sb, "case ");
+    sb_puts(sb, node->name);
+    sb_puts(sb, " in ");
+    for (int i = 0; i < node->narms; i++) {
+      for (int j = 0; node->arms[i].patterns[j]; j++) {
+        if (j > 0)
+          sb_puts(sb, "|");
+        sb_puts(sb, node->arms[i].patterns[j]);
+      }
+      sb_puts(sb, ") ");
+      rsh_body_text(node->arms[i].body, ";; ", sb);
+    }
+    sb_puts(sb, "esac");
+    break;
+  case NODE_GROUP:
+    sb_puts(sb, "{ ");
+    rsh_body_text(node->left, "; }", sb);
+    break;
+  case NODE_FUNC:
+    sb_puts(sb, node->name);
+    sb_puts(sb, "() ");
+    rsh_node_text(node->right, sb);
+    break;
+  }
+}
+
+// a list inside a compound command and what closes it, nothing for an empty
+// one
+void rsh_body_text(Node *body, const char *close, StrBuf *sb) {
+  if (body)
+    rsh_node_text(body, sb);
+  sb_puts(sb, body || strncmp(close, "; ", 2) ? close : close + 2);
+}
+
+// blocks SIGCHLD into a signalfd and, for an interactive shell, takes the
+// terminal: own process group, job control signals ignored
+void rsh_jobs_init(bool interactive) {
+  sigset_t chld;
+  sigemptyset(&chld);
+  sigaddset(&chld, SIGCHLD);
+  sigprocmask(SIG_BLOCK, &chld, NULL);
+  sigchld_fd = signalfd(-1, &chld, SFD_NONBLOCK | SFD_CLOEXEC);
+  if (sigchld_fd == -1) {
+    perror("rsh: signalfd");
+    exit(EXIT_FAILURE);
+  }
+
+  if (!interactive)
+    return;
+
+  // wait until we are in the foreground
+  while (tcgetpgrp(STDIN_FILENO) != (shell_pgid = getpgrp()))
+    kill(-shell_pgid, SIGTTIN);
+
+  signal(SIGINT, SIG_IGN);
+  signal(SIGQUIT, SIG_IGN);
+  signal(SIGTSTP, SIG_IGN);
+  signal(SIGTTIN, SIG_IGN);
+  signal(SIGTTOU, SIG_IGN);
+
+  shell_pgid = getpid();
+  if (setpgid(shell_pgid, shell_pgid) == -1 && errno != EPERM) {
+    perror("rsh: setpgid");
+    return;
+  }
+  tcsetpgrp(STDIN_FILENO, shell_pgid);
+  tcgetattr(STDIN_FILENO, &shell_tmodes);
+  job_control = true;
+}
+
+// adds a job with nprocs empty process slots under the lowest free id
+Job *rsh_job_new(int nprocs, char *text, bool background) {
+  int slot = 0;
+  while (slot < jobs_cap && jobs[slot])
+    slot++;
+  if (slot == jobs_cap) {
+    int cap = jobs_cap ? jobs_cap * 2 : 16;
+    jobs = realloc(jobs, sizeof(Job *) * cap);
+    if (!jobs) {
+      fprintf(stderr, "rsh: job table allocation error");
+      exit(EXIT_FAILURE);
+    }
+    memset(jobs + jobs_cap, 0, sizeof(Job *) * (cap - jobs_cap));
+    jobs_cap = cap;
+  }
+
+  Job *job = calloc(1, sizeof(Job));
+  if (!job || !(job->procs = calloc(nprocs, sizeof(Process)))) {
+    fprintf(stderr, "rsh: job allocation error");
+    exit(EXIT_FAILURE);
+  }
+  job->id = slot + 1;
+  jobs_live++;
+  job->nprocs = nprocs;
+  job->nstages = nprocs;
+  job->text = text ? text : strdup("");
+  job->background = background;
+  job->seq = ++job_seq;
+  jobs[slot] = job;
+  return job;
+}
+
+void rsh_job_free(Job *job) {
+  jobs[job->id - 1] = NULL;
+  jobs_live--;
+  free(job->procs);
+  free(job->text);
+  free(job);
+}
+
+bool rsh_job_done(Job *job) {
+  for (int i = 0; i < job->nprocs; i++) {
+    if (!job->procs[i].done)
+      return false;
+  }
+  return true;
+}
+
+// every process that is still alive is stopped
+bool rsh_job_stopped(Job *job) {
+  bool any = false;
+  for (int i = 0; i < job->nprocs; i++) {
+    if (!job->procs[i].done && !job->procs[i].stopped)
+      return false;
+    any |= job->procs[i].stopped;
+  }
+  return any;
+}
+
+// exit status of one stage, 128 + signal when killed/stopped
+int rsh_proc_status(Process *proc) {
+  if (proc->stopped)
+    return 128 + WSTOPSIG(proc->status);
+  return rsh_wait_status(proc->status);
+}
+
+// exit status of a job: its last process, or with pipefail the last one
+// that failed
+int rsh_job_status(Job *job) {
+  int status = rsh_proc_status(&job->procs[job->nstages - 1]);
+  for (int i = job->nstages - 2; opt_pipefail && status == 0 && i >= 0; i--) {
+    status = rsh_proc_status(&job->procs[i]);
+  }
+  return status;
+}
+
+// sizes the results for n stages, all 0 with no resource use
+void rsh_pipestatus_reset(int n) {
+  if (n > pipe_cap) {
+    pipe_cap = n * 2;
+    pipe_stages = realloc(pipe_stages, sizeof(StageResult) * pipe_cap);
+    if (!pipe_stages) {
+      fprintf(stderr, "rsh: allocation error");
+      exit(EXIT_FAILURE);
+    }
+  }
+  pipe_count = n;
+  memset(pipe_stages, 0, sizeof(StageResult) * n);
+}
+
+// results of a job that finished or stopped in the foreground
+void rsh_pipestatus_set(Job *job) {
+  rsh_pipestatus_reset(job->nstages);
+  for (int i = 0; i < job->nstages; i++) {
+    Process *proc = &job->procs[i];
+    pipe_stages[i].status = rsh_proc_status(proc);
+    pipe_stages[i].ru = proc->ru;
+    if (proc->done && proc->start.tv_sec)
+      pipe_stages[i].wall_us = rsh_elapsed_us(&proc->start, &proc->end);
+  }
+}
+
+// the table entry of a child, NULL for one the shell does not track
+Process *rsh_find_proc(pid_t pid) {
+  for (int j = 0; j < jobs_cap; j++) {
+    Job *job = jobs[j];
+    for (int i = 0; job && i < job->nprocs; i++) {
+      if (job->procs[i].pid == pid)
+        return &job->procs[i];
+    }
+  }
+  return NULL;
+}
+
+// the life of a child on its track, from spawn to reap
+void rsh_trace_reaped(pid_t pid, Process *proc) {
+  char detail[32];
+  if (WIFSIGNALED(proc->status))
+    snprintf(detail, sizeof(detail), "signal %d", WTERMSIG(proc->status));
+  else
+    snprintf(detail, sizeof(detail), "exit %d", WEXITSTATUS(proc->status));
+  rsh_trace_span(pid, "run", "run", rsh_ts_ns(&proc->start),
+                 rsh_ts_ns(&proc->end), detail);
+  snprintf(detail, sizeof(detail), "pid %d", (int)pid);
+  rsh_trace_instant(trace_pid, "wait", "reaped", detail);
+}
+
+// collects every pending status change without blocking. one wait4 per
+// change rather than one per tracked process, so a wide pipeline costs O(n)
+// system calls to reap and not O(n^2)
+void rsh_reap(void) {
+  struct signalfd_siginfo info;
+  while (read(sigchld_fd, &info, sizeof(info)) == sizeof(info))
+    ; // drain, wait4 below finds what changed
+
+  int status;
+  struct rusage ru;
+  pid_t pid;
+  while ((pid = wait4(-1, &status, WNOHANG | WUNTRACED | WCONTINUED, &ru)) >
+         0) {
+    Process *proc = rsh_find_proc(pid);
+    if (!proc)
+      continue; // not started by this shell
+    if (WIFSTOPPED(status)) {
+      proc->stopped = true;
+      proc->status = status;
+    } else if (WIFCONTINUED(status)) {
+      proc->stopped = false;
+    } else {
+      proc->done = true;
+      proc->stopped = false;
+      proc->status = status;
+      proc->ru = ru;
+      clock_gettime(CLOCK_MONOTONIC, &proc->end);
+      if (TRACING)
+        rsh_trace_reaped(pid, proc);
+    }
+  }
+}
+
+// "[1]+  Done                    sleep 1"
+void rsh_job_print(Job *job, OutBuf *o, const char *state) {
+  Job *prev = NULL, *cur = NULL;
+  for (int j = 0; j < jobs_cap; j++) {
+    Job *other = jobs[j];
+    if (!other)
+      continue;
+    if (!cur || other->seq > cur->seq) {
+      prev = cur;
+      cur = other;
+    } else if (!prev || other->seq > prev->seq) {
+      prev = other;
+    }
+  }
+  char mark = job == cur ? '+' : (job == prev ? '-' : ' ');
+  out_printf(o, "[%d]%c  %-24s%s%s\n", job->id, mark, state, job->text,
+             rsh_job_done(job) || rsh_job_stopped(job) ? "" : " &");
+}
+
+// state column of jobs for a job
+const char *rsh_job_state(Job *job, char *buf, size_t size) {
+  if (rsh_job_stopped(job))
+    return "Stopped";
+  if (!rsh_job_done(job))
+    return "Running";
+
+  int status = job->procs[job->nstages - 1].status;
+  if (WIFSIGNALED(status))
+    return strsignal(WTERMSIG(status));
+  if (WEXITSTATUS(status) != 0) {
+    snprintf(buf, size, "Exit %d", WEXITSTATUS(status));
+    return buf;
+  }
+  return "Done";
+}
+
+// reaps, reports finished and newly stopped background jobs (when print is
+// set) and drops the finished ones
+void rsh_notify_jobs(bool print) {
+  if (jobs_live == 0)
+    return; // nothing to reap: the prompt costs no read of the signalfd
+  rsh_reap();
+  OutBuf o = {.fd = STDERR_FILENO};
+  char buf[32];
+
+  for (int j = 0; j < jobs_cap; j++) {
+    Job *job = jobs[j];
+    if (!job)
+      continue;
+    if (rsh_job_done(job)) {
+      if (print && job->background)
+        rsh_job_print(job, &o, rsh_job_state(job, buf, sizeof(buf)));
+      rsh_job_free(job);
+    } else if (rsh_job_stopped(job) && !job->notified) {
+      if (print)
+        rsh_job_print(job, &o, "Stopped");
+      job->notified = true;
+    }
+  }
+  out_flush(&o);
+}
+
+// blocks until the job finishes or stops, sleeping on the signalfd between
+// table walks. a foreground job gets the terminal back to the shell after.
+// finished jobs are freed. returns the job's exit status
+int rsh_wait_job(Job *job) {
+  long long start = TRACING ? rsh_trace_now() : 0;
+  while (true) {
+    rsh_reap();
+    if (rsh_job_done(job) || rsh_job_stopped(job))
+      break;
+    struct pollfd pfd = {sigchld_fd, POLLIN, 0};
+    poll(&pfd, 1, -1);
+  }
+  if (TRACING)
+    rsh_trace_span(trace_pid, "wait", "wait_job", start, rsh_trace_now(),
+                   job->text);
+
+  if (job_control && !job->background) {
+    tcsetpgrp(STDIN_FILENO, shell_pgid);
+    tcsetattr(STDIN_FILENO, TCSADRAIN, &shell_tmodes);
+  }
+
+  int status = rsh_job_status(job);
+  if (!job->background)
+    rsh_pipestatus_set(job);
+  if (rsh_job_done(job)) {
+    rsh_job_free(job);
+  } else {
+    // stopped with ^Z: it becomes the current background job
+    job->background = true;
+    job->notified = true;
+    job->seq = ++job_seq;
+    OutBuf o = {.fd = STDERR_FILENO};
+    out_putc(&o, '\n');
+    rsh_job_print(job, &o, "Stopped");
+    out_flush(&o);
+  }
+  return status;
+}
+
+// %n, %+, %%, %-, %prefix or a pid. NULL (with a message) if there is none
+Job *rsh_find_job(const char *spec, const char *who) {
+  Job *found = NULL, *prev = NULL;
+  for (int j = 0; j < jobs_cap; j++) {
+    Job *job = jobs[j];
+    if (!job)
+      continue;
+
+    bool match;
+    if (spec == NULL || !strcmp(spec, "%") || !strcmp(spec, "%%") ||
+        !strcmp(spec, "%+") || !strcmp(spec, "%-")) {
+      match = true; // ranked by recency below
+    } else if (spec[0] == '%' && spec[1] >= '0' && spec[1] <= '9') {
+      match = job->id == atoi(spec + 1);
+    } else if (spec[0] == '%') {
+      match = !strncmp(job->text, spec + 1, strlen(spec + 1));
+    } else {
+      match = false;
+      for (int i = 0; i < job->nprocs; i++) {
+        if (job->procs[i].pid == atoi(spec))
+          match = true;
+      }
+    }
+    if (!match)
+      continue;
+    if (!found || job->seq > found->seq) {
+      prev = found;
+      found = job;
+    } else if (!prev || job->seq > prev->seq) {
+      prev = job;
+    }
+  }
+
+  if (spec && !strcmp(spec, "%-"))
+    found = prev;
+  if (!found)
+    fprintf(stderr, "rsh: %s: %s: no such job\n", who, spec ? spec : "current");
+  return found;
+}
+
+// sends SIGCONT to a stopped job
+void rsh_job_continue(Job *job) {
+  for (int i = 0; i < job->nprocs; i++) {
+    job->procs[i].stopped = false;
+  }
+  job->notified = false;
+  if (job_control && job->pgid > 0) {
+    kill(-job->pgid, SIGCONT);
+    return;
+  }
+  for (int i = 0; i < job->nprocs; i++) {
+    if (!job->procs[i].done && job->procs[i].pid > 0)
+      kill(job->procs[i].pid, SIGCONT);
+  }
+}
+
+// jobs [-lp]
+int bi_jobs(char **argv, BuiltinIO *io) {
+  bool pids = false, long_format = false;
+  for (int i = 1; argv[i]; i++) {
+    if (!strcmp(argv[i], "-p")) {
+      pids = true;
+    } else if (!strcmp(argv[i], "-l")) {
+      long_format = true;
+    } else {
+      fprintf(stderr, "rsh: jobs: usage: jobs [-lp]\n");
+      return 2;
+    }
+  }
+
+  rsh_reap();
+  OutBuf o = {.fd = io->out};
+  char buf[32];
+  for (int j = 0; j < jobs_cap; j++) {
+    Job *job = jobs[j];
+    if (!job)
+      continue;
+    if (pids) {
+      out_printf(&o, "%d\n", (int)job->procs[0].pid);
+      continue;
+    }
+    rsh_job_print(job, &o, rsh_job_state(job, buf, sizeof(buf)));
+    for (int i = 0; long_format && i < job->nprocs; i++) {
+      out_printf(&o, "      %d\n", (int)job->procs[i].pid);
+    }
+  }
+  out_flush(&o);
+
+  // what was shown as done is gone now
+  for (int j = 0; j < jobs_cap; j++) {
+    if (jobs[j] && jobs[j]->background && rsh_job_done(jobs[j]))
+      rsh_job_free(jobs[j]);
+  }
+  return o.failed ? 1 : 0;
+}
+
+// fg [job]: continue a job in the foreground and wait for it
+int bi_fg(char **argv, BuiltinIO *io) {
+  Job *job = rsh_find_job(argv[1], "fg");
+  if (!job)
+    return 1;
+
+  OutBuf o = {.fd = io->out};
+  out_printf(&o, "%s\n", job->text);
+  out_flush(&o);
+
+  job->background = false;
+  if (job_control && job->pgid > 0)
+    tcsetpgrp(STDIN_FILENO, job->pgid);
+  rsh_job_continue(job);
+  return rsh_wait_job(job);
+}
+
+// bg [job ...]: continue stopped jobs in the background
+int bi_bg(char **argv, BuiltinIO *io) {
+  int status = 0;
+  OutBuf o = {.fd = io->out};
+  int i = 1;
+  do {
+    Job *job = rsh_find_job(argv[i], "bg");
+    if (!job) {
+      status = 1;
+      continue;
+    }
+    job->background = true;
+    rsh_job_continue(job);
+    job->seq = ++job_seq;
+    out_printf(&o, "[%d]+ %s &\n", job->id, job->text);
+  } while (argv[i] && argv[++i]);
+  out_flush(&o);
+  return status;
+}
+
+// wait [job ...]: with no arguments waits for every background job
+int bi_wait(char **argv, BuiltinIO *io) {
+  (void)io;
+  int status = 0;
+
+  if (argv[1] == NULL) {
+    for (int j = 0; j < jobs_cap; j++) {
+      Job *job = jobs[j];
+      if (job && job->background && !rsh_job_stopped(job))
+        rsh_wait_job(job);
+    }
+    return 0;
+  }
+
+  for (int i = 1; argv[i]; i++) {
+    Job *job = rsh_find_job(argv[i], "wait");
+    status = job ? rsh_wait_job(job) : 127;
+  }
+  return status;
+}
+
+long rsh_tv_us(struct timeval tv) { return tv.tv_sec * 1000000L + tv.tv_usec; }
+
+// prints a duration the way times and time do: 0m1.234s
+void out_duration(OutBuf *o, long us) {
+  long sec = us / 1000000;
+  out_printf(o, "%ldm%ld.%03lds", sec / 60, sec % 60, us % 1000000 / 1000);
+}
+
+// times: user and system time of the shell and of its children, then the
+// resource use of each stage of the last foreground pipeline
+int bi_times(char **argv, BuiltinIO *io) {
+  (void)argv;
+  struct rusage self, children;
+  getrusage(RUSAGE_SELF, &self);
+  getrusage(RUSAGE_CHILDREN, &children);
+
+  OutBuf o = {.fd = io->out};
+  out_duration(&o, rsh_tv_us(self.ru_utime));
+  out_putc(&o, ' ');
+  out_duration(&o, rsh_tv_us(self.ru_stime));
+  out_putc(&o, '\n');
+  out_duration(&o, rsh_tv_us(children.ru_utime));
+  out_putc(&o, ' ');
+  out_duration(&o, rsh_tv_us(children.ru_stime));
+  out_putc(&o, '\n');
+  for (int i = 0; i < pipe_count; i++) {
+    out_printf(&o, "[%d] status %d ", i, pipe_stages[i].status);
+    out_duration(&o, rsh_tv_us(pipe_stages[i].ru.ru_utime));
+    out_putc(&o, ' ');
+    out_duration(&o, rsh_tv_us(pipe_stages[i].ru.ru_stime));
+    out_printf(&o, " maxrss %ldk\n", pipe_stages[i].ru.ru_maxrss);
+  }
+  out_flush(&o);
+  return o.failed ? 1 : 0;
+}
+
+/* ---------------------------------------------------------------- TIMING
+  `time pipeline` prints what a pipeline cost, and with set -o timing every
+  command and every top-level line is added to the stats table: wall time
+  from CLOCK_MONOTONIC around the launch and the reap, cpu time, max rss,
+  context switches and page faults from wait4 (getrusage deltas for stages
+  run inside the shell). wall times go in a log-linear histogram, four
+  buckets per power of two, for the p99 column of stats.
+ * -----------------------------------------------------------------------------------------
+ */
+
+#define RSH_STATS_HASH_SIZE 64
+#define RSH_HIST_BUCKETS 192 // covers up to 2^48 us
+
+struct StatEntry {
+  char *name;
+  bool line; // a whole top-level line rather than one command
+  long count;
+  long min_us, max_us;
+  long long wall_us, user_us, sys_us;
+  long maxrss; // kB, the highest seen
+  long long ctxsw, faults;
+  unsigned hist[RSH_HIST_BUCKETS];
+  struct StatEntry *next;
+} typedef StatEntry;
+
+StatEntry *stats_table[RSH_STATS_HASH_SIZE];
+int stats_count;
+
+// histogram bucket of a duration: exact below 4us, then 4 per power of two
+int rsh_hist_bucket(long us) {
+  if (us < 4)
+    return us < 0 ? 0 : us;
+  int e = 63 - __builtin_clzl(us); // us >= 2^e
+  int bucket = 4 + (e - 2) * 4 + ((us >> (e - 2)) & 3);
+  return bucket < RSH_HIST_BUCKETS ? bucket : RSH_HIST_BUCKETS - 1;
+}
+
+// largest duration that falls into a bucket
+long rsh_hist_bound(int bucket) {
+  if (bucket < 4)
+    return bucket;
+  int e = (bucket - 4) / 4 + 2;
+  return ((4L + (bucket & 3) + 1) << (e - 2)) - 1;
+}
+
+// ru of what ran between two getrusage calls of the same process
+void rsh_rusage_sub(struct rusage *out, const struct rusage *after,
+                    const struct rusage *before) {
+  memset(out, 0, sizeof(*out));
+  timersub(&after->ru_utime, &before->ru_utime, &out->ru_utime);
+  timersub(&after->ru_stime, &before->ru_stime, &out->ru_stime);
+  out->ru_maxrss = after->ru_maxrss;
+  out->ru_minflt = after->ru_minflt - before->ru_minflt;
+  out->ru_majflt = after->ru_majflt - before->ru_majflt;
+  out->ru_nvcsw = after->ru_nvcsw - before->ru_nvcsw;
+  out->ru_nivcsw = after->ru_nivcsw - before->ru_nivcsw;
+}
+
+void rsh_stats_record(const char *name, bool line, long wall_us,
+                      const struct rusage *ru) {
+  unsigned h = rsh_path_hash(name) & (RSH_STATS_HASH_SIZE - 1);
+  StatEntry *e = stats_table[h];
+  while (e && (e->line != line || strcmp(e->name, name)))
+    e = e->next;
+
+  if (!e) {
+    e = calloc(1, sizeof(StatEntry));
+    if (!e || !(e->name = strdup(name))) {
+      fprintf(stderr, "rsh: allocation error");
+      exit(EXIT_FAILURE);
+    }
+    e->line = line;
+    e->min_us = wall_us;
+    e->next = stats_table[h];
+    stats_table[h] = e;
+    stats_count++;
+  }
+
+  e->count++;
+  if (wall_us < e->min_us)
+    e->min_us = wall_us;
+  if (wall_us > e->max_us)
+    e->max_us = wall_us;
+  e->wall_us += wall_us;
+  e->user_us += rsh_tv_us(ru->ru_utime);
+  e->sys_us += rsh_tv_us(ru->ru_stime);
+  if (ru->ru_maxrss > e->maxrss)
+    e->maxrss = ru->ru_maxrss;
+  e->ctxsw += ru->ru_nvcsw + ru->ru_nivcsw;
+  e->faults += ru->ru_minflt + ru->ru_majflt;
+  e->hist[rsh_hist_bucket(wall_us)]++;
+}
+
+// p99 from the histogram: the bound of the bucket holding the sample at
+// the 99th percentile, kept within what was actually seen
+long rsh_stats_p99(const StatEntry *e) {
+  long rank = (e->count * 99 + 99) / 100, seen = 0;
+  for (int b = 0; b < RSH_HIST_BUCKETS; b++) {
+    seen += e->hist[b];
+    if (seen >= rank) {
+      long bound = rsh_hist_bound(b);
+      return bound < e->min_us ? e->min_us
+                               : (bound > e->max_us ? e->max_us : bound);
+    }
+  }
+  return e->max_us;
+}
+
+// formats a duration in the unit that keeps it short: 850us, 12.3ms, 4.56s
+const char *rsh_fmt_us(char *buf, size_t size, long us) {
+  if (us < 1000)
+    snprintf(buf, size, "%ldus", us);
+  else if (us < 1000000)
+    snprintf(buf, size, "%.1fms", us / 1000.0);
+  else
+    snprintf(buf, size, "%.2fs", us / 1000000.0);
+  return buf;
+}
+
+// the per-stage line of time
+void rsh_time_stage(OutBuf *o, const char *name, const StageResult *r) {
+  out_printf(o, "  %-16.16s real ", name);
+  out_duration(o, r->wall_us);
+  out_puts(o, " user ");
+  out_duration(o, rsh_tv_us(r->ru.ru_utime));
+  out_puts(o, " sys ");
+  out_duration(o, rsh_tv_us(r->ru.ru_stime));
+  out_printf(o, " rss %ldk cs %ld flt %ld\n", r->ru.ru_maxrss,
+             r->ru.ru_nvcsw + r->ru.ru_nivcsw,
+             r->ru.ru_minflt + r->ru.ru_majflt);
+}
+
+// starts measuring something the shell runs itself
+void rsh_mark(Process *proc) {
+  clock_gettime(CLOCK_MONOTONIC, &proc->start);
+  getrusage(RUSAGE_SELF, &proc->ru);
+}
+
+// turns a mark into the wall time and rusage delta since, as if proc had been
+// a child
+void rsh_mark_end(Process *proc) {
+  struct rusage before = proc->ru, now;
+  getrusage(RUSAGE_SELF, &now);
+  clock_gettime(CLOCK_MONOTONIC, &proc->end);
+  rsh_rusage_sub(&proc->ru, &now, &before);
+}
+
+// reports a foreground pipeline that just finished: printed for time, added
+// to the stats for set -o timing. the stage results are in pipe_stages
+void rsh_time_pipeline(Command *stages, int n, bool print, long wall_us) {
+  if (opt_timing) {
+    for (int i = 0; i < n && i < pipe_count; i++) {
+      if (stages[i].argv[0])
+        rsh_stats_record(stages[i].argv[0], false, pipe_stages[i].wall_us,
+                         &pipe_stages[i].ru);
+    }
+  }
+  if (!print)
+    return;
+
+  long user = 0, sys = 0;
+  for (int i = 0; i < pipe_count; i++) {
+    user += rsh_tv_us(pipe_stages[i].ru.ru_utime);
+    sys += rsh_tv_us(pipe_stages[i].ru.ru_stime);
+  }
+  OutBuf o = {.fd = STDERR_FILENO};
+  out_puts(&o, "\nreal\t");
+  out_duration(&o, wall_us);
+  out_puts(&o, "\nuser\t");
+  out_duration(&o, user);
+  out_puts(&o, "\nsys\t");
+  out_duration(&o, sys);
+  out_putc(&o, '\n');
+  for (int i = 0; i < n && i < pipe_count; i++) {
+    rsh_time_stage(&o, stages[i].argv[0] ? stages[i].argv[0] : "(redirect)",
+                   &pipe_stages[i]);
+  }
+  out_flush(&o);
+}
+
+// stats [-r]: min/avg/p99/max wall time per command and per line recorded
+// under set -o timing, slowest total first. -r clears the table
+int bi_stats(char **argv, BuiltinIO *io) {
+  if (argv[1] && !strcmp(argv[1], "-r")) {
+    for (int h = 0; h < RSH_STATS_HASH_SIZE; h++) {
+      while (stats_table[h]) {
+        StatEntry *e = stats_table[h];
+        stats_table[h] = e->next;
+        free(e->name);
+        free(e);
+      }
+    }
+    stats_count = 0;
+    return 0;
+  } else if (argv[1]) {
+    fprintf(stderr, "rsh: stats: usage: stats [-r]\n");
+    return 2;
+  }
+
+  StatEntry **all = malloc(sizeof(StatEntry *) * (stats_count + 1));
+  if (!all) {
+    fprintf(stderr, "rsh: allocation error");
+    exit(EXIT_FAILURE);
+  }
+  int n = 0;
+  for (int h = 0; h < RSH_STATS_HASH_SIZE; h++) {
+    for (StatEntry *e = stats_table[h]; e; e = e->next)
+      all[n++] = e;
+  }
+  // insertion sort, slowest total first. the table is small
+  for (int i = 1; i < n; i++) {
+    StatEntry *e = all[i];
+    int j = i;
+    for (; j > 0 && all[j - 1]->wall_us < e->wall_us; j--)
+      all[j] = all[j - 1];
+    all[j] = e;
+  }
+
+  OutBuf o = {.fd = io->out};
+  char b[5][16];
+  out_printf(&o, "%-5s %-24s %7s %9s %9s %9s %9s %9s %9s %8s %8s %8s\n",
+             "kind", "name", "count", "min", "avg", "p99", "max", "user",
+             "sys", "maxrss", "ctxsw", "faults");
+  for (int i = 0; i < n; i++) {
+    StatEntry *e = all[i];
+    out_printf(&o, "%-5s %-24.24s %7ld %9s %9s %9s %9s %9s ",
+               e->line ? "line" : "cmd", e->name, e->count,
+               rsh_fmt_us(b[0], 16, e->min_us),
+               rsh_fmt_us(b[1], 16, e->wall_us / e->count),
+               rsh_fmt_us(b[2], 16, rsh_stats_p99(e)),
+               rsh_fmt_us(b[3], 16, e->max_us),
+               rsh_fmt_us(b[4], 16, e->user_us));
+    out_printf(&o, "%9s %7ldk %8lld %8lld\n", rsh_fmt_us(b[0], 16, e->sys_us),
+               e->maxrss, e->ctxsw, e->faults);
+  }
+  out_flush(&o);
+  free(all);
+  return o.failed ? 1 : 0;
+}
+
+/* ---------------------------------------------------------------- ANALYZE
+  a line ending in ANALYZE runs for real and then reports every pipeline it
+  ran. each pipe is split in two with a meter process in the middle that
+  relays the bytes and counts them, their lines, and how long it waited on
+  either side: waiting to read means the writer was slow to produce,
+  waiting to write means the reader was slow to consume. the meters keep
+  their counters in a shared mapping the shell reads once they exit
+ * -----------------------------------------------------------------------------------------
+ */
+
+#define RSH_METER_BUFSIZE (64 * 1024)
+
+// what crossed one pipe of a pipeline
+struct {
+  long long bytes;
+  long long lines;
+  long long read_wait_ns;  // the writing stage had nothing ready
+  long long write_wait_ns; // the reading stage was not keeping up
+} typedef LinkStats;
+
+bool rsh_analyze; // the line being run ended in ANALYZE
+
+// relays in to out until EOF, counting into st as it goes so a meter killed
+// by SIGPIPE still leaves its numbers
+void rsh_meter(int in, int out, LinkStats *st) {
+  static char buf[RSH_METER_BUFSIZE];
+  while (true) {
+    long long start = rsh_trace_now();
+    ssize_t n = read(in, buf, sizeof(buf));
+    long long got = rsh_trace_now();
+    st->read_wait_ns += got - start;
+    if (n == -1 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return;
+
+    st->bytes += n;
+    for (char *p = buf; (p = memchr(p, '\n', buf + n - p)); p++)
+      st->lines++;
+    if (!rsh_write_all(out, buf, n))
+      return;
+    st->write_wait_ns += rsh_trace_now() - got;
+  }
+}
+
+// "12.3MB"
+const char *rsh_fmt_bytes(char *buf, size_t size, long long bytes) {
+  if (bytes < 1024)
+    snprintf(buf, size, "%lldB", bytes);
+  else if (bytes < 1024 * 1024)
+    snprintf(buf, size, "%.1fkB", bytes / 1024.0);
+  else if (bytes < 1024LL * 1024 * 1024)
+    snprintf(buf, size, "%.1fMB", bytes / (1024.0 * 1024));
+  else
+    snprintf(buf, size, "%.2fGB", bytes / (1024.0 * 1024 * 1024));
+  return buf;
+}
+
+// one row per stage: its times from pipe_stages, what it read from the link
+// before it and wrote to the link after it
+void rsh_analyze_report(Pipeline *pipeline, Command *stages,
+                        const LinkStats *links, long wall_us) {
+  int n = pipeline->count;
+  StrBuf text = {0};
+  for (int i = 0; i < n; i++) {
+    if (i > 0)
+      sb_puts(&text, " | ");
+    rsh_cmd_text(pipeline->commands[i], &text);
+  }
+
+  OutBuf o = {.fd = STDERR_FILENO};
+  char b[8][24];
+  out_printf(&o, "ANALYZE %s (%s)\n", text.data,
+             rsh_fmt_us(b[0], 24, wall_us));
+  free(text.data);
+  out_printf(&o, "%-20s %9s %9s %9s %9s %9s %9s %9s %10s %9s %9s\n", "stage",
+             "wall", "user", "sys", "in", "in lines", "out", "out lines",
+             "out rate", "starved", "backlog");
+
+  for (int i = 0; i < n && i < pipe_count; i++) {
+    const StageResult *r = &pipe_stages[i];
+    const LinkStats *in = i > 0 ? &links[i - 1] : NULL;
+    const LinkStats *out = i < n - 1 ? &links[i] : NULL;
+    char name[32];
+    snprintf(name, sizeof(name), "%d %s", i,
+             stages[i].argv[0] ? stages[i].argv[0] : "(redirect)");
+
+    out_printf(&o, "%-20.20s %9s %9s %9s ", name,
+               rsh_fmt_us(b[0], 24, r->wall_us),
+               rsh_fmt_us(b[1], 24, rsh_tv_us(r->ru.ru_utime)),
+               rsh_fmt_us(b[2], 24, rsh_tv_us(r->ru.ru_stime)));
+    if (in)
+      out_printf(&o, "%9s %9lld ", rsh_fmt_bytes(b[3], 24, in->bytes),
+                 in->lines);
+    else
+      out_printf(&o, "%9s %9s ", "-", "-");
+    if (out) {
+      long long rate = r->wall_us > 0 ? out->bytes * 1000000 / r->wall_us : 0;
+      rsh_fmt_bytes(b[4], 24, rate);
+      strcat(b[4], "/s");
+      out_printf(&o, "%9s %9lld %10s ", rsh_fmt_bytes(b[5], 24, out->bytes),
+                 out->lines, b[4]);
+    } else {
+      out_printf(&o, "%9s %9s %10s ", "-", "-", "-");
+    }
+    // starved: its input link had nothing to give it. backlog: data sat
+    // in its input link because it was busy
+    if (in)
+      out_printf(&o, "%9s %9s\n", rsh_fmt_us(b[6], 24, in->read_wait_ns / 1000),
+                 rsh_fmt_us(b[7], 24, in->write_wait_ns / 1000));
+    else
+      out_printf(&o, "%9s %9s\n", "-", "-");
+  }
+  out_flush(&o);
+}
+
+/* ---------------------------------------------------------------- VARIABLES
+  shell variables live in one open-addressing table (linear probing, FNV-1a
+  hash stored per slot, tombstones for unset names) that the environment is
+  imported into at startup. the envp handed to exec is built from the
+  exported ones only when one of them changed since the last build, and
+  every child started in between shares that one array. each variable keeps
+  its "name=value" string, so a rebuild only copies the ones that changed.
+  positional parameters of the script or function being run sit apart.
+ * -----------------------------------------------------------------------------------------
+ */
+
+#define RSH_VARS_MIN 64 // first table size, power of two
+
+#define VAR_EXPORT 0x1 // in the environment of children
+#define VAR_DELETED 0x2 // tombstone: keeps probe chains intact
+
+struct {
+  char *name; // NULL for an empty or deleted slot
+  char *value;
+  char *env; // "name=value" when exported and built, else NULL
+  size_t size; // bytes allocated for value
+  uint32_t hash;
+  unsigned flags;
+} typedef Var;
+
+Var *var_table;
+size_t var_cap;  // slots, power of two
+size_t var_used; // live slots and tombstones, kept under 3/4 of var_cap
+
+char **env_array;      // NULL terminated, what children get
+size_t env_cap;
+bool env_dirty = true; // an exported variable changed since env_array
+unsigned long env_generation; // counts rebuilds of env_array
+
+char *no_args[] = {NULL};
+char **pos_argv = no_args; // $1 .. $n, NULL terminated
+int pos_argc;              // $#
+const char *shell_name = "rsh"; // $0
+
+uint32_t rsh_var_hash(const char *name, size_t len) {
+  uint32_t h = 2166136261u;
+  for (size_t i = 0; i < len; i++) {
+    h ^= (unsigned char)name[i];
+    h *= 16777619u;
+  }
+  return h;
+}
+
+char *rsh_var_strdup(const char *s, size_t len) {
+  char *copy = malloc(len + 1);
+  if (!copy) {
+    fprintf(stderr, "rsh: allocation error\n");
+    exit(EXIT_FAILURE);
+  }
+  memcpy(copy, s, len);
+  copy[len] = '\0';
+  return copy;
+}
+
+// the slot of the name of len bytes at name, or the empty slot it would go
+// in (the first tombstone on the way, if any)
+Var *rsh_var_slot(const char *name, size_t len, uint32_t hash) {
+  Var *tomb = NULL;
+  for (size_t i = hash & (var_cap - 1);; i = (i + 1) & (var_cap - 1)) {
+    Var *v = &var_table[i];
+    if (!v->name) {
+      if (!(v->flags & VAR_DELETED))
+        return tomb ? tomb : v;
+      if (!tomb)
+        tomb = v;
+    } else if (v->hash == hash && !strncmp(v->name, name, len) &&
+               v->name[len] == '\0') {
+      return v;
+    }
+  }
+}
+
+// doubles the table, or rehashes it in place when tombstones filled it
+void rsh_var_grow(void) {
+  size_t live = 0;
+  for (size_t i = 0; i < var_cap; i++)
+    live += var_table[i].name != NULL;
+  Var *old = var_table;
+  size_t old_cap = var_cap;
+  var_cap = var_cap == 0 ? RSH_VARS_MIN
+                         : (live * 2 >= var_cap ? var_cap * 2 : var_cap);
+  var_table = calloc(var_cap, sizeof(Var));
+  if (!var_table) {
+    fprintf(stderr, "rsh: allocation error\n");
+    exit(EXIT_FAILURE);
+  }
+  var_used = live;
+  for (size_t i = 0; i < old_cap; i++) {
+    if (!old[i].name)
+      continue;
+    size_t j = old[i].hash & (var_cap - 1);
+    while (var_table[j].name)
+      j = (j + 1) & (var_cap - 1);
+    var_table[j] = old[i];
+  }
+  free(old);
+}
+
+Var *rsh_var_find(const char *name, size_t len) {
+  if (var_cap == 0)
+    return NULL;
+  Var *v = rsh_var_slot(name, len, rsh_var_hash(name, len));
+  return v->name ? v : NULL;
+}
+
+// value of the name of len bytes at name, NULL when unset
+const char *rsh_var_get(const char *name, size_t len) {
+  Var *v = rsh_var_find(name, len);
+  return v ? v->value : NULL;
+}
+
+// the variable named name, created unset (value NULL) if need be
+Var *rsh_var_lookup(const char *name, size_t len) {
+  if ((var_used + 1) * 4 > var_cap * 3)
+    rsh_var_grow();
+  uint32_t hash = rsh_var_hash(name, len);
+  Var *v = rsh_var_slot(name, len, hash);
+  if (!v->name) {
+    if (!(v->flags & VAR_DELETED))
+      var_used++; // a reused tombstone was counted already
+    v->name = rsh_var_strdup(name, len);
+    v->value = NULL;
+    v->size = 0;
+    v->env = NULL;
+    v->hash = hash;
+    v->flags = 0;
+  }
+  return v;
+}
+
+// value NULL leaves the value alone, for export name
+void rsh_var_assign(Var *v, const char *value, unsigned flags) {
+  if (value) {
+    if (v->value && !strcmp(v->value, value) && (v->flags & flags) == flags)
+      return; // i=$i changes nothing, the envp stays as it is
+    // a counter rewrites its value in place
+    size_t len = strlen(value);
+    if (!v->value || len >= v->size) {
+      free(v->value);
+      v->size = len < 16 ? 16 : len + 1;
+      v->value = malloc(v->size);
+      if (!v->value) {
+        fprintf(stderr, "rsh: allocation error\n");
+        exit(EXIT_FAILURE);
+      }
+    }
+    memcpy(v->value, value, len + 1);
+  }
+  v->flags |= flags;
+  if (v->flags & VAR_EXPORT) {
+    free(v->env);
+    v->env = NULL;
+    env_dirty = true;
+  }
+}
+
+void rsh_var_set(const char *name, const char *value) {
+  rsh_var_assign(rsh_var_lookup(name, strlen(name)), value, 0);
+}
+
+// sets the variable and exports it, value NULL exports it as it is
+void rsh_var_export(const char *name, const char *value) {
+  Var *v = rsh_var_lookup(name, strlen(name));
+  if (!v->value && !value)
+    value = "";
+  rsh_var_assign(v, value, VAR_EXPORT);
+}
+
+void rsh_var_unset(const char *name) {
+  Var *v = rsh_var_find(name, strlen(name));
+  if (!v)
+    return;
+  if (v->flags & VAR_EXPORT)
+    env_dirty = true;
+  free(v->name);
+  free(v->value);
+  free(v->env);
+  memset(v, 0, sizeof(*v));
+  v->flags = VAR_DELETED;
+}
+
+// the exported variables as an envp, rebuilt only after one changed
+char **rsh_envp(void) {
+  if (!env_dirty)
+    return env_array;
+  size_t n = 0;
+  for (size_t i = 0; i < var_cap; i++) {
+    Var *v = &var_table[i];
+    if (!v->name || !(v->flags & VAR_EXPORT))
+      continue;
+    if (!v->env) {
+      size_t name_len = strlen(v->name), value_len = strlen(v->value);
+      v->env = malloc(name_len + value_len + 2);
+      if (!v->env) {
+        fprintf(stderr, "rsh: allocation error\n");
+        exit(EXIT_FAILURE);
+      }
+      memcpy(v->env, v->name, name_len);
+      v->env[name_len] = '=';
+      memcpy(v->env + name_len + 1, v->value, value_len + 1);
+    }
+    if (n + 1 >= env_cap) {
+      env_cap = env_cap ? 2 * env_cap : 64;
+      env_array = realloc(env_array, sizeof(char *) * env_cap);
+      if (!env_array) {
+        fprintf(stderr, "rsh: allocation error\n");
+        exit(EXIT_FAILURE);
+      }
+    }
+    env_array[n++] = v->env;
+  }
+  if (!env_array)
+    env_array = no_args;
+  else
+    env_array[n] = NULL;
+  env_dirty = false;
+  env_generation++;
+  return env_array;
+}
+
+// the shell's envp with the name=value words in assigns laid over it, for
+// one command started as `name=value cmd`
+char **rsh_envp_with(char **assigns, int n, Arena *arena) {
+  char **base = rsh_envp();
+  size_t count = 0;
+  while (base[count])
+    count++;
+  char **envp = arena_alloc(arena, sizeof(char *) * (count + n + 1));
+  size_t k = 0;
+  for (size_t i = 0; i < count; i++) {
+    size_t len = strchrnul(base[i], '=') - base[i];
+    bool replaced = false;
+    for (int j = 0; j < n && !replaced; j++)
+      replaced = !strncmp(assigns[j], base[i], len) && assigns[j][len] == '=';
+    if (!replaced)
+      envp[k++] = base[i];
+  }
+  for (int j = 0; j < n; j++)
+    envp[k++] = assigns[j];
+  envp[k] = NULL;
+  return envp;
+}
+
+// exports every name=value of envp
+void rsh_vars_import(char **envp) {
+  for (char **e = envp; *e; e++) {
+    char *eq = strchr(*e, '=');
+    if (eq && rsh_is_name(*e, eq - *e))
+      rsh_var_assign(rsh_var_lookup(*e, eq - *e), eq + 1, VAR_EXPORT);
+  }
+}
+
+extern char **environ;
+
+void rsh_vars_init(void) {
+  rsh_var_grow();
+  rsh_vars_import(environ);
+}
+
+// what a name=value in front of a builtin or function replaced
+struct {
+  char *name;
+  char *value; // NULL when it was unset
+  unsigned flags;
+} typedef SavedVar;
+
+// exports the name=value words for one in-shell command, returns what to
+// put back with rsh_vars_pop
+SavedVar *rsh_vars_push(char **assigns, int n, Arena *arena) {
+  SavedVar *saved = arena_alloc(arena, sizeof(SavedVar) * n);
+  for (int i = 0; i < n; i++) {
+    size_t len = strchr(assigns[i], '=') - assigns[i];
+    Var *v = rsh_var_lookup(assigns[i], len);
+    saved[i].name = memcpy(arena_alloc(arena, len + 1), v->name, len + 1);
+    saved[i].value = v->value ? rsh_var_strdup(v->value, strlen(v->value))
+                              : NULL;
+    saved[i].flags = v->flags;
+    rsh_var_assign(v, assigns[i] + len + 1, VAR_EXPORT);
+  }
+  return saved;
+}
+
+void rsh_vars_pop(SavedVar *saved, int n) {
+  for (int i = n - 1; i >= 0; i--) {
+    if (!saved[i].value) {
+      rsh_var_unset(saved[i].name);
+      continue;
+    }
+    Var *v = rsh_var_lookup(saved[i].name, strlen(saved[i].name));
+    if ((v->flags | saved[i].flags) & VAR_EXPORT)
+      env_dirty = true;
+    free(v->value);
+    free(v->env);
+    v->value = saved[i].value;
+    v->size = strlen(v->value) + 1;
+    v->env = NULL;
+    v->flags = saved[i].flags;
+  }
+}
+
+// name=value with an unquoted name, NULL when word is not an assignment
+const char *rsh_assignment(const char *word) {
+  const char *eq = strchr(word, '=');
+  return eq && rsh_is_name(word, eq - word) ? eq + 1 : NULL;
+}
+
+// export [-p] [name[=value] ...]
+int bi_export(char **argv, BuiltinIO *io) {
+  int i = 1;
+  if (argv[i] && !strcmp(argv[i], "-p"))
+    i++;
+  if (!argv[i]) {
+    OutBuf o = {.fd = io->out};
+    for (size_t j = 0; j < var_cap; j++) {
+      Var *v = &var_table[j];
+      if (v->name && (v->flags & VAR_EXPORT))
+        out_printf(&o, "export %s='%s'\n", v->name, v->value);
+    }
+    out_flush(&o);
+    return o.failed;
+  }
+
+  int status = 0;
+  for (; argv[i]; i++) {
+    const char *value = rsh_assignment(argv[i]);
+    size_t len = value ? (size_t)(value - 1 - argv[i]) : strlen(argv[i]);
+    if (!rsh_is_name(argv[i], len)) {
+      fprintf(stderr, "rsh: export: `%s': not a valid identifier\n", argv[i]);
+      status = 1;
+      continue;
+    }
+    Var *v = rsh_var_lookup(argv[i], len);
+    rsh_var_assign(v, value ? value : (v->value ? NULL : ""), VAR_EXPORT);
+  }
+  return status;
+}
+
+bool rsh_unset_func(const char *name); // EXECUTION
+
+// unset [-v | -f] name ...
+int bi_unset(char **argv, BuiltinIO *io) {
+  (void)io;
+  bool funcs = false;
+  int i = 1;
+  for (; argv[i] && argv[i][0] == '-' && argv[i][1]; i++) {
+    if (!strcmp(argv[i], "-f"))
+      funcs = true;
+    else if (!strcmp(argv[i], "-v"))
+      funcs = false;
+    else
+      break;
+  }
+  for (; argv[i]; i++) {
+    if (funcs)
+      rsh_unset_func(argv[i]);
+    else
+      rsh_var_unset(argv[i]);
+  }
+  return 0;
+}
+
+/* arithmetic for $((...)), on text whose $ parameters are already expanded:
+   C integer operators on longs, names read and assigned as variables */
+
+#define RSH_ARITH_DEPTH 1024 // variables whose values are expressions, nested
+
+struct {
+  const char *s;
+  int noeval; // inside the untaken side of && || ?:, assign nothing
+  const char *error;
+  int depth; // variable values being evaluated around this one
+} typedef Arith;
+
+long rsh_arith_assign(Arith *a);
+
+void arith_skip(Arith *a) {
+  while (isspace((unsigned char)*a->s))
+    a->s++;
+}
+
+// a variable's value: a number, or else an expression of its own, so x=1+2
+// makes $((x*2)) 6. unset and empty are 0
+long rsh_arith_value(Arith *a, const char *value) {
+  if (!value)
+    return 0;
+  char *end;
+  long n = strtol(value, &end, 0);
+  while (isspace((unsigned char)*end))
+    end++;
+  if (!*end)
+    return n;
+  if (a->depth == RSH_ARITH_DEPTH) {
+    a->error = "expression recursion level exceeded";
+    return 0;
+  }
+  Arith sub = {value, a->noeval, NULL, a->depth + 1};
+  n = rsh_arith_assign(&sub);
+  arith_skip(&sub);
+  if (!sub.error && *sub.s)
+    sub.error = "syntax error in expression";
+  a->error = sub.error;
+  return n;
+}
+
+// left / right or left % right for a right that is not 0. LONG_MIN / -1
+// does not fit and traps on x86, it wraps back to LONG_MIN instead
+long rsh_arith_div(long left, long right, bool mod) {
+  if (right == -1)
+    return mod ? 0 : (long)(0 - (unsigned long)left);
+  return mod ? left % right : left / right;
+}
+
+long rsh_arith_primary(Arith *a) {
+  arith_skip(a);
+  const char *s = a->s;
+  if (*s == '(') {
+    a->s++;
+    long n = rsh_arith_assign(a);
+    arith_skip(a);
+    if (*a->s != ')') {
+      a->error = "missing )";
+      return 0;
+    }
+    a->s++;
+    return n;
+  }
+  if (*s == '-' || *s == '+' || *s == '!' || *s == '~') {
+    a->s++;
+    long n = rsh_arith_primary(a);
+    return *s == '-'   ? (long)(0 - (unsigned long)n)
+           : *s == '+' ? n
+           : *s == '!' ? !n
+                       : ~n;
+  }
+  if (isdigit((unsigned char)*s)) {
+    char *end;
+    long n = strtol(s, &end, 0);
+    a->s = end;
+    return n;
+  }
+
+  size_t len = 0;
+  while (isalnum((unsigned char)s[len]) || s[len] == '_')
+    len++;
+  if (len == 0 || !rsh_is_name(s, len)) {
+    a->error = *s ? "operand expected" : "unexpected end of expression";
+    return 0;
+  }
+  a->s += len;
+  long n = rsh_arith_value(a, rsh_var_get(s, len));
+  if (a->error)
+    return 0;
+
+  // name op= value
+  arith_skip(a);
+  static const char *const ops[] = {"=", "+=", "-=", "*=", "/=", "%="};
+  int op = -1;
+  for (int i = 0; i < 6; i++) {
+    size_t oplen = strlen(ops[i]);
+    if (!strncmp(a->s, ops[i], oplen) && a->s[oplen] != '=')
+      op = i;
+  }
+  if (op == -1)
+    return n;
+  a->s += op == 0 ? 1 : 2;
+  long rhs = rsh_arith_assign(a);
+  if ((op == 4 || op == 5) && rhs == 0 && !a->noeval) {
+    a->error = "division by zero";
+    return 0;
+  }
+  switch (op) {
+  case 0: n = rhs; break;
+  // in unsigned arithmetic so overflow wraps around
+  case 1: n = (unsigned long)n + rhs; break;
+  case 2: n = (unsigned long)n - rhs; break;
+  case 3: n = (unsigned long)n * rhs; break;
+  case 4: n = rhs ? rsh_arith_div(n, rhs, false) : 0; break;
+  case 5: n = rhs ? rsh_arith_div(n, rhs, true) : 0; break;
+  }
+  if (!a->noeval && !a->error) {
+    char num[24], name[256];
+    snprintf(num, sizeof(num), "%ld", n);
+    snprintf(name, sizeof(name), "%.*s", (int)len, s);
+    rsh_var_set(name, num);
+  }
+  return n;
+}
+
+// the binary operator at a->s, spelled in op: its C precedence, 0 when
+// there is none (op= is an assignment, the primary's)
+int arith_op(Arith *a, char op[3]) {
+  arith_skip(a);
+  char c = a->s[0], d = a->s[1];
+  op[0] = c;
+  op[1] = op[2] = '\0';
+  switch (c) {
+  case '|':
+  case '&':
+    if (d == c) {
+      op[1] = d;
+      return c == '|' ? 1 : 2;
+    }
+    return d == '=' ? 0 : (c == '|' ? 3 : 5);
+  case '^':
+    return d == '=' ? 0 : 4;
+  case '=':
+  case '!':
+    op[1] = d;
+    return d == '=' ? 6 : 0;
+  case '<':
+  case '>':
+    if (d == '=' || d == c)
+      op[1] = d;
+    return d == c ? 8 : 7;
+  case '+':
+  case '-':
+    return d == '=' ? 0 : 9;
+  case '*':
+  case '/':
+  case '%':
+    return d == '=' ? 0 : 10;
+  }
+  return 0;
+}
+
+long rsh_arith_binary(Arith *a, int min_prec) {
+  long left = rsh_arith_primary(a);
+  char op[3];
+  int prec;
+  while (!a->error && (prec = arith_op(a, op)) >= min_prec && prec > 0) {
+    a->s += op[1] ? 2 : 1;
+    // the right side of && and || runs only when it decides the result
+    bool skip = (prec == 1 && left) || (prec == 2 && !left);
+    a->noeval += skip;
+    long right = rsh_arith_binary(a, prec + 1);
+    a->noeval -= skip;
+    char c = op[0], d = op[1];
+    if ((c == '/' || c == '%') && right == 0) {
+      if (!a->noeval)
+        a->error = "division by zero";
+      right = 1;
+    }
+    bool shift = (c == '<' || c == '>') && d == c;
+    if (shift && (right < 0 || right >= (long)(sizeof(long) * CHAR_BIT))) {
+      if (!a->noeval)
+        a->error = "shift count out of range";
+      right = 0;
+    }
+    switch (c) {
+    case '|': left = d ? left || right : left | right; break;
+    case '&': left = d ? left && right : left & right; break;
+    case '=': left = left == right; break;
+    case '!': left = left != right; break;
+    case '<': left = d == '=' ? left <= right : d ? (long)((unsigned long)left << right) : left < right; break;
+    case '>': left = d == '=' ? left >= right : d ? left >> right : left > right; break;
+    case '^': left ^= right; break;
+    case '+': left = (unsigned long)left + right; break;
+    case '-': left = (unsigned long)left - right; break;
+    case '*': left = (unsigned long)left * right; break;
+    case '/': left = rsh_arith_div(left, right, false); break;
+    case '%': left = rsh_arith_div(left, right, true); break;
+    }
+  }
+  return left;
+}
+
+// cond ? a : b, with assignments reached through the primaries
+long rsh_arith_assign(Arith *a) {
+  long cond = rsh_arith_binary(a, 1);
+  arith_skip(a);
+  if (*a->s != '?')
+    return cond;
+  a->s++;
+  a->noeval += !cond;
+  long yes = rsh_arith_assign(a);
+  a->noeval -= !cond;
+  arith_skip(a);
+  if (*a->s != ':') {
+    a->error = "missing :";
+    return 0;
+  }
+  a->s++;
+  a->noeval += !!cond;
+  long no = rsh_arith_assign(a);
+  a->noeval -= !!cond;
+  return cond ? yes : no;
+}
+
+// evaluates expr, false (and a message) on an error
+bool rsh_arith(const char *expr, long *result) {
+  Arith a = {expr, 0, NULL, 0};
+  *result = rsh_arith_assign(&a);
+  arith_skip(&a);
+  if (!a.error && *a.s)
+    a.error = "syntax error in expression";
+  if (a.error) {
+    fprintf(stderr, "rsh: %s: %s\n", expr, a.error);
+    return false;
+  }
+  return true;
+}
+
+/* ---------------------------------------------------------------- HISTORY
+  lines typed at the prompt are appended to $RSH_HISTFILE (~/.rsh_history)
+  as binary records, each in one write to an O_APPEND descriptor, so shells
+  sharing the file never interleave inside a record. the file is mmap'd and
+  nothing is read at startup: records are walked and indexed a batch at a
+  time while the shell waits for input, and a search first picks up what
+  other shells appended since. the index is a bloom filter of the trigrams
+  of every ~4 KiB block of records, so a search runs memmem only over the
+  blocks that may hold the text, newest first.
+ * -----------------------------------------------------------------------------------------
+ */
+
+#define RSH_HIST_ENV "RSH_HISTFILE"
+#define RSH_HIST_NAME ".rsh_history" // in $HOME
+#define RSH_HIST_MAGIC 0x31485352    // "RSH1"
+#define RSH_HIST_BLOCK 4096          // text bytes per indexed block
+#define RSH_HIST_BLOOM 8192          // filter bits per block, power of two
+#define RSH_HIST_MAX (1 << 20)       // longest entry kept
+
+// record header, followed by the text and padding to 8 bytes
+struct {
+  uint32_t magic;
+  uint32_t len;
+  uint32_t sum;  // FNV-1a of the text, a torn record fails it
+  uint32_t time; // seconds since the epoch
+} typedef HistRecord;
+
+struct {
+  uint32_t first; // entry number of its first record
+  uint64_t bloom[RSH_HIST_BLOOM / 64];
+} typedef HistBlock;
+
+struct {
+  int fd;
+  char *map;
+  size_t mapped;
+  size_t scanned; // records before this offset are indexed
+  bool stalled;   // the record at scanned is still being written
+  uint64_t *offs; // file offset of each entry
+  uint32_t count;
+  uint32_t cap;
+  HistBlock *blocks;
+  uint32_t nblocks;
+  uint32_t blocks_cap;
+  size_t block_bytes; // text in the last block
+  char *last;         // this shell's last entry, not added twice in a row
+  bool opened;        // rsh_hist_init has run
+} typedef History;
+
+History hist = {.fd = -1};
+
+uint32_t rsh_hist_sum(const char *s, size_t len) {
+  uint32_t h = 2166136261u;
+  for (size_t i = 0; i < len; i++)
+    h = (h ^ (unsigned char)s[i]) * 16777619u;
+  return h;
+}
+
+// the filter bit of the trigram at s
+uint32_t rsh_hist_gram(const char *s) {
+  uint32_t g = (unsigned char)s[0] | (unsigned char)s[1] << 8 |
+               (uint32_t)(unsigned char)s[2] << 16;
+  return (g * 2654435761u) >> 16 & (RSH_HIST_BLOOM - 1);
+}
+
+// opens the history file for an interactive shell, or for the history
+// builtin of any other. an empty $RSH_HISTFILE turns history off
+void rsh_hist_init(void) {
+  hist.opened = true;
+  const char *path = getenv(RSH_HIST_ENV);
+  char buf[PATH_MAX];
+  if (!path) {
+    const char *home = getenv("HOME");
+    if (!home || snprintf(buf, sizeof(buf), "%s/%s", home, RSH_HIST_NAME) >=
+                     (int)sizeof(buf))
+      return;
+    path = buf;
+  }
+  if (*path)
+    hist.fd = open(path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+}
+
+// maps what the file has grown to
+void rsh_hist_map(void) {
+  struct stat st;
+  if (hist.fd == -1 || fstat(hist.fd, &st) == -1 ||
+      (size_t)st.st_size <= hist.mapped)
+    return;
+  char *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, hist.fd, 0);
+  if (map == MAP_FAILED)
+    return;
+  if (hist.map)
+    munmap(hist.map, hist.mapped);
+  hist.map = map;
+  hist.mapped = st.st_size;
+  hist.stalled = false;
+}
+
+void rsh_hist_index(const char *text, size_t len) {
+  if (hist.nblocks == 0 || hist.block_bytes >= RSH_HIST_BLOCK) {
+    if (hist.nblocks == hist.blocks_cap) {
+      hist.blocks_cap = hist.blocks_cap ? 2 * hist.blocks_cap : 64;
+      hist.blocks =
+          realloc(hist.blocks, sizeof(HistBlock) * hist.blocks_cap);
+      if (!hist.blocks)
+        exit(EXIT_FAILURE);
+    }
+    HistBlock *b = &hist.blocks[hist.nblocks++];
+    memset(b, 0, sizeof(*b));
+    b->first = hist.count;
+    hist.block_bytes = 0;
+  }
+  uint64_t *bloom = hist.blocks[hist.nblocks - 1].bloom;
+  for (size_t i = 0; i + 3 <= len; i++) {
+    uint32_t bit = rsh_hist_gram(text + i);
+    bloom[bit >> 6] |= 1ULL << (bit & 63);
+  }
+  hist.block_bytes += len;
+}
+
+// walks and indexes up to budget records of the mapping
+void rsh_hist_step(size_t budget) {
+  while (budget-- > 0 && !hist.stalled &&
+         hist.scanned + sizeof(HistRecord) <= hist.mapped) {
+    HistRecord r; // a short write may leave the records after unaligned
+    memcpy(&r, hist.map + hist.scanned, sizeof(r));
+    size_t size = (sizeof(HistRecord) + r.len + 7) & ~(size_t)7;
+    const char *text = hist.map + hist.scanned + sizeof(HistRecord);
+    bool fits = r.len <= RSH_HIST_MAX && hist.scanned + size <= hist.mapped;
+    if (r.magic != RSH_HIST_MAGIC || !fits ||
+        rsh_hist_sum(text, r.len) != r.sum) {
+      // in flight at the end, or torn by a crash: the next record is found
+      // again by its magic
+      if (r.magic == RSH_HIST_MAGIC && r.len <= RSH_HIST_MAX &&
+          hist.scanned + size >= hist.mapped)
+        hist.stalled = true;
+      else
+        hist.scanned++;
+      continue;
+    }
+
+    if (hist.count == hist.cap) {
+      hist.cap = hist.cap ? 2 * hist.cap : 1024;
+      hist.offs = realloc(hist.offs, sizeof(uint64_t) * hist.cap);
+      if (!hist.offs)
+        exit(EXIT_FAILURE);
+    }
+    rsh_hist_index(text, r.len);
+    hist.offs[hist.count++] = hist.scanned;
+    hist.scanned += size;
+  }
+}
+
+// records left to index in what is mapped
+bool rsh_hist_pending(void) {
+  return !hist.stalled && hist.scanned + sizeof(HistRecord) <= hist.mapped;
+}
+
+// everything in the file, as far as it is written, indexed
+void rsh_hist_sync(void) {
+  rsh_hist_map();
+  rsh_hist_step(SIZE_MAX);
+}
+
+const char *rsh_hist_text(uint32_t entry, size_t *len) {
+  HistRecord r;
+  memcpy(&r, hist.map + hist.offs[entry], sizeof(r));
+  *len = r.len;
+  return hist.map + hist.offs[entry] + sizeof(r);
+}
+
+// appends a line run at the prompt, without its trailing newline. lines
+// that start with a blank are left out, as is a repeat of the one before
+void rsh_hist_add(const char *line, size_t len) {
+  while (len > 0 && isspace((unsigned char)line[len - 1]))
+    len--;
+  if (hist.fd == -1 || len == 0 || len > RSH_HIST_MAX || IS_BLANK(line[0]) ||
+      (hist.last && strlen(hist.last) == len && !memcmp(hist.last, line, len)))
+    return;
+  free(hist.last);
+  hist.last = strndup(line, len);
+
+  size_t size = (sizeof(HistRecord) + len + 7) & ~(size_t)7;
+  char *rec = calloc(1, size);
+  if (!rec)
+    exit(EXIT_FAILURE);
+  HistRecord head = {RSH_HIST_MAGIC, len, rsh_hist_sum(line, len),
+                     (uint32_t)time(NULL)};
+  memcpy(rec, &head, sizeof(head));
+  memcpy(rec + sizeof(head), line, len);
+  // one write: O_APPEND places it whole after whatever other shells wrote
+  if (write(hist.fd, rec, size) != (ssize_t)size)
+    fprintf(stderr, "rsh: history: %s\n", strerror(errno));
+  free(rec);
+}
+
+// the newest entry before entry `before` that holds the n bytes of q, -1
+// when there is none. an empty q matches every entry
+long rsh_hist_find(const char *q, size_t n, long before) {
+  uint32_t grams[64];
+  int ngrams = 0;
+  for (size_t i = 0; i + 3 <= n && ngrams < 64; i++)
+    grams[ngrams++] = rsh_hist_gram(q + i);
+  if (before > (long)hist.count)
+    before = hist.count;
+  if (before <= 0)
+    return -1;
+
+  // the block holding entry before - 1
+  long lo = 0, hi = hist.nblocks - 1;
+  while (lo < hi) {
+    long mid = (lo + hi + 1) / 2;
+    if (hist.blocks[mid].first < (uint32_t)before)
+      lo = mid;
+    else
+      hi = mid - 1;
+  }
+  for (long b = lo; b >= 0; b--) {
+    const HistBlock *blk = &hist.blocks[b];
+    int g = 0;
+    while (g < ngrams &&
+           (blk->bloom[grams[g] >> 6] & (1ULL << (grams[g] & 63))))
+      g++;
+    if (g < ngrams)
+      continue;
+    long end = b + 1 < (long)hist.nblocks ? hist.blocks[b + 1].first
+                                          : hist.count;
+    if (end > before)
+      end = before;
+    for (long e = end - 1; e >= (long)blk->first; e--) {
+      size_t len;
+      const char *text = rsh_hist_text(e, &len);
+      if (n == 0 || memmem(text, len, q, n))
+        return e;
+    }
+  }
+  return -1;
+}
+
+// history [-n count | count] [text ...]: the entries, or the last count of
+// them, that hold text, oldest first
+int bi_history(char **argv, BuiltinIO *io) {
+  long limit = -1;
+  int i = 1;
+  if (argv[1] && !strcmp(argv[1], "-n") && argv[2]) {
+    limit = atol(argv[2]);
+    i = 3;
+  } else if (argv[1] && argv[1][0] && strspn(argv[1], "0123456789") ==
+                                           strlen(argv[1])) {
+    limit = atol(argv[1]);
+    i = 2;
+  }
+  StrBuf q = {0};
+  for (int j = i; argv[j]; j++) {
+    if (j > i)
+      sb_puts(&q, " ");
+    sb_puts(&q, argv[j]);
+  }
+
+  if (!hist.opened)
+    rsh_hist_init();
+  rsh_hist_sync();
+  long *found = malloc(sizeof(long) * (hist.count + 1));
+  if (!found)
+    exit(EXIT_FAILURE);
+  long n = 0;
+  for (long e = hist.count; limit < 0 || n < limit; n++) {
+    if ((e = rsh_hist_find(q.data, q.len, e)) < 0)
+      break;
+    found[n] = e;
+  }
+
+  OutBuf o = {.fd = io->out};
+  while (n-- > 0) {
+    size_t len;
+    const char *text = rsh_hist_text(found[n], &len);
+    out_printf(&o, "%5ld  ", found[n] + 1);
+    out_write(&o, text, len);
+    out_putc(&o, '\n');
+  }
+  out_flush(&o);
+  free(found);
+  free(q.data);
+  return o.failed ? 1 : 0;
+}
+
+/* ---------------------------------------------------------------- GLOB
+  pathname expansion of * ? [...] and ** (any depth of directories), after
+  brace expansion of {a,b} and {1..9}. patterns come in with the bytes that
+  were quoted escaped by a backslash. each path component is compiled into a
+  short token program without allocating, and its literal parts reject most
+  names before the program runs: the fixed prefix and suffix by memcmp, the
+  literal after a * by memmem. a directory is read with getdents64 into a
+  large buffer and its names are kept in glob_arena until the next command
+  starts, so `cmd *.log *.txt` or a loop over several words reads it once.
+ * -----------------------------------------------------------------------------------------
+ */
+
+#define RSH_GLOB_DENTS (256 * 1024) // getdents64 buffer
+#define RSH_GLOB_TOKS 64            // tokens in one compiled component
+#define RSH_GLOB_SETS 8             // [...] in one compiled component
+#define RSH_GLOB_DIRS 32            // directory listings kept per command
+#define RSH_GLOB_KEEP (1 << 20) // listings bigger than this are freed after
+
+// words collected for an argv, growing at the end of an arena
+struct {
+  char **v;
+  int n;
+  int cap;
+  Arena *arena;
+} typedef WordList;
+
+void words_add(WordList *l, char *word) {
+  if (l->n == l->cap) {
+    int cap = l->cap ? 2 * l->cap : 16;
+    l->v = arena_grow(l->arena, l->v, sizeof(char *) * l->cap,
+                      sizeof(char *) * cap);
+    l->cap = cap;
+  }
+  l->v[l->n++] = word;
+}
+
+enum { GLOB_LIT, GLOB_ANY, GLOB_STAR, GLOB_SET } typedef GlobTokKind;
+
+struct {
+  uint8_t kind;
+  uint8_t len;  // GLOB_LIT: bytes at lits + at
+  uint16_t at;  // GLOB_LIT: offset in lits, GLOB_SET: index in sets
+} typedef GlobTok;
+
+// one compiled path component
+struct {
+  GlobTok tok[RSH_GLOB_TOKS];
+  int ntok;
+  uint64_t sets[RSH_GLOB_SETS][4];
+  int nsets;
+  char lits[NAME_MAX + 1];
+  size_t nlits;
+  size_t min_len; // bytes in the shortest name that matches
+  bool star;      // longer names can match too
+  bool dot;       // starts with a literal '.', so hidden names can match
+} typedef GlobPat;
+
+// [...] at s (n bytes left) into a new set. returns the bytes used, 0 when
+// there is no closing ] and the [ is just a character
+size_t glob_compile_set(GlobPat *g, const char *s, size_t n) {
+  uint64_t *set = g->sets[g->nsets];
+  memset(set, 0, sizeof(g->sets[0]));
+  size_t i = 1;
+  bool negate = i < n && (s[i] == '!' || s[i] == '^');
+  i += negate;
+  for (bool first = true; i < n && (s[i] != ']' || first); first = false) {
+    unsigned char lo = s[i] == '\\' && i + 1 < n ? s[++i] : s[i];
+    unsigned char hi = lo;
+    i++;
+    if (i + 1 < n && s[i] == '-' && s[i + 1] != ']') {
+      i++;
+      hi = s[i] == '\\' && i + 1 < n ? s[++i] : s[i];
+      i++;
+    }
+    for (unsigned c = lo; c <= hi; c++)
+      set[c >> 6] |= 1ULL << (c & 63);
+  }
+  if (i >= n)
+    return 0;
+  if (negate) {
+    for (int k = 0; k < 4; k++)
+      set[k] = ~set[k];
+  }
+  return i + 1;
+}
+
+// compiles the n bytes of one path component, false when it is too big to
+// match any name
+bool glob_compile(GlobPat *g, const char *s, size_t n) {
+  g->ntok = g->nsets = 0;
+  g->nlits = g->min_len = 0;
+  g->star = false;
+  for (size_t i = 0; i < n;) {
+    if (g->ntok == RSH_GLOB_TOKS)
+      return false;
+    GlobTok *tok = &g->tok[g->ntok];
+    GlobTok *prev = g->ntok ? tok - 1 : NULL;
+    if (s[i] == '*') {
+      if (!prev || prev->kind != GLOB_STAR)
+        *tok = (GlobTok){GLOB_STAR, 0, 0}, g->ntok++;
+      g->star = true;
+      i++;
+      continue;
+    }
+    if (s[i] == '?') {
+      *tok = (GlobTok){GLOB_ANY, 0, 0}, g->ntok++;
+      g->min_len++;
+      i++;
+      continue;
+    }
+    size_t used;
+    if (s[i] == '[' && g->nsets < RSH_GLOB_SETS &&
+        (used = glob_compile_set(g, s + i, n - i))) {
+      *tok = (GlobTok){GLOB_SET, 0, g->nsets++}, g->ntok++;
+      g->min_len++;
+      i += used;
+      continue;
+    }
+    if (s[i] == '\\' && i + 1 < n)
+      i++;
+    if (g->nlits == sizeof(g->lits))
+      return false;
+    if (prev && prev->kind == GLOB_LIT && prev->len < UINT8_MAX)
+      prev->len++;
+    else
+      *tok = (GlobTok){GLOB_LIT, 1, g->nlits}, g->ntok++;
+    g->lits[g->nlits++] = s[i++];
+    g->min_len++;
+  }
+  g->dot = g->ntok > 0 && g->tok[0].kind == GLOB_LIT && g->lits[0] == '.';
+  return true;
+}
+
+bool glob_match(const GlobPat *g, const char *s, size_t n) {
+  if (n < g->min_len || (!g->star && n != g->min_len))
+    return false;
+  if (s[0] == '.' && !g->dot)
+    return false;
+  // the literal ends first: *.log fails on most names right here
+  const GlobTok *first = &g->tok[0], *last = &g->tok[g->ntok - 1];
+  if (first->kind == GLOB_LIT && memcmp(s, g->lits, first->len))
+    return false;
+  if (last->kind == GLOB_LIT &&
+      memcmp(s + n - last->len, g->lits + last->at, last->len))
+    return false;
+
+  // one step back to the last * on a mismatch is enough for globs
+  int t = 0, star_t = -1;
+  size_t i = 0, star_i = 0;
+  while (true) {
+    if (t == g->ntok) {
+      if (i == n)
+        return true;
+    } else {
+      const GlobTok *tok = &g->tok[t];
+      const char *lit = g->lits + tok->at;
+      switch (tok->kind) {
+      case GLOB_STAR:
+        if (t + 1 == g->ntok)
+          return true;
+        star_t = t++;
+        star_i = i;
+        continue;
+      case GLOB_ANY:
+        if (i < n) {
+          i++, t++;
+          continue;
+        }
+        break;
+      case GLOB_SET:
+        if (i < n) {
+          unsigned char c = s[i];
+          if (g->sets[tok->at][c >> 6] & (1ULL << (c & 63))) {
+            i++, t++;
+            continue;
+          }
+        }
+        break;
+      case GLOB_LIT:
+        if (t == star_t + 1 && t + 1 == g->ntok) // *suffix, checked above
+          return n - i >= tok->len;
+        if (t == star_t + 1) {
+          // what the * takes is up to the next place the literal is found
+          const char *hit = memmem(s + i, n - i, lit, tok->len);
+          if (!hit)
+            return false;
+          star_i = hit - s;
+          i = star_i + tok->len;
+          t++;
+          continue;
+        }
+        if (n - i >= tok->len && !memcmp(s + i, lit, tok->len)) {
+          i += tok->len, t++;
+          continue;
+        }
+        break;
+      }
+    }
+    if (star_t < 0 || star_i >= n)
+      return false;
+    i = ++star_i;
+    t = star_t + 1;
+  }
+}
+
+// a directory's entries, each as name length, d_type, name, NUL
+struct {
+  char *path; // "" for the current directory
+  char *names;
+  size_t size;
+} typedef GlobDir;
+
+Arena glob_arena; // listings and the names in them
+GlobDir glob_dirs[RSH_GLOB_DIRS];
+int glob_ndirs;
+size_t glob_bytes; // listed since the last rsh_glob_begin
+char *glob_dents;
+
+// forgets the listings of the command before
+void rsh_glob_begin(void) {
+  if (glob_bytes == 0)
+    return;
+  glob_ndirs = 0;
+  if (glob_bytes > RSH_GLOB_KEEP)
+    arena_free(&glob_arena);
+  else
+    arena_reset(&glob_arena);
+  glob_bytes = 0;
+}
+
+// reads dir, or finds it read already by this command
+bool rsh_glob_list(const char *dir, GlobDir *out) {
+  for (int i = 0; i < glob_ndirs; i++) {
+    if (!strcmp(glob_dirs[i].path, dir)) {
+      *out = glob_dirs[i];
+      return true;
+    }
+  }
+
+  int fd = open(*dir ? dir : ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (fd == -1)
+    return false;
+  if (!glob_dents && !(glob_dents = malloc(RSH_GLOB_DENTS))) {
+    fprintf(stderr, "rsh: allocation error\n");
+    exit(EXIT_FAILURE);
+  }
+  size_t cap = 4096, len = 0;
+  char *names = arena_alloc(&glob_arena, cap);
+  ssize_t n;
+  while ((n = getdents64(fd, glob_dents, RSH_GLOB_DENTS)) > 0) {
+    for (ssize_t off = 0; off < n;) {
+      struct dirent64 *d = (struct dirent64 *)(glob_dents + off);
+      off += d->d_reclen;
+      const char *name = d->d_name;
+      if (name[0] == '.' && (!name[1] || (name[1] == '.' && !name[2])))
+        continue;
+      size_t name_len = strlen(name);
+      if (len + name_len + 3 > cap) {
+        names = arena_grow(&glob_arena, names, cap, 2 * cap + name_len);
+        cap = 2 * cap + name_len;
+      }
+      names[len] = (char)name_len;
+      names[len + 1] = (char)d->d_type;
+      memcpy(names + len + 2, name, name_len + 1);
+      len += name_len + 3;
+    }
+  }
+  close(fd);
+
+  *out = (GlobDir){NULL, names, len};
+  glob_bytes += len + 1;
+  if (glob_ndirs < RSH_GLOB_DIRS) {
+    out->path = arena_alloc(&glob_arena, strlen(dir) + 1);
+    strcpy(out->path, dir);
+    glob_dirs[glob_ndirs++] = *out;
+  }
+  return true;
+}
+
+// a pattern being matched against the file system
+struct {
+  WordList *out;
+  char **comps; // path components of the pattern, escaped
+  size_t *lens;
+  int ncomps;
+  bool dirs_only; // the pattern ends in /
+  char path[PATH_MAX];
+  size_t len;
+} typedef Glob;
+
+// an unescaped * ? or [...] in the n bytes at s
+bool rsh_glob_meta(const char *s, size_t n) {
+  for (size_t i = 0; i < n; i++) {
+    if (s[i] == '\\')
+      i++;
+    else if (s[i] == '*' || s[i] == '?' ||
+             (s[i] == '[' && memchr(s + i, ']', n - i)))
+      return true;
+  }
+  return false;
+}
+
+// the n bytes at s without their escaping backslashes
+char *rsh_glob_unescape(const char *s, size_t n, Arena *arena) {
+  char *word = arena_alloc(arena, n + 1), *p = word;
+  for (size_t i = 0; i < n; i++) {
+    if (s[i] == '\\' && i + 1 < n)
+      i++;
+    *p++ = s[i];
+  }
+  *p = '\0';
+  return word;
+}
+
+bool rsh_glob_push(Glob *g, const char *s, size_t n) {
+  if (g->len + n + 2 > sizeof(g->path))
+    return false;
+  memcpy(g->path + g->len, s, n);
+  g->len += n;
+  g->path[g->len] = '\0';
+  return true;
+}
+
+void rsh_glob_add(Glob *g) {
+  char *word = arena_alloc(g->out->arena, g->len + 2);
+  memcpy(word, g->path, g->len);
+  word[g->len] = '/';
+  word[g->len + g->dirs_only] = '\0';
+  words_add(g->out, word);
+}
+
+// the name just pushed onto path is a directory. lstat for ** so links are
+// not followed, stat for a pattern that ends in /
+bool rsh_glob_is_dir(Glob *g, unsigned char type, bool follow) {
+  if (type == DT_DIR)
+    return true;
+  if (type != DT_UNKNOWN && (type != DT_LNK || !follow))
+    return false;
+  struct stat st;
+  return (follow ? stat(g->path, &st) : lstat(g->path, &st)) == 0 &&
+         S_ISDIR(st.st_mode);
+}
+
+void rsh_glob_walk(Glob *g, int i);
+
+// ** matches any number of directories, itself included, but never goes
+// into hidden ones or through links
+void rsh_glob_any_depth(Glob *g, int i) {
+  bool last = i + 1 == g->ncomps;
+  if (!last)
+    rsh_glob_walk(g, i + 1);
+  GlobDir dir;
+  if (!rsh_glob_list(g->path, &dir))
+    return;
+  size_t base = g->len;
+  for (const char *e = dir.names; e < dir.names + dir.size;
+       e += (unsigned char)e[0] + 3) {
+    const char *name = e + 2;
+    if (name[0] == '.' || !rsh_glob_push(g, name, (unsigned char)e[0]))
+      continue;
+    bool is_dir = rsh_glob_is_dir(g, e[1], false);
+    if (last && (is_dir || !g->dirs_only))
+      rsh_glob_add(g);
+    if (is_dir && rsh_glob_push(g, "/", 1))
+      rsh_glob_any_depth(g, i);
+    g->len = base;
+    g->path[base] = '\0';
+  }
+}
+
+// matches component i in the directory path holds
+void rsh_glob_walk(Glob *g, int i) {
+  if (i == g->ncomps)
+    return;
+  const char *comp = g->comps[i];
+  size_t comp_len = g->lens[i];
+  bool last = i + 1 == g->ncomps;
+  size_t base = g->len;
+
+  if (comp_len == 2 && comp[0] == '*' && comp[1] == '*') {
+    rsh_glob_any_depth(g, i);
+  } else if (!rsh_glob_meta(comp, comp_len)) {
+    // a literal part is put on the path, the file system checks it later
+    char *lit = rsh_glob_unescape(comp, comp_len, &glob_arena);
+    struct stat st;
+    if (!rsh_glob_push(g, lit, strlen(lit)))
+      return;
+    if (!last && rsh_glob_push(g, "/", 1))
+      rsh_glob_walk(g, i + 1);
+    else if (last && (g->dirs_only ? stat(g->path, &st) == 0 &&
+                                         S_ISDIR(st.st_mode)
+                                   : lstat(g->path, &st) == 0))
+      rsh_glob_add(g);
+  } else {
+    GlobPat pat;
+    GlobDir dir;
+    if (!glob_compile(&pat, comp, comp_len) ||
+        !rsh_glob_list(g->path, &dir))
+      return;
+    for (const char *e = dir.names; e < dir.names + dir.size;
+         e += (unsigned char)e[0] + 3) {
+      size_t name_len = (unsigned char)e[0];
+      if (!glob_match(&pat, e + 2, name_len) ||
+          !rsh_glob_push(g, e + 2, name_len))
+        continue;
+      // a link or an unknown type may be a directory, opening it tells
+      bool may_dir = e[1] == DT_DIR || e[1] == DT_LNK || e[1] == DT_UNKNOWN;
+      if (!last && may_dir && rsh_glob_push(g, "/", 1))
+        rsh_glob_walk(g, i + 1);
+      else if (last && (!g->dirs_only || rsh_glob_is_dir(g, e[1], true)))
+        rsh_glob_add(g);
+      g->len = base;
+      g->path[base] = '\0';
+    }
+  }
+  g->len = base;
+  g->path[base] = '\0';
+}
+
+int rsh_glob_cmp(const void *a, const void *b) {
+  return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+// adds the names the n bytes of pat match, sorted, or pat itself when none
+// do
+void rsh_glob(const char *pat, size_t n, WordList *out) {
+  if (!rsh_glob_meta(pat, n)) {
+    words_add(out, rsh_glob_unescape(pat, n, out->arena));
+    return;
+  }
+
+  Glob g = {.out = out};
+  int ncomps = 1;
+  for (size_t i = 0; i < n; i++)
+    ncomps += pat[i] == '/';
+  g.comps = arena_alloc(&glob_arena, sizeof(char *) * ncomps);
+  g.lens = arena_alloc(&glob_arena, sizeof(size_t) * ncomps);
+  size_t i = 0;
+  if (pat[0] == '/') {
+    rsh_glob_push(&g, "/", 1);
+    while (pat[i] == '/')
+      i++;
+  }
+  while (i < n) {
+    const char *slash = memchr(pat + i, '/', n - i);
+    size_t end = slash ? (size_t)(slash - pat) : n;
+    g.comps[g.ncomps] = (char *)pat + i;
+    g.lens[g.ncomps++] = end - i;
+    i = end + 1;
+    g.dirs_only = slash && i >= n;
+  }
+
+  int start = out->n;
+  rsh_glob_walk(&g, 0);
+  if (out->n == start)
+    words_add(out, rsh_glob_unescape(pat, n, out->arena));
+  else
+    qsort(out->v + start, out->n - start, sizeof(char *), rsh_glob_cmp);
+}
+
+// pat with the brace at open..close replaced by the n bytes at s, expanded
+// on for the braces after it
+void rsh_brace(const char *pat, size_t n, WordList *out);
+
+void rsh_brace_choice(const char *pat, size_t n, size_t open, size_t close,
+                      const char *s, size_t len, WordList *out) {
+  size_t tail = n - close - 1;
+  char *word = arena_alloc(&glob_arena, open + len + tail + 1);
+  memcpy(word, pat, open);
+  memcpy(word + open, s, len);
+  memcpy(word + open + len, pat + close + 1, tail);
+  word[open + len + tail] = '\0';
+  rsh_brace(word, open + len + tail, out);
+}
+
+// {a,b,c} and {1..5} {a..e}: the first brace in pat is expanded and each
+// result expanded again for the braces after it, then globbed
+void rsh_brace(const char *pat, size_t n, WordList *out) {
+  for (size_t open = 0; open < n; open++) {
+    if (pat[open] == '\\') {
+      open++;
+      continue;
+    }
+    if (pat[open] != '{')
+      continue;
+    size_t close, commas = 0;
+    int depth = 0;
+    for (close = open + 1; close < n; close++) {
+      if (pat[close] == '\\')
+        close++;
+      else if (pat[close] == '{')
+        depth++;
+      else if (pat[close] == '}' && depth-- == 0)
+        break;
+      else if (pat[close] == ',' && depth == 0)
+        commas++;
+    }
+    if (close >= n)
+      continue;
+
+    const char *body = pat + open + 1, *end = pat + close;
+    if (commas > 0) {
+      const char *choice = body;
+      depth = 0;
+      for (const char *p = body; p < end; p++) {
+        if (*p == '\\') {
+          p++;
+        } else if (*p == '{') {
+          depth++;
+        } else if (*p == '}') {
+          depth--;
+        } else if (*p == ',' && depth == 0) {
+          rsh_brace_choice(pat, n, open, close, choice, p - choice, out);
+          choice = p + 1;
+        }
+      }
+      rsh_brace_choice(pat, n, open, close, choice, end - choice, out);
+      return;
+    }
+
+    // a range of numbers or of single letters and digits
+    const char *dots = memmem(body, end - body, "..", 2);
+    if (!dots)
+      continue;
+    char *num_end;
+    long from = strtol(body, &num_end, 10), to = 0;
+    bool numbers = num_end == dots && num_end != body;
+    if (numbers) {
+      to = strtol(dots + 2, &num_end, 10);
+      numbers = num_end == end && num_end != dots + 2;
+    }
+    bool chars = !numbers && dots == body + 1 && end == dots + 3 &&
+                 isalnum((unsigned char)body[0]) &&
+                 isalnum((unsigned char)dots[2]);
+    if (!numbers && !chars)
+      continue;
+    if (chars) {
+      from = (unsigned char)body[0];
+      to = (unsigned char)dots[2];
+    }
+    for (long v = from;; v += from <= to ? 1 : -1) {
+      char num[24];
+      size_t len = 1;
+      if (numbers)
+        len = snprintf(num, sizeof(num), "%ld", v);
+      else
+        num[0] = (char)v;
+      rsh_brace_choice(pat, n, open, close, num, len, out);
+      if (v == to)
+        break;
+    }
+    return;
+  }
+  rsh_glob(pat, n, out);
+}
+
+/* ---------------------------------------------------------------- EXECUTION
+ * -----------------------------------------------------------------------------------------
+ */
+
+// how external commands are started
+enum {
+  RSH_SPAWN_POSIX, // posix_spawnp (clone(CLONE_VM|CLONE_VFORK) in glibc)
+  RSH_SPAWN_FORK,  // classic fork + dup2 + execvp
+  RSH_SPAWN_ZYGOTE // a small helper process clones and execs, see ZYGOTE
+} typedef SpawnMode;
+
+SpawnMode rsh_spawn_mode = RSH_SPAWN_POSIX;
+
+Arena exec_arena; // unquoted words of the line being run, reset per line
+Arena subst_arena; // the parse of each $(...), given back when it has run
+int subst_status;  // of the last $(...), what a bare assignment returns
+
+// opens the redirect files of a command in the shell so errors are reported
+// before anything is started. fds are O_CLOEXEC, -1 means "not redirected"
+int rsh_open_redirects(Command *cmd, int *in_fd, int *out_fd) {
+  *in_fd = -1;
+  *out_fd = -1;
+
+  if (cmd->input_file) {
+    *in_fd = open(cmd->input_file, O_RDONLY | O_CLOEXEC);
+    if (*in_fd == -1) {
+      fprintf(stderr, "rsh: cannot open input file %s\n", cmd->input_file);
+      return -1;
+    }
+  }
+
+  if (cmd->output_file) {
+    int flags = O_WRONLY | O_CREAT | O_CLOEXEC;
+    flags |= cmd->append ? O_APPEND : O_TRUNC; // >> appends, > overwrites
+    *out_fd = open(cmd->output_file, flags, 0666);
+    if (*out_fd == -1) {
+      fprintf(stderr, "rsh: cannot open output file %s\n", cmd->output_file);
+      if (*in_fd != -1)
+        close(*in_fd);
+      *in_fd = -1;
+      return -1;
+    }
+  }
+  return 0;
+}
+
+// how a child is started
+struct {
+  int in_fd;  // becomes stdin, -1 keeps the shell's
+  int out_fd; // becomes stdout, -1 keeps the shell's
+  // fds a forked builtin closes (-1 entries are skipped). programs that
+  // exec need none: everything the shell opens is close-on-exec
+  const int *close_fds;
+  int nclose;
+  pid_t pgid;      // -1 stays in the shell's group, 0 starts a new one
+  bool foreground; // takes the terminal (job control only)
+  char **envp;     // NULL for the shell's exported variables
+} typedef SpawnOpts;
+
+// the signals a child gets back to default: the shell ignores some of them
+// and blocks SIGCHLD
+void rsh_child_sigdefaults(sigset_t *set) {
+  sigemptyset(set);
+  sigaddset(set, SIGPIPE);
+  sigaddset(set, SIGINT);
+  sigaddset(set, SIGQUIT);
+  sigaddset(set, SIGTSTP);
+  sigaddset(set, SIGTTIN);
+  sigaddset(set, SIGTTOU);
+  sigaddset(set, SIGCHLD);
+}
+
+// process group, terminal, fds and signals of a forked child
+int rsh_child_setup(const SpawnOpts *opts) {
+  if (opts->pgid != -1) {
+    setpgid(0, opts->pgid);
+    if (opts->foreground && job_control)
+      tcsetpgrp(STDIN_FILENO, getpgrp()); // SIGTTOU is still ignored here
+  }
+
+  sigset_t defaults;
+  rsh_child_sigdefaults(&defaults);
+  for (int sig = 1; sig < NSIG; sig++) {
+    if (sigismember(&defaults, sig) == 1)
+      signal(sig, SIG_DFL);
+  }
+  sigset_t none;
+  sigemptyset(&none);
+  sigprocmask(SIG_SETMASK, &none, NULL);
+
+  if (opts->in_fd != -1 && dup2(opts->in_fd, STDIN_FILENO) == -1)
+    return errno;
+  if (opts->out_fd != -1 && dup2(opts->out_fd, STDOUT_FILENO) == -1)
+    return errno;
+  for (int i = 0; i < opts->nclose; i++) {
+    if (opts->close_fds[i] != -1)
+      close(opts->close_fds[i]);
+  }
+  return 0;
+}
+
+// the spawn of a child on the shell's track and, up to its exec, on the
+// child's own
+void rsh_trace_spawned(pid_t pid, const char *how, const char *name,
+                       const char *path, long long start) {
+  long long end = rsh_trace_now();
+  rsh_trace_track(pid, name);
+  rsh_trace_span(trace_pid, "spawn", how, start, end, path);
+  rsh_trace_span(pid, "spawn", how, start, end, path);
+}
+
+int rsh_zygote_spawn(const char *path, char **argv, char **envp,
+                     const SpawnOpts *opts, pid_t *pid); // ZYGOTE, near the end
+
+// starts the program at path as described by opts.
+// returns 0 and sets *pid, or returns an errno value (exec failures included)
+int rsh_spawn(const char *path, char **argv, const SpawnOpts *opts,
+              pid_t *pid) {
+  char **envp = opts->envp ? opts->envp : rsh_envp();
+  if (rsh_spawn_mode == RSH_SPAWN_ZYGOTE) {
+    int err = rsh_zygote_spawn(path, argv, envp, opts, pid);
+    if (err != -1)
+      return err;
+  }
+  if (rsh_spawn_mode != RSH_SPAWN_FORK) {
+    posix_spawn_file_actions_t actions;
+    int err = posix_spawn_file_actions_init(&actions);
+    if (err)
+      return err;
+
+    if (opts->in_fd != -1 && opts->in_fd != STDIN_FILENO)
+      err = posix_spawn_file_actions_adddup2(&actions, opts->in_fd,
+                                             STDIN_FILENO);
+    if (!err && opts->out_fd != -1 && opts->out_fd != STDOUT_FILENO)
+      err = posix_spawn_file_actions_adddup2(&actions, opts->out_fd,
+                                             STDOUT_FILENO);
+#if defined(__GLIBC__) && __GLIBC_PREREQ(2, 35)
+    // the child takes the terminal itself so it never reads it too early
+    if (!err && opts->pgid != -1 && opts->foreground && job_control)
+      err = posix_spawn_file_actions_addtcsetpgrp_np(&actions, STDIN_FILENO);
+#endif
+
+    posix_spawnattr_t attr;
+    sigset_t defaults, none;
+    rsh_child_sigdefaults(&defaults);
+    sigemptyset(&none);
+    if (!err)
+      err = posix_spawnattr_init(&attr);
+    if (!err) {
+      short flags = POSIX_SPAWN_SETSIGDEF | POSIX_SPAWN_SETSIGMASK;
+      posix_spawnattr_setsigdefault(&attr, &defaults);
+      posix_spawnattr_setsigmask(&attr, &none);
+      if (opts->pgid != -1) {
+        flags |= POSIX_SPAWN_SETPGROUP;
+        posix_spawnattr_setpgroup(&attr, opts->pgid);
+      }
+      posix_spawnattr_setflags(&attr, flags);
+      long long start = TRACING ? rsh_trace_now() : 0;
+      err = posix_spawn(pid, path, &actions, &attr, argv, envp);
+      if (TRACING && !err)
+        rsh_trace_spawned(*pid, "posix_spawn", argv[0], path, start);
+      posix_spawnattr_destroy(&attr);
+    }
+    posix_spawn_file_actions_destroy(&actions);
+    return err;
+  }
+
+  // fork fallback. the child reports a failed execve through a close-on-exec
+  // pipe so both modes return the same errors
+  int errpipe[2];
+  if (pipe2(errpipe, O_CLOEXEC) == -1)
+    return errno;
+
+  long long start = TRACING ? rsh_trace_now() : 0;
+  *pid = fork();
+  if (*pid < 0) {
+    int err = errno;
+    close(errpipe[0]);
+    close(errpipe[1]);
+    return err;
+  }
+
+  if (*pid == 0) {
+    // child
+    rsh_trace_forked(argv[0]);
+    long long setup = TRACING ? rsh_trace_now() : 0;
+    int err = rsh_child_setup(opts);
+    if (!err) {
+      if (TRACING) {
+        rsh_trace_span(trace_pid, "spawn", "child_setup", setup,
+                       rsh_trace_now(), NULL);
+        rsh_trace_instant(trace_pid, "spawn", "execve", path);
+        rsh_trace_flush();
+      }
+      execve(path, argv, envp);
+      err = errno;
+    }
+    write(errpipe[1], &err, sizeof(err));
+    _exit(127);
+  }
+
+  // parent: EOF means the exec went through
+  int err = 0;
+  close(errpipe[1]);
+  ssize_t n;
+  do {
+    n = read(errpipe[0], &err, sizeof(err));
+  } while (n == -1 && errno == EINTR);
+  close(errpipe[0]);
+
+  if (n == sizeof(err)) {
+    waitpid(*pid, NULL, 0); // reap the failed child
+    return err;
+  }
+  if (TRACING)
+    rsh_trace_spawned(*pid, "fork+exec", argv[0], path, start);
+  return 0;
+}
+
+// resolves argv[0] through the PATH cache and spawns it. a cached path that
+// vanished is dropped and looked up again once
+int rsh_spawn_cmd(char **argv, const SpawnOpts *opts, pid_t *pid) {
+  bool cached;
+  const char *path = rsh_path_lookup(argv[0], &cached);
+  if (!path)
+    return ENOENT;
+
+  int err = rsh_spawn(path, argv, opts, pid);
+  if (err == ENOENT && cached) {
+    rsh_path_forget(argv[0]);
+    path = rsh_path_lookup(argv[0], &cached);
+    if (!path)
+      return ENOENT;
+    err = rsh_spawn(path, argv, opts, pid);
+  }
+  return err;
+}
+
+// a word being built at the end of an arena
+struct {
+  char *data;
+  size_t len;
+  size_t cap;
+  Arena *arena;
+  bool pattern; // bytes special to globbing go in with a backslash
+} typedef WordBuf;
+
+void word_put(WordBuf *w, const char *s, size_t len) {
+  if (w->pattern) {
+    w->pattern = false;
+    for (size_t i = 0; i < len; i++) {
+      if (s[i] && strchr("*?[]{},\\", s[i]))
+        word_put(w, "\\", 1);
+      word_put(w, s + i, 1);
+    }
+    w->pattern = true;
+    return;
+  }
+  if (w->len + len + 1 > w->cap) {
+    size_t cap = (w->len + len + 1) * 2;
+    w->data = arena_grow(w->arena, w->data, w->cap, cap);
+    w->cap = cap;
+  }
+  memcpy(w->data + w->len, s, len);
+  w->len += len;
+}
+
+void word_put_int(WordBuf *w, long n) {
+  char num[24];
+  char *p = num + sizeof(num);
+  unsigned long u = n < 0 ? -(unsigned long)n : (unsigned long)n;
+  do {
+    *--p = '0' + u % 10;
+    u /= 10;
+  } while (u);
+  if (n < 0)
+    *--p = '-';
+  word_put(w, p, num + sizeof(num) - p);
+}
+
+// the positional parameters as one word
+void word_put_args(WordBuf *w) {
+  for (int i = 0; i < pos_argc; i++) {
+    if (i > 0)
+      word_put(w, " ", 1);
+    word_put(w, pos_argv[i], strlen(pos_argv[i]));
+  }
+}
+
+size_t rsh_expand_arith(const char *s, WordBuf *w);
+size_t rsh_expand_brace(const char *s, WordBuf *w);
+void rsh_command_subst(const char *text, size_t len, WordBuf *w);
+
+// expands the parameter at s (which points at a '$'): $? $$ $! $# $@ $* $0-$9,
+// $name, ${...}, $((...)), $(...), $PIPESTATUS and ${PIPESTATUS[n]}, ${PIPESTATUS[@]}.
+// returns the bytes used, 0 when the $ is just a character
+size_t rsh_expand_dollar(const char *s, WordBuf *w) {
+  const char *value;
+  if (isdigit((unsigned char)s[1])) {
+    int n = s[1] - '0';
+    value = n == 0 ? shell_name : (n <= pos_argc ? pos_argv[n - 1] : "");
+    word_put(w, value, strlen(value));
+    return 2;
+  }
+
+  switch (s[1]) {
+  case '#':
+    word_put_int(w, pos_argc);
+    return 2;
+  case '@':
+  case '*':
+    word_put_args(w);
+    return 2;
+  case '?':
+    word_put_int(w, last_status);
+    return 2;
+  case '$':
+    word_put_int(w, getpid());
+    return 2;
+  case '!':
+    if (last_bg_pid > 0)
+      word_put_int(w, last_bg_pid);
+    return 2;
+  }
+
+  const char *name = "PIPESTATUS";
+  size_t name_len = strlen(name);
+  if (!strncmp(s + 1, name, name_len) &&
+      !isalnum((unsigned char)s[1 + name_len]) && s[1 + name_len] != '_') {
+    if (pipe_count > 0)
+      word_put_int(w, pipe_stages[0].status);
+    return 1 + name_len;
+  }
+  if (isalpha((unsigned char)s[1]) || s[1] == '_') {
+    size_t len = 1;
+    while (isalnum((unsigned char)s[1 + len]) || s[1 + len] == '_')
+      len++;
+    if ((value = rsh_var_get(s + 1, len)))
+      word_put(w, value, strlen(value));
+    return 1 + len;
+  }
+  if (s[1] == '(' && s[2] == '(')
+    return rsh_expand_arith(s, w);
+  if (s[1] == '(') {
+    const char *end = rsh_subst_end(s);
+    if (!end)
+      return 0;
+    rsh_command_subst(s + 2, end - s - 3, w);
+    return end - s;
+  }
+  if (s[1] != '{')
+    return 0;
+  if (strncmp(s + 2, name, name_len))
+    return rsh_expand_brace(s, w);
+
+  const char *p = s + 2 + name_len;
+  if (p[0] == '}') {
+    if (pipe_count > 0)
+      word_put_int(w, pipe_stages[0].status);
+    return p + 1 - s;
+  }
+  if (p[0] != '[')
+    return 0;
+  if ((p[1] == '@' || p[1] == '*') && p[2] == ']' && p[3] == '}') {
+    // one word: rsh does no field splitting
+    for (int i = 0; i < pipe_count; i++) {
+      if (i > 0)
+        word_put(w, " ", 1);
+      word_put_int(w, pipe_stages[i].status);
+    }
+    return p + 4 - s;
+  }
+  char *end;
+  long n = strtol(p + 1, &end, 10);
+  if (end == p + 1 || end[0] != ']' || end[1] != '}')
+    return 0;
+  if (n >= 0 && n < pipe_count)
+    word_put_int(w, pipe_stages[n].status);
+  return end + 2 - s;
+}
+
+bool arith_failed; // a $((...)) went wrong, the command is not run
+
+// $((expr)): parameters inside are expanded first, then the text evaluated.
+// an error leaves the word empty there, sets $? to 1 and arith_failed
+size_t rsh_expand_arith(const char *s, WordBuf *w) {
+  const char *end = s + 3;
+  for (int depth = 0; *end; end++) {
+    if (*end == '(')
+      depth++;
+    else if (*end == ')' && depth > 0)
+      depth--;
+    else if (*end == ')' && end[1] == ')')
+      break;
+  }
+  if (!*end)
+    return 0;
+
+  WordBuf expr = {NULL, 0, 0, w->arena, false};
+  size_t used;
+  for (const char *p = s + 3; p < end; p++) {
+    if (*p == '$' && (used = rsh_expand_dollar(p, &expr)))
+      p += used - 1;
+    else
+      word_put(&expr, p, 1);
+  }
+  word_put(&expr, "", 1);
+  long n;
+  if (rsh_arith(expr.data, &n)) {
+    word_put_int(w, n);
+  } else {
+    last_status = 1;
+    arith_failed = true;
+  }
+  return end + 2 - s;
+}
+
+// ${name} ${n} ${#name} ${name:-word} ${name:=word}. word is taken as it is
+size_t rsh_expand_brace(const char *s, WordBuf *w) {
+  const char *close = strchr(s + 2, '}');
+  if (!close)
+    return 0;
+  const char *p = s + 2;
+  bool length = p[0] == '#' && p[1] != '}';
+  p += length;
+
+  const char *name = p, *value;
+  if (isdigit((unsigned char)*p)) {
+    long n = strtol(p, (char **)&p, 10);
+    value = n == 0 ? shell_name : (n <= pos_argc ? pos_argv[n - 1] : NULL);
+  } else {
+    while (isalnum((unsigned char)*p) || *p == '_')
+      p++;
+    if (!rsh_is_name(name, p - name))
+      return 0;
+    value = rsh_var_get(name, p - name);
+  }
+
+  if (p[0] == ':' && (p[1] == '-' || p[1] == '=') && !length) {
+    if (!value || !*value) {
+      char *word = rsh_var_strdup(p + 2, close - p - 2);
+      if (p[1] == '=' && !isdigit((unsigned char)*name)) {
+        char *var = rsh_var_strdup(name, p - name);
+        rsh_var_set(var, word);
+        free(var);
+      }
+      word_put(w, word, strlen(word));
+      free(word);
+      return close + 1 - s;
+    }
+  } else if (p != close) {
+    return 0;
+  }
+
+  if (length)
+    word_put_int(w, value ? (long)strlen(value) : 0);
+  else if (value)
+    word_put(w, value, strlen(value));
+  return close + 1 - s;
+}
+
+// `...` at s: inside it a backslash only escapes $ ` and \, then it runs as
+// $(...) would. returns the bytes used
+size_t rsh_expand_backquote(const char *s, WordBuf *w) {
+  WordBuf text = {NULL, 0, 0, w->arena, false};
+  const char *p = s + 1;
+  for (; *p != '`'; p++) {
+    if (*p == '\\' && strchr("$`\\", p[1]))
+      p++;
+    word_put(&text, p, 1);
+  }
+  rsh_command_subst(text.data, text.len, w);
+  return p + 1 - s;
+}
+
+// quote removal and parameter expansion: copies a raw word without its
+// quotes and backslashes, with $ and `...` expanded outside single quotes.
+// as a pattern, what was quoted or expanded keeps a backslash before any
+// byte globbing would take as special
+char *rsh_unquote_word(const char *raw, Arena *arena, bool pattern) {
+  WordBuf w = {NULL, 0, strlen(raw) + 1, arena, pattern};
+  w.data = arena_alloc(arena, w.cap);
+  size_t used;
+
+  for (const char *s = raw; *s; s++) {
+    if (*s == '\\') {
+      s++;
+      if (*s != '\n') // backslash-newline is a line continuation
+        word_put(&w, s, 1);
+    } else if (*s == '\'') {
+      const char *close = strchr(s + 1, '\'');
+      word_put(&w, s + 1, close - s - 1);
+      s = close;
+    } else if (*s == '"') {
+      for (s++; *s != '"'; s++) {
+        // inside double quotes a backslash only escapes $ ` " \ and newline
+        if (*s == '\\' && strchr("$`\"\\\n", s[1])) {
+          s++;
+          if (*s == '\n')
+            continue;
+        } else if (*s == '$' && (used = rsh_expand_dollar(s, &w))) {
+          s += used - 1;
+          continue;
+        } else if (*s == '`') {
+          s += rsh_expand_backquote(s, &w) - 1;
+          continue;
+        } else if (*s != '\\' && *s != '$') {
+          // a run of plain characters goes in at once
+          size_t run = strcspn(s, "\\\"$`");
+          word_put(&w, s, run);
+          s += run - 1;
+          continue;
+        }
+        word_put(&w, s, 1);
+      }
+    } else if (*s == '$' && (used = rsh_expand_dollar(s, &w))) {
+      s += used - 1;
+    } else if (*s == '$') {
+      word_put(&w, s, 1);
+    } else if (*s == '`') {
+      s += rsh_expand_backquote(s, &w) - 1;
+    } else {
+      size_t run = strcspn(s, "\\'\"$`");
+      w.pattern = false; // unquoted, * and the rest stay special
+      word_put(&w, s, run);
+      w.pattern = pattern;
+      s += run - 1;
+    }
+  }
+  w.data[w.len] = '\0';
+  return w.data;
+}
+
+char *rsh_unquote(const char *raw, Arena *arena) {
+  return rsh_unquote_word(raw, arena, false);
+}
+
+// an unquoted * ? [ or { (not ${) in a raw word
+bool rsh_may_glob(const char *raw) {
+  if (!strpbrk(raw, "*?[{"))
+    return false;
+  for (const char *s = raw; s && *s; s++) {
+    if (*s == '\\' && s[1]) {
+      s++;
+    } else if (*s == '\'' || *s == '`') {
+      s = strchr(s + 1, *s);
+    } else if (*s == '"') {
+      for (s++; *s && *s != '"'; s++) {
+        if (*s == '\\' && s[1])
+          s++;
+        else if (*s == '$' && s[1] == '(' && (s = rsh_subst_end(s)))
+          s--;
+        if (!s)
+          return false;
+      }
+    } else if (*s == '$' && s[1] == '(') {
+      s = rsh_subst_end(s);
+      s = s ? s - 1 : NULL;
+    } else if (*s == '$' && s[1] == '{') {
+      s = strchr(s, '}');
+    } else if (strchr("*?[{", *s)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// a raw word into one or more words: quote removal and expansion, then
+// braces and pathname expansion when it may glob
+void rsh_expand_word(const char *raw, WordList *out) {
+  if (!rsh_may_glob(raw)) {
+    words_add(out, rsh_unquote(raw, out->arena));
+    return;
+  }
+  char *pat = rsh_unquote_word(raw, out->arena, true);
+  rsh_brace(pat, strlen(pat), out);
+}
+
+// fills out with cmd's words ready for exec. plain commands are used as
+// they are, otherwise the words are unquoted and expanded into the arena.
+// false when an arithmetic expansion failed and the command must not run
+bool rsh_expand_cmd(Command *cmd, Command *out, Arena *arena) {
+  *out = *cmd;
+  if (!cmd->quoted)
+    return true;
+  arith_failed = false;
+
+  WordList words = {arena_alloc(arena, sizeof(char *) * (cmd->argc + 1)), 0,
+                    cmd->argc + 1, arena};
+  rsh_glob_begin();
+  bool leading = true; // name=value words in front are not globbed
+  for (int i = 0; i < cmd->argc; i++) {
+    leading = leading && rsh_assignment(cmd->argv[i]);
+    if (leading)
+      words_add(&words, rsh_unquote(cmd->argv[i], arena));
+    else
+      rsh_expand_word(cmd->argv[i], &words);
+  }
+  words_add(&words, NULL);
+  out->argv = words.v;
+  out->argc = words.n - 1;
+  if (cmd->input_file)
+    out->input_file = rsh_unquote(cmd->input_file, arena);
+  if (cmd->output_file)
+    out->output_file = rsh_unquote(cmd->output_file, arena);
+  out->quoted = false;
+  return !arith_failed;
+}
+
+// runs a builtin in a child, used for builtins inside pipelines that are not
+// the stage run by the shell itself
+int rsh_fork_builtin(const Builtin *bi, char **argv, const SpawnOpts *opts,
+                     pid_t *pid) {
+  *pid = fork();
+  if (*pid < 0)
+    return errno;
+  if (*pid == 0) {
+    rsh_trace_forked(argv[0]);
+    if (rsh_child_setup(opts)) {
+      perror("rsh: dup2");
+      _exit(EXIT_FAILURE);
+    }
+    if (opts->envp) // name=value in front of it
+      rsh_vars_import(opts->envp);
+    BuiltinIO io = {STDIN_FILENO, STDOUT_FILENO};
+    long long start = TRACING ? rsh_trace_now() : 0;
+    int status = bi->fn(argv, &io);
+    if (TRACING) {
+      rsh_trace_span(trace_pid, "builtin", argv[0], start, rsh_trace_now(),
+                     NULL);
+      rsh_trace_flush();
+    }
+    _exit(status);
+  }
+  return 0;
+}
+
+// F_SETPIPE_SZ, 0 leaves the kernel default. unprivileged users are capped
+// by /proc/sys/fs/pipe-max-size, which is reported once per pipeline
+void rsh_set_pipe_size(int fd, long size, bool *warned) {
+  if (size == 0)
+    return;
+  if (fcntl(fd, F_SETPIPE_SZ, size > INT_MAX ? INT_MAX : (int)size) == -1 &&
+      !*warned) {
+    fprintf(stderr, "rsh: pipe size %ld: %s\n", size, strerror(errno));
+    *warned = true;
+  }
+}
+
+// splits the link after stage i: a meter reads the stage's pipe and feeds a
+// new one, whose read end is returned for the next stage. on failure the
+// link is left unmetered
+int rsh_start_meter(Job *job, int i, int from, LinkStats *st,
+                    long pipe_size) {
+  int to[2];
+  if (pipe2(to, O_CLOEXEC) == -1)
+    return from;
+  bool warned = true; // the stage's own pipe already complained
+  rsh_set_pipe_size(to[1], pipe_size, &warned);
+
+  Process *proc = &job->procs[job->nstages + i];
+  SpawnOpts opts = {-1, -1, NULL, 0, job_control ? job->pgid : -1, false,
+                    NULL};
+  clock_gettime(CLOCK_MONOTONIC, &proc->start);
+  proc->pid = fork();
+  if (proc->pid < 0) {
+    proc->pid = 0;
+    proc->done = true;
+    close(to[0]);
+    close(to[1]);
+    return from;
+  }
+
+  if (proc->pid == 0) {
+    rsh_trace_forked("meter");
+    rsh_child_setup(&opts); // SIGPIPE back to default: a meter dies like cat
+    close(to[0]);
+    rsh_meter(from, to[1], st);
+    rsh_trace_flush();
+    _exit(0);
+  }
+
+  if (job_control)
+    setpgid(proc->pid, job->pgid);
+  close(from);
+  close(to[1]);
+  return to[0];
+}
+
+#define RSH_BATCH_MIN (512 * 1024)      // first input cut per |@N run
+#define RSH_BATCH_MAX (8 * 1024 * 1024) // cuts double every n runs up to this
+#define RSH_BATCH_READ (64 * 1024)  // output read from a run at once
+
+// one run of a |@N stage's program over one batch of its input
+struct {
+  bool used;
+  unsigned long seq; // position of the batch in the input
+  pid_t pid;
+  int in, out;       // our ends of its stdin and stdout, -1 once closed
+  char *data;        // the batch, given back once written
+  size_t cap, len, off;
+  char *buf;         // output not written yet
+  size_t buf_len, buf_cap;
+  int status;
+} typedef Batch;
+
+// the stage's exit status over all batches: a filter that matched nothing in
+// one batch (grep's 1) is fine if another batch matched, a real failure or a
+// signal wins
+int rsh_batch_status(int status, int prev, bool first) {
+  int code = WIFSIGNALED(status) ? 128 + WTERMSIG(status)
+                                 : WEXITSTATUS(status);
+  if (first)
+    return code;
+  if (code > 1 || prev > 1)
+    return code > prev ? code : prev;
+  return code < prev ? code : prev;
+}
+
+// writes what the batch may hand on: everything in order once it is at the
+// head, complete records as they come when unordered, the rest at its end
+void rsh_batch_emit(Batch *b, bool unordered, char delim,
+                    unsigned long head) {
+  size_t n = b->buf_len;
+  if (!unordered && b->seq != head)
+    return;
+  if (unordered && b->out != -1) {
+    while (n > 0 && b->buf[n - 1] != delim)
+      n--;
+  }
+  if (n == 0)
+    return;
+  if (!rsh_write_all(STDOUT_FILENO, b->buf, n)) {
+    if (errno == EPIPE) { // the next stage is gone, leave as cat would
+      signal(SIGPIPE, SIG_DFL);
+      raise(SIGPIPE);
+    }
+    perror("rsh: replicas: write");
+    _exit(1);
+  }
+  memmove(b->buf, b->buf + n, b->buf_len - n);
+  b->buf_len -= n;
+}
+
+// the body of a |@N stage: stdin is cut into batches on record boundaries,
+// small first so every replica starts soon, then larger to pay for fewer
+// program starts, each batch runs through a fresh copy of argv with at
+// most n running at once, and their output is merged onto stdout in input
+// order (or as it comes with REPLICA_UNORDERED). a program that keeps state
+// across records (sort, wc, uniq) sees one batch at a time, not the stream
+int rsh_replicate(char **argv, int n, int flags) {
+  bool unordered = flags & REPLICA_UNORDERED;
+  char delim = flags & REPLICA_NUL ? '\0' : '\n';
+  int nslots = unordered ? n : 2 * n; // ordered output may wait on the head
+  Batch *slots = calloc(nslots, sizeof(Batch));
+  struct pollfd *fds = malloc(sizeof(struct pollfd) * (2 * nslots + 1));
+  Batch **owner = malloc(sizeof(Batch *) * (2 * nslots + 1));
+  size_t batch = RSH_BATCH_MIN, in_cap = 2 * batch, in_len = 0;
+  char *in_buf = malloc(in_cap);
+  char *spare = NULL; // a written batch's buffer, reused for the next cut
+  size_t spare_cap = 0;
+  if (!slots || !fds || !owner || !in_buf)
+    exit(EXIT_FAILURE);
+  signal(SIGPIPE, SIG_IGN); // a replica may exit before reading its batch
+
+  unsigned long head = 0, next = 0; // oldest batch not written, next to cut
+  int running = 0, busy = 0, status = 0;
+  int failed = 0; // the status when a batch could not be started
+  bool eof = false, any = false;
+  while (!eof || in_len > 0 || busy > 0) {
+    // cut and start batches while there is room
+    while (running < n && (in_len >= batch || (eof && in_len > 0))) {
+      size_t cut = in_len;
+      if (!eof) {
+        while (cut > 0 && in_buf[cut - 1] != delim)
+          cut--;
+        if (cut == 0) { // a record longer than the buffer
+          if (in_len < in_cap)
+            break;
+          in_cap *= 2;
+          if (!(in_buf = realloc(in_buf, in_cap)))
+            exit(EXIT_FAILURE);
+          break;
+        }
+      }
+      Batch *b = NULL;
+      for (int i = 0; i < nslots && !b; i++)
+        b = slots[i].used ? NULL : &slots[i];
+      if (!b)
+        break;
+
+      int to[2], from[2];
+      int err = pipe2(to, O_CLOEXEC) == -1 ? errno : 0;
+      if (!err && pipe2(from, O_CLOEXEC) == -1) {
+        err = errno;
+        close(to[0]);
+        close(to[1]);
+      }
+      if (err) {
+        fprintf(stderr, "rsh: replicas: pipe: %s\n", strerror(err));
+        failed = 1;
+      } else {
+        SpawnOpts opts = {to[0], from[1], NULL, 0, -1, false, NULL};
+        err = rsh_spawn_cmd(argv, &opts, &b->pid);
+        close(to[0]);
+        close(from[1]);
+        if (err) {
+          fprintf(stderr, "rsh: %s: %s\n", argv[0], strerror(err));
+          close(to[1]);
+          close(from[0]);
+          failed = err == ENOENT ? 127 : 126;
+        }
+      }
+      if (failed) {
+        // no more batches: the running ones finish and what they wrote
+        // still goes out, in order, before the stage fails
+        eof = true;
+        in_len = 0;
+        break;
+      }
+      fcntl(to[1], F_SETFL, O_NONBLOCK);
+      fcntl(to[1], F_SETPIPE_SZ, RSH_BATCH_MIN); // fewer wakeups per batch
+      fcntl(from[0], F_SETPIPE_SZ, RSH_BATCH_MIN);
+
+      // the batch takes the buffer, the partial record moves to a new one
+      char *rest = spare_cap == in_cap ? spare : malloc(in_cap);
+      if (!rest)
+        exit(EXIT_FAILURE);
+      if (rest == spare)
+        spare = NULL, spare_cap = 0;
+      memcpy(rest, in_buf + cut, in_len - cut);
+      b->used = true;
+      b->seq = next++;
+      b->in = to[1];
+      b->out = from[0];
+      b->data = in_buf;
+      b->cap = in_cap;
+      b->len = cut;
+      b->off = 0;
+      b->buf_len = 0;
+      in_buf = rest;
+      in_len -= cut;
+      running++;
+      busy++;
+      if (next % n == 0 && batch < RSH_BATCH_MAX) {
+        batch *= 2;
+        in_cap = 2 * batch;
+        if (!(in_buf = realloc(in_buf, in_cap)))
+          exit(EXIT_FAILURE);
+      }
+    }
+
+    int nfds = 0;
+    if (!eof && in_len < in_cap && (in_len < batch || running < n)) {
+      owner[nfds] = NULL;
+      fds[nfds++] = (struct pollfd){STDIN_FILENO, POLLIN, 0};
+    }
+    for (int i = 0; i < nslots; i++) {
+      Batch *b = &slots[i];
+      if (b->used && b->in != -1) {
+        owner[nfds] = b;
+        fds[nfds++] = (struct pollfd){b->in, POLLOUT, 0};
+      }
+      if (b->used && b->out != -1) {
+        owner[nfds] = b;
+        fds[nfds++] = (struct pollfd){b->out, POLLIN, 0};
+      }
+    }
+    if (nfds > 0 && poll(fds, nfds, -1) == -1) {
+      if (errno == EINTR)
+        continue;
+      perror("rsh: replicas: poll");
+      return 1;
+    }
+
+    for (int i = 0; i < nfds; i++) {
+      Batch *b = owner[i];
+      if (!fds[i].revents)
+        continue;
+      if (!b) {
+        ssize_t got = read(STDIN_FILENO, in_buf + in_len, in_cap - in_len);
+        if (got > 0)
+          in_len += got;
+        else if (got == 0 || errno != EINTR)
+          eof = true;
+      } else if (fds[i].fd == b->in) {
+        ssize_t put = write(b->in, b->data + b->off, b->len - b->off);
+        if (put > 0)
+          b->off += put;
+        if (b->off == b->len || (put == -1 && errno != EAGAIN &&
+                                 errno != EINTR)) {
+          close(b->in); // EOF for the replica
+          b->in = -1;
+          if (b->cap == in_cap && !spare) {
+            spare = b->data;
+            spare_cap = b->cap;
+          } else {
+            free(b->data);
+          }
+          b->data = NULL;
+        }
+      } else {
+        if (b->buf_cap - b->buf_len < RSH_BATCH_READ) {
+          b->buf_cap = b->buf_cap ? 2 * b->buf_cap : 4 * RSH_BATCH_READ;
+          if (!(b->buf = realloc(b->buf, b->buf_cap)))
+            exit(EXIT_FAILURE);
+        }
+        ssize_t got = read(b->out, b->buf + b->buf_len, b->buf_cap - b->buf_len);
+        if (got > 0) {
+          b->buf_len += got;
+        } else if (got == 0 || errno != EINTR) {
+          close(b->out);
+          b->out = -1;
+          int ws;
+          pid_t reaped;
+          while ((reaped = waitpid(b->pid, &ws, 0)) == -1 && errno == EINTR)
+            ;
+          if (reaped == -1) // no status to be had, count the run as failed
+            ws = W_EXITCODE(1, 0);
+          status = rsh_batch_status(ws, status, !any);
+          any = true;
+          running--;
+        }
+        rsh_batch_emit(b, unordered, delim, head);
+      }
+    }
+
+    // retire finished batches, in input order unless unordered
+    bool retired;
+    do {
+      retired = false;
+      for (int i = 0; i < nslots; i++) {
+        Batch *b = &slots[i];
+        if (!b->used || (!unordered && b->seq != head))
+          continue;
+        rsh_batch_emit(b, unordered, delim, head);
+        if (b->in != -1 || b->out != -1)
+          continue;
+        b->used = false;
+        busy--;
+        if (!unordered) {
+          head++;
+          retired = true;
+        }
+      }
+    } while (retired);
+  }
+  return failed ? failed : status;
+}
+
+// forks the process that runs a |@N stage in place of the program
+int rsh_fork_replicas(Command *cmd, const SpawnOpts *opts, pid_t *pid) {
+  *pid = fork();
+  if (*pid < 0)
+    return errno;
+  if (*pid == 0) {
+    rsh_trace_forked("replicas");
+    if (rsh_child_setup(opts)) {
+      perror("rsh: dup2");
+      _exit(EXIT_FAILURE);
+    }
+    if (opts->envp)
+      rsh_vars_import(opts->envp);
+    int status = rsh_replicate(cmd->argv, cmd->replicas, cmd->replica_flags);
+    rsh_trace_flush();
+    _exit(status);
+  }
+  return 0;
+}
+
+// one command of parallel: its argument, its captured stdout and how it went
+struct {
+  char *arg;
+  pid_t pid;
+  int out;    // read end of its stdout, -1 once at EOF
+  StrBuf buf; // stdout not written yet
+  struct timespec start, end;
+  struct rusage ru;
+  int status;
+  bool reaped; // status and ru are in
+  bool done;   // reaped and at EOF, its slot is free
+} typedef ParJob;
+
+// the argv of one job: {} in any word becomes arg, without any {} the arg is
+// appended. words are malloc'ed, the array ends up in *argv
+void rsh_par_argv(char **tmpl, int n, const char *arg, char ***argv) {
+  char **out = malloc(sizeof(char *) * (n + 2));
+  if (!out)
+    exit(EXIT_FAILURE);
+  bool placed = false;
+  for (int i = 0; i < n; i++) {
+    StrBuf word = {0};
+    const char *s = tmpl[i], *hole;
+    while ((hole = strstr(s, "{}"))) {
+      sb_write(&word, s, hole - s);
+      sb_puts(&word, arg);
+      s = hole + 2;
+      placed = true;
+    }
+    sb_puts(&word, s);
+    out[i] = word.data;
+  }
+  if (!placed && !(out[n++] = strdup(arg)))
+    exit(EXIT_FAILURE);
+  out[n] = NULL;
+  *argv = out;
+}
+
+void rsh_par_argv_free(char **argv) {
+  for (int i = 0; argv[i]; i++)
+    free(argv[i]);
+  free(argv);
+}
+
+int rsh_cmp_long(const void *a, const void *b) {
+  long x = *(const long *)a, y = *(const long *)b;
+  return (x > y) - (x < y);
+}
+
+// parallel -t: the makespan against the time the jobs kept slots busy, then
+// the spread of job times and the slowest jobs
+void rsh_par_report(ParJob *jobs, unsigned long njobs, int slots,
+                           int failed, long makespan_us) {
+  long *walls = malloc(sizeof(long) * (njobs ? njobs : 1));
+  if (!walls)
+    exit(EXIT_FAILURE);
+  long busy = 0, user = 0, sys = 0;
+  for (unsigned long i = 0; i < njobs; i++) {
+    walls[i] = jobs[i].pid ? rsh_elapsed_us(&jobs[i].start, &jobs[i].end) : 0;
+    busy += walls[i];
+    user += rsh_tv_us(jobs[i].ru.ru_utime);
+    sys += rsh_tv_us(jobs[i].ru.ru_stime);
+  }
+
+  char a[16], b[16], c[16], d[16];
+  OutBuf o = {.fd = STDERR_FILENO};
+  out_printf(&o, "parallel: %lu jobs on %d slots, %d failed\n", njobs, slots,
+             failed);
+  out_printf(&o, "  makespan %s  busy %s (%.2f slots)  user %s  sys %s\n",
+             rsh_fmt_us(a, sizeof(a), makespan_us),
+             rsh_fmt_us(b, sizeof(b), busy),
+             makespan_us ? (double)busy / makespan_us : 0.0,
+             rsh_fmt_us(c, sizeof(c), user), rsh_fmt_us(d, sizeof(d), sys));
+  if (njobs > 0) {
+    // the slowest few first, then the spread from the sorted times
+    out_puts(&o, "  slowest:");
+    for (int k = 0; k < 3 && (unsigned long)k < njobs; k++) {
+      unsigned long worst = 0;
+      for (unsigned long i = 1; i < njobs; i++) {
+        if (walls[i] > walls[worst])
+          worst = i;
+      }
+      out_printf(&o, "%s %s %s", k ? ";" : "",
+                 rsh_fmt_us(a, sizeof(a), walls[worst]), jobs[worst].arg);
+      walls[worst] = -1 - walls[worst]; // taken, restored below
+    }
+    out_putc(&o, '\n');
+    for (unsigned long i = 0; i < njobs; i++) {
+      if (walls[i] < 0)
+        walls[i] = -1 - walls[i];
+    }
+    qsort(walls, njobs, sizeof(long), rsh_cmp_long);
+    out_printf(&o, "  job min %s  avg %s  p99 %s  max %s\n",
+               rsh_fmt_us(a, sizeof(a), walls[0]),
+               rsh_fmt_us(b, sizeof(b), busy / (long)njobs),
+               rsh_fmt_us(c, sizeof(c), walls[(njobs * 99 + 99) / 100 - 1]),
+               rsh_fmt_us(d, sizeof(d), walls[njobs - 1]));
+  }
+  out_flush(&o);
+  free(walls);
+}
+
+// parallel [-j N] [-k] [-t] command [word ...] [::: arg ...]: runs command
+// once per arg (from ::: or one per line of stdin) with N at a time, by
+// default as many as the CPUs the shell may run on. a new job starts as soon
+// as one exits, each job's stdout is written in one piece when it ends (in
+// arg order with -k; stderr is not held back) and -t reports the makespan and
+// job times. the status is the number of failed jobs, 101 at most
+int bi_parallel(char **argv, BuiltinIO *io) {
+  int slots = 0;
+  bool keep_order = false, report = false;
+  int i = 1;
+  for (; argv[i] && argv[i][0] == '-' && argv[i][1]; i++) {
+    if (!strcmp(argv[i], "-k")) {
+      keep_order = true;
+    } else if (!strcmp(argv[i], "-t")) {
+      report = true;
+    } else if (!strncmp(argv[i], "-j", 2) && (argv[i][2] || argv[i + 1])) {
+      // -j N or -jN
+      const char *n = argv[i][2] ? argv[i] + 2 : argv[++i];
+      char *end;
+      slots = strtol(n, &end, 10);
+      if (end == n || *end || slots < 1)
+        slots = -1;
+    } else {
+      slots = -1;
+    }
+    if (slots == -1)
+      break;
+  }
+  char **tmpl = argv + i;
+  int ntmpl = 0;
+  while (tmpl[ntmpl] && strcmp(tmpl[ntmpl], ":::"))
+    ntmpl++;
+  if (slots == -1 || ntmpl == 0) {
+    fprintf(stderr, "rsh: parallel: usage: parallel [-j N] [-k] [-t] command "
+                    "[word ...] [::: arg ...]\n");
+    return 2;
+  }
+  if (slots == 0) {
+    cpu_set_t cpus;
+    slots = sched_getaffinity(0, sizeof(cpus), &cpus) == 0 ? CPU_COUNT(&cpus)
+                                                           : 1;
+  }
+
+  // args from ::: are taken as they are, lines of stdin are copied
+  char **list = tmpl[ntmpl] ? tmpl + ntmpl + 1 : NULL;
+  StrBuf lines = {0};
+  bool in_eof = list != NULL;
+
+  ParJob *jobs = NULL;
+  unsigned long njobs = 0, cap = 0, head = 0; // head: next to write with -k
+  int running = 0, failed = 0;
+  bool stop = false; // ^C: no new jobs
+  int *run = calloc(slots, sizeof(int)); // jobs index + 1 per slot, 0 free
+  struct pollfd *fds = malloc(sizeof(struct pollfd) * (slots + 2));
+  if (!run || !fds)
+    exit(EXIT_FAILURE);
+  int null_fd = list ? -1 : open("/dev/null", O_RDONLY | O_CLOEXEC);
+
+  struct timespec started, now;
+  clock_gettime(CLOCK_MONOTONIC, &started);
+  while (true) {
+    // start jobs while slots are free and args are at hand
+    while (!stop && running < slots) {
+      char *arg = NULL;
+      if (list) {
+        if (*list)
+          arg = *list++;
+      } else {
+        char *nl = lines.len ? memchr(lines.data, '\n', lines.len) : NULL;
+        if (nl || (in_eof && lines.len)) {
+          size_t len = nl ? (size_t)(nl - lines.data) : lines.len;
+          arg = strndup(lines.data, len);
+          if (!arg)
+            exit(EXIT_FAILURE);
+          size_t used = nl ? len + 1 : len;
+          memmove(lines.data, lines.data + used, lines.len - used);
+          lines.len -= used;
+        }
+      }
+      if (!arg)
+        break;
+
+      if (njobs == cap) {
+        cap = cap ? 2 * cap : 64;
+        if (!(jobs = realloc(jobs, sizeof(ParJob) * cap)))
+          exit(EXIT_FAILURE);
+      }
+      ParJob *job = &jobs[njobs++];
+      memset(job, 0, sizeof(*job));
+      job->arg = arg;
+      job->out = -1;
+
+      int pipefd[2];
+      char **job_argv;
+      rsh_par_argv(tmpl, ntmpl, arg, &job_argv);
+      int err = pipe2(pipefd, O_CLOEXEC) == -1 ? errno : 0;
+      if (!err) {
+        SpawnOpts opts = {list ? -1 : null_fd, pipefd[1], NULL, 0, -1, false,
+                          NULL};
+        clock_gettime(CLOCK_MONOTONIC, &job->start);
+        err = rsh_spawn_cmd(job_argv, &opts, &job->pid);
+        close(pipefd[1]);
+        if (err)
+          close(pipefd[0]);
+      }
+      if (err) {
+        fprintf(stderr, "rsh: parallel: %s: %s\n", job_argv[0], strerror(err));
+        job->pid = 0;
+        job->done = true;
+        job->status = W_EXITCODE(err == ENOENT ? 127 : 126, 0);
+        failed++;
+      } else {
+        job->out = pipefd[0];
+        for (int s = 0; s < slots; s++) {
+          if (!run[s]) {
+            run[s] = njobs;
+            break;
+          }
+        }
+        running++;
+      }
+      rsh_par_argv_free(job_argv);
+    }
+
+    // write what is complete: finished jobs as they end, or in order
+    for (; keep_order && head < njobs && jobs[head].done; head++) {
+      if (jobs[head].buf.len &&
+          !rsh_write_all(io->out, jobs[head].buf.data, jobs[head].buf.len))
+        stop = true;
+      free(jobs[head].buf.data);
+      jobs[head].buf = (StrBuf){0};
+    }
+
+    bool want_input = !in_eof && !stop && running < slots;
+    if (running == 0 && !want_input)
+      break;
+
+    // a job's EOF and its exit come apart (exec >&- say), so sleep on both
+    int nfds = 0;
+    for (int s = 0; s < slots; s++) {
+      if (run[s] && jobs[run[s] - 1].out != -1)
+        fds[nfds++] = (struct pollfd){jobs[run[s] - 1].out, POLLIN, 0};
+    }
+    fds[nfds++] = (struct pollfd){sigchld_fd, POLLIN, 0};
+    if (want_input)
+      fds[nfds++] = (struct pollfd){io->in, POLLIN, 0};
+    if (poll(fds, nfds, -1) == -1) {
+      if (errno == EINTR)
+        continue;
+      perror("rsh: parallel: poll");
+      break;
+    }
+
+    char chunk[RSH_BATCH_READ];
+    if (want_input && fds[nfds - 1].revents) {
+      ssize_t got = read(io->in, chunk, sizeof(chunk));
+      if (got > 0)
+        sb_write(&lines, chunk, got);
+      else if (got == 0 || errno != EINTR)
+        in_eof = true;
+    }
+    for (int s = 0, k = 0; s < slots; s++) {
+      if (!run[s] || jobs[run[s] - 1].out == -1)
+        continue;
+      ParJob *job = &jobs[run[s] - 1];
+      if (!fds[k++].revents)
+        continue;
+      ssize_t got = read(job->out, chunk, sizeof(chunk));
+      if (got > 0) {
+        sb_write(&job->buf, chunk, got);
+      } else if (got == 0 || errno != EINTR) {
+        close(job->out);
+        job->out = -1;
+      }
+    }
+
+    // drained before the wait4s, so an exit after them wakes the next poll
+    struct signalfd_siginfo info;
+    while (read(sigchld_fd, &info, sizeof(info)) == sizeof(info))
+      ;
+    for (int s = 0; s < slots; s++) {
+      if (!run[s])
+        continue;
+      ParJob *job = &jobs[run[s] - 1];
+      if (!job->reaped) {
+        int ws;
+        pid_t got = wait4(job->pid, &ws, WNOHANG, &job->ru);
+        if (got == 0 || (got == -1 && errno == EINTR))
+          continue;
+        if (got == -1) // not ours to wait for after all
+          ws = W_EXITCODE(127, 0);
+        clock_gettime(CLOCK_MONOTONIC, &job->end);
+        job->status = ws;
+        job->reaped = true;
+        if (!WIFEXITED(ws) || WEXITSTATUS(ws) != 0)
+          failed++;
+        if (WIFSIGNALED(ws) && WTERMSIG(ws) == SIGINT)
+          stop = true;
+        if (opt_timing)
+          rsh_stats_record(tmpl[0], false,
+                           rsh_elapsed_us(&job->start, &job->end), &job->ru);
+      }
+      if (job->out != -1)
+        continue; // exited, but something it started still has the pipe
+
+      job->done = true;
+      run[s] = 0;
+      running--;
+      if (!keep_order) {
+        if (job->buf.len &&
+            !rsh_write_all(io->out, job->buf.data, job->buf.len))
+          stop = true;
+        free(job->buf.data);
+        job->buf = (StrBuf){0};
+      }
+    }
+  }
+  clock_gettime(CLOCK_MONOTONIC, &now);
+
+  if (report)
+    rsh_par_report(jobs, njobs, slots, failed,
+                   rsh_elapsed_us(&started, &now));
+  for (unsigned long j = 0; j < njobs; j++) {
+    free(jobs[j].buf.data);
+    if (!list)
+      free(jobs[j].arg);
+  }
+  free(jobs);
+  free(lines.data);
+  free(run);
+  free(fds);
+  if (null_fd != -1)
+    close(null_fd);
+  return failed > 101 ? 101 : failed;
+}
+
+// runs a single builtin (or a redirect-only command) inside the shell,
+// returns its exit status
+int rsh_launch(Command *cmd, const Builtin *bi) {
+  int in_fd, out_fd;
+  if (rsh_open_redirects(cmd, &in_fd, &out_fd) == -1)
+    return 1;
+
+  int status = 0; // a command that is only redirects just creates the files
+  if (bi) {
+    // builtins run in the shell on the redirected fds
+    BuiltinIO io = {in_fd != -1 ? in_fd : STDIN_FILENO,
+                    out_fd != -1 ? out_fd : STDOUT_FILENO};
+    long long start = TRACING ? rsh_trace_now() : 0;
+    status = bi->fn(cmd->argv, &io);
+    if (TRACING)
+      rsh_trace_span(trace_pid, "builtin", cmd->argv[0], start,
+                     rsh_trace_now(), NULL);
+  }
+
+  if (in_fd != -1)
+    close(in_fd);
+  if (out_fd != -1)
+    close(out_fd);
+  return status;
+}
+
+#define RSH_FUNC_BUCKETS 64 // power of two
+#define RSH_FUNC_CHUNK 1024 // arena chunk of a function body
+#define RSH_FUNC_DEPTH 1000 // calls in progress, a runaway recursion fails
+
+// a defined function owns a copy of its body and the body's code
+struct Func {
+  char *name;
+  Node *body;
+  struct Code *code;
+  Arena arena;
+  int refs;  // calls running it
+  bool dead; // redefined or unset while running, freed by the last call
+  struct Func *next;
+} typedef Func;
+
+Func *func_table[RSH_FUNC_BUCKETS];
+int nfuncs;
+int func_depth; // calls in progress
+
+uint64_t rsh_hash64(const char *s, size_t len); // PLAN CACHE, near the end
+
+Func **rsh_func_slot(const char *name) {
+  Func **slot =
+      &func_table[rsh_hash64(name, strlen(name)) & (RSH_FUNC_BUCKETS - 1)];
+  while (*slot && strcmp((*slot)->name, name))
+    slot = &(*slot)->next;
+  return slot;
+}
+
+// a script without functions pays one compare per command
+Func *rsh_find_func(const char *name) {
+  return nfuncs ? *rsh_func_slot(name) : NULL;
+}
+
+void rsh_func_unlink(Func **slot);
+
+bool rsh_unset_func(const char *name) {
+  Func **slot = rsh_func_slot(name);
+  if (!*slot)
+    return false;
+  rsh_func_unlink(slot);
+  return true;
+}
+
+int bi_call_func(char **argv, BuiltinIO *io);
+
+// how the executor sees a function: a state-changing builtin, run in the
+// shell on its own and forked inside pipelines
+Builtin func_builtin = {"function", bi_call_func, true, false};
+
+// a pure list of name=value words sets variables and runs nothing
+bool rsh_assign_words(const Command *raw, const Command *cmd) {
+  if (cmd->argc == 0 || cmd->nassigns || cmd->input_file || cmd->output_file)
+    return false;
+  for (int i = 0; i < cmd->argc; i++) {
+    if (!rsh_assignment(raw->argv[i]))
+      return false;
+  }
+  for (int i = 0; i < cmd->argc; i++) {
+    char *eq = strchr(cmd->argv[i], '=');
+    *eq = '\0';
+    rsh_var_set(cmd->argv[i], eq + 1);
+    *eq = '=';
+  }
+  return true;
+}
+
+// name=value cmd: the words go to cmd's environment alone
+void rsh_split_assigns(const Command *raw, Command *cmd) {
+  int n = 0;
+  while (n < cmd->argc && rsh_assignment(raw->argv[n]))
+    n++;
+  if (n == 0 || n == cmd->argc)
+    return;
+  cmd->assigns = cmd->argv;
+  cmd->nassigns = n;
+  cmd->argv += n;
+  cmd->argc -= n;
+  cmd->resolved = false; // the plan looked at the first assignment
+}
+
+// runs a pipeline as a job. a foreground job is waited for and its exit
+// status (the last command's) returned, a background job returns 0 at once.
+// pipes are made one stage at a time, so the shell never holds more than the
+// previous stage's read end and the next pipe, and they are close-on-exec so
+// spawned children start with only their own stdin and stdout
+int rsh_execute_pipeline(Pipeline *pipeline, bool background) {
+  int num_commands = pipeline->count;
+  Command *stages = arena_alloc(&exec_arena, sizeof(Command) * num_commands);
+  const Builtin **builtins =
+      arena_alloc(&exec_arena, sizeof(Builtin *) * num_commands);
+
+  subst_status = 0;
+  for (int i = 0; i < num_commands; i++) {
+    if (!rsh_expand_cmd(pipeline->commands[i], &stages[i], &exec_arena)) {
+      rsh_pipestatus_reset(1);
+      pipe_stages[0].status = 1;
+      return 1;
+    }
+    rsh_split_assigns(pipeline->commands[i], &stages[i]);
+    // a replicated stage runs its program once per batch, never a builtin.
+    // a cached plan has looked the builtin up already, but functions come
+    // first
+    if (nfuncs && stages[i].argv[0] && stages[i].replicas < 2 &&
+        rsh_find_func(stages[i].argv[0]))
+      builtins[i] = &func_builtin;
+    else if (stages[i].resolved)
+      builtins[i] = stages[i].builtin;
+    else
+      builtins[i] = stages[i].argv[0] && stages[i].replicas < 2
+                        ? rsh_find_builtin(stages[i].argv)
+                        : NULL;
+  }
+
+  if (num_commands == 1 && !background &&
+      rsh_assign_words(pipeline->commands[0], &stages[0])) {
+    rsh_pipestatus_reset(1);
+    pipe_stages[0].status = subst_status;
+    return subst_status;
+  }
+
+  bool timing = opt_timing || pipeline->timed;
+  struct timespec started, ended;
+  clock_gettime(CLOCK_MONOTONIC, &started);
+
+  // no pipe: builtins and bare redirects never leave the shell
+  if (num_commands == 1 && !background &&
+      (builtins[0] || stages[0].argv[0] == NULL)) {
+    Process self = {0};
+    if (timing)
+      rsh_mark(&self);
+    SavedVar *saved = stages[0].nassigns ? rsh_vars_push(stages[0].assigns,
+                                                         stages[0].nassigns,
+                                                         &exec_arena)
+                                         : NULL;
+    int status = rsh_launch(&stages[0], builtins[0]);
+    if (saved)
+      rsh_vars_pop(saved, stages[0].nassigns);
+    rsh_pipestatus_reset(1);
+    pipe_stages[0].status = status;
+    if (timing) {
+      rsh_mark_end(&self);
+      pipe_stages[0].ru = self.ru;
+      pipe_stages[0].wall_us = rsh_elapsed_us(&self.start, &self.end);
+      rsh_time_pipeline(stages, 1, pipeline->timed, pipe_stages[0].wall_us);
+    }
+    return status;
+  }
+
+  // one builtin stage can run in the shell itself: the last one (it reads
+  // what the others write), else the first one (it runs once every reader
+  // exists). other builtin stages and state-changing ones are forked. with
+  // job control every stage is a child so ^Z can stop the whole pipeline
+  bool analyze = rsh_analyze && !background && num_commands > 1;
+  int in_shell = -1;
+  if (!background && !job_control && !analyze && num_commands > 1) {
+    if (builtins[num_commands - 1] && !builtins[num_commands - 1]->special)
+      in_shell = num_commands - 1;
+    else if (builtins[0] && !builtins[0]->special)
+      in_shell = 0;
+  }
+
+  StrBuf text = {0};
+  for (int i = 0; i < num_commands; i++) {
+    if (i > 0)
+      sb_puts(&text, " | ");
+    rsh_cmd_text(pipeline->commands[i], &text);
+  }
+  // ANALYZE puts a meter on each of the n - 1 links, tracked after the
+  // stages as extra processes of the job
+  int nlinks = analyze ? num_commands - 1 : 0;
+  LinkStats *links = NULL;
+  if (analyze) {
+    links = mmap(NULL, sizeof(LinkStats) * nlinks, PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (links == MAP_FAILED) {
+      perror("rsh: mmap");
+      links = NULL;
+      nlinks = 0;
+      analyze = false;
+    }
+  }
+  Job *job = rsh_job_new(num_commands + nlinks, text.data, background);
+  job->nstages = num_commands;
+
+  int prev_read = -1; // read end of the pipe into stage i
+  int shell_in = -1, shell_out = -1;
+  bool run_in_shell = false;
+  bool size_warned = false;
+
+  for (int i = 0; i < num_commands; i++) {
+    Command *cmd = &stages[i];
+    Process *proc = &job->procs[i];
+
+    int pipefd[2] = {-1, -1}; // stage i -> stage i + 1
+    if (i < num_commands - 1 && pipe2(pipefd, O_CLOEXEC) == -1) {
+      fprintf(stderr, "rsh: pipe for command %d: %s\n", i, strerror(errno));
+      // started stages see EOF, the rest never run
+      for (int j = i; j < num_commands; j++) {
+        job->procs[j].done = true;
+        job->procs[j].status = W_EXITCODE(1, 0);
+      }
+      if (prev_read != -1 && prev_read != shell_in)
+        close(prev_read);
+      break;
+    }
+    long pipe_size = 0;
+    if (pipefd[0] != -1) {
+      pipe_size = pipeline->pipe_sizes && pipeline->pipe_sizes[i]
+                      ? pipeline->pipe_sizes[i]
+                      : opt_pipesize;
+      rsh_set_pipe_size(pipefd[1], pipe_size, &size_warned);
+    }
+
+    int in_fd, out_fd;
+    bool opened = rsh_open_redirects(cmd, &in_fd, &out_fd) != -1;
+
+    // stage i reads pipe i-1 and writes pipe i unless a file redirect wins
+    SpawnOpts opts = {0};
+    opts.in_fd = in_fd != -1 ? in_fd : prev_read;
+    opts.out_fd = out_fd != -1 ? out_fd : pipefd[1];
+    opts.pgid = job_control ? job->pgid : -1;
+    opts.foreground = !background;
+    if (cmd->nassigns)
+      opts.envp = rsh_envp_with(cmd->assigns, cmd->nassigns, &exec_arena);
+
+    int err = 0;
+    if (!opened) {
+      // this stage is skipped, its neighbours see EOF/EPIPE
+      proc->done = true;
+      proc->status = W_EXITCODE(1, 0);
+    } else if (i == in_shell) {
+      // started after every other stage is running
+      run_in_shell = true;
+      shell_in = opts.in_fd;
+      shell_out = opts.out_fd;
+    } else if (cmd->argv[0] == NULL) {
+      // redirect-only stage, nothing to run
+      proc->done = true;
+    } else if (builtins[i] || cmd->replicas > 1) {
+      clock_gettime(CLOCK_MONOTONIC, &proc->start);
+      // a forked builtin never execs, so it drops what the shell holds by hand
+      int close_fds[] = {prev_read, pipefd[0], pipefd[1], shell_out, in_fd,
+                         out_fd};
+      opts.close_fds = close_fds;
+      opts.nclose = sizeof(close_fds) / sizeof(close_fds[0]);
+      err = builtins[i]
+                ? rsh_fork_builtin(builtins[i], cmd->argv, &opts, &proc->pid)
+                : rsh_fork_replicas(cmd, &opts, &proc->pid);
+    } else {
+      clock_gettime(CLOCK_MONOTONIC, &proc->start);
+      err = cmd->path ? rsh_spawn(cmd->path, cmd->argv, &opts, &proc->pid)
+                      : ENOENT;
+      if (err == ENOENT) // not resolved, or gone since the plan was made
+        err = rsh_spawn_cmd(cmd->argv, &opts, &proc->pid);
+    }
+
+    if (err) {
+      fprintf(stderr, "rsh: %s: %s\n", cmd->argv[0], strerror(err));
+      proc->pid = 0;
+      proc->done = true;
+      proc->status = W_EXITCODE(err == ENOENT ? 127 : 126, 0);
+    } else if (proc->pid > 0 && job_control) {
+      // the parent sets the group too, whichever runs first wins the race
+      if (job->pgid == 0)
+        job->pgid = proc->pid;
+      setpgid(proc->pid, job->pgid);
+      if (!background)
+        tcsetpgrp(STDIN_FILENO, job->pgid);
+    }
+
+    // keep only what the in-shell stage still needs and the next stage's
+    // input
+    if (in_fd != -1 && in_fd != shell_in)
+      close(in_fd);
+    if (out_fd != -1 && out_fd != shell_out)
+      close(out_fd);
+    if (prev_read != -1 && prev_read != shell_in)
+      close(prev_read);
+    if (pipefd[1] != -1 && pipefd[1] != shell_out)
+      close(pipefd[1]);
+    prev_read = pipefd[0];
+    if (analyze && prev_read != -1)
+      prev_read = rsh_start_meter(job, i, prev_read, &links[i], pipe_size);
+  }
+
+  if (run_in_shell) {
+    BuiltinIO io = {shell_in != -1 ? shell_in : STDIN_FILENO,
+                    shell_out != -1 ? shell_out : STDOUT_FILENO};
+    Process *proc = &job->procs[in_shell];
+    Command *cmd = &stages[in_shell];
+    SavedVar *saved =
+        cmd->nassigns
+            ? rsh_vars_push(cmd->assigns, cmd->nassigns, &exec_arena)
+            : NULL;
+    rsh_mark(proc);
+    int status = builtins[in_shell]->fn(cmd->argv, &io);
+    rsh_mark_end(proc);
+    if (saved)
+      rsh_vars_pop(saved, cmd->nassigns);
+    if (TRACING)
+      rsh_trace_span(trace_pid, "builtin", stages[in_shell].argv[0],
+                     rsh_ts_ns(&proc->start), rsh_ts_ns(&proc->end), NULL);
+    proc->done = true;
+    proc->status = W_EXITCODE(status & 0xff, 0);
+    // closes the pipe ends or the redirect files it used
+    if (shell_in != -1)
+      close(shell_in);
+    if (shell_out != -1)
+      close(shell_out);
+  }
+
+  if (TRACING)
+    rsh_trace_span(trace_pid, "exec", "start_pipeline", rsh_ts_ns(&started),
+                   rsh_trace_now(), job->text);
+
+  if (background) {
+    rsh_pipestatus_reset(1);
+    last_bg_pid = job->procs[num_commands - 1].pid;
+    if (job_control)
+      fprintf(stderr, "[%d] %d\n", job->id, (int)last_bg_pid);
+    return 0;
+  }
+
+  int status = rsh_wait_job(job);
+  clock_gettime(CLOCK_MONOTONIC, &ended);
+  if (timing)
+    rsh_time_pipeline(stages, num_commands, pipeline->timed,
+                      rsh_elapsed_us(&started, &ended));
+  if (links) {
+    rsh_analyze_report(pipeline, stages, links,
+                       rsh_elapsed_us(&started, &ended));
+    munmap(links, sizeof(LinkStats) * nlinks);
+  }
+  return status;
+}
+
+// in a forked copy of the shell: it keeps SIGCHLD on its signalfd but has
+// no job control and none of the parent's jobs
+void rsh_subshell_init(void) {
+  signal(SIGINT, SIG_DFL);
+  signal(SIGQUIT, SIG_DFL);
+  signal(SIGTSTP, SIG_DFL);
+  signal(SIGTTIN, SIG_DFL);
+  signal(SIGTTOU, SIG_DFL);
+  job_control = false;
+  jobs = NULL;
+  jobs_cap = 0;
+}
+
+// runs a list that is not a plain pipeline in the background: a forked copy
+// of the shell runs it and is tracked as a one-process job
+int rsh_execute(Node *node);
+
+int rsh_execute_background(Node *node) {
+  StrBuf text = {0};
+  rsh_node_text(node, &text);
+  Job *job = rsh_job_new(1, text.data, true);
+
+  fflush(NULL); // or the child flushes the same stdio buffers again
+  pid_t pid = fork();
+  if (pid < 0) {
+    perror("rsh: fork");
+    rsh_job_free(job);
+    return 1;
+  }
+
+  if (pid == 0) {
+    rsh_trace_forked("rsh (subshell)");
+    if (job_control)
+      setpgid(0, 0);
+    rsh_subshell_init();
+    exit(rsh_execute(node));
+  }
+
+  job->procs[0].pid = pid;
+  if (job_control) {
+    job->pgid = pid;
+    setpgid(pid, pid);
+    fprintf(stderr, "[%d] %d\n", job->id, (int)pid);
+  }
+  last_bg_pid = pid;
+  return 0;
+}
+
+#define RSH_SUBST_READ 16384   // least room in the word for each read
+#define RSH_CAPTURE_KEEP 65536 // capture_buf is freed when it grew past this
+
+bool rsh_run(char *buf, Arena *arena, size_t *more); // MAIN
+
+// true when expanding the words twice does no harm: nothing in them runs a
+// command or assigns a variable
+bool rsh_words_pure(const Command *raw) {
+  for (int i = 0; i < raw->argc; i++) {
+    if (strstr(raw->argv[i], "$(") || strchr(raw->argv[i], '`') ||
+        strstr(raw->argv[i], ":="))
+      return false;
+  }
+  return true;
+}
+
+// $(...) and `...`: runs text and appends its output, trailing newlines cut,
+// to w. a lone builtin that leaves the shell alone runs here with its output
+// captured in memory, a lone program is spawned with its stdout on a pipe.
+// anything else runs in a forked copy of the shell. pipes are read straight
+// into the word
+void rsh_command_subst(const char *text, size_t len, WordBuf *w) {
+  ArenaMark mark = arena_mark(&subst_arena);
+  char *src = arena_alloc(&subst_arena, len + 1);
+  memcpy(src, text, len);
+  src[len] = '\0';
+  // a pattern takes the output through word_put, which escapes it
+  WordBuf *dst = w, plain = {NULL, 0, 0, w->arena, false};
+  if (w->pattern)
+    w = &plain;
+  size_t start = w->len;
+  int status = 0;
+
+  Parser p = {0};
+  p.lx.src = src;
+  p.arena = &subst_arena;
+  parser_next(&p);
+  parser_skip_newlines(&p);
+  Node *node = p.tok.kind == TOK_EOF ? NULL : rsh_parse_list(&p);
+  parser_skip_newlines(&p);
+  if (!p.failed && p.tok.kind == TOK_EOF && !node)
+    goto done; // $() is empty
+
+  // a simple command is expanded here, which is only safe when the forked
+  // shell may expand it again
+  bool simple = false;
+  const Builtin *bi = NULL;
+  Command cmd;
+  if (!p.failed && p.tok.kind == TOK_EOF && node->type == NODE_PIPE &&
+      node->pipe->count == 1 && !node->pipe->timed &&
+      rsh_words_pure(node->pipe->commands[0])) {
+    if (!rsh_expand_cmd(node->pipe->commands[0], &cmd, &subst_arena)) {
+      status = 1;
+      goto done;
+    }
+    rsh_split_assigns(node->pipe->commands[0], &cmd);
+    simple = cmd.argv[0] && !cmd.input_file && !cmd.output_file &&
+             cmd.replicas < 2 && !(nfuncs && rsh_find_func(cmd.argv[0])) &&
+             !rsh_assignment(node->pipe->commands[0]->argv[0]);
+    bi = simple ? rsh_find_builtin(cmd.argv) : NULL;
+  }
+
+  if (bi && !bi->special && !cmd.nassigns) {
+    capture_buf.len = 0;
+    BuiltinIO io = {STDIN_FILENO, RSH_CAPTURE_FD};
+    status = bi->fn(cmd.argv, &io);
+    if (capture_buf.len > 0)
+      word_put(w, capture_buf.data, capture_buf.len);
+    if (capture_buf.cap > RSH_CAPTURE_KEEP) {
+      free(capture_buf.data);
+      capture_buf = (StrBuf){0};
+    }
+    goto done;
+  }
+
+  int fds[2];
+  if (pipe2(fds, O_CLOEXEC) == -1) {
+    perror("rsh: pipe");
+    status = 1;
+    goto done;
+  }
+  pid_t pid;
+  if (simple && !bi) {
+    char **envp = cmd.nassigns ? rsh_envp_with(cmd.assigns, cmd.nassigns,
+                                               &subst_arena)
+                               : NULL;
+    SpawnOpts opts = {-1, fds[1], NULL, 0, -1, false, envp};
+    int err = rsh_spawn_cmd(cmd.argv, &opts, &pid);
+    if (err) {
+      fprintf(stderr, "rsh: %s: %s\n", cmd.argv[0], strerror(err));
+      close(fds[0]);
+      close(fds[1]);
+      status = err == ENOENT ? 127 : 126;
+      goto done;
+    }
+  } else {
+    fflush(NULL); // or the child flushes the same stdio buffers again
+    pid = fork();
+    if (pid < 0) {
+      perror("rsh: fork");
+      close(fds[0]);
+      close(fds[1]);
+      status = 1;
+      goto done;
+    }
+    if (pid == 0) {
+      rsh_trace_forked("rsh (subst)");
+      rsh_subshell_init();
+      dup2(fds[1], STDOUT_FILENO);
+      // the parse above wrote NULs into src, the child reads the text afresh
+      char *buf = strndup(text, len);
+      Arena arena = {0};
+      if (!buf)
+        exit(EXIT_FAILURE);
+      rsh_run(buf, &arena, NULL);
+      fflush(NULL);
+      exit(last_status);
+    }
+  }
+
+  close(fds[1]);
+  while (true) {
+    if (w->cap - w->len < RSH_SUBST_READ + 1) {
+      size_t cap = w->len + RSH_SUBST_READ + 1;
+      if (cap < 2 * w->cap)
+        cap = 2 * w->cap;
+      w->data = arena_grow(w->arena, w->data, w->cap, cap);
+      w->cap = cap;
+    }
+    ssize_t n = read(fds[0], w->data + w->len, w->cap - w->len - 1);
+    if (n > 0)
+      w->len += n;
+    else if (n == 0 || errno != EINTR)
+      break;
+  }
+  close(fds[0]);
+  int wstatus;
+  while (waitpid(pid, &wstatus, 0) == -1 && errno == EINTR)
+    ;
+  status = rsh_wait_status(wstatus);
+
+done:
+  while (w->len > start && w->data[w->len - 1] == '\n')
+    w->len--;
+  if (w != dst && w->len > 0)
+    word_put(dst, w->data, w->len);
+  arena_release(&subst_arena, mark);
+  last_status = subst_status = status;
+}
+
+int rsh_run_code(const Code *code);
+
+// executes an AST, returns the exit status of the last pipeline run
+int rsh_execute(Node *node) {
+  int status;
+
+  switch (node->type) {
+  case NODE_PIPE:
+    // set as each pipeline ends so the next one sees it as $?
+    return last_status = rsh_execute_pipeline(node->pipe, false);
+  case NODE_AND:
+    status = rsh_execute(node->left);
+    return status == 0 ? rsh_execute(node->right) : status;
+  case NODE_OR:
+    status = rsh_execute(node->left);
+    return status != 0 ? rsh_execute(node->right) : status;
+  case NODE_SEQ:
+    rsh_execute(node->left);
+    return rsh_execute(node->right);
+  case NODE_BG:
+    if (node->left->type == NODE_PIPE)
+      return last_status = rsh_execute_pipeline(node->left->pipe, true);
+    return last_status = rsh_execute_background(node->left);
+  default:
+    // compiled by the parser, except nested ones that a forked subshell
+    // runs on their own
+    if (!node->code)
+      node->code = rsh_compile(node, &exec_arena);
+    return rsh_run_code(node->code);
+  }
+}
+
+// a loop or case's state in the frame running its code
+struct {
+  int status; // a loop's status so far
+  char **words; // for: the expanded words, malloc'd
+  int n, i;
+  char *word; // case: the expanded word, malloc'd
+} typedef Slot;
+
+#define RSH_FRAME_SLOTS 8 // slots kept on the stack
+
+char *rsh_strdup(const char *s) {
+  char *copy = strdup(s);
+  if (!copy) {
+    fprintf(stderr, "rsh: allocation error\n");
+    exit(EXIT_FAILURE);
+  }
+  return copy;
+}
+
+bool rsh_is_all_args(const char *raw) {
+  return !strcmp(raw, "$@") || !strcmp(raw, "\"$@\"");
+}
+
+// the words of a for loop, expanded once when the loop starts. "$@" gives
+// one word per positional parameter and a glob one per name, any other
+// word stays one word: rsh does no field splitting
+void rsh_for_words(Slot *slot, Node *node) {
+  for (int i = 0; i < slot->n; i++)
+    free(slot->words[i]);
+  free(slot->words);
+
+  char *all[] = {"$@", NULL};
+  char **raw = node->words ? node->words : all;
+  ArenaMark mark = arena_mark(&exec_arena);
+  WordList words = {NULL, 0, 0, &exec_arena};
+  rsh_glob_begin();
+  arith_failed = false;
+  for (int i = 0; raw[i]; i++) {
+    if (rsh_is_all_args(raw[i])) {
+      for (int j = 0; j < pos_argc; j++)
+        words_add(&words, pos_argv[j]);
+    } else {
+      rsh_expand_word(raw[i], &words);
+    }
+  }
+  if (arith_failed) { // the loop does not run and fails
+    words.n = 0;
+    slot->status = 1;
+  }
+  slot->words = malloc(sizeof(char *) * (words.n + 1));
+  if (!slot->words) {
+    fprintf(stderr, "rsh: allocation error\n");
+    exit(EXIT_FAILURE);
+  }
+  for (int i = 0; i < words.n; i++)
+    slot->words[i] = rsh_strdup(words.v[i]);
+  arena_release(&exec_arena, mark);
+  slot->words[words.n] = NULL;
+  slot->n = words.n;
+  slot->i = 0;
+}
+
+bool rsh_case_match(const CaseArm *arm, const char *word) {
+  ArenaMark mark = arena_mark(&exec_arena);
+  bool matched = false;
+  for (int i = 0; arm->patterns[i] && !matched; i++)
+    matched = fnmatch(rsh_unquote(arm->patterns[i], &exec_arena), word, 0) == 0;
+  arena_release(&exec_arena, mark);
+  return matched;
+}
+
+void rsh_define_func(Node *node);
+
+// runs compiled code, returns the status of the last command it ran. words
+// a pipeline expands are dropped as soon as it ends
+int rsh_run_code(const Code *code) {
+  Slot frame[RSH_FRAME_SLOTS];
+  Slot *slots = frame;
+  if (code->nslots > RSH_FRAME_SLOTS) {
+    slots = calloc(code->nslots, sizeof(Slot));
+    if (!slots) {
+      fprintf(stderr, "rsh: allocation error\n");
+      exit(EXIT_FAILURE);
+    }
+  } else {
+    memset(frame, 0, sizeof(Slot) * code->nslots);
+  }
+
+  int status = 0;
+  ArenaMark mark;
+  for (int pc = 0; pc < code->count;) {
+    const Op *op = &code->ops[pc++];
+    Slot *slot = &slots[op->slot];
+    switch (op->op) {
+    case OP_PIPE:
+      mark = arena_mark(&exec_arena);
+      status = last_status = rsh_execute_pipeline(op->pipe, false);
+      arena_release(&exec_arena, mark);
+      // ^C at a terminal stops the whole loop, not just this command
+      if (job_control && status == 128 + SIGINT)
+        goto done;
+      break;
+    case OP_BG:
+      mark = arena_mark(&exec_arena);
+      status = rsh_execute(op->node);
+      arena_release(&exec_arena, mark);
+      break;
+    case OP_JUMP:
+      pc = op->arg;
+      break;
+    case OP_JZ:
+      if (status == 0)
+        pc = op->arg;
+      break;
+    case OP_JNZ:
+      if (status != 0)
+        pc = op->arg;
+      break;
+    case OP_TRUE:
+      status = 0;
+      break;
+    case OP_LOOP:
+      slot->status = 0;
+      break;
+    case OP_SAVE:
+      slot->status = status;
+      break;
+    case OP_LEAVE:
+      status = slot->status;
+      break;
+    case OP_BREAK:
+      slot->status = 0;
+      pc = op->arg;
+      break;
+    case OP_FOR:
+      slot->status = 0;
+      rsh_for_words(slot, op->node);
+      break;
+    case OP_NEXT:
+      if (slot->i == slot->n)
+        pc = op->arg;
+      else
+        rsh_var_set(op->node->name, slot->words[slot->i++]);
+      break;
+    case OP_CASE:
+      free(slot->word);
+      mark = arena_mark(&exec_arena);
+      slot->word = rsh_strdup(rsh_unquote(op->node->name, &exec_arena));
+      arena_release(&exec_arena, mark);
+      break;
+    case OP_MATCH:
+      if (!rsh_case_match(op->arm, slot->word))
+        pc = op->arg;
+      break;
+    case OP_DEF:
+      rsh_define_func(op->node);
+      status = 0;
+      break;
+    case OP_RETURN:
+      status = last_status;
+      if (op->cmd->argv[1]) {
+        mark = arena_mark(&exec_arena);
+        status = atoi(rsh_unquote(op->cmd->argv[1], &exec_arena)) & 0xff;
+        arena_release(&exec_arena, mark);
+      }
+      goto done;
+    }
+  }
+
+done:
+  for (int i = 0; i < code->nslots; i++) {
+    for (int j = 0; j < slots[i].n; j++)
+      free(slots[i].words[j]);
+    free(slots[i].words);
+    free(slots[i].word);
+  }
+  if (slots != frame)
+    free(slots);
+  return last_status = status;
+}
+
+void rsh_func_free(Func *f) {
+  free(f->name);
+  arena_free(&f->arena);
+  free(f);
+}
+
+void rsh_func_unlink(Func **slot) {
+  Func *f = *slot;
+  *slot = f->next;
+  nfuncs--;
+  if (f->refs)
+    f->dead = true;
+  else
+    rsh_func_free(f);
+}
+
+Node *rsh_plan_copy_node(const Node *node, Arena *a,
+                         bool resolve); // PLAN CACHE, near the end
+
+// the body is copied out of the line, it outlives it
+void rsh_define_func(Node *node) {
+  Func **slot = rsh_func_slot(node->name);
+  if (*slot)
+    rsh_func_unlink(slot);
+  Func *f = calloc(1, sizeof(Func));
+  if (!f) {
+    fprintf(stderr, "rsh: allocation error\n");
+    exit(EXIT_FAILURE);
+  }
+  f->name = rsh_strdup(node->name);
+  f->arena.chunk_size = RSH_FUNC_CHUNK;
+  f->body = rsh_plan_copy_node(node->right, &f->arena, false);
+  f->code = rsh_compile(f->body, &f->arena);
+  f->next = *slot;
+  *slot = f;
+  nfuncs++;
+}
+
+// runs a function with argv[1..] as its positional parameters, on io's fds
+int bi_call_func(char **argv, BuiltinIO *io) {
+  Func *f = rsh_find_func(argv[0]);
+  if (!f)
+    return 127;
+  if (func_depth == RSH_FUNC_DEPTH) {
+    fprintf(stderr, "rsh: %s: maximum function nesting exceeded\n", argv[0]);
+    return 1;
+  }
+
+  // the body's commands use fds 0 and 1, so a redirected call moves them
+  int saved[2] = {-1, -1};
+  int fds[2] = {io->in, io->out};
+  for (int i = 0; i < 2; i++) {
+    if (fds[i] != i) {
+      fflush(stdout);
+      saved[i] = fcntl(i, F_DUPFD_CLOEXEC, 10);
+      dup2(fds[i], i);
+    }
+  }
+
+  char **outer_argv = pos_argv;
+  int outer_argc = pos_argc;
+  pos_argv = argv + 1;
+  for (pos_argc = 0; pos_argv[pos_argc]; pos_argc++)
+    ;
+  f->refs++;
+  func_depth++;
+  int status = rsh_run_code(f->code);
+  func_depth--;
+  if (--f->refs == 0 && f->dead)
+    rsh_func_free(f);
+  pos_argv = outer_argv;
+  pos_argc = outer_argc;
+
+  for (int i = 0; i < 2; i++) {
+    if (saved[i] != -1) {
+      fflush(stdout);
+      dup2(saved[i], i);
+      close(saved[i]);
+    }
+  }
+  return status;
+}
+
+/* ------------------------------------------------------ UTILS/TESTING
+ * -------------------------------------------------------------- */
+
+long last_duration_us; // wall time of the last line run at the prompt
+
+// the prompt, from the PS1 template or ps2 for the lines after the first of
+// a command. the escapes are
+//   \w  working directory, $HOME as ~    \W  its last component
+//   \u  user    \h  host, up to a dot    \$  # for root, $ for others
+//   \?  exit status of the last command   \j  jobs
+//   \D  how long the last command took    \e  escape    \n  newline
+//   \\  backslash    \[ \]  ignored (bash's marks for non-printing text)
+// rendering reads no files: the directory is the one cd keeps, and user,
+// host and uid are looked up once
+void print_prompt(StrBuf *sb, bool ps2) {
+  static char user[64], host[64];
+  static bool root;
+  if (!user[0]) {
+    const char *name = getenv("USER");
+    struct passwd *pw = name ? NULL : getpwuid(geteuid());
+    snprintf(user, sizeof(user), "%s", name ? name : pw ? pw->pw_name : "?");
+    if (gethostname(host, sizeof(host)) != 0)
+      strcpy(host, "?");
+    host[strcspn(host, ".")] = '\0';
+    root = geteuid() == 0;
+  }
+
+  const char *ps = rsh_var_get(ps2 ? "PS2" : "PS1", 3);
+  if (!ps)
+    ps = ps2 ? RSH_PS2 : RSH_PS1;
+  sb->len = 0;
+  sb_write(sb, "", 0);
+  char num[32];
+  for (const char *s = ps; *s; s++) {
+    const char *lit = strchrnul(s, '\\');
+    sb_write(sb, s, lit - s);
+    if (!*(s = lit) || !s[1])
+      break;
+    const char *cwd, *home;
+    size_t home_len;
+    switch (*++s) {
+    case 'w':
+      cwd = rsh_cwd();
+      home = rsh_var_get("HOME", 4);
+      home_len = home ? strlen(home) : 0;
+      if (home_len > 1 && !strncmp(cwd, home, home_len) &&
+          (cwd[home_len] == '/' || !cwd[home_len])) {
+        sb_write(sb, "~", 1);
+        cwd += home_len;
+      }
+      sb_puts(sb, cwd);
+      break;
+    case 'W':
+      cwd = rsh_cwd();
+      sb_puts(sb, cwd[1] ? strrchr(cwd, '/') + 1 : cwd);
+      break;
+    case 'u':
+      sb_puts(sb, user);
+      break;
+    case 'h':
+      sb_puts(sb, host);
+      break;
+    case '$':
+      sb_write(sb, root ? "#" : "$", 1);
+      break;
+    case '?':
+      sb_write(sb, num, snprintf(num, sizeof(num), "%d", last_status));
+      break;
+    case 'j':
+      sb_write(sb, num, snprintf(num, sizeof(num), "%d", jobs_live));
+      break;
+    case 'D':
+      if (last_duration_us < 1000000)
+        snprintf(num, sizeof(num), "%ldms", last_duration_us / 1000);
+      else if (last_duration_us < 60000000)
+        snprintf(num, sizeof(num), "%.1fs", last_duration_us / 1e6);
+      else
+        snprintf(num, sizeof(num), "%ldm%02lds", last_duration_us / 60000000,
+                 last_duration_us / 1000000 % 60);
+      sb_puts(sb, num);
+      break;
+    case 'e':
+      sb_write(sb, "\x1b", 1);
+      break;
+    case 'n':
+      sb_write(sb, "\n", 1);
+      break;
+    case '[':
+    case ']':
+      break;
+    default:
+      sb_write(sb, s - 1, 2);
+    }
+  }
+}
+
+void print_cmd(Command *cmd) {
+  for (int i = 0; cmd->argv[i] != NULL; i++) {
+    if (i == 0) {
+      fprintf(stderr, ANSI_COLOR_GREEN "%s " ANSI_COLOR_RESET, cmd->argv[i]);
+    } else {
+      fprintf(stderr, "%s ", cmd->argv[i]);
+    }
+  }
+  if (cmd->input_file)
+    fprintf(stderr, ANSI_COLOR_RED "LT " ANSI_COLOR_RESET "%s ", cmd->input_file);
+  if (cmd->output_file)
+    fprintf(stderr, ANSI_COLOR_RED "GT " ANSI_COLOR_RESET "%s ", cmd->output_file);
+}
+
+void print_keyword(const char *word) {
+  fprintf(stderr, ANSI_COLOR_YELLOW " %s " ANSI_COLOR_RESET, word);
+}
+
+void print_node(Node *node);
+
+// an empty list inside a compound command prints nothing
+void print_body(Node *node) {
+  if (node)
+    print_node(node);
+}
+
+void print_node(Node *node) {
+  switch (node->type) {
+  case NODE_PIPE:
+    if (node->pipe->timed)
+      fprintf(stderr, ANSI_COLOR_YELLOW "TIME " ANSI_COLOR_RESET);
+    for (int i = 0; node->pipe->commands[i] != NULL; i++) {
+      if (i != 0 && node->pipe->pipe_sizes && node->pipe->pipe_sizes[i - 1])
+        fprintf(stderr, ANSI_COLOR_CYAN " PIPE[%ld] " ANSI_COLOR_RESET,
+                node->pipe->pipe_sizes[i - 1]);
+      else if (i != 0 && node->pipe->commands[i]->replicas)
+        fprintf(stderr, ANSI_COLOR_CYAN " PIPE@%d%s%s " ANSI_COLOR_RESET,
+                node->pipe->commands[i]->replicas,
+                node->pipe->commands[i]->replica_flags & REPLICA_UNORDERED
+                    ? "u"
+                    : "",
+                node->pipe->commands[i]->replica_flags & REPLICA_NUL ? "z"
+                                                                      : "");
+      else if (i != 0)
+        fprintf(stderr, ANSI_COLOR_CYAN " PIPE " ANSI_COLOR_RESET);
+      print_cmd(node->pipe->commands[i]);
+    }
+    break;
+  case NODE_AND:
+  case NODE_OR:
+  case NODE_SEQ:
+    print_node(node->left);
+    fprintf(stderr,
+            ANSI_COLOR_YELLOW " %s " ANSI_COLOR_RESET,
+            node->type == NODE_AND ? "AND"
+                                   : (node->type == NODE_OR ? "OR" : "THEN"));
+    print_node(node->right);
+    break;
+  case NODE_BG:
+    print_node(node->left);
+    fprintf(stderr, ANSI_COLOR_YELLOW " BG " ANSI_COLOR_RESET);
+    break;
+  case NODE_IF:
+    print_keyword("IF");
+    print_body(node->left);
+    print_keyword("THEN");
+    print_body(node->right);
+    if (node->alt) {
+      print_keyword("ELSE");
+      print_body(node->alt);
+    }
+    print_keyword("FI");
+    break;
+  case NODE_WHILE:
+  case NODE_UNTIL:
+    print_keyword(node->type == NODE_WHILE ? "WHILE" : "UNTIL");
+    print_body(node->left);
+    print_keyword("DO");
+    print_body(node->right);
+    print_keyword("DONE");
+    break;
+  case NODE_FOR:
+    print_keyword("FOR");
+    fprintf(stderr, "%s", node->name);
+    if (node->words) {
+      print_keyword("IN");
+      for (int i = 0; node->words[i]; i++)
+        fprintf(stderr, "%s ", node->words[i]);
+    }
+    print_keyword("DO");
+    print_body(node->right);
+    print_keyword("DONE");
+    break;
+  case NODE_CASE:
+    print_keyword("CASE");
+    fprintf(stderr, "%s", node->name);
+    print_keyword("IN");
+    for (int i = 0; i < node->narms; i++) {
+      for (int j = 0; node->arms[i].patterns[j]; j++)
+        fprintf(stderr, "%s%s", j > 0 ? "|" : "", node->arms[i].patterns[j]);
+      print_keyword("MATCH");
+      print_body(node->arms[i].body);
+      print_keyword("END");
+    }
+    print_keyword("ESAC");
+    break;
+  case NODE_GROUP:
+    print_keyword("{");
+    print_body(node->left);
+    print_keyword("}");
+    break;
+  case NODE_FUNC:
+    fprintf(stderr, ANSI_COLOR_GREEN "%s" ANSI_COLOR_RESET, node->name);
+    print_keyword("FUNCTION");
+    print_node(node->right);
+    break;
+  }
+}
+
+/* ---------------------------------------------------------------- BUILTIN TABLE
+ * -----------------------------------------------------------------------------------------
+ */
+
+Builtin rsh_builtins[] = {
+    {"cd", bi_cd, true, false},
+    {"pushd", bi_pushd, true, false},
+    {"popd", bi_popd, true, false},
+    {"dirs", bi_dirs, false, false},
+    {"exit", bi_exit, true, false},
+    {"hash", bi_hash, true, false},
+    {"jobs", bi_jobs, true, false},
+    {"fg", bi_fg, true, false},
+    {"bg", bi_bg, true, false},
+    {"wait", bi_wait, true, false},
+    {"set", bi_set, true, false},
+    {"export", bi_export, true, false},
+    {"unset", bi_unset, true, false},
+    {"times", bi_times, false, false},
+    {"history", bi_history, false, false},
+    {"stats", bi_stats, false, false},
+    {"parallel", bi_parallel, false, false},
+    {"help", bi_help, false, false},
+    {":", bi_true, false, false},
+    {"true", bi_true, false, false},
+    {"false", bi_false, false, false},
+    {"echo", bi_echo, false, false},
+    {"pwd", bi_pwd, false, false},
+    {"printf", bi_printf, false, false},
+    {"test", bi_test, false, false},
+    {"[", bi_test, false, false},
+    {"cat", bi_cat, false, true},
+};
+
+#define RSH_BUILTIN_SLOTS 128 // power of two
+#define RSH_BUILTIN_SEED 8u   // collision free for every name above
+
+Builtin *builtin_slots[RSH_BUILTIN_SLOTS];
+
+unsigned rsh_builtin_hash(const char *name) {
+  unsigned h = 2166136261u ^ RSH_BUILTIN_SEED;
+  for (; *name; name++) {
+    h ^= (unsigned char)*name;
+    h *= 16777619u;
+  }
+  return (h ^ (h >> 16)) & (RSH_BUILTIN_SLOTS - 1);
+}
+
+void rsh_builtins_init(void) {
+  for (size_t i = 0; i < sizeof(rsh_builtins) / sizeof(rsh_builtins[0]); i++) {
+    unsigned slot = rsh_builtin_hash(rsh_builtins[i].name);
+    if (builtin_slots[slot]) {
+      fprintf(stderr, "rsh: builtins %s and %s collide, change RSH_BUILTIN_SEED\n",
+              builtin_slots[slot]->name, rsh_builtins[i].name);
+      exit(EXIT_FAILURE);
+    }
+    builtin_slots[slot] = &rsh_builtins[i];
+  }
+}
+
+// one hash, one strcmp. NULL when argv is not a builtin call
+const Builtin *rsh_find_builtin(char **argv) {
+  Builtin *bi = builtin_slots[rsh_builtin_hash(argv[0])];
+  if (!bi || strcmp(bi->name, argv[0]))
+    return NULL;
+  if (bi->plain_args) {
+    for (int i = 1; argv[i]; i++) {
+      if (argv[i][0] == '-' && argv[i][1] != '\0')
+        return NULL;
+    }
+  }
+  return bi;
+}
+
+/* ---------------------------------------------------------------- PLAN CACHE
+  a line that runs again is not lexed or parsed again. its parse tree is
+  copied out of the line's arena into an entry keyed by a 64-bit hash of the
+  raw text, with the builtin or PATH target of every plain command resolved,
+  and when the line comes around again the lexer just skips it. a line is
+  admitted the second time it is seen, so a script of one-off lines copies
+  nothing. entries are evicted least recently used first, and all of them go
+  whenever the PATH cache drops entries: PATH changed, cd with relative PATH
+  entries, hash -r or -d.
+ * -----------------------------------------------------------------------------------------
+ */
+
+#define RSH_PLAN_MAX 256     // lines kept
+#define RSH_PLAN_BUCKETS 512 // power of two
+#define RSH_PLAN_SEEN 1024   // hashes of lines seen once, power of two
+#define RSH_PLAN_CHUNK 1024  // arena chunk of an entry, most trees fit in one
+
+struct PlanEntry {
+  uint64_t hash;
+  char *key; // the raw line, as it was before parsing terminated its words
+  size_t len;
+  Node *node;
+  bool dry_run, analyze;
+  Arena arena; // owns node and everything under it
+  int refs;    // runs in progress, an entry dropped meanwhile waits for them
+  bool dead;
+  struct PlanEntry *chain;      // bucket
+  struct PlanEntry *newer, *older; // LRU list
+} typedef PlanEntry;
+
+PlanEntry *plan_table[RSH_PLAN_BUCKETS];
+PlanEntry *plan_mru, *plan_lru;
+int plan_count;
+unsigned long plan_hits, plan_misses;
+unsigned long plan_generation; // path_generation the entries were made under
+bool plan_learning; // rsh_run parses into the cache and runs nothing, SERVER
+uint64_t plan_seen[RSH_PLAN_SEEN];
+
+// 64x64 -> 128 bit multiply folded back to 64 bits
+uint64_t rsh_mum(uint64_t a, uint64_t b) {
+  __uint128_t r = (__uint128_t)a * b;
+  return (uint64_t)r ^ (uint64_t)(r >> 64);
+}
+
+// wyhash-style: eight bytes per multiply
+uint64_t rsh_hash64(const char *s, size_t len) {
+  uint64_t h = 0x9e3779b97f4a7c15ull ^ len;
+  for (; len >= 8; s += 8, len -= 8) {
+    uint64_t w;
+    memcpy(&w, s, 8);
+    h = rsh_mum(h ^ w, 0xa0761d6478bd642full);
+  }
+  uint64_t w = 0;
+  memcpy(&w, s, len);
+  return rsh_mum(rsh_mum(h ^ w, 0xe7037ed1a0b428dbull), 0x8ebc6af09c88c6e3ull);
+}
+
+void rsh_plan_free(PlanEntry *e) {
+  arena_free(&e->arena);
+  free(e->key);
+  free(e);
+}
+
+// takes an entry out of the table, freed now or by its last run
+void rsh_plan_drop(PlanEntry *e) {
+  PlanEntry **link = &plan_table[e->hash & (RSH_PLAN_BUCKETS - 1)];
+  while (*link != e)
+    link = &(*link)->chain;
+  *link = e->chain;
+  if (e->newer)
+    e->newer->older = e->older;
+  else
+    plan_mru = e->older;
+  if (e->older)
+    e->older->newer = e->newer;
+  else
+    plan_lru = e->newer;
+  plan_count--;
+  if (e->refs)
+    e->dead = true;
+  else
+    rsh_plan_free(e);
+}
+
+void rsh_plan_reset(void) {
+  while (plan_mru)
+    rsh_plan_drop(plan_mru);
+}
+
+// resolved targets die with the PATH cache entries they came from
+void rsh_plan_check(void) {
+  rsh_path_check_env();
+  if (plan_generation != path_generation) {
+    rsh_plan_reset();
+    plan_generation = path_generation;
+  }
+}
+
+void rsh_plan_touch(PlanEntry *e) {
+  if (e == plan_mru)
+    return;
+  e->newer->older = e->older;
+  if (e->older)
+    e->older->newer = e->newer;
+  else
+    plan_lru = e->newer;
+  e->newer = NULL;
+  e->older = plan_mru;
+  plan_mru->newer = e;
+  plan_mru = e;
+}
+
+// the entry for this line, most recently used from now on, or NULL
+PlanEntry *rsh_plan_find(const char *line, size_t len, uint64_t hash) {
+  rsh_plan_check();
+  for (PlanEntry *e = plan_table[hash & (RSH_PLAN_BUCKETS - 1)]; e;
+       e = e->chain) {
+    if (e->hash == hash && e->len == len && !memcmp(e->key, line, len)) {
+      plan_hits++;
+      rsh_plan_touch(e);
+      return e;
+    }
+  }
+  plan_misses++;
+  return NULL;
+}
+
+// true the second time a line is seen, when it is worth keeping
+bool rsh_plan_admit(uint64_t hash) {
+  uint64_t *slot = &plan_seen[hash & (RSH_PLAN_SEEN - 1)];
+  if (*slot == hash)
+    return true;
+  *slot = hash;
+  return false;
+}
+
+char *rsh_plan_strdup(Arena *a, const char *s) {
+  if (!s)
+    return NULL;
+  size_t len = strlen(s) + 1;
+  return memcpy(arena_alloc(a, len), s, len);
+}
+
+// a plain command's argv[0] is fixed, so what it runs can be looked up once
+void rsh_plan_resolve(Command *cmd, Arena *a) {
+  if (cmd->quoted || !cmd->argv[0])
+    return;
+  cmd->resolved = true;
+  if (cmd->replicas < 2)
+    cmd->builtin = rsh_find_builtin(cmd->argv);
+  if (!cmd->builtin) {
+    bool cached;
+    cmd->path = rsh_plan_strdup(a, rsh_path_lookup(cmd->argv[0], &cached));
+  }
+}
+
+Command *rsh_plan_copy_cmd(const Command *cmd, Arena *a, bool resolve) {
+  Command *out = arena_alloc(a, sizeof(Command));
+  *out = *cmd;
+  out->argv = arena_alloc(a, sizeof(char *) * (cmd->argc + 1));
+  for (int i = 0; i <= cmd->argc; i++)
+    out->argv[i] = rsh_plan_strdup(a, cmd->argv[i]);
+  out->input_file = rsh_plan_strdup(a, cmd->input_file);
+  out->output_file = rsh_plan_strdup(a, cmd->output_file);
+  if (resolve)
+    rsh_plan_resolve(out, a);
+  return out;
+}
+
+char **rsh_plan_copy_words(char **words, Arena *a) {
+  if (!words)
+    return NULL;
+  int n = 0;
+  while (words[n])
+    n++;
+  char **out = arena_alloc(a, sizeof(char *) * (n + 1));
+  for (int i = 0; i <= n; i++)
+    out[i] = rsh_plan_strdup(a, words[i]);
+  return out;
+}
+
+// copies a tree, compound commands included. their code points into the
+// tree it was compiled from, so the copy's is left to be compiled again.
+// function bodies are copied without resolving: a function outlives PATH
+Node *rsh_plan_copy_node(const Node *node, Arena *a, bool resolve) {
+  if (!node)
+    return NULL;
+  Node *out = arena_alloc(a, sizeof(Node));
+  *out = *node;
+  out->left = rsh_plan_copy_node(node->left, a, resolve);
+  out->right = rsh_plan_copy_node(node->right, a, resolve);
+  out->alt = rsh_plan_copy_node(node->alt, a, resolve);
+  out->name = rsh_plan_strdup(a, node->name);
+  out->words = rsh_plan_copy_words(node->words, a);
+  out->code = NULL;
+  if (node->arms) {
+    out->arms = arena_alloc(a, sizeof(CaseArm) * node->narms);
+    for (int i = 0; i < node->narms; i++) {
+      out->arms[i].patterns = rsh_plan_copy_words(node->arms[i].patterns, a);
+      out->arms[i].body = rsh_plan_copy_node(node->arms[i].body, a, resolve);
+    }
+  }
+  if (node->pipe) {
+    const Pipeline *pipe = node->pipe;
+    out->pipe = arena_alloc(a, sizeof(Pipeline));
+    *out->pipe = *pipe;
+    out->pipe->commands = arena_alloc(a, sizeof(Command *) * (pipe->count + 1));
+    for (int i = 0; i < pipe->count; i++)
+      out->pipe->commands[i] = rsh_plan_copy_cmd(pipe->commands[i], a, resolve);
+    out->pipe->commands[pipe->count] = NULL;
+    if (pipe->pipe_sizes) {
+      out->pipe->pipe_sizes = arena_alloc(a, sizeof(long) * pipe->count);
+      memcpy(out->pipe->pipe_sizes, pipe->pipe_sizes,
+             sizeof(long) * pipe->count);
+    }
+  }
+  return out;
+}
+
+// keeps a copy of the tree just parsed from key, which the entry takes over
+void rsh_plan_add(char *key, size_t len, uint64_t hash, const Node *node,
+                  const Parser *p) {
+  if (plan_count == RSH_PLAN_MAX)
+    rsh_plan_drop(plan_lru);
+  PlanEntry *e = calloc(1, sizeof(PlanEntry));
+  if (!e) {
+    fprintf(stderr, "rsh: allocation error");
+    exit(EXIT_FAILURE);
+  }
+  e->hash = hash;
+  e->key = key;
+  e->len = len;
+  e->arena.chunk_size = RSH_PLAN_CHUNK;
+  e->node = rsh_plan_copy_node(node, &e->arena, true);
+  rsh_compile_outer(e->node, &e->arena);
+  e->dry_run = p->dry_run;
+  e->analyze = p->analyze;
+
+  PlanEntry **bucket = &plan_table[hash & (RSH_PLAN_BUCKETS - 1)];
+  e->chain = *bucket;
+  *bucket = e;
+  e->older = plan_mru;
+  if (plan_mru)
+    plan_mru->newer = e;
+  plan_mru = e;
+  if (!plan_lru)
+    plan_lru = e;
+  plan_count++;
+}
+
+void rsh_plan_release(PlanEntry *e) {
+  if (--e->refs == 0 && e->dead)
+    rsh_plan_free(e);
+}
+
+// the plan line of hash
+void rsh_plan_report(OutBuf *o) {
+  unsigned long total = plan_hits + plan_misses;
+  out_printf(o, "plans: %d cached, %lu hits, %lu misses (%.1f%% hit)\n",
+             plan_count, plan_hits, plan_misses,
+             total ? 100.0 * plan_hits / total : 0.0);
+}
+
+/* ---------------------------------------------------------------- LINE EDITOR
+  on a terminal the shell reads lines itself, in raw mode: the cursor keys
+  and the usual emacs keys edit the line, Up and Down step through history
+  and Ctrl-R searches it backwards as the query is typed. Tab completes a
+  command name from a radix trie of every executable on PATH plus the
+  builtins, and anything else as a file name. the trie is built while the
+  first prompt sits idle and then kept current by inotify watches on the
+  PATH directories, so a Tab never rescans them: it walks down the typed
+  prefix, and the subtree below is exactly the candidates, with their common
+  prefix where the subtree first branches. each redraw of the line is one
+  write.
+  TERM=dumb, or stdin or stdout not being a terminal, reads with getline.
+ * -----------------------------------------------------------------------------------------
+ */
+
+#define RSH_TRIE_DIRS 63              // PATH directories tracked, a bit each
+#define RSH_TRIE_BUILTIN (1ULL << 63) // the name is a builtin
+#define RSH_EDIT_LIST 256             // candidates listed on a second Tab
+
+enum {
+  KEY_NONE = 1000,
+  KEY_UP,
+  KEY_DOWN,
+  KEY_LEFT,
+  KEY_RIGHT,
+  KEY_HOME,
+  KEY_END,
+  KEY_DELETE,
+  KEY_WORD_LEFT,
+  KEY_WORD_RIGHT,
+};
+
+#define CTRL_KEY(c) ((c) & 0x1f)
+
+// the names below a node share the bytes on the path down to it
+struct TrieNode {
+  char *label; // the edge into this node, not NUL terminated
+  size_t len;
+  uint64_t dirs; // PATH directories holding the name ending here, 0 for none
+  struct TrieNode *child; // children ordered by the first byte of the label
+  struct TrieNode *next;
+} typedef TrieNode;
+
+struct {
+  TrieNode root;
+  bool built;
+  char *path; // the PATH it was built from
+  char *dirs[RSH_TRIE_DIRS];
+  int wds[RSH_TRIE_DIRS]; // inotify watch of each directory, -1 for none
+  int ndirs;
+  int fd; // inotify, -1 when it could not be had
+  size_t names;
+  unsigned long builds;
+} typedef PathTrie;
+
+PathTrie path_trie = {.fd = -1};
+
+// what a Tab found: the first RSH_EDIT_LIST candidates kept for listing, all
+// of them counted and folded into their common prefix
+struct {
+  char **names;
+  int nkept;
+  size_t count;
+  char *common;
+  size_t common_len;
+  bool dir; // the last candidate added is a directory
+  Arena arena;
+} typedef Completion;
+
+struct {
+  StrBuf line;
+  size_t pos; // cursor, a byte offset into line
+  const char *prompt;
+  size_t prompt_cols; // columns taken by the prompt's last line
+  int cols;
+  StrBuf frame; // a redraw, written at once
+  char in[256]; // bytes read but not yet taken as keys
+  size_t in_len, in_pos;
+  long hist_at;   // entry shown by Up and Down, hist.count for the new line
+                  // and -1 before history is first looked at
+  StrBuf saved;   // the new line while history is shown instead
+  int last_key;   // a second Tab in a row lists
+  Completion comp;
+} typedef Editor;
+
+Editor editor;
+bool edit_interrupted;              // ^C dropped the line being typed
+volatile sig_atomic_t edit_resized; // the width is to be asked again
+
+void rsh_edit_winch(int sig) {
+  (void)sig;
+  edit_resized = 1;
+}
+
+// the line editor is only worth it where someone sees the redraws
+bool rsh_edit_usable(void) {
+  static int usable = -1;
+  if (usable == -1) {
+    const char *term = getenv("TERM");
+    usable = isatty(STDIN_FILENO) && isatty(STDOUT_FILENO) && term && *term &&
+             strcmp(term, "dumb") != 0;
+  }
+  return usable;
+}
+
+// the trie is built while the first prompt waits, not on the first Tab
+bool rsh_trie_pending(void) { return rsh_edit_usable() && !path_trie.built; }
+
+void rsh_trie_free(TrieNode *node) {
+  while (node) {
+    TrieNode *next = node->next;
+    rsh_trie_free(node->child);
+    free(node->label);
+    free(node);
+    node = next;
+  }
+}
+
+TrieNode *rsh_trie_node(const char *label, size_t len, uint64_t dirs) {
+  TrieNode *node = calloc(1, sizeof(TrieNode));
+  char *copy = malloc(len ? len : 1);
+  if (!node || !copy) {
+    fprintf(stderr, "rsh: allocation error\n");
+    exit(EXIT_FAILURE);
+  }
+  memcpy(copy, label, len);
+  *node = (TrieNode){copy, len, dirs, NULL, NULL};
+  return node;
+}
+
+// marks the n bytes at s as found in the directories of bit
+void rsh_trie_insert(const char *s, size_t n, uint64_t bit) {
+  TrieNode *node = &path_trie.root;
+  while (n > 0) {
+    TrieNode **link = &node->child;
+    while (*link && (unsigned char)(*link)->label[0] < (unsigned char)s[0])
+      link = &(*link)->next;
+    TrieNode *c = *link;
+    if (!c || c->label[0] != s[0]) {
+      TrieNode *leaf = rsh_trie_node(s, n, bit);
+      leaf->next = c;
+      *link = leaf;
+      path_trie.names++;
+      return;
+    }
+    size_t k = 1;
+    while (k < c->len && k < n && c->label[k] == s[k])
+      k++;
+    if (k < c->len) { // the name leaves the edge part way: split it there
+      TrieNode *tail = rsh_trie_node(c->label + k, c->len - k, c->dirs);
+      tail->child = c->child;
+      c->child = tail;
+      c->len = k;
+      c->dirs = 0;
+    }
+    node = c;
+    s += k;
+    n -= k;
+  }
+  if (node->dirs == 0)
+    path_trie.names++;
+  node->dirs |= bit;
+}
+
+// clears bit from the n bytes at s. returns whether node is left empty, to
+// be unlinked by its parent: no name ends at it or below
+bool rsh_trie_remove(TrieNode *node, const char *s, size_t n, uint64_t bit) {
+  if (n == 0) {
+    if (node->dirs && !(node->dirs &= ~bit))
+      path_trie.names--;
+    return node->dirs == 0 && !node->child;
+  }
+  for (TrieNode **link = &node->child; *link; link = &(*link)->next) {
+    TrieNode *c = *link;
+    if (c->label[0] != s[0])
+      continue;
+    if (c->len > n || memcmp(c->label, s, c->len) != 0)
+      return false;
+    if (rsh_trie_remove(c, s + c->len, n - c->len, bit)) {
+      *link = c->next;
+      free(c->label);
+      free(c);
+    }
+    break;
+  }
+  return node != &path_trie.root && node->dirs == 0 && !node->child;
+}
+
+// whether dir/name is a file a command could run
+bool rsh_trie_runnable(int dirfd, const char *name) {
+  struct stat st;
+  return fstatat(dirfd, name, &st, 0) == 0 && S_ISREG(st.st_mode) &&
+         (st.st_mode & 0111);
+}
+
+// the trie from scratch: the executables of every absolute PATH entry, and
+// the builtins. relative entries are left out, they change with cd
+void rsh_trie_build(void) {
+  long long start = TRACING ? rsh_trace_now() : 0;
+  rsh_trie_free(path_trie.root.child);
+  path_trie.root.child = NULL;
+  for (int i = 0; i < path_trie.ndirs; i++)
+    free(path_trie.dirs[i]);
+  path_trie.ndirs = 0;
+  path_trie.names = 0;
+  if (path_trie.fd != -1)
+    close(path_trie.fd);
+  path_trie.fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  free(path_trie.path);
+  const char *path = rsh_var_get("PATH", 4);
+  path_trie.path = strdup(path ? path : "");
+  path_trie.built = true;
+  path_trie.builds++;
+
+  for (size_t i = 0; i < sizeof(rsh_builtins) / sizeof(rsh_builtins[0]); i++)
+    rsh_trie_insert(rsh_builtins[i].name, strlen(rsh_builtins[i].name),
+                    RSH_TRIE_BUILTIN);
+
+  rsh_glob_begin();
+  for (const char *p = path_trie.path; *p && path_trie.ndirs < RSH_TRIE_DIRS;) {
+    const char *end = strchrnul(p, ':');
+    char dir[PATH_MAX];
+    size_t len = end - p;
+    bool seen = p[0] != '/' || len >= sizeof(dir);
+    if (!seen) {
+      memcpy(dir, p, len);
+      dir[len] = '\0';
+      for (int i = 0; i < path_trie.ndirs && !seen; i++)
+        seen = !strcmp(path_trie.dirs[i], dir);
+    }
+    p = *end ? end + 1 : end;
+    GlobDir d;
+    int dirfd;
+    if (seen || (dirfd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) == -1)
+      continue;
+    int i = path_trie.ndirs++;
+    path_trie.dirs[i] = strdup(dir);
+    path_trie.wds[i] =
+        path_trie.fd == -1
+            ? -1
+            : inotify_add_watch(path_trie.fd, dir,
+                                IN_CREATE | IN_DELETE | IN_MOVED_FROM |
+                                    IN_MOVED_TO | IN_ATTRIB | IN_DELETE_SELF |
+                                    IN_MOVE_SELF);
+    // listed after the watch is in place, so nothing falls in between
+    if (rsh_glob_list(dir, &d)) {
+      for (size_t off = 0; off < d.size;) {
+        size_t name_len = (unsigned char)d.names[off];
+        unsigned char type = d.names[off + 1];
+        const char *name = d.names + off + 2;
+        off += name_len + 3;
+        if ((type == DT_REG || type == DT_LNK || type == DT_UNKNOWN) &&
+            rsh_trie_runnable(dirfd, name))
+          rsh_trie_insert(name, name_len, 1ULL << i);
+      }
+    }
+    close(dirfd);
+  }
+  rsh_glob_begin();
+  if (TRACING)
+    rsh_trace_span(trace_pid, "edit", "trie_build", start, rsh_trace_now(),
+                   NULL);
+}
+
+// brings the trie up to date: rebuilt when PATH changed or inotify lost
+// track, otherwise only the names the kernel reported are looked at
+void rsh_trie_update(void) {
+  const char *path = rsh_var_get("PATH", 4);
+  if (!path_trie.built || strcmp(path ? path : "", path_trie.path) != 0) {
+    rsh_trie_build();
+    return;
+  }
+  if (path_trie.fd == -1)
+    return;
+
+  char buf[8192] __attribute__((aligned(__alignof__(struct inotify_event))));
+  ssize_t n;
+  while ((n = read(path_trie.fd, buf, sizeof(buf))) > 0) {
+    for (ssize_t off = 0; off < n;) {
+      struct inotify_event *ev = (struct inotify_event *)(buf + off);
+      off += sizeof(*ev) + ev->len;
+      if (ev->mask & (IN_Q_OVERFLOW | IN_DELETE_SELF | IN_MOVE_SELF)) {
+        rsh_trie_build();
+        return;
+      }
+      int i = 0;
+      while (i < path_trie.ndirs && path_trie.wds[i] != ev->wd)
+        i++;
+      if (i == path_trie.ndirs || ev->len == 0)
+        continue;
+      char file[PATH_MAX];
+      snprintf(file, sizeof(file), "%s/%s", path_trie.dirs[i], ev->name);
+      size_t name_len = strlen(ev->name);
+      if (!(ev->mask & (IN_DELETE | IN_MOVED_FROM)) &&
+          rsh_trie_runnable(AT_FDCWD, file))
+        rsh_trie_insert(ev->name, name_len, 1ULL << i);
+      else
+        rsh_trie_remove(&path_trie.root, ev->name, name_len, 1ULL << i);
+    }
+  }
+}
+
+// adds a candidate, narrowing the common prefix to it
+void rsh_comp_add(Completion *c, const char *name, size_t len, bool dir) {
+  if (c->count == 0) {
+    c->common = arena_alloc(&c->arena, len + 1);
+    memcpy(c->common, name, len);
+    c->common_len = len;
+  } else {
+    size_t k = 0;
+    while (k < c->common_len && k < len && c->common[k] == name[k])
+      k++;
+    c->common_len = k;
+  }
+  c->count++;
+  c->dir = dir;
+  if (c->nkept < RSH_EDIT_LIST) {
+    char *copy = arena_alloc(&c->arena, len + 2);
+    memcpy(copy, name, len);
+    copy[len] = dir ? '/' : '\0';
+    copy[len + dir] = '\0';
+    c->names[c->nkept++] = copy;
+  }
+}
+
+// the names in the subtree of node, whose path spells name[0..len). unless
+// all are wanted it stops once there are more than can be listed
+void rsh_comp_subtree(Completion *c, TrieNode *node, char *name, size_t len,
+                      bool all) {
+  if (node->dirs)
+    rsh_comp_add(c, name, len, false);
+  for (TrieNode *ch = node->child; ch && (all || c->count <= RSH_EDIT_LIST);
+       ch = ch->next) {
+    if (len + ch->len >= PATH_MAX)
+      continue;
+    memcpy(name + len, ch->label, ch->len);
+    rsh_comp_subtree(c, ch, name, len + ch->len, all);
+  }
+}
+
+// command names starting with the n bytes at s. their common prefix is read
+// off the trie, so only a listing needs to visit all of them
+void rsh_comp_commands(Completion *c, const char *s, size_t n, bool all) {
+  rsh_trie_update();
+  TrieNode *node = &path_trie.root;
+  char name[PATH_MAX];
+  size_t len = 0;
+  while (len < n) {
+    TrieNode *ch = node->child;
+    while (ch && ch->label[0] != s[len])
+      ch = ch->next;
+    if (!ch)
+      return;
+    size_t k = 0;
+    while (k < ch->len && len + k < n && ch->label[k] == s[len + k])
+      k++;
+    if (k < ch->len && len + k < n)
+      return; // the prefix leaves the edge part way
+    memcpy(name + len, ch->label, ch->len);
+    len += ch->len;
+    node = ch;
+  }
+  rsh_comp_subtree(c, node, name, len, all);
+  // the first name went down the edges all of them share
+  for (c->common_len = len; !node->dirs && node->child && !node->child->next;)
+    c->common_len += (node = node->child)->len;
+}
+
+// file names in the directory part of the n bytes at s that start with the
+// rest. hidden ones only when the rest starts with a dot
+void rsh_comp_files(Completion *c, const char *s, size_t n) {
+  const char *slash = memrchr(s, '/', n);
+  size_t dir_len = slash ? (size_t)(slash - s) + 1 : 0;
+  char dir[PATH_MAX];
+  if (dir_len >= sizeof(dir))
+    return;
+  memcpy(dir, s, dir_len);
+  dir[dir_len] = '\0';
+  const char *base = s + dir_len;
+  size_t base_len = n - dir_len;
+
+  GlobDir d;
+  rsh_glob_begin();
+  if (!rsh_glob_list(dir, &d))
+    return;
+  char path[PATH_MAX];
+  for (size_t off = 0; off < d.size;) {
+    size_t name_len = (unsigned char)d.names[off];
+    unsigned char type = d.names[off + 1];
+    const char *name = d.names + off + 2;
+    off += name_len + 3;
+    if (name_len < base_len || memcmp(name, base, base_len) != 0 ||
+        (name[0] == '.' && base[0] != '.'))
+      continue;
+    bool is_dir = type == DT_DIR;
+    if (type == DT_LNK || type == DT_UNKNOWN) {
+      struct stat st;
+      snprintf(path, sizeof(path), "%s%s", *dir ? dir : "./", name);
+      is_dir = stat(path, &st) == 0 && S_ISDIR(st.st_mode);
+    }
+    rsh_comp_add(c, name, name_len, is_dir);
+  }
+}
+
+// columns the byte takes on the screen: control characters show as ^X,
+// UTF-8 continuation bytes belong to the character before
+int rsh_edit_width(unsigned char c) {
+  if (c < 0x20 || c == 0x7f)
+    return 2;
+  return (c & 0xc0) == 0x80 ? 0 : 1;
+}
+
+// columns of a prompt, leaving out its ESC [ ... m color sequences
+size_t rsh_edit_prompt_cols(const char *s) {
+  size_t cols = 0;
+  for (; *s; s++) {
+    if (s[0] == '\x1b' && s[1] == '[') {
+      s += 2;
+      while (*s && !isalpha((unsigned char)*s))
+        s++;
+      if (!*s)
+        break;
+      continue;
+    }
+    cols += (*s & 0xc0) != 0x80;
+  }
+  return cols;
+}
+
+// draws the prompt and as much of the line as fits around the cursor
+void rsh_edit_refresh(Editor *e) {
+  size_t avail = e->cols > (int)e->prompt_cols + 1
+                     ? e->cols - e->prompt_cols - 1
+                     : 1;
+  // scrolled so the cursor is on screen
+  size_t start = 0, cursor = 0;
+  for (size_t i = 0; i < e->pos; i++)
+    cursor += rsh_edit_width(e->line.data[i]);
+  while (cursor >= avail) {
+    cursor -= rsh_edit_width(e->line.data[start++]);
+    while (start < e->pos && (e->line.data[start] & 0xc0) == 0x80)
+      start++;
+  }
+
+  e->frame.len = 0;
+  sb_write(&e->frame, "\r", 1);
+  sb_puts(&e->frame, e->prompt);
+  size_t used = 0;
+  for (size_t i = start; i < e->line.len; i++) {
+    unsigned char ch = e->line.data[i];
+    int w = rsh_edit_width(ch);
+    if (used + w > avail)
+      break;
+    if (w == 2) {
+      char ctl[2] = {'^', ch == 0x7f ? '?' : ch + '@'};
+      sb_write(&e->frame, ctl, 2);
+    } else {
+      sb_write(&e->frame, (char *)&ch, 1);
+    }
+    used += w;
+  }
+  sb_write(&e->frame, "\x1b[K\r", 4);
+  if (e->prompt_cols + cursor > 0) { // ESC [ 0 C would still move one
+    char move[32];
+    snprintf(move, sizeof(move), "\x1b[%zuC", e->prompt_cols + cursor);
+    sb_puts(&e->frame, move);
+  }
+  rsh_write_all(STDOUT_FILENO, e->frame.data, e->frame.len);
+}
+
+// the next byte typed. timeout -1 waits as long as it takes, reaping jobs
+// and indexing history meanwhile. -1 at end of input or when nothing came
+int rsh_edit_byte(Editor *e, int timeout) {
+  if (e->in_pos == e->in_len) {
+    if (timeout >= 0) {
+      struct pollfd pfd = {STDIN_FILENO, POLLIN, 0};
+      if (poll(&pfd, 1, timeout) <= 0)
+        return -1;
+    } else {
+      rsh_wait_input();
+    }
+    ssize_t n;
+    while ((n = read(STDIN_FILENO, e->in, sizeof(e->in))) == -1 &&
+           errno == EINTR)
+      ;
+    if (n <= 0)
+      return -1;
+    e->in_len = n;
+    e->in_pos = 0;
+  }
+  return (unsigned char)e->in[e->in_pos++];
+}
+
+// the next key, with the escape sequences of cursor keys decoded. a lone
+// Esc is told apart by nothing following it soon
+int rsh_edit_key(Editor *e) {
+  int c = rsh_edit_byte(e, -1);
+  if (c != '\x1b')
+    return c;
+  int c1 = rsh_edit_byte(e, 50);
+  if (c1 != '[' && c1 != 'O') {
+    if (c1 == 'b')
+      return KEY_WORD_LEFT;
+    if (c1 == 'f')
+      return KEY_WORD_RIGHT;
+    return c1 == -1 ? '\x1b' : KEY_NONE;
+  }
+  int num = 0, mod = 0, c2;
+  while ((c2 = rsh_edit_byte(e, 50)) != -1 && (isdigit(c2) || c2 == ';')) {
+    if (c2 == ';')
+      mod = 1, num = num ? num : 1;
+    else if (mod)
+      mod = c2 - '0';
+    else
+      num = num * 10 + c2 - '0';
+  }
+  bool word = mod == 5 || mod == 3; // with Ctrl or Alt
+  switch (c2) {
+  case 'A':
+    return KEY_UP;
+  case 'B':
+    return KEY_DOWN;
+  case 'C':
+    return word ? KEY_WORD_RIGHT : KEY_RIGHT;
+  case 'D':
+    return word ? KEY_WORD_LEFT : KEY_LEFT;
+  case 'H':
+    return KEY_HOME;
+  case 'F':
+    return KEY_END;
+  case '~':
+    if (num == 1 || num == 7)
+      return KEY_HOME;
+    if (num == 4 || num == 8)
+      return KEY_END;
+    if (num == 3)
+      return KEY_DELETE;
+  }
+  return KEY_NONE;
+}
+
+void rsh_edit_insert(Editor *e, const char *s, size_t n) {
+  sb_write(&e->line, s, n); // makes the room
+  memmove(e->line.data + e->pos + n, e->line.data + e->pos,
+          e->line.len - n - e->pos);
+  memcpy(e->line.data + e->pos, s, n);
+  e->pos += n;
+}
+
+void rsh_edit_delete(Editor *e, size_t from, size_t to) {
+  memmove(e->line.data + from, e->line.data + to, e->line.len - to + 1);
+  e->line.len -= to - from;
+  e->pos = from;
+}
+
+void rsh_edit_set(Editor *e, const char *s, size_t n) {
+  e->line.len = 0;
+  sb_write(&e->line, s, n);
+  e->pos = n;
+}
+
+// the start of the character before pos, and of the one after it
+size_t rsh_edit_prev(Editor *e, size_t pos) {
+  while (pos > 0 && (e->line.data[--pos] & 0xc0) == 0x80)
+    ;
+  return pos;
+}
+
+size_t rsh_edit_next(Editor *e, size_t pos) {
+  while (pos < e->line.len && (e->line.data[++pos] & 0xc0) == 0x80)
+    ;
+  return pos;
+}
+
+size_t rsh_edit_word_start(Editor *e, size_t pos) {
+  while (pos > 0 && !isalnum((unsigned char)e->line.data[pos - 1]))
+    pos--;
+  while (pos > 0 && isalnum((unsigned char)e->line.data[pos - 1]))
+    pos--;
+  return pos;
+}
+
+size_t rsh_edit_word_end(Editor *e, size_t pos) {
+  while (pos < e->line.len && !isalnum((unsigned char)e->line.data[pos]))
+    pos++;
+  while (pos < e->line.len && isalnum((unsigned char)e->line.data[pos]))
+    pos++;
+  return pos;
+}
+
+// shows history entry at, or the line being typed once past the newest
+void rsh_edit_history(Editor *e, long at) {
+  if (e->hist_at == (long)hist.count) {
+    e->saved.len = 0;
+    sb_write(&e->saved, e->line.data, e->line.len);
+  }
+  e->hist_at = at;
+  if (at == (long)hist.count) {
+    rsh_edit_set(e, e->saved.data, e->saved.len);
+  } else {
+    size_t len;
+    const char *text = rsh_hist_text(at, &len);
+    rsh_edit_set(e, text, len);
+  }
+}
+
+// Ctrl-R: the newest entry holding what is typed is shown as it is typed,
+// Ctrl-R again goes on to older ones. Enter runs the entry, Ctrl-G or Esc
+// puts the line back, any other key starts editing the entry
+int rsh_edit_search(Editor *e) {
+  rsh_hist_sync();
+  StrBuf q = {0};
+  sb_write(&q, "", 0);
+  long found = -1;
+  int key;
+  bool failed = false;
+  while (true) {
+    e->frame.len = 0;
+    sb_puts(&e->frame, failed ? "\r(failed reverse-i-search)`"
+                              : "\r(reverse-i-search)`");
+    sb_write(&e->frame, q.data, q.len);
+    sb_write(&e->frame, "': ", 3);
+    size_t len = 0;
+    const char *text = found >= 0 ? rsh_hist_text(found, &len) : "";
+    size_t room = e->cols > (int)q.len + 24 ? e->cols - q.len - 24 : 0;
+    for (size_t i = 0; i < len && i < room; i++)
+      sb_write(&e->frame, text[i] == '\n' ? " " : text + i, 1);
+    sb_write(&e->frame, "\x1b[K", 3);
+    rsh_write_all(STDOUT_FILENO, e->frame.data, e->frame.len);
+
+    key = rsh_edit_key(e);
+    if (key == CTRL_KEY('R')) {
+      long older = q.len ? rsh_hist_find(q.data, q.len, found >= 0 ? found
+                                                                    : hist.count)
+                         : -1;
+      failed = older < 0;
+      if (older >= 0)
+        found = older;
+      continue;
+    }
+    if (key == 127 || key == CTRL_KEY('H')) {
+      if (q.len > 0)
+        q.data[--q.len] = '\0';
+    } else if (key >= 0x20 && key < 0x100 && key != 127) {
+      char ch = key;
+      sb_write(&q, &ch, 1);
+    } else {
+      break;
+    }
+    long at = q.len ? rsh_hist_find(q.data, q.len, hist.count) : -1;
+    failed = q.len && at < 0;
+    if (!failed)
+      found = at;
+  }
+  free(q.data);
+  if (key == CTRL_KEY('G') || key == '\x1b' || key == -1) {
+    rsh_edit_refresh(e);
+    return KEY_NONE;
+  }
+  if (found >= 0) {
+    size_t len;
+    const char *text = rsh_hist_text(found, &len);
+    rsh_edit_set(e, text, len);
+    e->hist_at = hist.count;
+  }
+  return key;
+}
+
+// characters that keep their meaning in a completed word with a backslash
+bool rsh_edit_special(char c) {
+  return strchr(" \t\n\\'\"$`*?[]{}|&;<>()#~!=", c) != NULL;
+}
+
+// Tab: the word before the cursor is completed as far as its candidates
+// agree, a second Tab lists them
+void rsh_edit_complete(Editor *e, bool list) {
+  long long start = TRACING ? rsh_trace_now() : 0;
+  // the word: back to an unescaped blank or operator
+  size_t from = e->pos;
+  while (from > 0) {
+    char c = e->line.data[from - 1];
+    bool escaped = from > 1 && e->line.data[from - 2] == '\\';
+    if (!escaped && (IS_BLANK(c) || strchr("|;&<>()", c)))
+      break;
+    from--;
+  }
+  // a command name is the first word, or after an operator or keyword
+  size_t before = from;
+  while (before > 0 && IS_BLANK(e->line.data[before - 1]))
+    before--;
+  bool command = before == 0 || strchr("|;&(", e->line.data[before - 1]);
+  if (!command) {
+    size_t kw = before;
+    while (kw > 0 && !IS_BLANK(e->line.data[kw - 1]))
+      kw--;
+    static const char *keywords[] = {"then", "do", "else", "elif", "if",
+                                     "while", "until", "!", "{", "time"};
+    for (size_t i = 0; i < sizeof(keywords) / sizeof(keywords[0]); i++)
+      if (strlen(keywords[i]) == before - kw &&
+          !memcmp(e->line.data + kw, keywords[i], before - kw))
+        command = true;
+  }
+
+  // matched without its backslashes
+  char word[PATH_MAX];
+  size_t n = 0;
+  for (size_t i = from; i < e->pos && n < sizeof(word) - 1; i++) {
+    if (e->line.data[i] == '\\' && i + 1 < e->pos)
+      i++;
+    word[n++] = e->line.data[i];
+  }
+  word[n] = '\0';
+  command = command && !memchr(word, '/', n);
+
+  Completion *c = &e->comp;
+  arena_reset(&c->arena);
+  c->names = arena_alloc(&c->arena, RSH_EDIT_LIST * sizeof(char *));
+  c->nkept = 0;
+  c->count = 0;
+  c->common_len = 0;
+  if (command)
+    rsh_comp_commands(c, word, n, list);
+  else
+    rsh_comp_files(c, word, n);
+  const char *slash = command ? NULL : memrchr(word, '/', n);
+  size_t typed = slash ? n - (slash - word) - 1 : n;
+  if (TRACING)
+    rsh_trace_span(trace_pid, "edit", "complete", start, rsh_trace_now(),
+                   word);
+
+  if (c->count == 0) {
+    rsh_write_all(STDOUT_FILENO, "\a", 1);
+    return;
+  }
+  if (c->common_len > typed || c->count == 1) {
+    char esc[2 * PATH_MAX];
+    size_t len = 0;
+    for (size_t i = typed; i < c->common_len; i++) {
+      if (rsh_edit_special(c->common[i]))
+        esc[len++] = '\\';
+      esc[len++] = c->common[i];
+    }
+    if (c->count == 1)
+      esc[len++] = c->dir ? '/' : ' ';
+    rsh_edit_insert(e, esc, len);
+    rsh_edit_refresh(e);
+    return;
+  }
+  if (!list) {
+    rsh_write_all(STDOUT_FILENO, "\a", 1);
+    return;
+  }
+
+  // in columns below the line, then the prompt again
+  qsort(c->names, c->nkept, sizeof(char *), rsh_glob_cmp);
+  size_t width = 0;
+  for (int i = 0; i < c->nkept; i++)
+    if (strlen(c->names[i]) > width)
+      width = strlen(c->names[i]);
+  width += 2;
+  int per_row = e->cols / (int)width > 0 ? e->cols / (int)width : 1;
+  e->frame.len = 0;
+  sb_write(&e->frame, "\r\n", 2);
+  for (int i = 0; i < c->nkept; i++) {
+    sb_puts(&e->frame, c->names[i]);
+    if ((i + 1) % per_row == 0 || i + 1 == c->nkept)
+      sb_write(&e->frame, "\x1b[K\r\n", 5);
+    else
+      for (size_t pad = strlen(c->names[i]); pad < width; pad++)
+        sb_write(&e->frame, " ", 1);
+  }
+  if (c->count > (size_t)c->nkept) {
+    char more[64];
+    snprintf(more, sizeof(more), "... and %zu more\r\n",
+             c->count - c->nkept);
+    sb_puts(&e->frame, more);
+  }
+  rsh_write_all(STDOUT_FILENO, e->frame.data, e->frame.len);
+  rsh_edit_refresh(e);
+}
+
+// reads a line on the terminal with editing. returns it in *line with its
+// newline, or NULL at end of input (^D on an empty line)
+char *rsh_edit_line(const char *prompt, char **line, size_t *bufsize) {
+  Editor *e = &editor;
+  struct termios raw, saved = shell_tmodes;
+  // under job control the terminal is back in shell_tmodes after every job
+  if (!job_control && tcgetattr(STDIN_FILENO, &saved) == -1)
+    return NULL;
+  raw = saved;
+  raw.c_iflag &= ~(ICRNL | IXON | BRKINT | INPCK | ISTRIP);
+  raw.c_lflag &= ~(ICANON | ECHO | ISIG | IEXTEN);
+  raw.c_cc[VMIN] = 1;
+  raw.c_cc[VTIME] = 0;
+  tcsetattr(STDIN_FILENO, TCSADRAIN, &raw);
+
+  if (e->cols == 0) {
+    struct sigaction sa = {.sa_handler = rsh_edit_winch};
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGWINCH, &sa, NULL);
+    edit_resized = 1;
+  }
+  struct winsize ws;
+  if (edit_resized) {
+    edit_resized = 0;
+    e->cols = ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == 0 && ws.ws_col > 0
+                  ? ws.ws_col
+                  : 80;
+  }
+  fflush(stdout);
+  rsh_write_all(STDOUT_FILENO, prompt, strlen(prompt));
+  const char *last_nl = strrchr(prompt, '\n');
+  e->prompt = last_nl ? last_nl + 1 : prompt;
+  e->prompt_cols = rsh_edit_prompt_cols(e->prompt);
+  rsh_edit_set(e, "", 0);
+  e->saved.len = 0;
+  e->last_key = 0;
+  e->hist_at = -1; // other shells' lines are read in on the first Up
+
+  bool eof = false;
+  while (true) {
+    int key = rsh_edit_key(e);
+    if (key == CTRL_KEY('R'))
+      key = rsh_edit_search(e);
+    if (key == -1 || (key == CTRL_KEY('D') && e->line.len == 0)) {
+      eof = true;
+      break;
+    }
+    if (key == '\r' || key == '\n')
+      break;
+    if (key == CTRL_KEY('C')) {
+      e->pos = e->line.len;
+      rsh_edit_refresh(e);
+      rsh_write_all(STDOUT_FILENO, "^C", 2);
+      rsh_edit_set(e, "", 0);
+      edit_interrupted = true;
+      break;
+    }
+
+    switch (key) {
+    case '\t':
+      rsh_edit_complete(e, e->last_key == '\t');
+      break;
+    case 127:
+    case CTRL_KEY('H'):
+      if (e->pos > 0)
+        rsh_edit_delete(e, rsh_edit_prev(e, e->pos), e->pos);
+      break;
+    case CTRL_KEY('D'):
+    case KEY_DELETE:
+      if (e->pos < e->line.len) {
+        size_t at = e->pos;
+        rsh_edit_delete(e, at, rsh_edit_next(e, at));
+      }
+      break;
+    case CTRL_KEY('B'):
+    case KEY_LEFT:
+      e->pos = rsh_edit_prev(e, e->pos);
+      break;
+    case CTRL_KEY('F'):
+    case KEY_RIGHT:
+      e->pos = rsh_edit_next(e, e->pos);
+      break;
+    case KEY_WORD_LEFT:
+      e->pos = rsh_edit_word_start(e, e->pos);
+      break;
+    case KEY_WORD_RIGHT:
+      e->pos = rsh_edit_word_end(e, e->pos);
+      break;
+    case CTRL_KEY('A'):
+    case KEY_HOME:
+      e->pos = 0;
+      break;
+    case CTRL_KEY('E'):
+    case KEY_END:
+      e->pos = e->line.len;
+      break;
+    case CTRL_KEY('K'):
+      e->line.data[e->line.len = e->pos] = '\0';
+      break;
+    case CTRL_KEY('U'):
+      rsh_edit_delete(e, 0, e->pos);
+      break;
+    case CTRL_KEY('W'): {
+      size_t at = e->pos;
+      while (at > 0 && IS_BLANK(e->line.data[at - 1]))
+        at--;
+      while (at > 0 && !IS_BLANK(e->line.data[at - 1]))
+        at--;
+      rsh_edit_delete(e, at, e->pos);
+      break;
+    }
+    case CTRL_KEY('L'):
+      rsh_write_all(STDOUT_FILENO, "\x1b[H\x1b[2J", 7);
+      break;
+    case CTRL_KEY('P'):
+    case KEY_UP: {
+      if (e->hist_at == -1) {
+        rsh_hist_sync();
+        e->hist_at = hist.count;
+      }
+      long at = rsh_hist_find("", 0, e->hist_at);
+      if (at >= 0)
+        rsh_edit_history(e, at);
+      break;
+    }
+    case CTRL_KEY('N'):
+    case KEY_DOWN:
+      if (e->hist_at >= 0 && e->hist_at < (long)hist.count)
+        rsh_edit_history(e, e->hist_at + 1);
+      break;
+    default:
+      if (key >= 0x20 && key < 0x100) {
+        char ch = key;
+        rsh_edit_insert(e, &ch, 1);
+      }
+    }
+    e->last_key = key;
+    rsh_edit_refresh(e);
+  }
+
+  tcsetattr(STDIN_FILENO, TCSADRAIN, &saved);
+  // the screen is current after every key, only the cursor may need to go
+  // to the end of the line
+  if (!eof && e->pos != e->line.len) {
+    e->pos = e->line.len;
+    rsh_edit_refresh(e);
+  }
+  rsh_write_all(STDOUT_FILENO, "\r\n", 2);
+  if (eof)
+    return NULL;
+
+  if (*bufsize < e->line.len + 2) {
+    *bufsize = e->line.len + 2;
+    if (!(*line = realloc(*line, *bufsize))) {
+      fprintf(stderr, "rsh: allocation error\n");
+      exit(EXIT_FAILURE);
+    }
+  }
+  memcpy(*line, e->line.data, e->line.len);
+  memcpy(*line + e->line.len, "\n", 2);
+  return *line;
+}
+
+/* ---------------------------------------------------------------- ZYGOTE
+  RSH_SPAWN=zygote starts external commands from small helper processes
+  instead of from the shell. a fork copies the page tables of whatever
+  the shell has grown to, and a helper is a fresh exec of rsh that never
+  grows: it waits on a Unix socket for spawn requests. a request carries
+  the path, argv, the environment when it changed since the helper last
+  saw it, and stdin, stdout and stderr as fds passed with SCM_RIGHTS, plus
+  the working directory after a cd. the helper clones the child with
+  CLONE_PARENT, so the child is the shell's own: wait4, rusage, process
+  groups and the terminal work as for any other child. the helper answers
+  with the pid once the exec went through, or with its error. a helper
+  that went away is replaced on the next spawn, and posix_spawn serves
+  meanwhile.
+ * -----------------------------------------------------------------------------------------
+ */
+
+#define RSH_ZYGOTE_FD 3  // the helper's end of its socket
+#define RSH_ZYGOTE_MAX 8 // helpers, RSH_ZYGOTES picks how many
+#define RSH_ZYGOTE_NOENV UINT32_MAX
+
+struct {
+  uint32_t size; // bytes after the header: path, argv, then envp strings
+  uint32_t argc;
+  uint32_t envc; // RSH_ZYGOTE_NOENV keeps the environment of the last one
+  int32_t pgid;  // as in SpawnOpts
+  uint8_t foreground;
+  uint8_t chdir; // a fd of the new working directory follows stdio
+} typedef ZygoteRequest;
+
+struct {
+  int32_t pid; // -1 when the helper could not clone
+  int32_t err; // the exec's errno, 0 when it went through
+} typedef ZygoteReply;
+
+struct {
+  pid_t pid;
+  int sock; // -1 for a helper not running
+  unsigned long env_gen; // of the environment it has, 0 for none
+  unsigned long cwd_gen;
+} typedef Zygote;
+
+Zygote zygotes[RSH_ZYGOTE_MAX];
+int nzygotes;
+int zygote_next;
+pid_t zygote_owner; // forked copies of the shell leave the pool alone
+
+// starts a helper, a new exec of this binary on the other end of a socket
+bool rsh_zygote_start(Zygote *z) {
+  int sv[2];
+  if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) == -1)
+    return false;
+  posix_spawn_file_actions_t actions;
+  posix_spawn_file_actions_init(&actions);
+  posix_spawn_file_actions_adddup2(&actions, sv[1], RSH_ZYGOTE_FD);
+  char *argv[] = {"rsh", "--zygote", NULL};
+  char *envp[] = {NULL};
+  int err = posix_spawn(&z->pid, "/proc/self/exe", &actions, NULL, argv, envp);
+  posix_spawn_file_actions_destroy(&actions);
+  close(sv[1]);
+  if (err) {
+    close(sv[0]);
+    z->sock = -1;
+    return false;
+  }
+  z->sock = sv[0];
+  z->env_gen = 0;
+  z->cwd_gen = cwd_generation; // it starts where the shell is
+  return true;
+}
+
+void rsh_zygote_stop(Zygote *z) {
+  close(z->sock); // the helper exits on EOF, rsh_reap collects it
+  z->sock = -1;
+}
+
+bool rsh_zygote_send(int sock, const void *data, size_t len) {
+  while (len > 0) {
+    ssize_t n = send(sock, data, len, MSG_NOSIGNAL);
+    if (n == -1 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return false;
+    data = (const char *)data + n;
+    len -= n;
+  }
+  return true;
+}
+
+bool rsh_zygote_recv(int sock, void *data, size_t len) {
+  while (len > 0) {
+    ssize_t n = read(sock, data, len);
+    if (n == -1 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return false;
+    data = (char *)data + n;
+    len -= n;
+  }
+  return true;
+}
+
+// has a helper start path. returns an errno value as rsh_spawn does, or -1
+// when no helper could take it
+int rsh_zygote_spawn(const char *path, char **argv, char **envp,
+                     const SpawnOpts *opts, pid_t *pid) {
+  if (zygote_owner != getpid()) {
+    if (zygote_owner)
+      return -1; // a subshell: its requests would interleave with the shell's
+    zygote_owner = getpid();
+    const char *n = getenv("RSH_ZYGOTES");
+    nzygotes = n && atoi(n) > 0 ? atoi(n) : 1;
+    if (nzygotes > RSH_ZYGOTE_MAX)
+      nzygotes = RSH_ZYGOTE_MAX;
+    for (int i = 0; i < nzygotes; i++)
+      zygotes[i].sock = -1;
+  }
+  Zygote *z = &zygotes[zygote_next++ % nzygotes];
+  if (z->sock == -1 && !rsh_zygote_start(z))
+    return -1;
+
+  long long start = TRACING ? rsh_trace_now() : 0;
+  // the environment goes along only when it is not the one the helper has
+  unsigned long env_gen = opts->envp ? 0 : env_generation;
+  bool send_env = env_gen == 0 || env_gen != z->env_gen;
+  ZygoteRequest req = {0, 0, RSH_ZYGOTE_NOENV, opts->pgid,
+                       opts->foreground && job_control,
+                       z->cwd_gen != cwd_generation};
+  StrBuf body = {0};
+  sb_write(&body, path, strlen(path) + 1);
+  for (; argv[req.argc]; req.argc++)
+    sb_write(&body, argv[req.argc], strlen(argv[req.argc]) + 1);
+  if (send_env)
+    for (req.envc = 0; envp[req.envc]; req.envc++)
+      sb_write(&body, envp[req.envc], strlen(envp[req.envc]) + 1);
+  req.size = body.len;
+
+  int fds[4] = {opts->in_fd != -1 ? opts->in_fd : STDIN_FILENO,
+                opts->out_fd != -1 ? opts->out_fd : STDOUT_FILENO,
+                STDERR_FILENO, -1};
+  int nfds = 3;
+  if (req.chdir && (fds[nfds++] = open(".", O_PATH | O_DIRECTORY |
+                                                O_CLOEXEC)) == -1) {
+    req.chdir = false;
+    nfds--;
+  }
+  char control[CMSG_SPACE(sizeof(fds))] = {0};
+  struct iovec iov = {&req, sizeof(req)};
+  struct msghdr msg = {.msg_iov = &iov,
+                       .msg_iovlen = 1,
+                       .msg_control = control,
+                       .msg_controllen = CMSG_SPACE(nfds * sizeof(int))};
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(nfds * sizeof(int));
+  memcpy(CMSG_DATA(cmsg), fds, nfds * sizeof(int));
+
+  ssize_t sent;
+  while ((sent = sendmsg(z->sock, &msg, MSG_NOSIGNAL)) == -1 && errno == EINTR)
+    ;
+  ZygoteReply reply;
+  bool ok = sent > 0 &&
+            rsh_zygote_send(z->sock, (char *)&req + sent, sizeof(req) - sent) &&
+            rsh_zygote_send(z->sock, body.data, body.len) &&
+            rsh_zygote_recv(z->sock, &reply, sizeof(reply));
+  free(body.data);
+  if (req.chdir)
+    close(fds[3]);
+  if (!ok) {
+    rsh_zygote_stop(z);
+    return -1;
+  }
+  z->env_gen = env_gen;
+  z->cwd_gen = cwd_generation;
+  if (reply.pid == -1)
+    return -1;
+
+  *pid = reply.pid;
+  if (reply.err) {
+    waitpid(*pid, NULL, 0); // reap the failed child, it is ours
+    return reply.err;
+  }
+  if (TRACING)
+    rsh_trace_spawned(*pid, "zygote", argv[0], path, start);
+  return 0;
+}
+
+// what the helper's child needs up to its exec
+struct {
+  const char *path;
+  char **argv;
+  char **envp;
+  const int *fds; // its stdin, stdout and stderr
+  SpawnOpts opts;
+  int err; // errno of the failed exec, set before the child exits
+} typedef ZygoteChild;
+
+char zygote_stack[64 * 1024] __attribute__((aligned(16)));
+
+int rsh_zygote_child(void *arg) {
+  ZygoteChild *c = arg;
+  for (int fd = 0; fd < 3 && !c->err; fd++)
+    if (dup2(c->fds[fd], fd) == -1)
+      c->err = errno;
+  if (!c->err)
+    c->err = rsh_child_setup(&c->opts);
+  if (!c->err) {
+    execve(c->path, c->argv, c->envp);
+    c->err = errno;
+  }
+  _exit(127);
+}
+
+// rsh --zygote: a helper. it serves requests until the shell closes the
+// socket, and dies with the shell in any case
+int rsh_zygote_main(void) {
+  int sock = RSH_ZYGOTE_FD;
+  prctl(PR_SET_NAME, "rsh-zygote");
+  prctl(PR_SET_PDEATHSIG, SIGKILL);
+  if (getppid() == 1)
+    return 1;
+  // requests for the foreground come from a shell with job control only
+  job_control = true;
+
+  StrBuf env = {0};
+  char *body = NULL, **argv = NULL, **envp = NULL;
+  size_t body_cap = 0, argv_cap = 0, envp_cap = 0;
+  char *no_env[] = {NULL};
+  while (true) {
+    ZygoteRequest req;
+    int fds[4];
+    char control[CMSG_SPACE(sizeof(fds))];
+    struct iovec iov = {&req, sizeof(req)};
+    struct msghdr msg = {.msg_iov = &iov,
+                         .msg_iovlen = 1,
+                         .msg_control = control,
+                         .msg_controllen = sizeof(control)};
+    ssize_t n;
+    while ((n = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC)) == -1 && errno == EINTR)
+      ;
+    if (n <= 0)
+      return 0;
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    int nfds = cmsg && cmsg->cmsg_type == SCM_RIGHTS
+                   ? (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int)
+                   : 0;
+    if (nfds > 4)
+      nfds = 4;
+    if (nfds)
+      memcpy(fds, CMSG_DATA(cmsg), nfds * sizeof(int));
+    if (!rsh_zygote_recv(sock, (char *)&req + n, sizeof(req) - n) ||
+        nfds < 3 + req.chdir)
+      return 1;
+    if (body_cap < req.size + 1) {
+      free(body);
+      body_cap = req.size + 1;
+      if (!(body = malloc(body_cap)))
+        return 1;
+    }
+    if (!rsh_zygote_recv(sock, body, req.size))
+      return 1;
+
+    // the strings, pointed into body and, for a new environment, into env
+    if (argv_cap < req.argc + 1) {
+      argv_cap = req.argc + 1;
+      if (!(argv = realloc(argv, argv_cap * sizeof(char *))))
+        return 1;
+    }
+    char *s = body, *end = body + req.size;
+    const char *path = s;
+    s += strnlen(s, end - s) + 1;
+    for (uint32_t i = 0; i < req.argc && s < end; i++) {
+      argv[i] = s;
+      s += strnlen(s, end - s) + 1;
+    }
+    argv[req.argc] = NULL;
+    if (req.envc != RSH_ZYGOTE_NOENV) {
+      env.len = 0;
+      sb_write(&env, s, end - s);
+      if (envp_cap < req.envc + 1) {
+        envp_cap = req.envc + 1;
+        if (!(envp = realloc(envp, envp_cap * sizeof(char *))))
+          return 1;
+      }
+      char *e = env.data;
+      for (uint32_t i = 0; i < req.envc; i++) {
+        envp[i] = e;
+        e += strlen(e) + 1;
+      }
+      envp[req.envc] = NULL;
+    }
+    if (req.chdir) {
+      fchdir(fds[3]);
+      close(fds[3]);
+    }
+
+    // the child is the shell's rather than ours (CLONE_PARENT), and runs on
+    // our memory until its exec the way posix_spawn's does, so it costs no
+    // page table copy and its exec error comes back in child.err
+    ZygoteChild child = {path, argv, envp ? envp : no_env, fds,
+                         {-1, -1, NULL, 0, req.pgid, req.foreground, NULL}, 0};
+    ZygoteReply reply = {0, 0};
+    reply.pid = clone(rsh_zygote_child, zygote_stack + sizeof(zygote_stack),
+                      CLONE_VM | CLONE_VFORK | CLONE_PARENT | SIGCHLD, &child);
+    reply.err = child.err;
+    for (int fd = 0; fd < 3; fd++)
+      close(fds[fd]);
+    if (!rsh_zygote_send(sock, &reply, sizeof(reply)))
+      return 1;
+  }
+}
+
+/* ---------------------------------------------------------------- SERVER
+  rsh --server SOCKET is for callers that start a shell per command, such
+  as a build running every recipe line through rsh -c. rshc (src/rshc.c)
+  sends what rsh -c would have been given: the command, $0 and the
+  arguments, and the environment. its stdin, stdout, stderr and working
+  directory go along as fds passed with SCM_RIGHTS. the server keeps
+  RSH_WORKERS idle workers forked ahead of time. each is a copy of the
+  server, with the builtins, PATH cache and plan cache already set up. a
+  worker accepts one connection and hands it to the server, together with
+  the command. the server forks a replacement and parses the command into
+  its own plan cache, for the workers forked after. the worker moves into
+  the client's directory, takes its environment and stdio, and runs the
+  command the way rsh -c does, in a process group of its own that rshc
+  forwards its signals to. the server is the worker's parent and holds the
+  connection. so rshc gets the status the server reaps, however the
+  command ended: exit, exec or a signal.
+ * -----------------------------------------------------------------------------------------
+ */
+
+#define RSH_SERVER_WORKERS 4      // idle workers, RSH_WORKERS changes it
+#define RSH_SERVER_TEXT (64 * 1024) // commands longer are run, not learnt
+#define RSH_SERVER_BODY (16 << 20)  // largest request, well past ARG_MAX
+
+// what rshc sends first, with its stdin, stdout, stderr and working
+// directory as fds. keep in step with src/rshc.c
+struct {
+  uint32_t size; // bytes after the header: argc, then envc strings
+  uint32_t argc; // the command, then $0 and the arguments
+  uint32_t envc;
+} typedef ServerRequest;
+
+// a connection taken by a worker, answered when the worker is reaped
+struct {
+  pid_t pid;
+  int conn;
+} typedef ServerConn;
+
+int server_sock = -1; // clients connect here
+int server_feed[2];   // workers to the server: a connection and its command
+int server_sigfd = -1; // SIGINT, SIGTERM and SIGHUP stop the server
+sigset_t server_sigs;
+pid_t server_pid;
+ServerConn *server_conns;
+int server_nconns, server_conns_cap;
+int server_idle; // workers waiting in accept
+
+bool rsh_run(char *buf, Arena *arena, size_t *more); // MAIN
+
+// a worker: serves one client, then exits with the command's status
+void rsh_server_worker(void) {
+  prctl(PR_SET_PDEATHSIG, SIGTERM);
+  if (getppid() != server_pid)
+    _exit(1);
+  close(server_feed[0]);
+  close(server_sigfd);
+  sigprocmask(SIG_UNBLOCK, &server_sigs, NULL);
+  // a server started with & ignores these, the commands should not
+  signal(SIGINT, SIG_DFL);
+  signal(SIGQUIT, SIG_DFL);
+
+  int conn;
+  while ((conn = accept4(server_sock, NULL, NULL, SOCK_CLOEXEC)) == -1 &&
+         errno == EINTR)
+    ;
+  if (conn == -1)
+    _exit(1);
+  close(server_sock);
+
+  ServerRequest req;
+  int fds[4];
+  char control[CMSG_SPACE(sizeof(fds))];
+  struct iovec iov = {&req, sizeof(req)};
+  struct msghdr msg = {.msg_iov = &iov,
+                       .msg_iovlen = 1,
+                       .msg_control = control,
+                       .msg_controllen = sizeof(control)};
+  ssize_t n;
+  while ((n = recvmsg(conn, &msg, MSG_CMSG_CLOEXEC)) == -1 && errno == EINTR)
+    ;
+  struct cmsghdr *cmsg = n > 0 ? CMSG_FIRSTHDR(&msg) : NULL;
+  if (!cmsg || cmsg->cmsg_type != SCM_RIGHTS ||
+      cmsg->cmsg_len != CMSG_LEN(sizeof(fds)))
+    _exit(1);
+  memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+  // the header is the client's word, every string takes at least its NUL
+  char *body;
+  if (!rsh_zygote_recv(conn, (char *)&req + n, sizeof(req) - n) ||
+      req.argc == 0 || req.size > RSH_SERVER_BODY ||
+      (size_t)req.argc + req.envc > req.size ||
+      !(body = malloc((size_t)req.size + 1)) ||
+      !rsh_zygote_recv(conn, body, req.size))
+    _exit(1);
+  body[req.size] = '\0';
+
+  char **strs = malloc(((size_t)req.argc + req.envc + 2) * sizeof(char *));
+  if (!strs) {
+    fprintf(stderr, "rsh: allocation error\n");
+    exit(EXIT_FAILURE);
+  }
+  char *s = body, *end = body + req.size;
+  for (size_t i = 0; i < (size_t)req.argc + req.envc; i++) {
+    strs[i] = s < end ? s : end;
+    s += strlen(strs[i]) + 1;
+  }
+  char **argv = strs, **envp = strs + req.argc + 1;
+  memmove(envp, strs + req.argc, req.envc * sizeof(char *));
+  argv[req.argc] = envp[req.envc] = NULL;
+
+  // the server answers the client from here on
+  setpgid(0, 0);
+  pid_t pid = getpid();
+  size_t len = strlen(argv[0]);
+  struct iovec feed[2] = {{&pid, sizeof(pid)},
+                          {argv[0], len < RSH_SERVER_TEXT ? len : 0}};
+  char feed_control[CMSG_SPACE(sizeof(int))] = {0};
+  struct msghdr feed_msg = {.msg_iov = feed,
+                            .msg_iovlen = 2,
+                            .msg_control = feed_control,
+                            .msg_controllen = sizeof(feed_control)};
+  cmsg = CMSG_FIRSTHDR(&feed_msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+  memcpy(CMSG_DATA(cmsg), &conn, sizeof(int));
+  int32_t pgid = pid;
+  if (sendmsg(server_feed[1], &feed_msg, MSG_NOSIGNAL) == -1 ||
+      !rsh_zygote_send(conn, &pgid, sizeof(pgid)))
+    _exit(1);
+  close(conn);
+  close(server_feed[1]);
+
+  // the client's directory, stdio and environment
+  if (fchdir(fds[3]) == -1)
+    _exit(1);
+  close(fds[3]);
+  for (int fd = 0; fd < 3; fd++) {
+    if (dup2(fds[fd], fd) == -1)
+      _exit(1);
+    close(fds[fd]);
+  }
+  for (size_t i = 0; i < var_cap; i++)
+    if (var_table[i].name)
+      rsh_var_unset(var_table[i].name);
+  rsh_vars_import(envp);
+  free(shell_cwd);
+  shell_cwd = NULL;
+  cwd_generation++;
+  rsh_path_check_env();
+  if (path_has_relative)
+    rsh_path_reset();
+
+  if (req.argc > 1) { // rshc -c command name arg ...
+    shell_name = argv[1];
+    pos_argv = argv + 2;
+    pos_argc = req.argc - 2;
+  }
+  Arena arena = {0};
+  rsh_run(argv[0], &arena, NULL);
+  exit(last_status);
+}
+
+// forks an idle worker, false when it could not
+bool rsh_server_fork(void) {
+  pid_t pid = fork();
+  if (pid == -1) {
+    perror("rsh: server: fork");
+    return false;
+  }
+  if (pid == 0)
+    rsh_server_worker();
+  server_idle++;
+  return true;
+}
+
+// takes the connections workers took, to answer them later, and parses
+// their commands into the plan cache. a worker sends its connection before
+// it exits, so one reaped after this is known unless it took none
+void rsh_server_feed(Arena *arena) {
+  static char text[RSH_SERVER_TEXT];
+  while (true) {
+    pid_t pid;
+    int conn;
+    char control[CMSG_SPACE(sizeof(int))];
+    struct iovec iov[2] = {{&pid, sizeof(pid)}, {text, sizeof(text) - 1}};
+    struct msghdr msg = {.msg_iov = iov,
+                         .msg_iovlen = 2,
+                         .msg_control = control,
+                         .msg_controllen = sizeof(control)};
+    ssize_t n = recvmsg(server_feed[0], &msg, MSG_DONTWAIT | MSG_CMSG_CLOEXEC);
+    if (n == -1 && errno == EINTR)
+      continue;
+    if (n < (ssize_t)sizeof(pid))
+      return;
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    if (!cmsg || cmsg->cmsg_type != SCM_RIGHTS)
+      continue;
+    memcpy(&conn, CMSG_DATA(cmsg), sizeof(int));
+
+    server_idle--;
+    if (server_nconns == server_conns_cap) {
+      server_conns_cap = server_conns_cap ? 2 * server_conns_cap : 16;
+      server_conns =
+          realloc(server_conns, server_conns_cap * sizeof(ServerConn));
+      if (!server_conns) {
+        fprintf(stderr, "rsh: allocation error\n");
+        exit(EXIT_FAILURE);
+      }
+    }
+    server_conns[server_nconns++] = (ServerConn){pid, conn};
+
+    text[n - sizeof(pid)] = '\0';
+    plan_learning = true;
+    rsh_run(text, arena, NULL);
+    plan_learning = false;
+  }
+}
+
+int rsh_server_find(pid_t pid) {
+  int i = 0;
+  while (i < server_nconns && server_conns[i].pid != pid)
+    i++;
+  return i;
+}
+
+// answers the clients of the workers that exited
+void rsh_server_reap(Arena *arena) {
+  struct signalfd_siginfo si;
+  while (read(sigchld_fd, &si, sizeof(si)) > 0)
+    ;
+  pid_t pid;
+  int status;
+  while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+    int i = rsh_server_find(pid);
+    if (i == server_nconns) { // it may have sent its connection since
+      rsh_server_feed(arena);
+      i = rsh_server_find(pid);
+    }
+    if (i == server_nconns) { // died before it took a connection
+      server_idle--;
+      continue;
+    }
+    int32_t reply = status;
+    rsh_zygote_send(server_conns[i].conn, &reply, sizeof(reply));
+    close(server_conns[i].conn);
+    server_conns[i] = server_conns[--server_nconns];
+  }
+}
+
+// rsh --server path: serves rshc clients until SIGINT, SIGTERM or SIGHUP
+int rsh_server_main(const char *path) {
+  struct sockaddr_un addr = {.sun_family = AF_UNIX};
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "rsh: server: %s: path too long\n", path);
+    return 2;
+  }
+  strcpy(addr.sun_path, path);
+  // a socket left over from a server that was killed is replaced, anything
+  // else at path is not ours to remove
+  struct stat st;
+  if (lstat(path, &st) == 0) {
+    if (!S_ISSOCK(st.st_mode)) {
+      fprintf(stderr, "rsh: server: %s: %s\n", path, strerror(EADDRINUSE));
+      return 1;
+    }
+    unlink(path);
+  }
+  server_sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (server_sock == -1 ||
+      bind(server_sock, (struct sockaddr *)&addr, sizeof(addr)) == -1 ||
+      lstat(path, &st) == -1 || listen(server_sock, SOMAXCONN) == -1 ||
+      socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, server_feed) ==
+          -1) {
+    fprintf(stderr, "rsh: server: %s: %s\n", path, strerror(errno));
+    return 1;
+  }
+  sigemptyset(&server_sigs);
+  sigaddset(&server_sigs, SIGINT);
+  sigaddset(&server_sigs, SIGTERM);
+  sigaddset(&server_sigs, SIGHUP);
+  sigprocmask(SIG_BLOCK, &server_sigs, NULL);
+  server_sigfd = signalfd(-1, &server_sigs, SFD_CLOEXEC);
+  server_pid = getpid();
+  const char *n = getenv("RSH_WORKERS");
+  int workers = n && atoi(n) > 0 ? atoi(n) : RSH_SERVER_WORKERS;
+  rsh_path_check_env();
+
+  Arena arena = {0};
+  struct pollfd pfds[3] = {{server_feed[0], POLLIN, 0},
+                           {sigchld_fd, POLLIN, 0},
+                           {server_sigfd, POLLIN, 0}};
+  while (true) {
+    while (server_idle < workers && rsh_server_fork())
+      ;
+    if (poll(pfds, 3, -1) == -1 && errno != EINTR)
+      break;
+    rsh_server_feed(&arena);
+    if (pfds[1].revents)
+      rsh_server_reap(&arena);
+    if (pfds[2].revents)
+      break;
+  }
+  // the workers go with the server, PR_SET_PDEATHSIG. the socket goes
+  // unless another server has replaced it since
+  struct stat now;
+  if (lstat(path, &now) == 0 && now.st_dev == st.st_dev &&
+      now.st_ino == st.st_ino)
+    unlink(path);
+  arena_free(&arena);
+  return 0;
+}
+
+/* ----------------------------------------------------------------------------------
+ * MAIN
+ * ---------------------------------------------------------------------------------
+ */
+
+// runs a top-level line under set -o timing and adds it to the stats: its
+// wall time and what the shell and its reaped children used meanwhile
+void rsh_execute_timed(Node *node) {
+  struct timespec start, end;
+  struct rusage self0, self1, kids0, kids1, self, kids;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  getrusage(RUSAGE_SELF, &self0);
+  getrusage(RUSAGE_CHILDREN, &kids0);
+
+  last_status = rsh_execute(node);
+
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  getrusage(RUSAGE_SELF, &self1);
+  getrusage(RUSAGE_CHILDREN, &kids1);
+  rsh_rusage_sub(&self, &self1, &self0);
+  rsh_rusage_sub(&kids, &kids1, &kids0);
+  timeradd(&self.ru_utime, &kids.ru_utime, &self.ru_utime);
+  timeradd(&self.ru_stime, &kids.ru_stime, &self.ru_stime);
+  self.ru_maxrss = kids1.ru_maxrss > self1.ru_maxrss ? kids1.ru_maxrss
+                                                     : self1.ru_maxrss;
+  self.ru_minflt += kids.ru_minflt;
+  self.ru_majflt += kids.ru_majflt;
+  self.ru_nvcsw += kids.ru_nvcsw;
+  self.ru_nivcsw += kids.ru_nivcsw;
+
+  StrBuf text = {0};
+  rsh_node_text(node, &text);
+  rsh_stats_record(text.data ? text.data : "", true,
+                   rsh_elapsed_us(&start, &end), &self);
+  free(text.data);
+}
+
+// parses and runs every complete command in buf, one at a time so a command
+// sees the effects of the ones before it. buf is modified in place.
+// returns false on a syntax error
+bool rsh_run(char *buf, Arena *arena, size_t *more) {
+  Parser p = {0};
+  p.lx.src = buf;
+  p.arena = arena;
+  parser_next(&p);
+
+  while (true) {
+    parser_skip_newlines(&p);
+    if (p.tok.kind == TOK_EOF)
+      return true;
+
+    p.dry_run = false;
+    p.analyze = false;
+    long long start = TRACING ? rsh_trace_now() : 0;
+
+    // the rest of the line, hashed before parsing writes NULs into it
+    size_t off = p.tok.off;
+    size_t len = strchrnul(buf + off, '\n') - (buf + off);
+    uint64_t hash = rsh_hash64(buf + off, len);
+    PlanEntry *plan = rsh_plan_find(buf + off, len, hash);
+    Node *node;
+    if (plan) {
+      node = plan->node;
+      p.dry_run = plan->dry_run;
+      p.analyze = plan->analyze;
+      plan->refs++;
+      p.lx.pos = off + len;
+      parser_next(&p);
+      if (TRACING)
+        rsh_trace_span(trace_pid, "parse", "plan_hit", start, rsh_trace_now(),
+                       NULL);
+    } else {
+      char *key = rsh_plan_admit(hash) ? strndup(buf + off, len) : NULL;
+      node = rsh_parse_list(&p);
+      if (TRACING)
+        rsh_trace_span(trace_pid, "parse", "parse_list", start,
+                       rsh_trace_now(), NULL);
+      if (p.failed) {
+        free(key);
+        arena_reset(arena);
+        arena_reset(&exec_arena);
+        if (plan_learning)
+          return false;
+        if (p.incomplete && more) { // the caller reads on from off
+          *more = off;
+          return false;
+        }
+        if (p.incomplete && p.tok.kind == TOK_ERROR)
+          fprintf(stderr, "rsh: syntax error: %s\n", p.lx.error);
+        else if (p.incomplete)
+          fprintf(stderr, "rsh: syntax error: unexpected end of file\n");
+        last_status = 2;
+        return false;
+      }
+      // only a list that is the whole line can be found by the line again
+      if (key && node && p.tok.off == off + len &&
+          (p.tok.kind == TOK_NEWLINE || p.tok.kind == TOK_EOF))
+        rsh_plan_add(key, len, hash, node, &p);
+      else
+        free(key);
+    }
+
+    if (plan_learning) {
+      // the server wanted the plan only
+    } else if (node && !p.dry_run) {
+      rsh_analyze = p.analyze;
+      if (opt_timing)
+        rsh_execute_timed(node);
+      else
+        last_status = rsh_execute(node);
+      rsh_analyze = false;
+      if (!job_control)
+        rsh_notify_jobs(false); // scripts only reap, they have no prompt
+    } else if (node) {
+      print_node(node);
+      fprintf(stderr, "\n");
+    }
+    if (plan)
+      rsh_plan_release(plan);
+
+    // drops the whole parse tree at once
+    arena_reset(arena);
+    arena_reset(&exec_arena);
+  }
+}
+
+// reads lines from stdin. only a terminal gets the banner and a prompt
+void rsh_loop(bool interactive) {
+  char *line = NULL;
+  size_t bufsize = 0;
+  Arena arena = {0}; // owns each line's parse tree
+
+  if (interactive) {
+    // start prompt
+    system("clear");
+    printf("Welcome to rsh!\nType any system command, \"help\" for help, or "
+           "\"exit\" to exit!\n");
+    rsh_hist_init();
+  } else {
+    setvbuf(stdin, NULL, _IOFBF, RSH_STDIN_BUFSIZE);
+  }
+
+  // a compound command spanning lines is run once it is complete: pending
+  // keeps its lines as read, text is the copy parsing writes into
+  StrBuf pending = {0}, text = {0}, prompt = {0};
+  size_t more;
+  struct timespec start, end;
+  while (true) {
+    if (interactive && pending.len == 0)
+      rsh_notify_jobs(true);
+    if (interactive)
+      print_prompt(&prompt, pending.len > 0);
+    if (!rsh_read_line(&line, &bufsize, interactive ? prompt.data : NULL,
+                       interactive))
+      break;
+    if (edit_interrupted) { // ^C drops a compound command half typed too
+      edit_interrupted = false;
+      pending.len = 0;
+      last_status = 130;
+      continue;
+    }
+    sb_puts(&pending, line);
+    text.len = 0;
+    sb_write(&text, pending.data, pending.len);
+    more = SIZE_MAX;
+    if (interactive)
+      clock_gettime(CLOCK_MONOTONIC, &start);
+    rsh_run(text.data, &arena, &more);
+    if (interactive) {
+      clock_gettime(CLOCK_MONOTONIC, &end);
+      last_duration_us = rsh_elapsed_us(&start, &end);
+      rsh_hist_add(pending.data, more == SIZE_MAX ? pending.len : more);
+    }
+    if (more == SIZE_MAX) {
+      pending.len = 0;
+    } else {
+      memmove(pending.data, pending.data + more, pending.len - more + 1);
+      pending.len -= more;
+    }
+  }
+  if (pending.len > 0) // ended inside a compound command
+    rsh_run(pending.data, &arena, NULL);
+
+  free(pending.data);
+  free(text.data);
+  free(prompt.data);
+  arena_free(&arena);
+  free(line);
+}
+
+// maps a script and runs it. the mapping is private so words can be NUL
+// terminated in place, and the file is laid over a zeroed anonymous mapping
+// one byte longer so the text always ends in a NUL
+int rsh_run_file(const char *path) {
+  long long start = TRACING ? rsh_trace_now() : 0;
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd == -1) {
+    fprintf(stderr, "rsh: %s: %s\n", path, strerror(errno));
+    return 127;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode)) {
+    fprintf(stderr, "rsh: %s: not a regular file\n", path);
+    close(fd);
+    return 126;
+  }
+
+  size_t size = st.st_size;
+  char *buf = mmap(NULL, size + 1, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (buf == MAP_FAILED ||
+      (size > 0 && mmap(buf, size, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED)) {
+    fprintf(stderr, "rsh: %s: %s\n", path, strerror(errno));
+    close(fd);
+    return 126;
+  }
+  close(fd);
+  madvise(buf, size, MADV_SEQUENTIAL);
+
+  if (TRACING)
+    rsh_trace_span(trace_pid, "io", "map_script", start, rsh_trace_now(),
+                   path);
+
+  Arena arena = {0};
+  rsh_run(buf, &arena, NULL);
+  arena_free(&arena);
+  munmap(buf, size + 1);
+  return last_status;
+}
+
+int main(int argc, char **argv) {
+  if (argc == 2 && !strcmp(argv[1], "--zygote"))
+    return rsh_zygote_main();
+  rsh_builtins_init();
+  rsh_vars_init();
+  signal(SIGPIPE, SIG_IGN); // builtins see EPIPE instead of killing the shell
+  bool interactive = argc == 1 && isatty(STDIN_FILENO);
+  rsh_jobs_init(interactive);
+
+  char *trace = getenv(RSH_TRACE_ENV);
+  if (trace && *trace)
+    rsh_trace_init(trace);
+
+  char *spawn_mode = getenv(RSH_SPAWN_ENV);
+  if (spawn_mode && !strcmp(spawn_mode, "fork"))
+    rsh_spawn_mode = RSH_SPAWN_FORK;
+  else if (spawn_mode && !strcmp(spawn_mode, "zygote"))
+    rsh_spawn_mode = RSH_SPAWN_ZYGOTE;
+
+  if (argc == 3 && !strcmp(argv[1], "--server"))
+    return rsh_server_main(argv[2]);
+
+  // rsh -c command
+  if (argc > 1 && !strcmp(argv[1], "-c")) {
+    if (argc < 3) {
+      fprintf(stderr, RSH_USAGE);
+      return 2;
+    }
+    Arena arena = {0};
+    if (argc > 3) { // rsh -c command name arg ...
+      shell_name = argv[3];
+      pos_argv = argv + 4;
+      pos_argc = argc - 4;
+    }
+    rsh_run(argv[2], &arena, NULL); // argv strings are writable
+    return last_status;
+  }
+
+  // rsh script
+  if (argc > 1) {
+    if (argv[1][0] == '-') {
+      fprintf(stderr, RSH_USAGE);
+      return 2;
+    }
+    shell_name = argv[1];
+    pos_argv = argv + 2;
+    pos_argc = argc - 2;
+    return rsh_run_file(argv[1]);
+  }
+
+  rsh_loop(interactive);
+  return last_status;
+}
+
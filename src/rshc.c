@@ -0,0 +1,176 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h> // sockaddr_un
+#include <sys/wait.h>
+#include <unistd.h>
+
+// rshc -c command [name arg ...] runs command on the rsh --server listening
+// at $RSH_SERVER, as `rsh -c` would have run it here: in this directory,
+// with this environment and these stdin, stdout and stderr. it exits the
+// way the command did. with no server there it runs rsh -c itself.
+
+#define RSHC_SERVER_ENV "RSH_SERVER"
+#define RSHC_USAGE "usage: rshc -c command [name arg ...]\n"
+
+// keep in step with ServerRequest in src/rsh.c
+struct {
+  uint32_t size; // bytes after the header: argc, then envc strings
+  uint32_t argc; // the command, then $0 and the arguments
+  uint32_t envc;
+} typedef ServerRequest;
+
+// the request's strings, each with its NUL
+struct {
+  char *data;
+  size_t len, cap;
+} typedef Body;
+
+extern char **environ;
+
+pid_t server_pgid; // the worker running the command, 0 until it answered
+
+void rshc_forward(int sig) {
+  if (server_pgid > 0)
+    kill(-server_pgid, sig);
+}
+
+bool rshc_send(int sock, const void *data, size_t len) {
+  while (len > 0) {
+    ssize_t n = send(sock, data, len, MSG_NOSIGNAL);
+    if (n == -1 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return false;
+    data = (const char *)data + n;
+    len -= n;
+  }
+  return true;
+}
+
+// false on EOF, which means the server went away
+bool rshc_recv(int sock, void *data, size_t len) {
+  while (len > 0) {
+    ssize_t n = read(sock, data, len);
+    if (n == -1 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return false;
+    data = (char *)data + n;
+    len -= n;
+  }
+  return true;
+}
+
+void rshc_add(Body *b, const char *s) {
+  size_t len = strlen(s) + 1;
+  if (b->len + len > b->cap) {
+    while (b->len + len > b->cap)
+      b->cap = b->cap ? 2 * b->cap : 4096;
+    if (!(b->data = realloc(b->data, b->cap))) {
+      fprintf(stderr, "rshc: allocation error\n");
+      exit(EXIT_FAILURE);
+    }
+  }
+  memcpy(b->data + b->len, s, len);
+  b->len += len;
+}
+
+int rshc_connect(const char *path) {
+  struct sockaddr_un addr = {.sun_family = AF_UNIX};
+  if (!path || !*path || strlen(path) >= sizeof(addr.sun_path))
+    return -1;
+  strcpy(addr.sun_path, path);
+  int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (sock != -1 &&
+      connect(sock, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+    close(sock);
+    return -1;
+  }
+  return sock;
+}
+
+int main(int argc, char **argv) {
+  if (argc < 3 || strcmp(argv[1], "-c")) {
+    fprintf(stderr, RSHC_USAGE);
+    return 2;
+  }
+  int sock = rshc_connect(getenv(RSHC_SERVER_ENV));
+  if (sock == -1) {
+    argv[0] = "rsh";
+    execvp("rsh", argv);
+    fprintf(stderr, "rshc: no server at $%s and no rsh: %s\n",
+            RSHC_SERVER_ENV, strerror(errno));
+    return 127;
+  }
+
+  ServerRequest req = {0, argc - 2, 0};
+  Body body = {0};
+  for (int i = 2; i < argc; i++)
+    rshc_add(&body, argv[i]);
+  for (char **e = environ; *e; e++, req.envc++)
+    rshc_add(&body, *e);
+  req.size = body.len;
+
+  // stdio that is closed here is /dev/null there
+  int fds[4];
+  for (int fd = 0; fd < 3; fd++)
+    fds[fd] = fcntl(fd, F_GETFD) == -1 ? open("/dev/null", O_RDWR) : fd;
+  fds[3] = open(".", O_PATH | O_DIRECTORY | O_CLOEXEC);
+  if (fds[3] == -1) {
+    fprintf(stderr, "rshc: .: %s\n", strerror(errno));
+    return 1;
+  }
+  char control[CMSG_SPACE(sizeof(fds))] = {0};
+  struct iovec iov = {&req, sizeof(req)};
+  struct msghdr msg = {.msg_iov = &iov,
+                       .msg_iovlen = 1,
+                       .msg_control = control,
+                       .msg_controllen = sizeof(control)};
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+  memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+  // signals meant for the command, ^C in a build say, go on to it
+  struct sigaction sa = {0};
+  sa.sa_handler = rshc_forward;
+  int forwarded[] = {SIGINT, SIGQUIT, SIGTERM, SIGHUP};
+  for (size_t i = 0; i < sizeof(forwarded) / sizeof(forwarded[0]); i++)
+    sigaction(forwarded[i], &sa, NULL);
+
+  ssize_t sent;
+  while ((sent = sendmsg(sock, &msg, MSG_NOSIGNAL)) == -1 && errno == EINTR)
+    ;
+  int32_t pgid, status;
+  bool ok = sent > 0 &&
+            rshc_send(sock, (char *)&req + sent, sizeof(req) - sent) &&
+            rshc_send(sock, body.data, body.len);
+  free(body.data);
+  if (!ok || !rshc_recv(sock, &pgid, sizeof(pgid))) {
+    fprintf(stderr, "rshc: server at %s did not take the command\n",
+            getenv(RSHC_SERVER_ENV));
+    return 127;
+  }
+  server_pgid = pgid;
+  if (!rshc_recv(sock, &status, sizeof(status))) {
+    fprintf(stderr, "rshc: server at %s went away\n", getenv(RSHC_SERVER_ENV));
+    return 255;
+  }
+
+  if (WIFSIGNALED(status)) { // die the same way, make tells the difference
+    signal(WTERMSIG(status), SIG_DFL);
+    raise(WTERMSIG(status));
+    return 128 + WTERMSIG(status);
+  }
+  return WEXITSTATUS(status);
+}
@@ -1,2 +1,6 @@
 make
+# case arms written (pat) and (a|b), each word a single token
+for w in x a b; do
+  ./rsh -c "case $w in (x) echo x;; (a|b) echo ab;; esac"
+done | tr '\n' ' ' | grep -qx 'x ab ab ' || echo 'test.sh: case (pat) arms broken'
 leaks --atExit -q -- ./rsh